@@ -0,0 +1,508 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <freefare.h>
+
+#include "async.h"
+#include "desfsh.h"
+#include "fn.h"
+#include "session.h"
+
+
+/*
+ * Asynchrone Kartenkommandos
+ *
+ * Mit async.spawn() gestartete Funktionen laufen als Coroutinen. Ruft eine
+ * solche Coroutine ein asynchrones Kartenkommando auf, wird es an den
+ * E/A-Thread übergeben und die Coroutine pausiert. In der Zwischenzeit laufen
+ * die übrigen Coroutinen weiter. Da die Karte nur ein Kommando gleichzeitig
+ * bearbeiten kann, ist immer höchstens ein Kommando in Arbeit. Jedes weitere
+ * Kartenkommando wartet zunächst auf dessen Abschluss.
+ */
+#define ASYNC_MAXTASKS	64
+
+
+struct async_req
+{
+  lua_State *co;
+  FreefareTag tag;
+  async_exec_t exec;
+  async_finish_t finish;
+  void *arg;
+  int idempotent;
+  int result;
+};
+
+struct async_task
+{
+  lua_State *co;
+  int ref;
+  int nargs;
+  unsigned char waiting;
+};
+
+struct async_s
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned char started;
+  unsigned char stop;
+  unsigned char todo;
+  unsigned char done;
+  struct async_req *req;
+
+  struct async_task tasks[ASYNC_MAXTASKS];
+  unsigned int ntasks;
+  lua_State *current;
+  unsigned char running;
+};
+
+/* Jeder Lua-Zustand läuft in einem eigenen Thread. */
+static __thread struct async_s async;
+
+
+static int async_spawn(lua_State *l);
+static int async_wait(lua_State *l);
+static int async_yield(lua_State *l);
+
+
+
+
+static int async_resume(lua_State *co, lua_State *from, int nargs)
+{
+#if LUA_VERSION_NUM > 503
+  int nres;
+
+  return lua_resume(co, from, nargs, &nres);
+#elif LUA_VERSION_NUM > 501
+  return lua_resume(co, from, nargs);
+#else
+  (void)from;
+  return lua_resume(co, nargs);
+#endif
+}
+
+
+static void *async_worker(void *arg)
+{
+  struct async_s *ctx = arg;
+  struct async_req *req;
+
+
+  pthread_mutex_lock(&ctx->mutex);
+  while(1)
+  {
+    while(!ctx->todo && !ctx->stop)
+      pthread_cond_wait(&ctx->cond, &ctx->mutex);
+
+    if(!ctx->todo)
+      break;
+
+    ctx->todo = 0;
+    req = ctx->req;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    req->result = req->exec(req->tag, req->arg);
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->done = 1;
+    pthread_cond_broadcast(&ctx->cond);
+  }
+  pthread_mutex_unlock(&ctx->mutex);
+
+
+  return NULL;
+}
+
+
+static int async_start()
+{
+  if(async.started)
+    return 0;
+
+  if(pthread_mutex_init(&async.mutex, NULL))
+    return -1;
+
+  if(pthread_cond_init(&async.cond, NULL))
+  {
+    pthread_mutex_destroy(&async.mutex);
+    return -1;
+  }
+
+  async.stop = 0;
+  async.todo = 0;
+  async.done = 0;
+  async.req  = NULL;
+
+  if(pthread_create(&async.thread, NULL, async_worker, &async))
+  {
+    pthread_cond_destroy(&async.cond);
+    pthread_mutex_destroy(&async.mutex);
+    return -1;
+  }
+
+  async.started = 1;
+
+
+  return 0;
+}
+
+
+static int async_find(lua_State *co)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < async.ntasks; i++)
+    if(async.tasks[i].co == co)
+      return i;
+
+
+  return -1;
+}
+
+
+/*
+ * Ergebnis des laufenden Kommandos an die wartende Coroutine übergeben.
+ */
+static void async_complete()
+{
+  struct async_req *req;
+  unsigned int tries;
+  int idx;
+
+
+  req = async.req;
+  async.req  = NULL;
+  async.done = 0;
+
+  /*
+   * Übertragungsfehler werden wie bei synchronen Kommandos behandelt. Die
+   * Wiederholung erfolgt dann allerdings blockierend im Lua-Thread.
+   */
+  tries = 0;
+  if(req->idempotent)
+    while(req->result < 0 && session_recover(&tries))
+      req->result = req->exec(tag, req->arg);
+  session_outcome(req->result, tries);
+
+  idx = async_find(req->co);
+
+  lua_settop(req->co, 0);
+  req->finish(req->co, req->result, req->arg);
+
+  if(idx >= 0)
+  {
+    async.tasks[idx].nargs   = lua_gettop(req->co);
+    async.tasks[idx].waiting = 0;
+  }
+
+  free(req->arg);
+  free(req);
+}
+
+
+static void async_remove(lua_State *l, unsigned int idx)
+{
+  luaL_unref(l, LUA_REGISTRYINDEX, async.tasks[idx].ref);
+
+  async.ntasks--;
+  if(idx < async.ntasks)
+    async.tasks[idx] = async.tasks[async.ntasks];
+}
+
+
+
+
+/*
+ * Läuft die Funktion innerhalb einer mit async.spawn() gestarteten Coroutine?
+ */
+int async_task(lua_State *l)
+{
+  return async.current != NULL && async.current == l;
+}
+
+
+/*
+ * Kommando an den E/A-Thread übergeben und die aufrufende Coroutine
+ * pausieren. Die Funktion übernimmt den Speicher von <arg>.
+ */
+int async_call(lua_State *l, async_exec_t exec, async_finish_t finish, void *arg, int idempotent)
+{
+  struct async_req *req;
+  int idx;
+
+
+  async_sync();
+
+  idx = async_find(l);
+  req = malloc(sizeof(struct async_req));
+  if(idx < 0 || req == NULL || async_start())
+  {
+    free(req);
+    free(arg);
+    return luaL_error(l, "internal error (%s:%d): unable to start command", __FILE__, __LINE__);
+  }
+
+  req->co         = l;
+  req->tag        = tag;
+  req->exec       = exec;
+  req->finish     = finish;
+  req->arg        = arg;
+  req->idempotent = idempotent;
+  req->result     = -1;
+
+  async.tasks[idx].waiting = 1;
+
+  pthread_mutex_lock(&async.mutex);
+  async.req  = req;
+  async.todo = 1;
+  async.done = 0;
+  pthread_cond_broadcast(&async.cond);
+  pthread_mutex_unlock(&async.mutex);
+
+
+  return lua_yield(l, 0);
+}
+
+
+/*
+ * Auf ein laufendes asynchrones Kommando warten. Muss vor jedem weiteren
+ * Zugriff auf die Karte aufgerufen werden.
+ */
+void async_sync()
+{
+  if(async.req == NULL)
+    return;
+
+  pthread_mutex_lock(&async.mutex);
+  while(!async.done)
+    pthread_cond_wait(&async.cond, &async.mutex);
+  pthread_mutex_unlock(&async.mutex);
+
+  async_complete();
+}
+
+
+/*
+ * Alle Coroutinen bis zu ihrem Ende ausführen. Im Fehlerfall liegt die
+ * erste Fehlermeldung oben auf dem Stack.
+ */
+int async_run(lua_State *l)
+{
+  unsigned int i, ready;
+  int status, failed;
+  lua_State *co;
+
+
+  if(async.running)
+    return 0;
+
+  async.running = 1;
+  failed = 0;
+
+  while(async.ntasks > 0)
+  {
+    ready = 0;
+    i = 0;
+    while(i < async.ntasks)
+    {
+      if(async.tasks[i].waiting)
+      {
+        i++;
+        continue;
+      }
+
+      co = async.tasks[i].co;
+      async.current = co;
+      status = async_resume(co, l, async.tasks[i].nargs);
+      async.current = NULL;
+
+      /* Neue Coroutinen können das Feld verändert haben. */
+      i = async_find(co);
+
+      if(status == LUA_YIELD)
+      {
+        if(!async.tasks[i].waiting)
+        {
+          lua_settop(co, 0);
+          async.tasks[i].nargs = 0;
+          ready++;
+        }
+        i++;
+        continue;
+      }
+
+      if(status != 0 && !failed)
+      {
+        lua_checkstack(l, 1);
+        lua_xmove(co, l, 1);
+        failed = 1;
+      }
+
+      async_remove(l, i);
+    }
+
+    /* Läuft nur noch das Kartenkommando, warten wir darauf. */
+    if(async.req != NULL && (ready == 0 || async.done))
+      async_sync();
+  }
+
+  async.running = 0;
+
+
+  return failed;
+}
+
+
+void async_close()
+{
+  async_sync();
+
+  if(!async.started)
+    return;
+
+  pthread_mutex_lock(&async.mutex);
+  async.stop = 1;
+  pthread_cond_broadcast(&async.cond);
+  pthread_mutex_unlock(&async.mutex);
+
+  pthread_join(async.thread, NULL);
+  pthread_cond_destroy(&async.cond);
+  pthread_mutex_destroy(&async.mutex);
+
+  async.started = 0;
+  async.ntasks  = 0;
+}
+
+
+
+
+FN_ALIAS(async_spawn) = { "spawn", NULL };
+FN_PARAM(async_spawn) =
+{
+  FNPARAM("fn",  "Function",  0),
+  FNPARAM("...", "Arguments", 1),
+  FNPARAMEND
+};
+FN_RET(async_spawn) =
+{
+  FNPARAMEND
+};
+FN("async", async_spawn, "Start Coroutine",
+"Starts <fn> with the given arguments as coroutine. The coroutine runs as\n" \
+"soon as async.wait() is called or the current command finished. Inside a\n" \
+"coroutine the commands cmd.read(), cmd.rrec(), cmd.write(), cmd.wrec() and\n" \
+"cmd.getval() are executed in the background while the other coroutines\n" \
+"continue. All other card commands wait for a running background command\n" \
+"and are executed synchronously.\n");
+
+
+static int async_spawn(lua_State *l)
+{
+  lua_State *co;
+  int nargs;
+
+
+  luaL_argcheck(l, lua_isfunction(l, 1), 1, "function expected");
+
+  if(async.ntasks >= ASYNC_MAXTASKS)
+    return luaL_error(l, "too many coroutines (max. %d)", ASYNC_MAXTASKS);
+
+  nargs = lua_gettop(l) - 1;
+
+  lua_checkstack(l, 1);
+  co = lua_newthread(l);
+  lua_insert(l, 1);
+  lua_checkstack(co, nargs + 1);
+  lua_xmove(l, co, nargs + 1);
+
+  async.tasks[async.ntasks].co      = co;
+  async.tasks[async.ntasks].ref     = luaL_ref(l, LUA_REGISTRYINDEX);
+  async.tasks[async.ntasks].nargs   = nargs;
+  async.tasks[async.ntasks].waiting = 0;
+  async.ntasks++;
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(async_wait) = { "wait", NULL };
+FN_PARAM(async_wait) =
+{
+  FNPARAMEND
+};
+FN_RET(async_wait) =
+{
+  FNPARAMEND
+};
+FN("async", async_wait, "Wait for Coroutines",
+"Runs all coroutines until they are finished. If a coroutine fails, the\n" \
+"remaining coroutines are finished first. Then the first error is raised.\n" \
+"This function must not be called from a coroutine.\n");
+
+
+static int async_wait(lua_State *l)
+{
+  if(async.current != NULL)
+    return luaL_error(l, "async.wait() called from a coroutine");
+
+  lua_settop(l, 0);
+  if(async_run(l))
+    return lua_error(l);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(async_yield) = { "yield", NULL };
+FN_PARAM(async_yield) =
+{
+  FNPARAMEND
+};
+FN_RET(async_yield) =
+{
+  FNPARAMEND
+};
+FN("async", async_yield, "Yield Coroutine",
+"Passes control to the other coroutines. Long computations should call this\n" \
+"function from time to time. Outside of a coroutine it does nothing.\n");
+
+
+static int async_yield(lua_State *l)
+{
+  if(!async_task(l))
+    return 0;
+
+  lua_settop(l, 0);
+
+
+  return lua_yield(l, 0);
+}
@@ -0,0 +1,49 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_ASYNC_H_
+#define _DESF_ASYNC_H_
+
+#include <lua.h>
+#include <freefare.h>
+
+#include "fn.h"
+
+
+/*
+ * Ein asynchrones Kartenkommando besteht aus dem eigentlichen Aufruf, der im
+ * E/A-Thread ausgeführt wird, und der Auswertung, die im Lua-Thread die
+ * Rückgabewerte auf den Stack der wartenden Coroutine legt.
+ */
+typedef int (*async_exec_t)(FreefareTag tag, void *arg);
+typedef void (*async_finish_t)(lua_State *l, int result, void *arg);
+
+
+extern int async_task(lua_State *l);
+extern int async_call(lua_State *l, async_exec_t exec, async_finish_t finish, void *arg, int idempotent);
+extern void async_sync();
+extern int async_run(lua_State *l);
+extern void async_close();
+
+extern FNDECL(async_spawn);
+extern FNDECL(async_wait);
+extern FNDECL(async_yield);
+
+
+#endif
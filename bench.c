@@ -0,0 +1,405 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "bench.h"
+#include "fn.h"
+
+
+/*
+ * Mikro-Benchmarks
+ *
+ * Eine Messreihe ruft eine Lua-Funktion zunächst einige Male zum Aufwärmen
+ * und danach wiederholt mit Zeitmessung auf. Jeder Aufruf wird einzeln mit
+ * der monotonen Uhr gemessen, sodass die Perzentile exakt aus den sortierten
+ * Messwerten bestimmt werden. Die Ergebnisse werden gesammelt, damit ein
+ * Skript sie am Ende gemeinsam ausgeben oder für den Vergleich zweier
+ * Versionen in eine Datei schreiben kann.
+ */
+struct bench_result
+{
+  char name[48];
+  unsigned long iter;
+  uint64_t total;
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t max;
+};
+
+struct bench_s
+{
+  unsigned int nresults;
+  struct bench_result results[BENCH_MAXRESULTS];
+};
+
+static struct bench_s bench =
+{
+  .nresults = 0,
+};
+
+
+static int bench_clock(lua_State *l);
+static int bench_run(lua_State *l);
+static int bench_print(lua_State *l);
+static int bench_save(lua_State *l);
+static int bench_reset(lua_State *l);
+
+
+
+
+static uint64_t bench_now()
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int bench_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Perzentil nach dem Rangverfahren aus sortierten Messwerten */
+static uint64_t bench_percentile(const uint64_t *samples, unsigned long n, double q)
+{
+  unsigned long rank;
+
+
+  rank = q * n + 0.5;
+  if(rank < 1)
+    rank = 1;
+  if(rank > n)
+    rank = n;
+
+
+  return samples[rank - 1];
+}
+
+
+static void bench_push(lua_State *l, const struct bench_result *r)
+{
+  lua_newtable(l);
+  lua_pushstring(l, r->name);                        lua_setfield(l, -2, "name");
+  lua_pushinteger(l, r->iter);                       lua_setfield(l, -2, "iter");
+  lua_pushnumber(l, r->total / 1e9);                 lua_setfield(l, -2, "total");
+  lua_pushnumber(l, r->total / 1e9 / r->iter);       lua_setfield(l, -2, "mean");
+  lua_pushnumber(l, r->min / 1e9);                   lua_setfield(l, -2, "min");
+  lua_pushnumber(l, r->p50 / 1e9);                   lua_setfield(l, -2, "p50");
+  lua_pushnumber(l, r->p90 / 1e9);                   lua_setfield(l, -2, "p90");
+  lua_pushnumber(l, r->p99 / 1e9);                   lua_setfield(l, -2, "p99");
+  lua_pushnumber(l, r->max / 1e9);                   lua_setfield(l, -2, "max");
+  lua_pushnumber(l, r->total ? 1e9 * r->iter / r->total : 0);
+  lua_setfield(l, -2, "ops");
+}
+
+
+
+
+FN_ALIAS(bench_clock) = { "clock", NULL };
+FN_PARAM(bench_clock) =
+{
+  FNPARAMEND
+};
+FN_RET(bench_clock) =
+{
+  FNPARAM("time", "Monotonic Time in Seconds", 0),
+  FNPARAMEND
+};
+FN("bench", bench_clock, "Read High Resolution Clock",
+"Returns the time of the monotonic system clock in seconds with nanosecond\n" \
+"resolution. Only differences between two values are meaningful.\n");
+
+
+static int bench_clock(lua_State *l)
+{
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushnumber(l, bench_now() / 1e9);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(bench_run) = { "run", NULL };
+FN_PARAM(bench_run) =
+{
+  FNPARAM("name",   "Name of the Benchmark",                 0),
+  FNPARAM("fn",     "Function to measure",                   0),
+  FNPARAM("iter",   "Number of measured Calls (def. 1000)",  1),
+  FNPARAM("warmup", "Number of Warm-up Calls (def. iter/10)", 1),
+  FNPARAMEND
+};
+FN_RET(bench_run) =
+{
+  FNPARAM("result", "Measurement Result", 0),
+  FNPARAMEND
+};
+FN("bench", bench_run, "Run Benchmark",
+"Calls <fn> <warmup> times without measurement and afterwards <iter> times\n" \
+"while measuring each call. The result table contains the name, the number\n" \
+"of measured calls (iter), the total, mean, minimum, maximum and median\n" \
+"time as well as the 90th and 99th percentile (total, mean, min, max, p50,\n" \
+"p90, p99) in seconds and the number of calls per second (ops). The result\n" \
+"is also kept for bench.print() and bench.save(). Errors raised by <fn>\n" \
+"abort the benchmark.\n");
+
+
+static int bench_run(lua_State *l)
+{
+  struct bench_result r;
+  const char *name;
+  uint64_t *samples, t0;
+  long iter, warmup, i;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "name expected");
+  luaL_argcheck(l, lua_isfunction(l, 2), 2, "function expected");
+  luaL_argcheck(l, lua_isnoneornil(l, 3) || lua_isnumber(l, 3), 3, "number expected");
+  luaL_argcheck(l, lua_isnoneornil(l, 4) || lua_isnumber(l, 4), 4, "number expected");
+
+  name   = lua_tostring(l, 1);
+  iter   = lua_isnumber(l, 3) ? lua_tointeger(l, 3) : 1000;
+  warmup = lua_isnumber(l, 4) ? lua_tointeger(l, 4) : iter / 10;
+  luaL_argcheck(l, iter >= 1 && iter <= BENCH_MAXITER, 3, "out of range");
+  luaL_argcheck(l, warmup >= 0 && warmup <= BENCH_MAXITER, 4, "out of range");
+
+  lua_settop(l, 2);
+  lua_checkstack(l, 2);
+
+  for(i = 0; i < warmup; i++)
+  {
+    lua_pushvalue(l, 2);
+    lua_call(l, 0, 0);
+  }
+
+  /*
+   * Der Speicher für die Messwerte gehört Lua, damit er auch bei einem
+   * Fehler in der gemessenen Funktion freigegeben wird.
+   */
+  samples = lua_newuserdata(l, iter * sizeof(uint64_t));
+
+  for(i = 0; i < iter; i++)
+  {
+    lua_pushvalue(l, 2);
+    t0 = bench_now();
+    lua_call(l, 0, 0);
+    samples[i] = bench_now() - t0;
+  }
+
+  qsort(samples, iter, sizeof(uint64_t), bench_cmp);
+
+  memset(&r, 0, sizeof(struct bench_result));
+  snprintf(r.name, sizeof(r.name), "%s", name);
+  r.iter = iter;
+  for(i = 0; i < iter; i++)
+    r.total += samples[i];
+  r.min = samples[0];
+  r.p50 = bench_percentile(samples, iter, 0.50);
+  r.p90 = bench_percentile(samples, iter, 0.90);
+  r.p99 = bench_percentile(samples, iter, 0.99);
+  r.max = samples[iter - 1];
+
+  if(bench.nresults < BENCH_MAXRESULTS)
+    bench.results[bench.nresults++] = r;
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 3);
+  bench_push(l, &r);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(bench_print) = { "print", NULL };
+FN_PARAM(bench_print) =
+{
+  FNPARAMEND
+};
+FN_RET(bench_print) =
+{
+  FNPARAMEND
+};
+FN("bench", bench_print, "Print Benchmark Results",
+"Prints the number of calls, the mean, median, 90th and 99th percentile and\n" \
+"maximum time of each benchmark run so far.\n");
+
+
+static int bench_print(lua_State *l)
+{
+  const struct bench_result *r;
+  unsigned int i;
+
+
+  (void)l;
+
+  if(bench.nresults == 0)
+    return 0;
+
+  printf("%-24s %8s %10s %10s %10s %10s %10s %12s\n",
+    "BENCHMARK", "ITER", "MEAN/us", "P50/us", "P90/us", "P99/us", "MAX/us", "OPS/s");
+
+  for(i = 0; i < bench.nresults; i++)
+  {
+    r = &bench.results[i];
+
+    printf("%-24s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f %12.1f\n",
+      r->name, r->iter,
+      r->total / 1e3 / r->iter,
+      r->p50 / 1e3,
+      r->p90 / 1e3,
+      r->p99 / 1e3,
+      r->max / 1e3,
+      r->total ? 1e9 * r->iter / r->total : 0);
+  }
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(bench_save) = { "save", NULL };
+FN_PARAM(bench_save) =
+{
+  FNPARAM("file",  "Result File",                  0),
+  FNPARAM("label", "Label, e.g. the Revision",     1),
+  FNPARAMEND
+};
+FN_RET(bench_save) =
+{
+  FNPARAM("ok", "Success", 0),
+  FNPARAMEND
+};
+FN("bench", bench_save, "Save Benchmark Results",
+"Appends one JSON line per benchmark run so far to <file>. Each line holds\n" \
+"the <label>, the name, the number of calls and the times in nanoseconds\n" \
+"(total, min, p50, p90, p99, max). Results of different revisions can be\n" \
+"collected in the same file and compared by label and name.\n");
+
+
+static void bench_json_str(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for(; *s != '\0'; s++)
+  {
+    if(*s == '"' || *s == '\\')
+      fputc('\\', f);
+    if((unsigned char)*s >= 0x20)
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+
+static int bench_save(lua_State *l)
+{
+  const struct bench_result *r;
+  const char *label;
+  unsigned int i;
+  FILE *f;
+  int ok;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "file name expected");
+  luaL_argcheck(l, lua_isnoneornil(l, 2) || lua_isstring(l, 2), 2, "string expected");
+
+  label = lua_isstring(l, 2) ? lua_tostring(l, 2) : "";
+
+  f = fopen(lua_tostring(l, 1), "a");
+  if(f != NULL)
+  {
+    for(i = 0; i < bench.nresults; i++)
+    {
+      r = &bench.results[i];
+
+      fprintf(f, "{\"label\":");
+      bench_json_str(f, label);
+      fprintf(f, ",\"name\":");
+      bench_json_str(f, r->name);
+      fprintf(f, ",\"iter\":%lu,\"total\":%llu,\"min\":%llu,\"p50\":%llu,"
+                 "\"p90\":%llu,\"p99\":%llu,\"max\":%llu}\n",
+        r->iter, (unsigned long long)r->total, (unsigned long long)r->min,
+        (unsigned long long)r->p50, (unsigned long long)r->p90,
+        (unsigned long long)r->p99, (unsigned long long)r->max);
+    }
+
+    ok = !ferror(f);
+    ok = !fclose(f) && ok;
+  }
+  else
+    ok = 0;
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, ok);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(bench_reset) = { "reset", NULL };
+FN_PARAM(bench_reset) =
+{
+  FNPARAMEND
+};
+FN_RET(bench_reset) =
+{
+  FNPARAMEND
+};
+FN("bench", bench_reset, "Reset Benchmark Results", NULL);
+
+
+static int bench_reset(lua_State *l)
+{
+  (void)l;
+
+  bench.nresults = 0;
+
+
+  return 0;
+}
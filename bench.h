@@ -0,0 +1,41 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_BENCH_H_
+#define _DESF_BENCH_H_
+
+#include "fn.h"
+
+
+/*
+ * Anzahl der Messreihen, die bis zu bench.reset() aufbewahrt werden, und
+ * obere Grenze der Wiederholungen einer Messreihe.
+ */
+#define BENCH_MAXRESULTS	128
+#define BENCH_MAXITER		1000000
+
+
+extern FNDECL(bench_clock);
+extern FNDECL(bench_run);
+extern FNDECL(bench_print);
+extern FNDECL(bench_save);
+extern FNDECL(bench_reset);
+
+
+#endif
@@ -34,6 +34,7 @@ extern FNDECL(cmd_gkv);
 extern FNDECL(cmd_createapp);
 extern FNDECL(cmd_deleteapp);
 extern FNDECL(cmd_appids);
+extern FNDECL(cmd_dfnames);
 extern FNDECL(cmd_selapp);
 extern FNDECL(cmd_format);
 extern FNDECL(cmd_getver);
@@ -63,8 +64,13 @@ extern FNDECL(cmd_rrec);
 extern FNDECL(cmd_crec);
 extern FNDECL(cmd_commit);
 extern FNDECL(cmd_abort);
+extern FNDECL(cmd_values);
+extern FNDECL(cmd_wrecs);
+extern FNDECL(cmd_records);
+
+/* RAW */
+extern FNDECL(cmd_raw);
 
-//get_df_names
 //set_default_key
 //set_ats
 
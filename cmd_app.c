@@ -28,6 +28,8 @@
 #include "desflua.h"
 #include "desfsh.h"
 #include "fn.h"
+#include "rcache.h"
+#include "session.h"
 
 
 
@@ -69,7 +71,7 @@ static int cmd_fileids(lua_State *l)
 
   debug_cmd("GetFileIDs");
 
-  result = mifare_desfire_get_file_ids(tag, &fids, &len);
+  SESSION_RETRY(result, mifare_desfire_get_file_ids(tag, &fids, &len));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -126,7 +128,7 @@ static int cmd_gfs(lua_State *l)
   debug_cmd("GetFileSettings");
   debug_gen(DEBUG_IN, "FID", "%d", fid);
 
-  result = mifare_desfire_get_file_settings(tag, fid, &settings);
+  SESSION_RETRY(result, mifare_desfire_get_file_settings(tag, fid, &settings));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -246,6 +248,7 @@ static int cmd_cfs(lua_State *l)
 
   result = mifare_desfire_change_file_settings(tag, fid, comm, acl);
   desflua_handle_result(l, result, tag);
+  rcache_drop(fid);
 
 
   return lua_gettop(l);
@@ -285,6 +288,7 @@ static int cmd_create_df(lua_State *l, unsigned char backup)
   else
     result = mifare_desfire_create_std_data_file(tag, fid, comm, acl, size);
   desflua_handle_result(l, result, tag);
+  rcache_drop(fid);
 
 
   return lua_gettop(l);
@@ -398,6 +402,7 @@ static int cmd_cvf(lua_State *l)
 
   result = mifare_desfire_create_value_file(tag, fid, comm, acl, lower, upper, value, lcredit);
   desflua_handle_result(l, result, tag);
+  rcache_drop(fid);
 
 
   return lua_gettop(l);
@@ -440,6 +445,7 @@ static int cmd_create_rf(lua_State *l, unsigned char cyclic)
   else
     result = mifare_desfire_create_linear_record_file(tag, fid, comm, acl, recsize, maxrecs);
   desflua_handle_result(l, result, tag);
+  rcache_drop(fid);
 
 
   return lua_gettop(l);
@@ -532,6 +538,7 @@ static int cmd_delf(lua_State *l)
 
   result = mifare_desfire_delete_file(tag, fid);
   desflua_handle_result(l, result, tag);
+  rcache_drop(fid);
 
 
   return lua_gettop(l);
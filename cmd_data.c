@@ -19,16 +19,21 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <freefare.h>
 
+#include "async.h"
 #include "buffer.h"
 #include "cmd.h"
 #include "debug.h"
 #include "desflua.h"
 #include "desfsh.h"
 #include "fn.h"
+#include "rcache.h"
+#include "session.h"
+#include "wback.h"
 
 
 
@@ -43,8 +48,222 @@ static int cmd_rrec(lua_State *l);
 static int cmd_crec(lua_State *l);
 static int cmd_commit(lua_State *l);
 static int cmd_abort(lua_State *l);
+static int cmd_values(lua_State *l);
+static int cmd_wrecs(lua_State *l);
+static int cmd_records(lua_State *l);
 
 
+/*
+ * Parameter eines Datenkommandos. Asynchron ausgeführte Kommandos erhalten
+ * eine Kopie auf dem Heap.
+ */
+struct cmd_xfer
+{
+  char op;
+  unsigned char hascomm;
+  uint8_t fid;
+  uint32_t off, len;
+  uint8_t comm;
+  uint8_t *data;
+  int32_t val;
+};
+
+
+
+
+static int cmd_xfer_async(lua_State *l, const struct cmd_xfer *x,
+  async_exec_t exec, async_finish_t finish, int idempotent)
+{
+  struct cmd_xfer *copy;
+
+
+  copy = malloc(sizeof(struct cmd_xfer));
+  if(copy == NULL)
+  {
+    free(x->data);
+    return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+  }
+
+  *copy = *x;
+
+
+  return async_call(l, exec, finish, copy, idempotent);
+}
+
+
+static int cmd_read_exec(FreefareTag tag, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  if(x->hascomm)
+  {
+    switch(x->op)
+    {
+    case 'f': return mifare_desfire_read_data_ex(tag, x->fid, x->off, x->len, x->data, x->comm);
+    case 'r': return mifare_desfire_read_records_ex(tag, x->fid, x->off, x->len, x->data, x->comm);
+    }
+  }
+  else
+  {
+    switch(x->op)
+    {
+    case 'f': return mifare_desfire_read_data(tag, x->fid, x->off, x->len, x->data);
+    case 'r': return mifare_desfire_read_records(tag, x->fid, x->off, x->len, x->data);
+    }
+  }
+
+
+  return -1;
+}
+
+
+static void cmd_read_finish(lua_State *l, int result, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  desflua_handle_result(l, result, tag);
+
+  if(result >= 0)
+  {
+    buffer_push(l, x->data, result);
+    debug_buffer(DEBUG_OUT, x->data, result, x->op == 'r' ? 0 : x->off);
+  }
+
+  free(x->data);
+}
+
+
+static int cmd_write_exec(FreefareTag tag, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  if(x->hascomm)
+  {
+    switch(x->op)
+    {
+    case 'f': return mifare_desfire_write_data_ex(tag, x->fid, x->off, x->len, x->data, x->comm);
+    case 'r': return mifare_desfire_write_record_ex(tag, x->fid, x->off, x->len, x->data, x->comm);
+    }
+  }
+  else
+  {
+    switch(x->op)
+    {
+    case 'f': return mifare_desfire_write_data(tag, x->fid, x->off, x->len, x->data);
+    case 'r': return mifare_desfire_write_record(tag, x->fid, x->off, x->len, x->data);
+    }
+  }
+
+
+  return -1;
+}
+
+
+static void cmd_write_finish(lua_State *l, int result, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  free(x->data);
+
+  desflua_handle_result(l, result, tag);
+}
+
+
+static int cmd_getval_exec(FreefareTag tag, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  if(x->hascomm)
+    return mifare_desfire_get_value_ex(tag, x->fid, &x->val, x->comm);
+  else
+    return mifare_desfire_get_value(tag, x->fid, &x->val);
+}
+
+
+static void cmd_getval_finish(lua_State *l, int result, void *arg)
+{
+  struct cmd_xfer *x = arg;
+
+
+  desflua_handle_result(l, result, tag);
+  if(result < 0)
+    return;
+
+  lua_pushinteger(l, x->val);
+
+  debug_gen(DEBUG_OUT, "VAL", "%d", x->val);
+}
+
+
+/*
+ * Lesen über den Cache. Fehlende Bytes werden in einem Stück gelesen und
+ * zwischengespeichert, das Ergebnis dann aus dem Cache zusammengesetzt.
+ */
+static int cmd_read_cached(lua_State *l, struct cmd_xfer *x, uint32_t datalen,
+  int missing, uint32_t moff, uint32_t mlen)
+{
+  int result;
+  struct cmd_xfer f;
+
+
+  result = 0;
+
+  if(missing)
+  {
+    f      = *x;
+    f.off  = moff;
+    f.len  = mlen;
+    f.data = malloc(mlen);
+    if(f.data == NULL)
+    {
+      free(x->data);
+      return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+    }
+
+    debug_info("Reading %u bytes at offset %u to fill the cache.", mlen, moff);
+    SESSION_RETRY(result, cmd_read_exec(tag, &f));
+    if(result >= 0)
+      rcache_store(f.fid, f.off, result, f.data);
+    free(f.data);
+
+    if(result < 0)
+    {
+      cmd_read_finish(l, result, x);
+      return lua_gettop(l);
+    }
+  }
+
+  /* Ließ sich der Bereich nicht zwischenspeichern, lesen wir direkt. */
+  if(rcache_copy(x->fid, x->off, datalen, x->data))
+  {
+    SESSION_RETRY(result, cmd_read_exec(tag, x));
+    cmd_read_finish(l, result, x);
+    return lua_gettop(l);
+  }
+
+  if(missing)
+    desflua_handle_result(l, result, tag);
+  else
+  {
+    lua_settop(l, 0);
+    lua_checkstack(l, 2);
+    lua_pushinteger(l, 0);
+    lua_pushstring(l, "OK");
+    debug_result(0, "OK");
+  }
+
+  buffer_push(l, x->data, datalen);
+  debug_buffer(DEBUG_OUT, x->data, datalen, x->off);
+  free(x->data);
+
+
+  return lua_gettop(l);
+}
 
 
 static int cmd_read_gen(lua_State *l, char op)
@@ -55,9 +274,12 @@ static int cmd_read_gen(lua_State *l, char op)
   uint32_t off, len;
   uint8_t comm;
   int nocheck;
-  uint8_t *data;
   struct mifare_desfire_file_settings settings;
+  unsigned char hassettings;
   uint32_t datalen;
+  uint32_t moff, mlen;
+  int missing;
+  struct cmd_xfer x;
 
 
   luaL_argcheck(l, lua_isnumber(l, 1), 1, "file number expected");
@@ -109,40 +331,22 @@ static int cmd_read_gen(lua_State *l, char op)
    * der Längenparameter größer als Null ist.
    */
 
-  datalen = len;
+  datalen     = len;
+  hassettings = 0;
 
-  if(!nocheck)
+  if(op == 'f' && rcache_getsettings(fid, &settings))
+  {
+    debug_info("File settings taken from cache.");
+    hassettings = 1;
+  }
+  else if(!nocheck)
   {
     debug_info("Executing GetFileSettings() to determine file type and size.");
-    result = mifare_desfire_get_file_settings(tag, fid, &settings);
+    SESSION_RETRY(result, mifare_desfire_get_file_settings(tag, fid, &settings));
     if(result >= 0)
     {
-      if(len == 0)
-      {
-        switch(settings.file_type)
-        {
-        case MDFT_STANDARD_DATA_FILE:
-        case MDFT_BACKUP_DATA_FILE:
-          datalen = settings.settings.standard_file.file_size;
-          debug_info("  --> %d bytes", datalen);
-          break;
-
-        case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
-        case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
-          datalen = settings.settings.linear_record_file.current_number_of_records *
-                    settings.settings.linear_record_file.record_size;
-          debug_info("  --> %d bytes (%d records, %d bytes/record)", datalen,
-            settings.settings.linear_record_file.current_number_of_records,
-            settings.settings.linear_record_file.record_size);
-          break;
-
-        case MDFT_VALUE_FILE_WITH_BACKUP:
-          return luaL_error(l, "Operation not supported for value files.");
-
-        default:
-          return luaL_error(l, "Operation not supported for file type %d.", settings.file_type);
-        }
-      }
+      hassettings = 1;
+      rcache_putsettings(fid, &settings);
     }
     else
     {
@@ -151,6 +355,33 @@ static int cmd_read_gen(lua_State *l, char op)
     }
   }
 
+  if(hassettings && len == 0)
+  {
+    switch(settings.file_type)
+    {
+    case MDFT_STANDARD_DATA_FILE:
+    case MDFT_BACKUP_DATA_FILE:
+      datalen = settings.settings.standard_file.file_size;
+      debug_info("  --> %d bytes", datalen);
+      break;
+
+    case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+      datalen = settings.settings.linear_record_file.current_number_of_records *
+                settings.settings.linear_record_file.record_size;
+      debug_info("  --> %d bytes (%d records, %d bytes/record)", datalen,
+        settings.settings.linear_record_file.current_number_of_records,
+        settings.settings.linear_record_file.record_size);
+      break;
+
+    case MDFT_VALUE_FILE_WITH_BACKUP:
+      return luaL_error(l, "Operation not supported for value files.");
+
+    default:
+      return luaL_error(l, "Operation not supported for file type %d.", settings.file_type);
+    }
+  }
+
 
   /*
    * Prüfen, ob wir die Anzahl der zu lesenden Bytes kennen.
@@ -166,38 +397,35 @@ static int cmd_read_gen(lua_State *l, char op)
    * abgehandelt.
    */
 
-  data = (uint8_t*)malloc(datalen * sizeof(uint8_t));
-  if(data == NULL)
+  x.op      = op;
+  x.hascomm = hascomm;
+  x.fid     = fid;
+  x.off     = off;
+  x.len     = len;
+  x.comm    = hascomm ? comm : 0;
+  x.data    = (uint8_t*)malloc(datalen * sizeof(uint8_t));
+  if(x.data == NULL)
     return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
 
-  if(hascomm)
-  {
-    switch(op)
-    {
-    case 'f': result = mifare_desfire_read_data_ex(tag, fid, off, len, data, comm);    break;
-    case 'r': result = mifare_desfire_read_records_ex(tag, fid, off, len, data, comm); break;
-    }
-  }
-  else
-  {
-    switch(op)
-    {
-    case 'f': result = mifare_desfire_read_data(tag, fid, off, len, data);    break;
-    case 'r': result = mifare_desfire_read_records(tag, fid, off, len, data); break;
-    }
-  }
-  desflua_handle_result(l, result, tag);
-
-  if(result < 0)
-    goto exit;
+  /*
+   * Bekannte Bytes liefert der Cache. Fehlende Bytes lesen wir nur
+   * außerhalb von Coroutinen über den Cache, damit kein zwischenzeitlicher
+   * Schreibzugriff einer anderen Coroutine übergangen wird.
+   */
+  moff    = 0;
+  mlen    = 0;
+  missing = op == 'f' ? rcache_missing(fid, off, datalen, &moff, &mlen) : -1;
+  if(missing == 0 || (missing > 0 && !async_task(l)))
+    return cmd_read_cached(l, &x, datalen, missing, moff, mlen);
 
-  buffer_push(l, data, result);
+  /* Innerhalb einer Coroutine wird die Übertragung im Hintergrund ausgeführt. */
+  if(async_task(l))
+    return cmd_xfer_async(l, &x, cmd_read_exec, cmd_read_finish, 1);
 
-  debug_buffer(DEBUG_OUT, data, result, op == 'r' ? 0 : off);
+  SESSION_RETRY(result, cmd_read_exec(tag, &x));
+  cmd_read_finish(l, result, &x);
 
 
-exit:
-  free(data);
   return lua_gettop(l);
 }
 
@@ -210,6 +438,7 @@ static int cmd_write_gen(lua_State *l, char op)
   uint32_t off, len;
   uint8_t *data;
   uint8_t comm;
+  struct cmd_xfer x;
 
 
   luaL_argcheck(l, lua_isnumber(l, 1), 1, "file number expected");
@@ -226,6 +455,33 @@ static int cmd_write_gen(lua_State *l, char op)
   fid = lua_tointeger(l, 1);
   off = lua_tointeger(l, 2);
 
+  if(op == 'f')
+    rcache_invalidate(fid, off, len);
+  session_txnopen(fid);
+
+  /* Schreibzugriffe auf Datendateien ggf. zurückhalten. */
+  if(op == 'f' && wback_active() && !async_task(l))
+  {
+    if(wback_defer(fid, off, len, data, hascomm, hascomm ? comm : 0))
+    {
+      free(data);
+      return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+    }
+
+    /*
+     * Auf der Karte landet der Schreibzugriff erst mit wback_flush(), erst
+     * dort zählt er als Kommando.
+     */
+    debug_info("WriteData(%d, %d, %d) deferred", fid, off, len);
+
+    lua_settop(l, 0);
+    lua_checkstack(l, 2);
+    lua_pushinteger(l, 0);
+    lua_pushstring(l, "Deferred");
+
+    return 2;
+  }
+
   switch(op)
   {
     case 'f': debug_cmd("WriteData");   break;
@@ -236,26 +492,19 @@ static int cmd_write_gen(lua_State *l, char op)
   debug_gen(DEBUG_IN, "OFF", "%d", off);
   debug_buffer(DEBUG_IN, data, len, off);
 
-  if(hascomm)
-  {
-    switch(op)
-    {
-    case 'f': result = mifare_desfire_write_data_ex(tag, fid, off, len, data, comm);   break;
-    case 'r': result = mifare_desfire_write_record_ex(tag, fid, off, len, data, comm); break;
-    }
-  }
-  else
-  {
-    switch(op)
-    {
-    case 'f': result = mifare_desfire_write_data(tag, fid, off, len, data);   break;
-    case 'r': result = mifare_desfire_write_record(tag, fid, off, len, data); break;
-    }
-  }
+  x.op      = op;
+  x.hascomm = hascomm;
+  x.fid     = fid;
+  x.off     = off;
+  x.len     = len;
+  x.comm    = hascomm ? comm : 0;
+  x.data    = data;
 
-  free(data);
+  if(async_task(l))
+    return cmd_xfer_async(l, &x, cmd_write_exec, cmd_write_finish, 0);
 
-  desflua_handle_result(l, result, tag);
+  result = cmd_write_exec(tag, &x);
+  cmd_write_finish(l, result, &x);
 
 
   return lua_gettop(l);
@@ -341,7 +590,7 @@ static int cmd_getval(lua_State *l)
   unsigned char hascomm;
   uint8_t fid;
   uint8_t comm;
-  int32_t val;
+  struct cmd_xfer x;
 
 
   luaL_argcheck(l, lua_isnumber(l, 1), 1, "file number expected");
@@ -358,26 +607,64 @@ static int cmd_getval(lua_State *l)
   debug_cmd("GetValue");
   debug_gen(DEBUG_IN, "FID", "%d", fid);
 
-  if(hascomm)
-    result = mifare_desfire_get_value_ex(tag, fid, &val, comm);
-  else
-    result = mifare_desfire_get_value(tag, fid, &val);
-  desflua_handle_result(l, result, tag);
-  if(result < 0)
-    goto exit;
+  x.hascomm = hascomm;
+  x.fid     = fid;
+  x.comm    = hascomm ? comm : 0;
+  x.data    = NULL;
 
-  lua_pushinteger(l, val);
+  if(async_task(l))
+    return cmd_xfer_async(l, &x, cmd_getval_exec, cmd_getval_finish, 1);
 
-  debug_gen(DEBUG_OUT, "VAL", "%d", val);
+  SESSION_RETRY(result, cmd_getval_exec(tag, &x));
+  cmd_getval_finish(l, result, &x);
 
 
-exit:
   return lua_gettop(l);
 }
 
 
 
 
+static int cmd_value_exec(char op, uint8_t fid, int32_t amount, unsigned char hascomm, uint8_t comm)
+{
+  if(hascomm)
+  {
+    switch(op)
+    {
+    case 'c': return mifare_desfire_credit_ex(tag, fid, amount, comm);
+    case 'd': return mifare_desfire_debit_ex(tag, fid, amount, comm);
+    case 'l': return mifare_desfire_limited_credit_ex(tag, fid, amount, comm);
+    }
+  }
+  else
+  {
+    switch(op)
+    {
+    case 'c': return mifare_desfire_credit(tag, fid, amount);
+    case 'd': return mifare_desfire_debit(tag, fid, amount);
+    case 'l': return mifare_desfire_limited_credit(tag, fid, amount);
+    }
+  }
+
+
+  return -1;
+}
+
+
+static void cmd_value_debug(char op, uint8_t fid, int32_t amount)
+{
+  switch(op)
+  {
+    case 'c': debug_cmd("Credit");        break;
+    case 'd': debug_cmd("Debit");         break;
+    case 'l': debug_cmd("LimitedCredit"); break;
+  }
+
+  debug_gen(DEBUG_IN, "FID", "%d", fid);
+  debug_gen(DEBUG_IN, "AMOUNT", "%d", amount);
+}
+
+
 static int cmd_value(lua_State *l, char op)
 {
   int result;
@@ -400,34 +687,10 @@ static int cmd_value(lua_State *l, char op)
   fid    = lua_tointeger(l, 1);
   amount = lua_tointeger(l, 2);
 
-  switch(op)
-  {
-    case 'c': debug_cmd("Credit");        break;
-    case 'd': debug_cmd("Debit");         break;
-    case 'l': debug_cmd("LimitedCredit"); break;
-  }
-
-  debug_gen(DEBUG_IN, "FID", "%d", fid);
-  debug_gen(DEBUG_IN, "AMOUNT", "%d", amount);
+  cmd_value_debug(op, fid, amount);
 
-  if(hascomm)
-  {
-    switch(op)
-    {
-    case 'c': result = mifare_desfire_credit_ex(tag, fid, amount, comm);         break;
-    case 'd': result = mifare_desfire_debit_ex(tag, fid, amount, comm);          break;
-    case 'l': result = mifare_desfire_limited_credit_ex(tag, fid, amount, comm); break;
-    }
-  }
-  else
-  {
-    switch(op)
-    {
-    case 'c': result = mifare_desfire_credit(tag, fid, amount);         break;
-    case 'd': result = mifare_desfire_debit(tag, fid, amount);          break;
-    case 'l': result = mifare_desfire_limited_credit(tag, fid, amount); break;
-    }
-  }
+  session_txnopen(fid);
+  result = cmd_value_exec(op, fid, amount, hascomm, hascomm ? comm : 0);
   desflua_handle_result(l, result, tag);
 
 
@@ -594,6 +857,7 @@ int cmd_crec(lua_State *l)
   debug_cmd("ClearRecordFile");
   debug_gen(DEBUG_IN, "FID", "%d", fid);
 
+  session_txnopen(fid);
   result = mifare_desfire_clear_record_file(tag, fid);
   desflua_handle_result(l, result, tag);
 
@@ -611,11 +875,16 @@ FN_PARAM(cmd_commit) =
 };
 FN_RET(cmd_commit) =
 {
-  FNPARAM("code", "Return Code",  0),
-  FNPARAM("err",  "Error String", 0),
+  FNPARAM("code",   "Return Code",               0),
+  FNPARAM("err",    "Error String",              0),
+  FNPARAM("writes", "Status of Deferred Writes", 1),
   FNPARAMEND
 };
-FN("cmd", cmd_commit, "Commit Transaction", NULL);
+FN("cmd", cmd_commit, "Commit Transaction",
+"Commits the transaction. When write-behind is enabled, pending writes are\n" \
+"sent beforehand. The list <writes> contains the status of each deferred\n" \
+"call to cmd.write() since the last commit or abort as a table with the\n" \
+"fields fid, off, len, code and err.\n");
 
 
 static int cmd_commit(lua_State *l)
@@ -626,6 +895,9 @@ static int cmd_commit(lua_State *l)
   debug_cmd("Commit");
   result = mifare_desfire_commit_transaction(tag);
   desflua_handle_result(l, result, tag);
+  session_txnclose(result);
+  rcache_commit();
+  wback_push(l);
 
 
   return lua_gettop(l);
@@ -641,8 +913,9 @@ FN_PARAM(cmd_abort) =
 };
 FN_RET(cmd_abort) =
 {
-  FNPARAM("code", "Return Code",  0),
-  FNPARAM("err",  "Error String", 0),
+  FNPARAM("code",   "Return Code",               0),
+  FNPARAM("err",    "Error String",              0),
+  FNPARAM("writes", "Status of Deferred Writes", 1),
   FNPARAMEND
 };
 FN("cmd", cmd_abort, "Abort Transaction", NULL);
@@ -656,7 +929,502 @@ static int cmd_abort(lua_State *l)
   debug_cmd("Abort");
   result = mifare_desfire_abort_transaction(tag);
   desflua_handle_result(l, result, tag);
+  session_txnclose(result);
+  rcache_commit();
+  wback_push(l);
+
+
+  return lua_gettop(l);
+}
+
+
+
+
+FN_ALIAS(cmd_values) = { "values", NULL };
+FN_PARAM(cmd_values) =
+{
+  FNPARAM("ops",      "List of Value Operations", 0),
+  FNPARAM("readback", "Read resulting Values",    1),
+  FNPARAMEND
+};
+FN_RET(cmd_values) =
+{
+  FNPARAM("code",   "Return Code",                                    0),
+  FNPARAM("err",    "Error String",                                   0),
+  FNPARAM("values", "Values by File ID or Index of failed Operation", 1),
+  FNPARAMEND
+};
+FN("cmd", cmd_values, "Apply several Value Operations",
+"Applies a list of value operations within a single transaction and commits\n" \
+"it. Each operation is a table { fid, op, amount, comm } where op is one of\n" \
+"\"credit\", \"debit\" or \"lcredit\" and comm is optional. All operations\n" \
+"are checked before the first command is sent. If an operation fails, the\n" \
+"transaction is aborted and the index of the failed operation is returned\n" \
+"as third value. If <readback> is true, the resulting values are read after\n" \
+"the commit and returned as a table indexed by file ID.\n");
+
+
+static int cmd_values(lua_State *l)
+{
+  struct cmd_valop
+  {
+    char op;
+    uint8_t fid;
+    int32_t amount;
+    unsigned char hascomm;
+    uint8_t comm;
+    int32_t val;
+  } *ops;
+  int result;
+  unsigned int nops, i, j;
+  int readback;
+  const char *opstr;
+  uint8_t err;
+  const char *str;
+
+
+  luaL_argcheck(l, lua_istable(l, 1), 1, "list of value operations expected");
+  readback = lua_gettop(l) >= 2 && lua_toboolean(l, 2);
+
+#if LUA_VERSION_NUM > 501
+  nops = lua_rawlen(l, 1);
+#else
+  nops = lua_objlen(l, 1);
+#endif
+  luaL_argcheck(l, nops > 0, 1, "list of value operations is empty");
+
+  ops = malloc(nops * sizeof(struct cmd_valop));
+  if(ops == NULL)
+    return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+
+
+  /* Alle Operationen prüfen, bevor das erste Kommando gesendet wird. */
+  lua_settop(l, 1);
+  lua_checkstack(l, 6);
+  for(i = 0; i < nops; i++)
+  {
+    lua_rawgeti(l, 1, i + 1);
+    if(!lua_istable(l, -1))
+    {
+      free(ops);
+      return luaL_error(l, "operation %d: table expected", i + 1);
+    }
+
+    lua_rawgeti(l, -1, 1);
+    lua_rawgeti(l, -2, 2);
+    lua_rawgeti(l, -3, 3);
+    lua_rawgeti(l, -4, 4);
+
+    opstr = lua_isstring(l, -3) ? lua_tostring(l, -3) : "";
+         if(!strcasecmp(opstr, "credit"))  { ops[i].op = 'c'; }
+    else if(!strcasecmp(opstr, "debit"))   { ops[i].op = 'd'; }
+    else if(!strcasecmp(opstr, "lcredit")) { ops[i].op = 'l'; }
+    else                                   { ops[i].op = 0;   }
+
+    ops[i].hascomm = !lua_isnil(l, -1);
+    ops[i].comm    = 0;
+
+    if(!lua_isnumber(l, -4) || !ops[i].op || !lua_isnumber(l, -2) ||
+       (ops[i].hascomm && desflua_get_comm(l, -1, &ops[i].comm)))
+    {
+      free(ops);
+      return luaL_error(l, "operation %d: { fid, \"credit\"|\"debit\"|\"lcredit\", amount, [comm] } expected", i + 1);
+    }
+
+    ops[i].fid    = lua_tointeger(l, -4);
+    ops[i].amount = lua_tointeger(l, -2);
+
+    lua_pop(l, 5);
+  }
+
+
+  /* Operationen ausführen. Beim ersten Fehler wird die Transaktion verworfen. */
+  for(i = 0; i < nops; i++)
+  {
+    cmd_value_debug(ops[i].op, ops[i].fid, ops[i].amount);
+
+    session_txnopen(ops[i].fid);
+    result = cmd_value_exec(ops[i].op, ops[i].fid, ops[i].amount, ops[i].hascomm, ops[i].comm);
+    if(result >= 0)
+      continue;
+
+    desflua_handle_result(l, result, tag);
+
+    debug_cmd("Abort");
+    result = mifare_desfire_abort_transaction(tag);
+    desflua_result(result, tag, &err, &str);
+    session_txnclose(result);
+    rcache_commit();
+
+    free(ops);
+    lua_pushinteger(l, i + 1);
+
+    return lua_gettop(l);
+  }
+
+  debug_cmd("Commit");
+  result = mifare_desfire_commit_transaction(tag);
+  session_txnclose(result);
+  rcache_commit();
+
+  if(result < 0 || !readback)
+  {
+    free(ops);
+    desflua_handle_result(l, result, tag);
+    return lua_gettop(l);
+  }
+
+  desflua_result(result, tag, &err, &str);
+
+
+  /* Die resultierenden Werte jeder Datei einmal lesen. */
+  for(i = 0; i < nops; i++)
+  {
+    for(j = 0; j < i && ops[j].fid != ops[i].fid; j++);
+    if(j < i)
+      continue;
+
+    debug_cmd("GetValue");
+    debug_gen(DEBUG_IN, "FID", "%d", ops[i].fid);
+
+    if(ops[i].hascomm)
+      SESSION_RETRY(result, mifare_desfire_get_value_ex(tag, ops[i].fid, &ops[i].val, ops[i].comm));
+    else
+      SESSION_RETRY(result, mifare_desfire_get_value(tag, ops[i].fid, &ops[i].val));
+
+    if(result < 0)
+    {
+      free(ops);
+      desflua_handle_result(l, result, tag);
+      return lua_gettop(l);
+    }
+
+    desflua_result(result, tag, &err, &str);
+    debug_gen(DEBUG_OUT, "VAL", "%d", ops[i].val);
+  }
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 5);
+  lua_pushinteger(l, err);
+  lua_pushstring(l, str);
+  lua_newtable(l);
+  for(i = 0; i < nops; i++)
+  {
+    for(j = 0; j < i && ops[j].fid != ops[i].fid; j++);
+    if(j < i)
+      continue;
+
+    lua_pushinteger(l, ops[i].val);
+    lua_rawseti(l, -2, ops[i].fid);
+  }
+
+  free(ops);
+
+
+  return lua_gettop(l);
+}
+
+
+
+
+FN_ALIAS(cmd_wrecs) = { "wrecs", NULL };
+FN_PARAM(cmd_wrecs) =
+{
+  FNPARAM("fid",     "File ID",                0),
+  FNPARAM("records", "List of Records",        0),
+  FNPARAM("comm",    "Communication Settings", 1),
+  FNPARAMEND
+};
+FN_RET(cmd_wrecs) =
+{
+  FNPARAM("code", "Return Code",                0),
+  FNPARAM("err",  "Error String",               0),
+  FNPARAM("idx",  "Index of the failed Record", 1),
+  FNPARAMEND
+};
+FN("cmd", cmd_wrecs, "Append several Records",
+"Appends each buffer of the list <records> as a new record to the record\n" \
+"file. As the card creates only one new record per transaction, each record\n" \
+"is committed on its own. If a record can't be written or committed, the\n" \
+"remaining records are skipped and the index of the record is returned as\n" \
+"third value. The records before it stay written.\n");
+
+
+static int cmd_wrecs(lua_State *l)
+{
+  struct cmd_rec
+  {
+    uint8_t *data;
+    unsigned int len;
+  } *recs;
+  int result;
+  unsigned char hascomm;
+  uint8_t fid;
+  uint8_t comm;
+  unsigned int nrecs, i, failed;
+  uint8_t err;
+  const char *str;
+
+
+  luaL_argcheck(l, lua_isnumber(l, 1), 1, "file number expected");
+  luaL_argcheck(l, lua_istable(l, 2), 2, "list of records expected");
+  hascomm = lua_gettop(l) >= 3;
+  if(hascomm)
+  {
+    result = desflua_get_comm(l, 3, &comm);
+    if(result)
+      desflua_argerror(l, 3, "comm");
+  }
+
+  fid = lua_tointeger(l, 1);
+
+#if LUA_VERSION_NUM > 501
+  nrecs = lua_rawlen(l, 2);
+#else
+  nrecs = lua_objlen(l, 2);
+#endif
+  luaL_argcheck(l, nrecs > 0, 2, "list of records is empty");
+
+  recs = calloc(nrecs, sizeof(struct cmd_rec));
+  if(recs == NULL)
+    return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+
+
+  /* Alle Datensätze einlesen, bevor das erste Kommando gesendet wird. */
+  lua_settop(l, 3);
+  lua_checkstack(l, 2);
+  for(i = 0; i < nrecs; i++)
+  {
+    lua_rawgeti(l, 2, i + 1);
+    if(buffer_get(l, -1, &recs[i].data, &recs[i].len))
+    {
+      failed = i;
+      for(i = 0; i < failed; i++)
+        free(recs[i].data);
+      free(recs);
+      return luaL_error(l, "record %d: %s", failed + 1, lua_tostring(l, -1));
+    }
+    lua_pop(l, 1);
+  }
+
+
+  /*
+   * Die Karte legt je Transaktion und Datei nur einen neuen Datensatz an.
+   * Weitere WriteRecord-Kommandos vor dem Commit überschreiben diesen
+   * Datensatz. Jeder Datensatz wird deshalb einzeln bestätigt.
+   */
+  for(i = 0; i < nrecs; i++)
+  {
+    debug_cmd("WriteRecord");
+    debug_gen(DEBUG_IN, "FID", "%d", fid);
+    debug_gen(DEBUG_IN, "OFF", "%d", 0);
+    debug_buffer(DEBUG_IN, recs[i].data, recs[i].len, 0);
+
+    session_txnopen(fid);
+    if(hascomm)
+      result = mifare_desfire_write_record_ex(tag, fid, 0, recs[i].len, recs[i].data, comm);
+    else
+      result = mifare_desfire_write_record(tag, fid, 0, recs[i].len, recs[i].data);
+
+    if(result < 0)
+    {
+      desflua_handle_result(l, result, tag);
+
+      debug_cmd("Abort");
+      result = mifare_desfire_abort_transaction(tag);
+      desflua_result(result, tag, &err, &str);
+      session_txnclose(result);
+      break;
+    }
+
+    debug_cmd("Commit");
+    result = mifare_desfire_commit_transaction(tag);
+    desflua_handle_result(l, result, tag);
+    session_txnclose(result);
+    if(result < 0)
+      break;
+  }
+  failed = i;
+
+  for(i = 0; i < nrecs; i++)
+    free(recs[i].data);
+  free(recs);
+  rcache_commit();
+
+  if(failed < nrecs)
+    lua_pushinteger(l, failed + 1);
 
 
   return lua_gettop(l);
 }
+
+
+
+
+/*
+ * Zustand des Iterators über die Datensätze einer Datei. Der Puffer für
+ * einen Block von Datensätzen schließt sich direkt an.
+ */
+struct cmd_reciter
+{
+  uint8_t fid;
+  unsigned char hascomm;
+  uint8_t comm;
+  uint32_t recsize;
+  uint32_t chunk;
+  uint32_t remaining;
+  uint32_t idx;
+  uint32_t nbuf, pos;
+  uint8_t buf[];
+};
+
+
+static int cmd_records_next(lua_State *l)
+{
+  struct cmd_reciter *it;
+  int result;
+  uint32_t n, off;
+  uint8_t err;
+  const char *str;
+
+
+  it = lua_touserdata(l, lua_upvalueindex(1));
+
+  if(it->pos >= it->nbuf)
+  {
+    if(it->remaining == 0)
+      return 0;
+
+    /* Die ältesten noch nicht gelieferten Datensätze lesen. */
+    n   = it->remaining < it->chunk ? it->remaining : it->chunk;
+    off = it->remaining - n;
+
+    debug_cmd("ReadRecord");
+    debug_gen(DEBUG_IN, "FID", "%d", it->fid);
+    debug_gen(DEBUG_IN, "OFF", "%d", off);
+    debug_gen(DEBUG_IN, "LEN", "%d", n);
+
+    if(it->hascomm)
+      SESSION_RETRY(result, mifare_desfire_read_records_ex(tag, it->fid, off, n, it->buf, it->comm));
+    else
+      SESSION_RETRY(result, mifare_desfire_read_records(tag, it->fid, off, n, it->buf));
+
+    desflua_result(result, tag, &err, &str);
+    if(result < 0)
+      return luaL_error(l, "reading records of file %d failed: %d: %s", it->fid, err, str);
+
+    debug_buffer(DEBUG_OUT, it->buf, result, 0);
+
+    it->remaining -= n;
+    it->nbuf       = result / it->recsize;
+    it->pos        = 0;
+
+    if(it->nbuf == 0)
+    {
+      it->remaining = 0;
+      return 0;
+    }
+  }
+
+  lua_checkstack(l, 2);
+  lua_pushinteger(l, ++it->idx);
+  buffer_push(l, it->buf + it->pos * it->recsize, it->recsize);
+  it->pos++;
+
+
+  return 2;
+}
+
+
+FN_ALIAS(cmd_records) = { "records", NULL };
+FN_PARAM(cmd_records) =
+{
+  FNPARAM("fid",   "File ID",                       0),
+  FNPARAM("comm",  "Communication Settings",        1),
+  FNPARAM("chunk", "Number of Records per Command", 1),
+  FNPARAMEND
+};
+FN_RET(cmd_records) =
+{
+  FNPARAM("iter", "Iterator", 0),
+  FNPARAMEND
+};
+FN("cmd", cmd_records, "Iterate over Records",
+"Returns an iterator over the records of a record file for use in a generic\n" \
+"for loop. Each step yields the index and the content of a record, starting\n" \
+"with the oldest one. The records are read in chunks of <chunk> records. By\n" \
+"default a chunk holds as many records as fit into 256 bytes. Only one chunk\n" \
+"is kept in memory. The number of records is determined via\n" \
+"GetFileSettings when the iterator is created. Errors are raised as Lua\n" \
+"errors.\n");
+
+
+static int cmd_records(lua_State *l)
+{
+  int result;
+  unsigned char hascomm;
+  uint8_t fid;
+  uint8_t comm;
+  uint32_t chunk;
+  struct mifare_desfire_file_settings settings;
+  struct cmd_reciter *it;
+  uint8_t err;
+  const char *str;
+
+
+  luaL_argcheck(l, lua_isnumber(l, 1), 1, "file number expected");
+  hascomm = lua_gettop(l) >= 2 && !lua_isnil(l, 2);
+  if(hascomm)
+  {
+    result = desflua_get_comm(l, 2, &comm);
+    if(result)
+      desflua_argerror(l, 2, "comm");
+  }
+  luaL_argcheck(l, lua_gettop(l) < 3 || lua_isnil(l, 3) ||
+    (lua_isnumber(l, 3) && lua_tointeger(l, 3) > 0), 3, "positive number of records expected");
+
+  fid   = lua_tointeger(l, 1);
+  chunk = lua_isnumber(l, 3) ? lua_tointeger(l, 3) : 0;
+
+  debug_cmd("GetFileSettings");
+  debug_gen(DEBUG_IN, "FID", "%d", fid);
+
+  SESSION_RETRY(result, mifare_desfire_get_file_settings(tag, fid, &settings));
+  desflua_result(result, tag, &err, &str);
+  if(result < 0)
+    return luaL_error(l, "unable to determine number of records of file %d: %d: %s", fid, err, str);
+
+  if(settings.file_type != MDFT_LINEAR_RECORD_FILE_WITH_BACKUP &&
+     settings.file_type != MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP)
+    return luaL_error(l, "file %d is not a record file", fid);
+
+  if(settings.settings.linear_record_file.record_size == 0)
+    return luaL_error(l, "file %d has a record size of 0", fid);
+
+  if(chunk == 0)
+    chunk = 256 / settings.settings.linear_record_file.record_size;
+  if(chunk == 0)
+    chunk = 1;
+  if(chunk > settings.settings.linear_record_file.current_number_of_records &&
+     settings.settings.linear_record_file.current_number_of_records > 0)
+    chunk = settings.settings.linear_record_file.current_number_of_records;
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+
+  it = lua_newuserdata(l, sizeof(struct cmd_reciter) + chunk * settings.settings.linear_record_file.record_size);
+  it->fid       = fid;
+  it->hascomm   = hascomm;
+  it->comm      = hascomm ? comm : 0;
+  it->recsize   = settings.settings.linear_record_file.record_size;
+  it->chunk     = chunk;
+  it->remaining = settings.settings.linear_record_file.current_number_of_records;
+  it->idx       = 0;
+  it->nbuf      = 0;
+  it->pos       = 0;
+
+  lua_pushcclosure(l, cmd_records_next, 1);
+
+
+  return 1;
+}
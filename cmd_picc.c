@@ -23,18 +23,21 @@
 #include <lauxlib.h>
 #include <freefare.h>
 
+#include "buffer.h"
 #include "cmd.h"
 #include "debug.h"
 #include "desflua.h"
 #include "desfsh.h"
 #include "fn.h"
 #include "key.h"
+#include "session.h"
 
 
 
 static int cmd_createapp(lua_State *l);
 static int cmd_deleteapp(lua_State *l);
 static int cmd_appids(lua_State *l);
+static int cmd_dfnames(lua_State *l);
 static int cmd_selapp(lua_State *l);
 static int cmd_format(lua_State *l);
 static int cmd_getver(lua_State *l);
@@ -150,6 +153,8 @@ static int cmd_deleteapp(lua_State *l)
 
   free(app);
   desflua_handle_result(l, result, tag);
+  if(result >= 0)
+    session_deleted(aid);
 
 
   return lua_gettop(l);
@@ -184,7 +189,7 @@ static int cmd_appids(lua_State *l)
 
   debug_cmd("GetApplicationIDs");
 
-  result = mifare_desfire_get_application_ids(tag, &apps, &len);
+  SESSION_RETRY(result, mifare_desfire_get_application_ids(tag, &apps, &len));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -212,6 +217,67 @@ exit:
 
 
 
+FN_ALIAS(cmd_dfnames) = { "dfnames", "GetDFNames", NULL };
+FN_PARAM(cmd_dfnames) =
+{
+  FNPARAMEND
+};
+FN_RET(cmd_dfnames) =
+{
+  FNPARAM("code", "Return Code",  0),
+  FNPARAM("err",  "Error String", 0),
+  FNPARAM("dfs",  "List of DFs",  1),
+  FNPARAMEND
+};
+FN("cmd", cmd_dfnames, "Get ISO DF Names",
+"Returns the AID, ISO file ID and DF name of all applications created with\n" \
+"ISO parameters. Each entry of <dfs> is a table with the fields 'aid',\n" \
+"'fid' and 'name'. All applications are listed in a single exchange.\n");
+
+
+static int cmd_dfnames(lua_State *l)
+{
+  int result;
+  MifareDESFireDF *dfs;
+  size_t len, i;
+  char buffer[10];
+
+
+  debug_cmd("GetDFNames");
+
+  SESSION_RETRY(result, mifare_desfire_get_df_names(tag, &dfs, &len));
+  desflua_handle_result(l, result, tag);
+
+  if(result < 0)
+    goto exit;
+
+  lua_checkstack(l, 4);
+  lua_newtable(l);
+  for(i = 0; i < len; i++)
+  {
+    snprintf(buffer, 10, "0x%06x", dfs[i].aid);
+    lua_pushinteger(l, i + 1);
+    lua_newtable(l);
+    lua_pushstring(l, buffer);          lua_setfield(l, -2, "aid");
+    lua_pushinteger(l, dfs[i].fid);     lua_setfield(l, -2, "fid");
+    buffer_push(l, dfs[i].df_name, dfs[i].df_name_len);
+    lua_setfield(l, -2, "name");
+    lua_settable(l, -3);
+
+    debug_gen(DEBUG_OUT, "AID", "0x%06x", dfs[i].aid);
+    debug_gen(DEBUG_OUT, "ISOFID", "0x%04x", dfs[i].fid);
+    debug_buffer(DEBUG_OUT, dfs[i].df_name, dfs[i].df_name_len, 0);
+  }
+  free(dfs);
+
+
+exit:
+  return lua_gettop(l);
+}
+
+
+
+
 FN_ALIAS(cmd_selapp) = { "selapp", "select", "SelectApplication", NULL };
 FN_PARAM(cmd_selapp) =
 {
@@ -231,21 +297,16 @@ static int cmd_selapp(lua_State *l)
 {
   int result;
   uint32_t aid;
-  MifareDESFireAID app;
 
 
   luaL_argcheck(l, lua_isnumber(l, 1), 1, "AID must be a number");
 
   aid = lua_tointeger(l, 1);
-  app = mifare_desfire_aid_new(aid);
-  if(app == NULL)
-    return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
 
   debug_cmd("SelectApplication");
   debug_gen(DEBUG_IN, "AID", "0x%06x", aid);
 
-  result = mifare_desfire_select_application(tag, app);
-  free(app);
+  SESSION_RETRY(result, session_select(aid));
   desflua_handle_result(l, result, tag);
 
 
@@ -277,6 +338,8 @@ static int cmd_format(lua_State *l)
   debug_cmd("FormatPICC");
   result = mifare_desfire_format_picc(tag);
   desflua_handle_result(l, result, tag);
+  if(result >= 0)
+    session_deauth();
 
 
   return lua_gettop(l);
@@ -310,7 +373,7 @@ static int cmd_getver(lua_State *l)
 
 
   debug_cmd("GetVersion");
-  result = mifare_desfire_get_version(tag, &info);
+  SESSION_RETRY(result, mifare_desfire_get_version(tag, &info));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -435,7 +498,7 @@ static int cmd_freemem(lua_State *l)
 
 
   debug_cmd("FreeMem");
-  result = mifare_desfire_free_mem(tag, &freemem);
+  SESSION_RETRY(result, mifare_desfire_free_mem(tag, &freemem));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -475,7 +538,7 @@ static int cmd_carduid(lua_State *l)
 
 
   debug_cmd("GetCardUID");
-  result = mifare_desfire_get_card_uid(tag, &uid);
+  SESSION_RETRY(result, mifare_desfire_get_card_uid(tag, &uid));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -0,0 +1,302 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <nfc/nfc.h>
+#include <freefare.h>
+
+#include "buffer.h"
+#include "cmd.h"
+#include "debug.h"
+#include "desflua.h"
+#include "desfsh.h"
+#include "fn.h"
+#include "session.h"
+#include "trace.h"
+
+
+/*
+ * Längere Kommandos werden in mehrere Rahmen aufgeteilt, die mit
+ * ADDITIONAL_FRAME fortgesetzt werden. Die Nutzdaten je Rahmen legt
+ * session_framesize() fest.
+ */
+#define RAW_MAXFRAME	(SESSION_MAXFRAME + 6)
+#define RAW_MAXRESP	256
+
+
+
+static int cmd_raw(lua_State *l);
+
+
+
+
+static const char *cmd_raw_strerror(uint8_t status)
+{
+  switch(status)
+  {
+  case OPERATION_OK:          return "OK";
+  case NO_CHANGES:            return "No changes";
+  case OUT_OF_EEPROM_ERROR:   return "Insufficient NV-Memory";
+  case ILLEGAL_COMMAND_CODE:  return "Command code not supported";
+  case INTEGRITY_ERROR:       return "CRC or MAC does not match data";
+  case NO_SUCH_KEY:           return "Invalid key number specified";
+  case LENGTH_ERROR:          return "Length of command string invalid";
+  case PERMISSION_DENIED:     return "Current configuration/status does not allow the requested command";
+  case PARAMETER_ERROR:       return "Value of params invalid";
+  case APPLICATION_NOT_FOUND: return "Requested AID not found on PICC";
+  case APPL_INTEGRITY_ERROR:  return "Unrecoverable error within application";
+  case AUTHENTICATION_ERROR:  return "Current authentication status does not allow the requested command";
+  case ADDITIONAL_FRAME:      return "Additional data frame is expected to be sent";
+  case BOUNDARY_ERROR:        return "Attempt to read/write data from/to beyond the file's/record's limit";
+  case PICC_INTEGRITY_ERROR:  return "Unrecoverable error within PICC";
+  case COMMAND_ABORTED:       return "Previous command was not fully completed";
+  case PICC_DISABLED_ERROR:   return "PICC was disabled by an unrecoverable error";
+  case COUNT_ERROR:           return "Number of applications limited to 28";
+  case DUPLICATE_ERROR:       return "File/Application with same number already exists";
+  case EEPROM_ERROR:          return "Could not complete NV-write operation";
+  case FILE_NOT_FOUND:        return "Specified file number does not exist";
+  case FILE_INTEGRITY_ERROR:  return "Unrecoverable error within file";
+  default:                    return "Unknown error";
+  }
+}
+
+
+/*
+ * Einen Rahmen im nativen oder im ISO 7816-4 Format senden. Im nativen Format
+ * steht der Status im ersten Byte der Antwort, im ISO-Format folgt er als
+ * SW2 auf SW1 = 0x91 nach den Daten.
+ */
+static int cmd_raw_frame(int iso, uint8_t cmd, const uint8_t *data, size_t len,
+  uint8_t *status, uint8_t *resp, size_t *resplen)
+{
+  uint8_t tx[RAW_MAXFRAME], rx[RAW_MAXRESP];
+  size_t txlen;
+  int result;
+
+
+  txlen = 0;
+  if(iso)
+  {
+    tx[txlen++] = 0x90;
+    tx[txlen++] = cmd;
+    tx[txlen++] = 0x00;
+    tx[txlen++] = 0x00;
+    if(len > 0)
+    {
+      tx[txlen++] = len;
+      memcpy(tx + txlen, data, len);
+      txlen += len;
+    }
+    tx[txlen++] = 0x00;
+  }
+  else
+  {
+    tx[txlen++] = cmd;
+    if(len > 0)
+    {
+      memcpy(tx + txlen, data, len);
+      txlen += len;
+    }
+  }
+
+  result = nfc_initiator_transceive_bytes(device, tx, txlen, rx, sizeof(rx), 0);
+  if(result < 0)
+    return -1;
+
+  if(iso)
+  {
+    if(result < 2 || rx[result - 2] != 0x91)
+      return -2;
+
+    *status  = rx[result - 1];
+    *resplen = result - 2;
+    memcpy(resp, rx, *resplen);
+  }
+  else
+  {
+    if(result < 1)
+      return -2;
+
+    *status  = rx[0];
+    *resplen = result - 1;
+    memcpy(resp, rx + 1, *resplen);
+  }
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(cmd_raw) = { "raw", "transceive", NULL };
+FN_PARAM(cmd_raw) =
+{
+  FNPARAM("cmd",    "Command Code",         0),
+  FNPARAM("buffer", "Command Data",         1),
+  FNPARAM("iso",    "ISO 7816-4 Wrapping",  1),
+  FNPARAMEND
+};
+FN_RET(cmd_raw) =
+{
+  FNPARAM("code",   "Return Code",   0),
+  FNPARAM("err",    "Error String",  0),
+  FNPARAM("buffer", "Response Data", 1),
+  FNPARAMEND
+};
+FN("cmd", cmd_raw, "Send Raw Command",
+"Sends the command <cmd> with the given data to the card. Commands are sent\n" \
+"in native DESFire framing, unless <iso> is true. Then they are wrapped into\n" \
+"ISO 7816-4 APDUs. Data exceeding one frame is split into several frames and\n" \
+"frames announced by the card via status 0xAF are fetched automatically. The\n" \
+"response data of all frames is returned as one buffer.\n" \
+"\n" \
+"The data is sent as is. Secure messaging has to be applied by the caller,\n" \
+"as the session key of an authentication is not accessible. The command\n" \
+"may change the state of the card unnoticed by the shell, so the session\n" \
+"state is reset afterwards. If the transmission fails, <code> is -1.\n");
+
+
+static int cmd_raw(lua_State *l)
+{
+  int result;
+  uint8_t cmd, status, frame;
+  uint8_t *data, *resp, *p;
+  unsigned int len;
+  size_t off, n, rlen, rsize, flen, framesize;
+  unsigned long nframes;
+  int iso;
+  uint8_t rx[RAW_MAXRESP];
+
+
+  luaL_argcheck(l, lua_isnumber(l, 1), 1, "command code expected");
+
+  data = NULL;
+  len  = 0;
+  if(lua_gettop(l) >= 2 && !lua_isnil(l, 2))
+  {
+    result = buffer_get(l, 2, &data, &len);
+    if(result)
+      desflua_argerror(l, 2, "buffer");
+  }
+
+  iso = lua_toboolean(l, 3);
+  cmd = lua_tointeger(l, 1);
+
+  if(device == NULL)
+  {
+    free(data);
+    return luaL_error(l, "no device connected");
+  }
+
+  debug_cmd("Raw");
+  debug_gen(DEBUG_IN, "CMD", "0x%02x", cmd);
+  debug_gen(DEBUG_IN, "FRAME", "%s", iso ? "ISO" : "NATIVE");
+  debug_buffer(DEBUG_IN, data, len, 0);
+
+  rsize = RAW_MAXRESP;
+  rlen  = 0;
+  resp  = malloc(rsize);
+  if(resp == NULL)
+  {
+    free(data);
+    return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+  }
+
+
+  /*
+   * Solange die Karte weitere Rahmen anfordert oder ankündigt, senden wir
+   * entweder die nächsten Daten oder fordern mit einem leeren
+   * ADDITIONAL_FRAME die restliche Antwort an.
+   */
+  framesize = session_framesize();
+  nframes   = 0;
+  off       = 0;
+  frame     = cmd;
+  do
+  {
+    n = len - off;
+    if(n > framesize)
+      n = framesize;
+
+    result = cmd_raw_frame(iso, frame, data + off, n, &status, rx, &flen);
+    if(result < 0)
+      break;
+
+    nframes++;
+
+    off  += n;
+    frame = ADDITIONAL_FRAME;
+
+    if(rlen + flen > rsize)
+    {
+      rsize = 2 * (rlen + flen);
+      p = realloc(resp, rsize);
+      if(p == NULL)
+      {
+        free(resp);
+        free(data);
+        return luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+      }
+      resp = p;
+    }
+
+    memcpy(resp + rlen, rx, flen);
+    rlen += flen;
+  } while(status == ADDITIONAL_FRAME);
+
+  free(data);
+
+  session_frames(nframes);
+  debug_info("%lu frames with up to %u data bytes exchanged.", nframes, (unsigned int)framesize);
+
+  /* Der Zustand der Karte ist nun unbekannt. */
+  session_reset();
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 3);
+
+  if(result < 0)
+  {
+    lua_pushinteger(l, -1);
+    lua_pushstring(l, result == -1 ? nfc_strerror(device) : "invalid response");
+    debug_result(0xff, lua_tostring(l, -1));
+    trace_error();
+    goto exit;
+  }
+
+  lua_pushinteger(l, status);
+  lua_pushstring(l, cmd_raw_strerror(status));
+  debug_result(status, cmd_raw_strerror(status));
+
+  if(status == OPERATION_OK)
+  {
+    buffer_push(l, resp, rlen);
+    debug_buffer(DEBUG_OUT, resp, rlen, 0);
+  }
+
+
+exit:
+  free(resp);
+  return lua_gettop(l);
+}
@@ -28,6 +28,7 @@
 #include "desfsh.h"
 #include "fn.h"
 #include "key.h"
+#include "session.h"
 
 
 
@@ -63,12 +64,12 @@ static int cmd_auth(lua_State *l)
 {
   int result;
   uint8_t keyno;
-  MifareDESFireKey k;
+  struct session_key k;
   char *keystr;
 
 
   luaL_argcheck(l, lua_isnumber(l, 1), 1, "key number expected");
-  result = key_get(l, 2, &k, &keystr); if(result) { desflua_argerror(l, 2, "key"); }
+  result = session_getkey(l, 2, &k, &keystr); if(result) { desflua_argerror(l, 2, "key"); }
 
   keyno = lua_tointeger(l, 1);
 
@@ -77,9 +78,8 @@ static int cmd_auth(lua_State *l)
   debug_gen(DEBUG_IN, "KEY", "%s", keystr);
   free(keystr);
 
-  result = mifare_desfire_authenticate(tag, keyno, k);
+  SESSION_RETRY(result, session_auth(keyno, &k));
   desflua_handle_result(l, result, tag);
-  mifare_desfire_key_free(k);
 
 
   return lua_gettop(l);
@@ -155,7 +155,7 @@ static int cmd_gks(lua_State *l)
 
 
   debug_cmd("GetKeySettings");
-  result = mifare_desfire_get_key_settings(tag, &settings, &maxkeys);
+  SESSION_RETRY(result, mifare_desfire_get_key_settings(tag, &settings, &maxkeys));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
@@ -230,6 +230,7 @@ static int cmd_ck(lua_State *l)
 
   result = mifare_desfire_change_key(tag, keyno, knew, kold);
   desflua_handle_result(l, result, tag);
+  session_deauth();
   mifare_desfire_key_free(kold);
   mifare_desfire_key_free(knew);
 
@@ -273,7 +274,7 @@ static int cmd_gkv(lua_State *l)
   debug_gen(DEBUG_IN, "KNO", "%d", keyno);
 
   debug_cmd("GetKeyVersion");
-  result = mifare_desfire_get_key_version(tag, keyno, &ver);
+  SESSION_RETRY(result, mifare_desfire_get_key_version(tag, keyno, &ver));
   desflua_handle_result(l, result, tag);
 
   if(result < 0)
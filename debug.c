@@ -20,20 +20,35 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <freefare.h>
 
+#include "async.h"
 #include "debug.h"
+#include "evlog.h"
 #include "fn.h"
 #include "hexdump.h"
+#include "stats.h"
+#include "wback.h"
 
 
 
-static uint8_t debug_flags = 0;
+static __thread uint8_t debug_flags = 0;
+
+/*
+ * Parameter mit Schlüsselmaterial. Sie erscheinen zwar in der Debug-Ausgabe
+ * auf dem Terminal, dürfen aber nicht in die Protokolldatei gelangen.
+ */
+static const char *debug_secret[] = { "KEY", "KNEW", "KOLD", NULL };
 
 static int debug(lua_State *l);
 static void debug_color(int fg, int bg, int attr);
+static void debug_logparam(const char *label, const char *fmt, ...);
+static int debug_issecret(const char *label);
+static void debug_vgen(unsigned char dir, const char *label, const char *fmt, va_list args);
+static void debug_print(unsigned char dir, const char *label, const char *fmt, ...);
 
 
 
@@ -84,8 +99,36 @@ static void debug_color(int fg, int bg, int attr)
 }
 
 
+static void debug_logparam(const char *label, const char *fmt, ...)
+{
+  va_list args;
+
+
+  va_start(args, fmt);
+  evlog_param(label, fmt, args);
+  va_end(args);
+}
+
+
 void debug_cmd(const char *name)
 {
+  /*
+   * Jedes Kartenkommando beginnt hier. Ein noch laufendes asynchrones
+   * Kommando muss vorher abgeschlossen sein und zurückgehaltene
+   * Schreibzugriffe müssen vorher auf der Karte landen.
+   */
+  async_sync();
+  wback_flush();
+
+  debug_announce(name);
+}
+
+
+void debug_announce(const char *name)
+{
+  evlog_cmd(name);
+  stats_begin(name);
+
   if(!(debug_flags & DEBUG_STAT))
     return;
 
@@ -113,9 +156,8 @@ void debug_info(const char *fmt, ...)
 }
 
 
-void debug_gen(unsigned char dir, const char *label, const char *fmt, ...)
+static void debug_vgen(unsigned char dir, const char *label, const char *fmt, va_list args)
 {
-  va_list args;
   const char *arrow;
 
 
@@ -133,16 +175,68 @@ void debug_gen(unsigned char dir, const char *label, const char *fmt, ...)
     return;
 
   printf("%8s %s ", label, arrow);
-  va_start(args, fmt);
   vprintf(fmt, args);
-  va_end(args);
   debug_color(-1, -1, 0);
   printf("\n");
 }
 
 
+static void debug_print(unsigned char dir, const char *label, const char *fmt, ...)
+{
+  va_list args;
+
+
+  va_start(args, fmt);
+  debug_vgen(dir, label, fmt, args);
+  va_end(args);
+}
+
+
+static int debug_issecret(const char *label)
+{
+  int i;
+
+
+  for(i = 0; debug_secret[i] != NULL; i++)
+    if(strcmp(label, debug_secret[i]) == 0)
+      return 1;
+
+  return 0;
+}
+
+
+void debug_gen(unsigned char dir, const char *label, const char *fmt, ...)
+{
+  va_list args;
+
+
+  /*
+   * Eingabeparameter ins Ereignisprotokoll übernehmen. Schlüssel werden
+   * dabei unkenntlich gemacht.
+   */
+  if((dir & DEBUG_IN) && evlog_active())
+  {
+    if(debug_issecret(label))
+      debug_logparam(label, "%s", "<redacted>");
+    else
+    {
+      va_start(args, fmt);
+      evlog_param(label, fmt, args);
+      va_end(args);
+    }
+  }
+
+  va_start(args, fmt);
+  debug_vgen(dir, label, fmt, args);
+  va_end(args);
+}
+
+
 void debug_result(uint8_t err, const char *str)
 {
+  evlog_result(err, str);
+  stats_end(err, str);
+
   if(!(debug_flags & DEBUG_STAT))
     return;
 
@@ -215,9 +309,16 @@ void debug_buffer(unsigned char dir, uint8_t *buf, unsigned int len, unsigned in
   char *line;
 
 
+  /* Puffer werden im Ereignisprotokoll nur mit ihrer Länge vermerkt. */
+  if((dir & DEBUG_IN) && evlog_active())
+    debug_logparam("BUFLEN", "%u", len);
+
+  if(!(dir & debug_flags))
+    return;
+
   for(idx = 0; idx < len; idx += 8)
   {
     line = hexdump_line(buf + idx, len - idx, offset + idx);
-    debug_gen(dir, "BUF", "%s", line);
+    debug_print(dir, "BUF", "%s", line);
   }
 }
@@ -28,6 +28,8 @@
 #include "cmd.h"
 #include "debug.h"
 #include "desflua.h"
+#include "session.h"
+#include "trace.h"
 
 
 
@@ -141,6 +143,22 @@ void desflua_push_acl(lua_State *l, uint16_t acl)
 }
 
 
+void desflua_result(int result, FreefareTag tag, uint8_t *err, const char **str)
+{
+  *err = mifare_desfire_last_picc_error(tag);
+  *str = result >= 0 ? "OK" : freefare_strerror(tag);
+
+  /* Nach einem Fehler kennen wir den Zustand der Karte nicht mehr. */
+  if(result < 0)
+    session_reset();
+
+  debug_result(*err, *str);
+
+  if(result < 0)
+    trace_error();
+}
+
+
 void desflua_handle_result(lua_State *l, int result, FreefareTag tag)
 {
   uint8_t err;
@@ -150,12 +168,9 @@ void desflua_handle_result(lua_State *l, int result, FreefareTag tag)
   lua_settop(l, 0);
   lua_checkstack(l, 2);
 
-  err = mifare_desfire_last_picc_error(tag);
-  str = result >= 0 ? "OK" : freefare_strerror(tag);
+  desflua_result(result, tag, &err, &str);
   lua_pushinteger(l, err);
   lua_pushstring(l, str);
-
-  debug_result(err, str);
 }
 
 
@@ -21,30 +21,197 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <nfc/nfc.h>
 #include <freefare.h>
 #include <openssl/evp.h>
 
 #include "desfsh.h"
+#include "emul.h"
+#include "evlog.h"
+#include "job.h"
+#include "prof.h"
+#include "replay.h"
+#include "session.h"
 #include "shell.h"
+#include "stats.h"
+#include "trace.h"
 
 
 #define MAXDEVS		16
 
+/* Stationsbetrieb: Abfrageintervall in 150ms-Schritten bzw. Millisekunden. */
+#define STATION_POLLNR	20
+#define STATION_PERIOD	2
+#define STATION_REMOVE	100
+#define STATION_MISSES	2
+
+/* Zwischenspeicher der Geräteliste. */
+#define DEVCACHE_NAME	"desfsh-devices"
+
 
 static int help = 0;
 static const char *devstr = NULL;
 static const char *tagstr = NULL;
 static int devnr = -1;
+static int devall = 0;
+static int devnrs[MAXDEVS];
+static unsigned int ndevnrs = 0;
 static int tagnr = -1;
+static int alltags = 0;
+static int station = 0;
 static int online = 1;
 static int interactive = 0;
 static const char *command = NULL;
+static const char *jobfile = NULL;
+static const char *resultfile = NULL;
+static const char *logfile = NULL;
+static int devcache = 0;
+static int summary = 0;
+static const char *tracefile = NULL;
+static const char *recordfile = NULL;
+static const char *replayfile = NULL;
+static const char *proffile = NULL;
+static int realtime = 0;
+static int emulate = 0;
+
+
+__thread FreefareTag tag = NULL;
+__thread nfc_device *device = NULL;
+
+static volatile sig_atomic_t station_stop = 0;
+
+/*
+ * Der gemeinsame Kontext von libnfc und die Treiber darunter (libusb,
+ * PC/SC) vertragen keine gleichzeitigen Aufrufe aus mehreren Threads.
+ * Geräte werden deshalb nacheinander geöffnet und geschlossen. Die
+ * Kartenkommandos laufen weiterhin parallel.
+ */
+static pthread_mutex_t dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Zustand eines Lesegeräts im Mehrgerätebetrieb. Jedes Gerät wird von einem
+ * eigenen Thread mit eigenem LUA-Zustand bedient.
+ */
+struct reader_s
+{
+  pthread_t thread;
+  unsigned char started;
+  nfc_context *ctx;
+  unsigned int nr;
+  nfc_connstring connstr;
+  char uid[32];
+  int status;
+  const char *msg;
+  double elapsed;
+  unsigned long saved, recovered, failed;
+};
+
+
+/*
+ * Ein Gerät der Geräteübersicht. Alle Geräte werden parallel geöffnet und
+ * ihre Tags in einen Puffer geschrieben, der anschließend in der
+ * Reihenfolge der Geräte ausgegeben wird.
+ */
+struct devinfo_s
+{
+  pthread_t thread;
+  unsigned char started;
+  nfc_context *ctx;
+  const char *connstr;
+  char *out;
+  size_t outlen;
+};
+
+
+
+static int parse_devs(const char *arg)
+{
+  const char *pos;
+  char *end;
+  long nr;
+
+
+  devall  = 0;
+  ndevnrs = 0;
+
+  if(!strcasecmp(arg, "all"))
+  {
+    devall = 1;
+    devnr  = -1;
+    return 0;
+  }
+
+  pos = arg;
+  while(1)
+  {
+    nr = strtol(pos, &end, 10);
+    if(end == pos || nr < 0)
+      return -1;
 
+    if(ndevnrs >= MAXDEVS)
+      return -1;
+    devnrs[ndevnrs++] = nr;
 
-FreefareTag tag = NULL;
+    if(*end == '\0')
+      break;
+    if(*end != ',')
+      return -1;
+    pos = end + 1;
+  }
 
+  devnr = devnrs[0];
+
+
+  return 0;
+}
+
+
+
+static int parse_framesize(const char *arg)
+{
+  char *end;
+  long size;
+
+
+  size = strtol(arg, &end, 10);
+  if(*arg == '\0' || *end != '\0' || size < 1 || size > SESSION_MAXFRAME)
+  {
+    fprintf(stderr, "Invalid frame size '%s'.\n", arg);
+    return -1;
+  }
+
+  session_defframesize(size);
+
+
+  return 0;
+}
+
+
+static int parse_devcache(const char *arg)
+{
+  char *end;
+  long secs;
+
+
+  secs = strtol(arg, &end, 10);
+  if(*arg == '\0' || *end != '\0' || secs < 0 || secs > 86400)
+  {
+    fprintf(stderr, "Invalid cache time '%s'.\n", arg);
+    return -1;
+  }
+
+  devcache = secs;
+
+
+  return 0;
+}
 
 
 static int parse(int argc, char *argv[])
@@ -56,6 +223,21 @@ static int parse(int argc, char *argv[])
     { .name = "tag",         .has_arg = 1, .flag = NULL, .val = 't' },
     { .name = "devicename",  .has_arg = 1, .flag = NULL, .val = 'D' },
     { .name = "tagname",     .has_arg = 1, .flag = NULL, .val = 'T' },
+    { .name = "alltags",     .has_arg = 0, .flag = NULL, .val = 'a' },
+    { .name = "station",     .has_arg = 0, .flag = NULL, .val = 's' },
+    { .name = "job",         .has_arg = 1, .flag = NULL, .val = 'j' },
+    { .name = "result",      .has_arg = 1, .flag = NULL, .val = 'r' },
+    { .name = "log",         .has_arg = 1, .flag = NULL, .val = 'l' },
+    { .name = "framesize",   .has_arg = 1, .flag = NULL, .val = 'F' },
+    { .name = "selectrate",  .has_arg = 1, .flag = NULL, .val = 'b' },
+    { .name = "devcache",    .has_arg = 1, .flag = NULL, .val = 'C' },
+    { .name = "stats",       .has_arg = 0, .flag = NULL, .val = 'S' },
+    { .name = "trace",       .has_arg = 1, .flag = NULL, .val = 'x' },
+    { .name = "record",      .has_arg = 1, .flag = NULL, .val = 'X' },
+    { .name = "replay",      .has_arg = 1, .flag = NULL, .val = 'R' },
+    { .name = "realtime",    .has_arg = 0, .flag = NULL, .val = 'w' },
+    { .name = "emulate",     .has_arg = 0, .flag = NULL, .val = 'E' },
+    { .name = "profile",     .has_arg = 1, .flag = NULL, .val = 'P' },
     { .name = "offline",     .has_arg = 0, .flag = NULL, .val = 'o' },
     { .name = "interactive", .has_arg = 0, .flag = NULL, .val = 'i' },
     { .name = "command",     .has_arg = 1, .flag = NULL, .val = 'c' },
@@ -66,17 +248,32 @@ static int parse(int argc, char *argv[])
   {
     int c;
 
-    c = getopt_long(argc, argv, "hd:t:D:T:oic:", longopts, NULL);
+    c = getopt_long(argc, argv, "hd:t:D:T:asj:r:l:F:b:C:Sx:X:R:wEP:oic:", longopts, NULL);
     if(c == -1)
       break;
 
     switch(c)
     {
     case 'h': help = 1;                             break;
-    case 'D': devstr = optarg;       devnr  = -1;   break;
+    case 'D': devstr = optarg;       devnr  = -1;   devall = 0; ndevnrs = 0; break;
     case 'T': tagstr = optarg;       tagnr  = -1;   break;
-    case 'd': devnr  = atoi(optarg); devstr = NULL; break;
+    case 'd': if(parse_devs(optarg)) { return -1; } devstr = NULL; break;
     case 't': tagnr  = atoi(optarg); tagstr = NULL; break;
+    case 'a': alltags = 1;                          break;
+    case 's': station = 1;                          break;
+    case 'j': jobfile = optarg;                     break;
+    case 'r': resultfile = optarg;                  break;
+    case 'l': logfile = optarg;                     break;
+    case 'F': if(parse_framesize(optarg)) { return -1; } break;
+    case 'C': if(parse_devcache(optarg)) { return -1; } break;
+    case 'S': summary = 1;                          break;
+    case 'x': tracefile = optarg;                   break;
+    case 'X': recordfile = optarg;                  break;
+    case 'R': replayfile = optarg;                  break;
+    case 'w': realtime = 1;                         break;
+    case 'E': emulate = 1;                          break;
+    case 'P': proffile = optarg;                    break;
+    case 'b': if(session_defselectrate(atoi(optarg))) { fprintf(stderr, "Invalid bit rate '%s'.\n", optarg); return -1; } break;
     case 'o': online = 0;                           break;
     case 'i': interactive = 1;                      break;
     case 'c': command = optarg;                     break;
@@ -103,7 +300,35 @@ static void show_help(const char *name)
   printf("  -D <devstring>   NFC device to connect\n");
   printf("  -T <tagstring>   NFC tag (UID) to connect\n");
   printf("  -d <devnumber>   NFC device number to connect (can be used instead of -D)\n");
+  printf("                   A comma separated list or 'all' runs the command on\n");
+  printf("                   several devices in parallel.\n");
   printf("  -t <tagnumber>   NFC tag number to connect (can be used instead of -T)\n");
+  printf("  -a               Execute the command on all DESFire tags of the device\n");
+  printf("                   one after another.\n");
+  printf("  -s               Station mode. Wait for tags and execute the command on\n");
+  printf("                   each presented tag until interrupted.\n");
+  printf("  -j <jobfile>     Assign a record of the CSV or JSONL job file to each tag\n");
+  printf("                   (only with -a or -s).\n");
+  printf("  -r <resultfile>  Append the results of the job to this file instead of\n");
+  printf("                   printing them.\n");
+  printf("  -l <logfile>     Append all commands and events as JSON lines to this file.\n");
+  printf("  -F <bytes>       Data bytes per frame for raw commands (default 52, max. 247).\n");
+  printf("  -b <kbps>        Select tags with this modulation bit rate (106, 212, 424\n");
+  printf("                   or 848 kbit/s). The rate is only passed to the reader\n");
+  printf("                   driver, no PPS is sent. Falls back to lower rates, if not\n");
+  printf("                   supported.\n");
+  printf("  -C <seconds>     Cache the list of devices for the given time.\n");
+  printf("  -S               Print latency statistics of all commands on exit.\n");
+  printf("  -x <tracefile>   Write the last frames exchanged with the reader to this\n");
+  printf("                   file after each failed command.\n");
+  printf("  -X <tracefile>   Write all frames exchanged with the reader to this file.\n");
+  printf("  -R <tracefile>   Replay a trace file written by -X instead of using a\n");
+  printf("                   reader. Responses are served as fast as possible.\n");
+  printf("  -w               Delay replayed responses like in the recording.\n");
+  printf("  -E               Use an emulated, initially empty DESFire EV1 card instead\n");
+  printf("                   of a reader.\n");
+  printf("  -P <file>        Profile all Lua scripts and write the folded stacks\n");
+  printf("                   to this file on exit.\n");
   printf("  -o               Offline Mode. Don't connect to any NFC device.\n");
   printf("  -i               Enter interactive shell mode.\n");
   printf("                   Default if no command specified via -c.\n");
@@ -112,57 +337,756 @@ static void show_help(const char *name)
 }
 
 
-static void show_tags(nfc_device *dev, const char *indent)
+static void show_tags(FILE *out, nfc_device *dev, const char *indent)
 {
   FreefareTag *tags;
   unsigned int i;
+  char *uidstr;
 
 
   if(indent == NULL)
     indent = "";
 
   tags = freefare_get_tags(dev);
+  if(tags == NULL)
+    return;
+
   for(i = 0; tags[i] != NULL; i++)
   {
     FreefareTag tag;
 
     tag = tags[i];
-    printf("%s%2d: %s --> %s\n", indent, i,
-        freefare_get_tag_friendly_name(tag),
-        freefare_get_tag_uid(tag));
+    uidstr = freefare_get_tag_uid(tag);
+    fprintf(out, "%s%2d: %s --> %s\n", indent, i,
+        freefare_get_tag_friendly_name(tag), uidstr);
+    free(uidstr);
   }
   freefare_free_tags(tags);
 }
 
 
+static FreefareTag find_tag(FreefareTag *tags)
+{
+  unsigned int i;
+  char *uidstr;
+  int match;
+
+
+  if(tags == NULL)
+    return NULL;
+
+  for(i = 0; tags[i] != NULL; i++)
+  {
+    if(tagnr >= 0)
+      match = tagnr == (int)i;
+    else if(tagstr != NULL)
+    {
+      uidstr = freefare_get_tag_uid(tags[i]);
+      match = uidstr != NULL && !strcasecmp(uidstr, tagstr);
+      free(uidstr);
+    }
+    else
+      match = freefare_get_tag_type(tags[i]) == MIFARE_DESFIRE;
+
+    if(match)
+      return tags[i];
+  }
+
+
+  return NULL;
+}
+
+
+/*
+ * Ist der Tag per UID angegeben, wählen wir ihn direkt aus, statt alle Tags
+ * im Feld aufzuzählen. Das Ergebnis ist wie bei freefare_get_tags() eine mit
+ * NULL abgeschlossene Liste. Gelingt die direkte Auswahl nicht, zählen wir
+ * wie bisher alle Tags auf.
+ */
+static FreefareTag *get_tags(nfc_device *dev)
+{
+  FreefareTag *tags;
+  nfc_modulation nm;
+  nfc_target target;
+  uint8_t uid[10];
+  size_t uidlen;
+  unsigned int byte;
+
+
+  if(tagstr == NULL || tagnr >= 0)
+    return freefare_get_tags(dev);
+
+  for(uidlen = 0; uidlen < sizeof(uid) && sscanf(tagstr + 2 * uidlen, "%2x", &byte) == 1; uidlen++)
+    uid[uidlen] = byte;
+
+  if(strlen(tagstr) != 2 * uidlen || (uidlen != 4 && uidlen != 7 && uidlen != 10))
+    return freefare_get_tags(dev);
+
+  if(nfc_initiator_init(dev) < 0)
+    return NULL;
+
+  nfc_device_set_property_bool(dev, NP_INFINITE_SELECT, false);
+
+  nm.nmt = NMT_ISO14443A;
+  nm.nbr = NBR_106;
+  if(nfc_initiator_select_passive_target(dev, nm, uid, uidlen, &target) <= 0)
+    return freefare_get_tags(dev);
+
+  /* Wie bei der Aufzählung bleibt der Tag bis zum Verbinden abgewählt. */
+  nfc_initiator_deselect_target(dev);
+
+  tags = malloc(2 * sizeof(FreefareTag));
+  if(tags == NULL)
+    return NULL;
+
+  tags[0] = freefare_tag_new(dev, target);
+  tags[1] = NULL;
+  if(tags[0] == NULL)
+  {
+    free(tags);
+    return freefare_get_tags(dev);
+  }
+
+
+  return tags;
+}
+
+
+/*
+ * Das Kommando auf dem aktuellen Tag ausführen. Ist eine Auftragsdatei
+ * angegeben, wird zuvor der passende Datensatz bereitgestellt und danach
+ * das Ergebnis protokolliert.
+ */
+static int run_tag(lua_State *l, unsigned long idx, const char *uidstr, const char **msg)
+{
+  struct timespec start, end;
+  int result;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  session_newtag();
+  shell_settag(l, idx, uidstr);
+
+  if(jobfile != NULL && job_begin(l, uidstr))
+  {
+    result = -1;
+    *msg = "no job record";
+  }
+  else if(session_connect() < 0)
+  {
+    result = -1;
+    *msg = "unable to connect tag";
+  }
+  else
+  {
+    result = shell_run(l, command);
+    *msg = result ? "command failed" : "OK";
+    mifare_desfire_disconnect(tag);
+  }
+
+  if(jobfile != NULL)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job_end(l, uidstr, *msg,
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+
+
+  return result;
+}
+
+
+/*
+ * Das Kommando nacheinander auf allen DESFire-Tags ausführen. Der
+ * LUA-Zustand bleibt dabei erhalten, sodass Ergebnisse über alle Tags
+ * gesammelt werden können. Der Rückgabewert ist die Anzahl der
+ * fehlgeschlagenen Tags.
+ */
+static int run_tags(FreefareTag *tags)
+{
+  lua_State *l;
+  struct timespec start, end;
+  unsigned int i, nfailed;
+  char *uidstr;
+  int result;
+  const char *msg;
+
+
+  l = shell_open(online);
+  if(l == NULL)
+    return -1;
+
+  if(jobfile != NULL && job_open(jobfile, resultfile))
+  {
+    shell_close(l);
+    return -1;
+  }
+
+  nfailed = 0;
+  for(i = 0; tags[i] != NULL; i++)
+  {
+    if(freefare_get_tag_type(tags[i]) != MIFARE_DESFIRE)
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    tag = tags[i];
+    uidstr = freefare_get_tag_uid(tag);
+    printf("*** Tag %d: %s\n", i, uidstr);
+
+    result = run_tag(l, i, uidstr, &msg);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("*** Tag %d: %s (%.3fs)\n\n", i, msg,
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    if(result)
+      nfailed++;
+    free(uidstr);
+  }
+
+  tag = NULL;
+  if(jobfile != NULL)
+    job_close();
+  shell_close(l);
+
+
+  return nfailed;
+}
+
+
+static void station_sigint(int sig)
+{
+  (void)sig;
+  station_stop = 1;
+}
+
+
+/*
+ * Prüfen, ob sich die Karte noch im Feld befindet. Dazu wählen wir sie
+ * anhand ihrer UID erneut aus.
+ */
+static int station_present(nfc_device *dev, const nfc_target *target)
+{
+  int result;
+
+
+  result = nfc_initiator_select_passive_target(dev, target->nm,
+    target->nti.nai.abtUid, target->nti.nai.szUidLen, NULL);
+  if(result > 0)
+    nfc_initiator_deselect_target(dev);
+
+
+  return result > 0;
+}
+
+
+/*
+ * Stationsbetrieb: Auf eine Karte warten, das Kommando ausführen und warten,
+ * bis die Karte entfernt wurde. Gerät und LUA-Zustand bleiben dabei über
+ * alle Karten hinweg erhalten. Der Rückgabewert ist die Anzahl der
+ * fehlgeschlagenen Karten.
+ */
+static int run_station(nfc_device *dev)
+{
+  static const nfc_modulation mod = { .nmt = NMT_ISO14443A, .nbr = NBR_106 };
+  lua_State *l;
+  nfc_target target;
+  struct timespec start, end;
+  unsigned long ncards, nfailed;
+  unsigned int misses;
+  double cycle, total;
+  char *uidstr;
+  const char *msg;
+  int result;
+
+
+  l = shell_open(online);
+  if(l == NULL)
+    return -1;
+
+  if(nfc_initiator_init(dev) < 0)
+  {
+    fprintf(stderr, "Unable to initialize device: %s\n", nfc_strerror(dev));
+    shell_close(l);
+    return -1;
+  }
+
+  /* Sonst blockiert die Prüfung auf eine entfernte Karte für immer. */
+  nfc_device_set_property_bool(dev, NP_INFINITE_SELECT, false);
+
+  if(jobfile != NULL && job_open(jobfile, resultfile))
+  {
+    shell_close(l);
+    return -1;
+  }
+
+  station_stop = 0;
+  signal(SIGINT, station_sigint);
+
+  printf("Waiting for tags. Press Ctrl-C to stop.\n");
+
+  ncards  = 0;
+  nfailed = 0;
+  total   = 0;
+
+  while(!station_stop)
+  {
+    /* Auf eine Karte warten. */
+    result = nfc_initiator_poll_target(dev, &mod, 1, STATION_POLLNR, STATION_PERIOD, &target);
+    if(result <= 0)
+    {
+      if(result < 0 && result != NFC_ETIMEOUT && !station_stop)
+      {
+        fprintf(stderr, "Polling failed: %s\n", nfc_strerror(dev));
+        usleep(STATION_REMOVE * 1000);
+      }
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    tag = freefare_tag_new(dev, target);
+    if(tag == NULL || freefare_get_tag_type(tag) != MIFARE_DESFIRE)
+    {
+      printf("*** Tag is not a DESFire card, ignored.\n");
+      goto wait_removal;
+    }
+
+    ncards++;
+    uidstr = freefare_get_tag_uid(tag);
+    printf("*** Tag %lu: %s\n", ncards, uidstr);
+
+    result = run_tag(l, ncards, uidstr, &msg);
+
+    if(result)
+      nfailed++;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    cycle = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    total += cycle;
+
+    printf("*** Tag %lu: %s %s (%.3fs)\n", ncards, uidstr, msg, cycle);
+    free(uidstr);
+
+wait_removal:
+    if(tag != NULL)
+      freefare_free_tag(tag);
+    tag = NULL;
+
+    /* Warten, bis die Karte entfernt wurde. */
+    misses = 0;
+    while(!station_stop && misses < STATION_MISSES)
+    {
+      if(station_present(dev, &target))
+        misses = 0;
+      else
+        misses++;
+      usleep(STATION_REMOVE * 1000);
+    }
+  }
+
+  signal(SIGINT, SIG_DFL);
+
+  if(jobfile != NULL)
+    job_close();
+
+  printf("\n%lu tags processed, %lu failed", ncards, nfailed);
+  if(ncards > 0)
+    printf(", %.3fs average cycle time", total / ncards);
+  printf(".\n");
+
+  shell_close(l);
+
+
+  return nfailed;
+}
+
+
+/*
+ * Pfad des Zwischenspeichers. Er liegt im Laufzeitverzeichnis des Nutzers.
+ * Ohne dieses Verzeichnis wird nichts zwischengespeichert, da eine Datei an
+ * einem vorhersagbaren Ort in /tmp von anderen Nutzern angelegt oder als
+ * symbolische Verknüpfung untergeschoben werden könnte.
+ */
+static int devcache_path(char *path, size_t len)
+{
+  const char *dir;
+
+
+  dir = getenv("XDG_RUNTIME_DIR");
+  if(dir == NULL || *dir != '/')
+    return -1;
+
+  snprintf(path, len, "%s/%s", dir, DEVCACHE_NAME);
+
+
+  return 0;
+}
+
+
+/*
+ * Die Datei öffnen, ohne symbolischen Verknüpfungen zu folgen. Wir
+ * vertrauen ihr nur, wenn sie eine reguläre Datei des aktuellen Nutzers ist,
+ * die niemand sonst beschreiben kann.
+ */
+static FILE *devcache_open(int flags, const char *mode)
+{
+  char path[512];
+  struct stat st;
+  FILE *f;
+  int fd;
+
+
+  if(devcache_path(path, sizeof(path)))
+    return NULL;
+
+  fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if(fd < 0)
+    return NULL;
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+     (st.st_mode & (S_IWGRP | S_IWOTH)))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  f = fdopen(fd, mode);
+  if(f == NULL)
+    close(fd);
+
+
+  return f;
+}
+
+
+static int devcache_load(nfc_connstring connstr[])
+{
+  char line[sizeof(nfc_connstring)];
+  FILE *f;
+  long stamp;
+  int n;
+
+
+  f = devcache_open(O_RDONLY, "r");
+  if(f == NULL)
+    return -1;
+
+  if(fgets(line, sizeof(line), f) == NULL || sscanf(line, "%ld", &stamp) != 1 ||
+     time(NULL) - stamp < 0 || time(NULL) - stamp > devcache)
+  {
+    fclose(f);
+    return -1;
+  }
+
+  n = 0;
+  while(n < MAXDEVS && fgets(line, sizeof(line), f) != NULL)
+  {
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(connstr[n++], sizeof(nfc_connstring), "%s", line);
+  }
+  fclose(f);
+
+
+  return n;
+}
+
+
+static void devcache_save(nfc_connstring connstr[], int n)
+{
+  FILE *f;
+  int i;
+
+
+  f = devcache_open(O_WRONLY | O_CREAT, "w");
+  if(f == NULL)
+    return;
+
+  if(ftruncate(fileno(f), 0) < 0)
+  {
+    fclose(f);
+    return;
+  }
+
+  fprintf(f, "%ld\n", (long)time(NULL));
+  for(i = 0; i < n; i++)
+    fprintf(f, "%s\n", connstr[i]);
+  fclose(f);
+}
+
+
+/*
+ * Vorhandene Geräte auflisten. Mit -C wird die Liste für die angegebene
+ * Zeit zwischengespeichert, sodass wiederholte Aufrufe die Geräte nicht
+ * erneut suchen müssen. Mit <refresh> wird der Zwischenspeicher ignoriert,
+ * etwa wenn sich ein gespeichertes Gerät nicht öffnen lässt.
+ */
+static int list_devs(nfc_context *ctx, nfc_connstring connstr[], int refresh)
+{
+  int n;
+
+
+  if(devcache > 0 && !refresh)
+  {
+    n = devcache_load(connstr);
+    if(n > 0)
+      return n;
+  }
+
+  n = nfc_list_devices(ctx, connstr, MAXDEVS);
+
+  if(devcache > 0 && n > 0)
+    devcache_save(connstr, n);
+
+
+  return n;
+}
+
+
+static nfc_device *dev_open(nfc_context *ctx, const char *connstr)
+{
+  nfc_device *dev;
+
+
+  pthread_mutex_lock(&dev_mutex);
+  dev = nfc_open(ctx, connstr);
+  pthread_mutex_unlock(&dev_mutex);
+
+
+  return dev;
+}
+
+
+static void dev_close(nfc_device *dev)
+{
+  pthread_mutex_lock(&dev_mutex);
+  nfc_close(dev);
+  pthread_mutex_unlock(&dev_mutex);
+}
+
+
+static void *show_dev(void *arg)
+{
+  struct devinfo_s *d = (struct devinfo_s*)arg;
+  nfc_device *dev;
+  FILE *out;
+
+
+  out = open_memstream(&d->out, &d->outlen);
+  if(out == NULL)
+    return NULL;
+
+  dev = dev_open(d->ctx, d->connstr);
+  if(dev == NULL)
+    fprintf(out, "  ** Unable to open device. **\n");
+  else
+  {
+    show_tags(out, dev, "  ");
+    dev_close(dev);
+  }
+
+  fclose(out);
+
+
+  return NULL;
+}
+
+
 static void show_devs(nfc_context *ctx)
 {
   nfc_connstring connstr[MAXDEVS];
+  struct devinfo_s devs[MAXDEVS];
   unsigned int n, i;
 
 
-  n = nfc_list_devices(ctx, connstr, MAXDEVS);
+  n = list_devs(ctx, connstr, 0);
   if(n == 0)
   {
     printf("No devices found.\n");
     return;
   }
 
+  /* Alle Geräte gleichzeitig öffnen und abfragen. */
+  memset(devs, 0, sizeof(devs));
+  for(i = 0; i < n; i++)
+  {
+    devs[i].ctx     = ctx;
+    devs[i].connstr = connstr[i];
+    devs[i].started = !pthread_create(&devs[i].thread, NULL, show_dev, &devs[i]);
+  }
+
   printf("%d devices found:\n", n);
   for(i = 0; i < n; i++)
   {
-    nfc_device *dev;
+    if(devs[i].started)
+      pthread_join(devs[i].thread, NULL);
 
     printf("%2d: %s\n", i, connstr[i]);
-    dev = nfc_open(ctx, connstr[i]);
-    if(dev == NULL)
+    if(devs[i].out != NULL)
+      fputs(devs[i].out, stdout);
+    else
+      printf("  ** Unable to query device. **\n");
+    free(devs[i].out);
+  }
+}
+
+
+static void *reader_run(void *arg)
+{
+  struct reader_s *r = (struct reader_s*)arg;
+  struct timespec start, end;
+  nfc_device *dev;
+  FreefareTag *tags;
+  char *uidstr;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  r->status = -1;
+
+  dev = dev_open(r->ctx, r->connstr);
+  if(dev == NULL)
+  {
+    r->msg = "unable to open device";
+    goto end_exit;
+  }
+
+  device = dev;
+
+  tags = get_tags(dev);
+  if(tags == NULL)
+  {
+    r->msg = "unable to list tags";
+    goto end_close;
+  }
+
+  tag = find_tag(tags);
+  if(tag == NULL)
+  {
+    r->msg = "tag not found";
+    goto end_free;
+  }
+
+  if(freefare_get_tag_type(tag) != MIFARE_DESFIRE)
+  {
+    r->msg = "tag is not a DESFire card";
+    goto end_free;
+  }
+
+  uidstr = freefare_get_tag_uid(tag);
+  snprintf(r->uid, sizeof(r->uid), "%s", uidstr != NULL ? uidstr : "");
+  free(uidstr);
+
+  if(session_connect() < 0)
+  {
+    r->msg = "unable to connect tag";
+    goto end_free;
+  }
+
+  r->status = shell(online, 0, command);
+  r->msg = r->status ? "command failed" : "OK";
+  session_counters(&r->saved, &r->recovered, &r->failed);
+
+  mifare_desfire_disconnect(tag);
+
+end_free:
+  freefare_free_tags(tags);
+
+end_close:
+  dev_close(dev);
+
+end_exit:
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  r->elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+
+  return NULL;
+}
+
+
+/*
+ * Das Kommando parallel auf mehreren Lesegeräten ausführen. Der
+ * Rückgabewert ist die Anzahl der fehlgeschlagenen Geräte.
+ */
+static int run_readers(nfc_context *ctx)
+{
+  nfc_connstring connstr[MAXDEVS];
+  struct reader_s readers[MAXDEVS];
+  unsigned int n, nreaders, nfailed, i;
+  int result;
+
+
+  n = list_devs(ctx, connstr, 0);
+
+  nreaders = devall ? n : ndevnrs;
+  if(nreaders == 0)
+  {
+    printf("No devices found.\n");
+    return 1;
+  }
+
+  for(i = 0; i < nreaders; i++)
+  {
+    unsigned int nr;
+
+    nr = devall ? i : (unsigned int)devnrs[i];
+    if(nr >= n)
     {
-      printf("  ** Unable to open device. **\n");
+      printf("Device number %d invalid. Only %d devices present.\n", nr, n);
+      return 1;
+    }
+
+    memset(&readers[i], 0, sizeof(readers[i]));
+    readers[i].ctx = ctx;
+    readers[i].nr  = nr;
+    memcpy(readers[i].connstr, connstr[nr], sizeof(nfc_connstring));
+  }
+
+  for(i = 0; i < nreaders; i++)
+  {
+    result = pthread_create(&readers[i].thread, NULL, reader_run, &readers[i]);
+    if(result)
+    {
+      readers[i].status = -1;
+      readers[i].msg    = "unable to create thread";
       continue;
     }
-    show_tags(dev, "  ");
-    nfc_close(dev);
+
+    readers[i].started = 1;
   }
+
+  for(i = 0; i < nreaders; i++)
+    if(readers[i].started)
+      pthread_join(readers[i].thread, NULL);
+
+
+  /* Ergebnisse zusammenfassen. */
+  nfailed = 0;
+
+  printf("\n");
+  printf("DEV  UID             TIME      SAVED  RECOV  FAIL  STATUS\n");
+  printf("----------------------------------------------------------------\n");
+  for(i = 0; i < nreaders; i++)
+  {
+    struct reader_s *r = &readers[i];
+
+    printf("%3d  %-14s  %7.3fs  %5lu  %5lu  %4lu  %s\n",
+      r->nr, r->uid, r->elapsed, r->saved, r->recovered, r->failed, r->msg);
+
+    if(r->status != 0)
+      nfailed++;
+  }
+  printf("\n");
+
+
+  return nfailed;
+}
+
+
+static void show_stats()
+{
+  stats_summary(stderr);
 }
 
 
@@ -189,56 +1113,166 @@ int main(int argc, char *argv[])
 
   OpenSSL_add_all_algorithms();
 
+  if(jobfile != NULL && ((!alltags && !station) || devall || ndevnrs > 1))
+  {
+    fprintf(stderr, "Option -j requires -a or -s on a single device.\n");
+    return -1;
+  }
+
+  if(logfile != NULL && evlog_open(logfile))
+  {
+    fprintf(stderr, "Unable to open log file '%s'.\n", logfile);
+    EVP_cleanup();
+    return -1;
+  }
+
+  if(summary)
+    atexit(show_stats);
+
+  if(proffile != NULL)
+    prof_autostart(proffile);
+
+  if(tracefile != NULL)
+    trace_autodump(tracefile);
+
+  if(recordfile != NULL && trace_stream(recordfile))
+  {
+    fprintf(stderr, "Unable to open trace file '%s'.\n", recordfile);
+    EVP_cleanup();
+    return -1;
+  }
+
+  if(replayfile != NULL && (station || devall || ndevnrs > 1))
+  {
+    fprintf(stderr, "Option -R can't be combined with -s or several devices.\n");
+    EVP_cleanup();
+    return -1;
+  }
+
+  if(emulate && (replayfile != NULL || station || devall || ndevnrs > 1))
+  {
+    fprintf(stderr, "Option -E can't be combined with -R, -s or several devices.\n");
+    EVP_cleanup();
+    return -1;
+  }
+
+  if(replayfile != NULL && replay_open(replayfile, realtime))
+  {
+    fprintf(stderr, "Unable to read trace file '%s'.\n", replayfile);
+    EVP_cleanup();
+    return -1;
+  }
+
+  if(online && (devall || ndevnrs > 1))
+  {
+    if(command == NULL)
+    {
+      fprintf(stderr, "Multiple devices require a command (-c).\n");
+      EVP_cleanup();
+      return -1;
+    }
+
+    nfc_init(&ctx);
+    result = run_readers(ctx) ? 1 : 0;
+    nfc_exit(ctx);
+    EVP_cleanup();
+    return result;
+  }
+
   if(online)
   {
     nfc_connstring connstr[MAXDEVS];
-    int i, n;
+    int n;
 
     nfc_init(&ctx);
-    if(devstr == NULL && devnr < 0)
+    if(replayfile != NULL)
+      dev = replay_device();
+    else if(emulate)
+      dev = emul_device();
+    else if(devstr == NULL && devnr < 0)
     {
       show_devs(ctx);
       goto end_exit;
     }
-
-    if(devstr == NULL)
+    else if(devstr == NULL)
     {
-      n = nfc_list_devices(ctx, connstr, MAXDEVS);
+      n = list_devs(ctx, connstr, 0);
+      dev = devnr < n ? nfc_open(ctx, connstr[devnr]) : NULL;
+
+      /* Ein veralteter Zwischenspeicher wird neu aufgebaut. */
+      if(dev == NULL && devcache > 0)
+      {
+        n = list_devs(ctx, connstr, 1);
+        dev = devnr < n ? nfc_open(ctx, connstr[devnr]) : NULL;
+      }
+
       if(devnr >= n)
       {
         printf("Device number %d invalid. Only %d devices present.\n", devnr, n);
         goto end_exit;
       }
-      devstr = connstr[devnr];
     }
+    else
+      dev = nfc_open(ctx, devstr);
 
-    dev = nfc_open(ctx, devstr);
     if(dev == NULL)
     {
       printf("Unable to open device.\n");
       goto end_exit;
     }
 
-    if(tagstr == NULL && tagnr < 0)
+    device = dev;
+
+    if(station)
     {
-      show_tags(dev, NULL);
-      goto end_close;
+      if(command == NULL)
+      {
+        fprintf(stderr, "Option -s requires a command (-c).\n");
+        goto end_close;
+      }
+
+      result = run_station(dev) ? 1 : 0;
+      nfc_close(dev);
+      nfc_exit(ctx);
+      EVP_cleanup();
+      return result;
     }
 
-    tags = freefare_get_tags(dev);
-    tag = NULL;
-    for(i = 0; tags[i] != NULL; i++)
+    if(alltags)
     {
-      const char *uidstr;
+      if(command == NULL)
+      {
+        fprintf(stderr, "Option -a requires a command (-c).\n");
+        goto end_close;
+      }
+
+      tags = freefare_get_tags(dev);
+      if(tags == NULL)
+      {
+        fprintf(stderr, "Unable to list tags: %s\n", nfc_strerror(dev));
+        nfc_close(dev);
+        nfc_exit(ctx);
+        EVP_cleanup();
+        return 1;
+      }
 
-      tag = tags[i];
-      uidstr = freefare_get_tag_uid(tag);
+      result = run_tags(tags) ? 1 : 0;
+      freefare_free_tags(tags);
+      nfc_close(dev);
+      nfc_exit(ctx);
+      EVP_cleanup();
+      return result;
+    }
 
-      if((tagnr >= 0 && tagnr == i) || \
-         (tagstr != NULL && !strcasecmp(uidstr, tagstr)))
-        break;
+    if(tagstr == NULL && tagnr < 0)
+    {
+      show_tags(stdout, dev, NULL);
+      goto end_close;
     }
 
+    tags = get_tags(dev);
+    tag = find_tag(tags);
+
     if(tag == NULL)
     {
       fprintf(stderr, "Tag not found.\n");
@@ -251,7 +1285,7 @@ int main(int argc, char *argv[])
       goto end_free;
     }
 
-    mifare_desfire_connect(tag);
+    session_connect();
   }
 
   shell(online, interactive, command);
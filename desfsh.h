@@ -20,10 +20,12 @@
 #ifndef _DESF_H_
 #define _DESF_H_
 
+#include <nfc/nfc.h>
 #include <freefare.h>
 
 
-extern FreefareTag tag;
+extern __thread FreefareTag tag;
+extern __thread nfc_device *device;
 
 
 #endif
@@ -0,0 +1,2383 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <nfc/nfc.h>
+#include <freefare.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "emul.h"
+#include "trace.h"
+
+
+/*
+ * Emulierte DESFire EV1 Karte
+ *
+ * Das Gerät der Emulation ersetzt einen Leser mit genau einer Karte im Feld.
+ * Die Rahmen, die libfreefare bzw. cmd.raw() senden, werden wie von der
+ * Karte ausgewertet: Applikationen, alle Dateitypen mit Transaktionen,
+ * Authentifizierung mit DES, 3DES, 3K3DES und AES sowie die gesicherte
+ * Übertragung (MAC, CMAC und Verschlüsselung) beider Verfahren. Die Karte
+ * lebt nur im Speicher und beginnt mit jedem Programmstart leer mit dem
+ * DES-Nullschlüssel als PICC-Hauptschlüssel.
+ *
+ * Die Zufallszahlen der Karte stammen aus einem festen Generator, sodass
+ * sich ein Ablauf mit der Emulation immer gleich verhält.
+ */
+#define EMUL_DES	0x00
+#define EMUL_3K3DES	0x40
+#define EMUL_AES	0x80
+
+/* Schlüsseleinstellungen */
+#define EMUL_KS_CHANGEMK	0x01
+#define EMUL_KS_FREELIST	0x02
+#define EMUL_KS_FREECREATE	0x04
+#define EMUL_KS_CHANGECONF	0x08
+
+/* Antwort ohne gesicherte Übertragung (Authentifizierung, Auswahl) */
+#define EMUL_RAW	0xff
+
+#define EMUL_LEGACY	0
+#define EMUL_NEW	1
+
+#define EMUL_MAXCMD	(EMUL_MEMORY + 64)
+#define EMUL_MAXRESP	(EMUL_MEMORY + 64)
+
+
+struct emul_key
+{
+  uint8_t data[24];
+  uint8_t version;
+};
+
+struct emul_file
+{
+  uint8_t type;
+  uint8_t comm;
+  uint16_t ar;
+  uint16_t isofid;
+  uint32_t size;
+  uint32_t maxrec;
+  uint32_t nrec;
+  uint32_t mem;
+  uint8_t *data;
+  uint8_t *shadow;
+  int32_t lower;
+  int32_t upper;
+  int32_t value;
+  int32_t pending;
+  int32_t limit;
+  int32_t debited;
+  uint8_t limited;
+  unsigned char dirty;
+  unsigned char clear;
+  unsigned char credited;
+  unsigned char lcredited;
+};
+
+struct emul_app
+{
+  uint32_t aid;
+  uint8_t settings;
+  uint8_t nkeys;
+  uint8_t crypto;
+  uint16_t isofid;
+  uint8_t dfname[16];
+  uint8_t dfnamelen;
+  struct emul_key keys[EMUL_KEYS];
+  struct emul_file *files[EMUL_FILES];
+};
+
+struct emul_cipher
+{
+  EVP_CIPHER_CTX *enc;
+  EVP_CIPHER_CTX *dec;
+  unsigned int bs;
+};
+
+struct emul_s
+{
+  pthread_mutex_t mutex;
+  char dev;
+  unsigned char active;
+  int error;
+  uint64_t rnd;
+
+  /* Inhalt der Karte */
+  struct emul_app picc;
+  struct emul_app *apps[EMUL_APPS];
+  unsigned int napps;
+  uint32_t used;
+
+  /* Sitzung */
+  struct emul_app *app;
+  int authkey;
+  uint8_t scheme;
+  struct emul_cipher skey;
+  uint8_t iv[16];
+  uint8_t sk1[16];
+  uint8_t sk2[16];
+
+  /* Laufende Authentifizierung */
+  uint8_t authcmd;
+  uint8_t authno;
+  uint8_t rndlen;
+  uint8_t rndb[16];
+  uint8_t aiv[16];
+  struct emul_cipher akey;
+
+  /* Kommando, ggf. über mehrere Rahmen */
+  uint8_t cmd[EMUL_MAXCMD];
+  size_t cmdlen;
+  size_t cmdexp;
+  unsigned char unwrapped;
+  unsigned char drop;
+
+  /* Antwort, ggf. über mehrere Rahmen */
+  uint8_t resp[EMUL_MAXRESP];
+  size_t resplen;
+  size_t resppos;
+  uint8_t rcomm;
+  uint8_t status;
+  uint8_t framesz[EMUL_APPS + 1];
+  unsigned int nframes;
+  unsigned int frame;
+};
+
+static struct emul_s emul =
+{
+  .mutex   = PTHREAD_MUTEX_INITIALIZER,
+  .active  = 0,
+  .error   = 0,
+  .rnd     = 0x4445534653484531ULL,
+  .picc    =
+  {
+    .aid      = 0x000000,
+    .settings = 0x0f,
+    .nkeys    = 1,
+    .crypto   = EMUL_DES,
+  },
+  .napps   = 0,
+  .used    = 0,
+  .app     = &emul.picc,
+  .authkey = -1,
+  .authcmd = 0,
+  .cmdexp  = 0,
+};
+
+static const uint8_t emul_uid[7]       = { 0x04, 0x44, 0x45, 0x53, 0x46, 0x53, 0x48 };
+static const uint8_t emul_ats[5]       = { 0x75, 0x77, 0x81, 0x02, 0x80 };
+static const uint8_t emul_hwversion[7] = { 0x04, 0x01, 0x01, 0x01, 0x00, 0x1a, 0x05 };
+static const uint8_t emul_swversion[7] = { 0x04, 0x01, 0x01, 0x01, 0x04, 0x1a, 0x05 };
+static const uint8_t emul_batch[7]     = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x21 };
+
+
+static int emul_owns(const nfc_device *pnd);
+static int emul_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen);
+static int emul_list(nfc_modulation nm, nfc_target ant[], size_t n);
+static int emul_select(nfc_modulation nm, const uint8_t *uid, size_t uidlen, nfc_target *target);
+static int emul_deselect();
+static int emul_error();
+static const char *emul_strerror();
+
+
+const struct trace_backend emul_backend =
+{
+  .name       = "DESFire Emulation",
+  .connstring = "emul",
+  .owns       = emul_owns,
+  .transceive = emul_transceive,
+  .list       = emul_list,
+  .select     = emul_select,
+  .deselect   = emul_deselect,
+  .error      = emul_error,
+  .strerror   = emul_strerror,
+};
+
+
+
+
+/*
+ * Hilfsfunktionen
+ */
+static void emul_random(uint8_t *buf, size_t len)
+{
+  size_t i;
+
+
+  /* xorshift64* */
+  for(i = 0; i < len; i++)
+  {
+    emul.rnd ^= emul.rnd >> 12;
+    emul.rnd ^= emul.rnd << 25;
+    emul.rnd ^= emul.rnd >> 27;
+    buf[i] = (emul.rnd * 0x2545f4914f6cdd1dULL) >> 56;
+  }
+}
+
+
+static uint32_t emul_get(const uint8_t *buf, unsigned int n)
+{
+  uint32_t v;
+
+
+  for(v = 0; n > 0; n--)
+    v = v << 8 | buf[n - 1];
+
+
+  return v;
+}
+
+
+static void emul_put(uint8_t *buf, uint32_t v, unsigned int n)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < n; i++)
+    buf[i] = v >> (8 * i);
+}
+
+
+static size_t emul_pad(size_t len, unsigned int bs)
+{
+  return (len + bs - 1) / bs * bs;
+}
+
+
+static void emul_xor(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+  while(len-- > 0)
+    *dst++ ^= *src++;
+}
+
+
+static void emul_rol(uint8_t *dst, const uint8_t *src, unsigned int len)
+{
+  memcpy(dst, src + 1, len - 1);
+  dst[len - 1] = src[0];
+}
+
+
+/* ISO 14443-3 CRC_A, wie ihn das alte Verfahren nutzt */
+static uint16_t emul_crc16(const uint8_t *data, size_t len)
+{
+  uint16_t crc;
+  uint8_t b;
+
+
+  for(crc = 0x6363; len > 0; len--)
+  {
+    b = *data++ ^ (crc & 0xff);
+    b ^= b << 4;
+    crc = (crc >> 8) ^ ((uint16_t)b << 8) ^ ((uint16_t)b << 3) ^ (b >> 4);
+  }
+
+
+  return crc;
+}
+
+
+/* CRC-32 ohne abschließende Invertierung, wie ihn das neue Verfahren nutzt */
+static uint32_t emul_crc32(const uint8_t *data, size_t len)
+{
+  return ~crc32(crc32(0L, Z_NULL, 0), data, len) & 0xffffffff;
+}
+
+
+
+
+/*
+ * Blockchiffren
+ *
+ * DES-Schlüssel sind wie 3DES-Schlüssel mit zwei gleichen Hälften abgelegt,
+ * sodass für beide 3DES verwendet wird. Einfaches DES steht unter OpenSSL 3
+ * nur über den Legacy-Provider zur Verfügung.
+ */
+static void emul_cipher_free(struct emul_cipher *ci)
+{
+  EVP_CIPHER_CTX_free(ci->enc);
+  EVP_CIPHER_CTX_free(ci->dec);
+  ci->enc = NULL;
+  ci->dec = NULL;
+}
+
+
+static int emul_cipher_init(struct emul_cipher *ci, uint8_t crypto, const uint8_t *key)
+{
+  const EVP_CIPHER *cipher;
+
+
+  emul_cipher_free(ci);
+
+  switch(crypto)
+  {
+  case EMUL_3K3DES: cipher = EVP_des_ede3_ecb(); ci->bs = 8;  break;
+  case EMUL_AES:    cipher = EVP_aes_128_ecb();  ci->bs = 16; break;
+  default:          cipher = EVP_des_ede_ecb();  ci->bs = 8;  break;
+  }
+
+  ci->enc = EVP_CIPHER_CTX_new();
+  ci->dec = EVP_CIPHER_CTX_new();
+  if(ci->enc == NULL || ci->dec == NULL ||
+     !EVP_EncryptInit_ex(ci->enc, cipher, NULL, key, NULL) ||
+     !EVP_DecryptInit_ex(ci->dec, cipher, NULL, key, NULL))
+  {
+    emul_cipher_free(ci);
+    return -1;
+  }
+
+  EVP_CIPHER_CTX_set_padding(ci->enc, 0);
+  EVP_CIPHER_CTX_set_padding(ci->dec, 0);
+
+
+  return 0;
+}
+
+
+static void emul_block(const struct emul_cipher *ci, int enc, uint8_t *block)
+{
+  uint8_t out[16];
+  int outlen;
+
+
+  EVP_CipherUpdate(enc ? ci->enc : ci->dec, out, &outlen, block, ci->bs);
+  memcpy(block, out, ci->bs);
+}
+
+
+/* CBC-Verschlüsselung der Daten an das Lesegerät */
+static void emul_send(const struct emul_cipher *ci, uint8_t *iv, uint8_t *data, size_t len)
+{
+  size_t off;
+
+
+  for(off = 0; off < len; off += ci->bs)
+  {
+    emul_xor(data + off, iv, ci->bs);
+    emul_block(ci, 1, data + off);
+    memcpy(iv, data + off, ci->bs);
+  }
+}
+
+
+/*
+ * Entschlüsselung der Daten vom Lesegerät. Beim alten Verfahren
+ * "verschlüsselt" das Lesegerät mit der Entschlüsselungsfunktion, die
+ * Karte entschlüsselt dann mit der Verschlüsselungsfunktion.
+ */
+static void emul_recv(const struct emul_cipher *ci, int enc, uint8_t *iv, uint8_t *data, size_t len)
+{
+  uint8_t save[16];
+  size_t off;
+
+
+  for(off = 0; off < len; off += ci->bs)
+  {
+    memcpy(save, data + off, ci->bs);
+    emul_block(ci, enc, data + off);
+    emul_xor(data + off, iv, ci->bs);
+    memcpy(iv, save, ci->bs);
+  }
+}
+
+
+/* MAC des alten Verfahrens: die ersten 4 Bytes des letzten CBC-Blocks */
+static void emul_mac(const uint8_t *data, size_t len, uint8_t *mac)
+{
+  uint8_t iv[16], block[16];
+  unsigned int bs;
+  size_t off, n;
+
+
+  bs = emul.skey.bs;
+  memset(iv, 0, sizeof(iv));
+
+  for(off = 0; off < len; off += bs)
+  {
+    n = len - off < bs ? len - off : bs;
+    memset(block, 0, bs);
+    memcpy(block, data + off, n);
+    emul_xor(iv, block, bs);
+    emul_block(&emul.skey, 1, iv);
+  }
+
+  memcpy(mac, iv, 4);
+}
+
+
+/*
+ * CMAC des neuen Verfahrens. Der Initialisierungsvektor der Sitzung wird
+ * dabei fortgeschrieben. Übertragen werden die ersten 8 Bytes.
+ */
+static void emul_cmac(const uint8_t *data, size_t len, uint8_t *mac)
+{
+  uint8_t block[16];
+  unsigned int bs;
+  size_t off, n;
+
+
+  bs = emul.skey.bs;
+
+  for(off = 0; off + bs < len; off += bs)
+  {
+    emul_xor(emul.iv, data + off, bs);
+    emul_block(&emul.skey, 1, emul.iv);
+  }
+
+  n = len - off;
+  memset(block, 0, bs);
+  memcpy(block, data + off, n);
+  if(n < bs)
+  {
+    block[n] = 0x80;
+    emul_xor(block, emul.sk2, bs);
+  }
+  else
+    emul_xor(block, emul.sk1, bs);
+
+  emul_xor(emul.iv, block, bs);
+  emul_block(&emul.skey, 1, emul.iv);
+
+  memcpy(mac, emul.iv, 8);
+}
+
+
+static void emul_subkeys()
+{
+  uint8_t l[16], r;
+  unsigned int bs, i;
+
+
+  bs = emul.skey.bs;
+  r = bs == 8 ? 0x1b : 0x87;
+
+  memset(l, 0, bs);
+  emul_block(&emul.skey, 1, l);
+
+  for(i = 0; i < bs; i++)
+    emul.sk1[i] = l[i] << 1 | (i + 1 < bs ? l[i + 1] >> 7 : 0);
+  if(l[0] & 0x80)
+    emul.sk1[bs - 1] ^= r;
+
+  for(i = 0; i < bs; i++)
+    emul.sk2[i] = emul.sk1[i] << 1 | (i + 1 < bs ? emul.sk1[i + 1] >> 7 : 0);
+  if(emul.sk1[0] & 0x80)
+    emul.sk2[bs - 1] ^= r;
+}
+
+
+
+
+/*
+ * Speicherverwaltung und Transaktionen
+ */
+static int emul_alloc(uint32_t size)
+{
+  size = emul_pad(size > 0 ? size : 1, EMUL_BLOCK);
+  if(size > EMUL_MEMORY - emul.used)
+    return -1;
+
+  emul.used += size;
+
+
+  return size;
+}
+
+
+static void emul_file_free(struct emul_file *f)
+{
+  if(f == NULL)
+    return;
+
+  emul.used -= f->mem;
+  free(f->data);
+  free(f->shadow);
+  free(f);
+}
+
+
+static void emul_app_free(struct emul_app *app)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < EMUL_FILES; i++)
+    emul_file_free(app->files[i]);
+
+  free(app);
+}
+
+
+static void emul_abort()
+{
+  struct emul_file *f;
+  unsigned int i;
+
+
+  for(i = 0; i < EMUL_FILES; i++)
+  {
+    f = emul.app->files[i];
+    if(f == NULL)
+      continue;
+
+    if(f->type == MDFT_BACKUP_DATA_FILE)
+      memcpy(f->shadow, f->data, f->size);
+
+    f->pending   = f->value;
+    f->dirty     = 0;
+    f->clear     = 0;
+    f->credited  = 0;
+    f->lcredited = 0;
+    f->debited   = 0;
+  }
+}
+
+
+static void emul_commit()
+{
+  struct emul_file *f;
+  unsigned int i, cap;
+
+
+  for(i = 0; i < EMUL_FILES; i++)
+  {
+    f = emul.app->files[i];
+    if(f == NULL || (!f->dirty && !f->clear))
+      continue;
+
+    switch(f->type)
+    {
+    case MDFT_BACKUP_DATA_FILE:
+      memcpy(f->data, f->shadow, f->size);
+      break;
+
+    case MDFT_VALUE_FILE_WITH_BACKUP:
+      f->value = f->pending;
+      if(f->credited || f->lcredited)
+        f->limit = 0;
+      else if(f->debited > 0)
+        f->limit = f->debited;
+      break;
+
+    case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+      if(f->clear)
+        f->nrec = 0;
+      if(!f->dirty)
+        break;
+
+      /* Eine zyklische Datei hält einen Datensatz für die Transaktion frei. */
+      cap = f->type == MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP ? f->maxrec - 1 : f->maxrec;
+      if(f->nrec >= cap)
+      {
+        memmove(f->data, f->data + f->size, (f->nrec - 1) * f->size);
+        f->nrec--;
+      }
+
+      memcpy(f->data + f->nrec * f->size, f->shadow, f->size);
+      f->nrec++;
+      break;
+    }
+  }
+
+  emul_abort();
+}
+
+
+static void emul_deauth()
+{
+  emul.authkey = -1;
+  emul.authcmd = 0;
+}
+
+
+static void emul_reset()
+{
+  emul_abort();
+  emul_deauth();
+  emul.app     = &emul.picc;
+  emul.cmdexp  = 0;
+  emul.resplen = 0;
+  emul.resppos = 0;
+}
+
+
+static struct emul_file *emul_file(uint8_t fno)
+{
+  return fno < EMUL_FILES ? emul.app->files[fno] : NULL;
+}
+
+
+/*
+ * Zugriffsrechte einer Datei prüfen. Passt der authentifizierte Schlüssel,
+ * gelten die Kommunikationseinstellungen der Datei. Bei freiem Zugriff wird
+ * unverschlüsselt übertragen.
+ */
+static uint8_t emul_access(const struct emul_file *f, const uint8_t *keys, unsigned int n, uint8_t *comm)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < n; i++)
+    if(emul.authkey >= 0 && keys[i] == emul.authkey)
+    {
+      *comm = f->comm == MDCM_ENCIPHERED ? MDCM_ENCIPHERED : f->comm == MDCM_MACED ? MDCM_MACED : MDCM_PLAIN;
+      return OPERATION_OK;
+    }
+
+  for(i = 0; i < n; i++)
+    if(keys[i] == MDAR_FREE)
+    {
+      *comm = MDCM_PLAIN;
+      return OPERATION_OK;
+    }
+
+  for(i = 0; i < n; i++)
+    if(keys[i] != MDAR_DENY)
+      return AUTHENTICATION_ERROR;
+
+
+  return PERMISSION_DENIED;
+}
+
+
+static int emul_master()
+{
+  return emul.authkey == 0;
+}
+
+
+
+
+/*
+ * Gesicherte Übertragung
+ *
+ * emul_unwrap() prüft bzw. entschlüsselt die Daten eines Kommandos ab
+ * <offset>, die im Klartext <plen> Bytes lang sind. Danach steht der
+ * Klartext im Kommandopuffer. emul_wrap() sichert die Antwort. Beim neuen
+ * Verfahren geht jedes Kommando und jede Antwort in den CMAC ein, auch wenn
+ * im Klartext übertragen wird. Kommandos, die emul_unwrap() nicht selbst
+ * aufrufen, gelten als Klartext.
+ */
+static uint8_t emul_unwrap(size_t offset, uint8_t comm, size_t plen)
+{
+  uint8_t *data, mac[8], iv[16];
+  size_t len;
+  unsigned int bs, crclen;
+  uint32_t crc;
+
+
+  emul.unwrapped = 1;
+
+  if(emul.cmdlen < offset)
+    return LENGTH_ERROR;
+
+  data = emul.cmd + offset;
+  len  = emul.cmdlen - offset;
+  bs   = emul.skey.bs;
+
+  if(emul.authkey < 0)
+    comm = MDCM_PLAIN;
+
+  switch(comm)
+  {
+  case MDCM_PLAIN:
+    if(len != plen)
+      return LENGTH_ERROR;
+
+    if(emul.authkey >= 0 && emul.scheme == EMUL_NEW)
+      emul_cmac(emul.cmd, emul.cmdlen, mac);
+    break;
+
+  case MDCM_MACED:
+    if(emul.scheme == EMUL_LEGACY)
+    {
+      if(len != plen + 4)
+        return LENGTH_ERROR;
+
+      emul_mac(data, plen, mac);
+      if(memcmp(mac, data + plen, 4))
+        return INTEGRITY_ERROR;
+    }
+    else
+    {
+      if(len != plen + 8)
+        return LENGTH_ERROR;
+
+      emul_cmac(emul.cmd, offset + plen, mac);
+      if(memcmp(mac, data + plen, 8))
+        return INTEGRITY_ERROR;
+    }
+    break;
+
+  case MDCM_ENCIPHERED:
+    crclen = emul.scheme == EMUL_LEGACY ? 2 : 4;
+    if(len != emul_pad(plen + crclen, bs))
+      return LENGTH_ERROR;
+
+    if(emul.scheme == EMUL_LEGACY)
+    {
+      memset(iv, 0, sizeof(iv));
+      emul_recv(&emul.skey, 1, iv, data, len);
+      crc = emul_crc16(data, plen);
+    }
+    else
+    {
+      emul_recv(&emul.skey, 0, emul.iv, data, len);
+      crc = emul_crc32(emul.cmd, offset + plen);
+    }
+
+    if(crc != emul_get(data + plen, crclen))
+      return INTEGRITY_ERROR;
+    break;
+  }
+
+  emul.cmdlen = offset + plen;
+
+
+  return OPERATION_OK;
+}
+
+
+static void emul_wrap(uint8_t comm)
+{
+  uint8_t iv[16];
+  size_t n, elen;
+  unsigned int bs;
+
+
+  if(emul.authkey < 0 || comm == EMUL_RAW)
+    return;
+
+  n  = emul.resplen;
+  bs = emul.skey.bs;
+
+  if(emul.scheme == EMUL_LEGACY)
+  {
+    switch(comm)
+    {
+    case MDCM_MACED:
+      emul_mac(emul.resp, n, emul.resp + n);
+      emul.resplen += 4;
+      break;
+
+    case MDCM_ENCIPHERED:
+      emul_put(emul.resp + n, emul_crc16(emul.resp, n), 2);
+      elen = emul_pad(n + 2, bs);
+      memset(emul.resp + n + 2, 0, elen - n - 2);
+      memset(iv, 0, sizeof(iv));
+      emul_send(&emul.skey, iv, emul.resp, elen);
+      emul.resplen = elen;
+      break;
+    }
+
+    return;
+  }
+
+  /* Der Status geht beim neuen Verfahren mit in CRC bzw. CMAC ein. */
+  emul.resp[n] = OPERATION_OK;
+  if(comm == MDCM_ENCIPHERED)
+  {
+    emul_put(emul.resp + n, emul_crc32(emul.resp, n + 1), 4);
+    elen = emul_pad(n + 4, bs);
+    memset(emul.resp + n + 4, 0, elen - n - 4);
+    emul_send(&emul.skey, emul.iv, emul.resp, elen);
+    emul.resplen = elen;
+  }
+  else
+  {
+    emul_cmac(emul.resp, n + 1, emul.resp + n);
+    emul.resplen += 8;
+  }
+}
+
+
+/* Länge der übertragenen Daten für <len> Bytes Klartext */
+static size_t emul_wirelen(uint8_t comm, size_t len)
+{
+  if(emul.authkey < 0)
+    return len;
+
+  switch(comm)
+  {
+  case MDCM_MACED:
+    return len + (emul.scheme == EMUL_LEGACY ? 4 : 8);
+
+  case MDCM_ENCIPHERED:
+    return emul_pad(len + (emul.scheme == EMUL_LEGACY ? 2 : 4), emul.skey.bs);
+
+  default:
+    return len;
+  }
+}
+
+
+
+
+/*
+ * Authentifizierung
+ *
+ * Die Karte sendet zuerst RndB, das Lesegerät antwortet mit RndA und dem
+ * rotierten RndB, die Karte bestätigt mit dem rotierten RndA. Beim alten
+ * Verfahren (0x0A) beginnt jeder Block mit einem Null-IV, beim neuen
+ * Verfahren (0x1A, 0xAA) läuft der IV über alle Rahmen weiter.
+ */
+static uint8_t emul_auth()
+{
+  struct emul_app *app;
+  uint8_t keyno;
+  unsigned int n;
+
+
+  emul_abort();
+  emul_deauth();
+  emul.rcomm = EMUL_RAW;
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  app   = emul.app;
+  keyno = emul.cmd[1];
+  if(keyno >= app->nkeys)
+    return NO_SUCH_KEY;
+
+  switch(emul.cmd[0])
+  {
+  case 0x0a:
+    if(app->crypto != EMUL_DES)
+      return AUTHENTICATION_ERROR;
+    n = 8;
+    break;
+
+  case 0x1a:
+    if(app->crypto == EMUL_AES)
+      return AUTHENTICATION_ERROR;
+    n = app->crypto == EMUL_3K3DES ? 16 : 8;
+    break;
+
+  default:
+    if(app->crypto != EMUL_AES)
+      return AUTHENTICATION_ERROR;
+    n = 16;
+    break;
+  }
+
+  if(emul_cipher_init(&emul.akey, app->crypto, app->keys[keyno].data) < 0)
+    return CRYPTO_ERROR;
+
+  emul_random(emul.rndb, n);
+  memcpy(emul.resp, emul.rndb, n);
+  memset(emul.aiv, 0, sizeof(emul.aiv));
+  emul_send(&emul.akey, emul.aiv, emul.resp, n);
+  emul.resplen = n;
+
+  emul.authcmd = emul.cmd[0];
+  emul.authno  = keyno;
+  emul.rndlen  = n;
+
+
+  return ADDITIONAL_FRAME;
+}
+
+
+static uint8_t emul_auth2()
+{
+  const uint8_t *key;
+  uint8_t *data, rnda[16], rolb[16], sk[24];
+  uint8_t authcmd, crypto;
+  unsigned int n;
+
+
+  authcmd = emul.authcmd;
+  emul.authcmd = 0;
+  emul.rcomm = EMUL_RAW;
+
+  n    = emul.rndlen;
+  data = emul.cmd + 1;
+  if(emul.cmdlen != 1 + 2 * n)
+    return LENGTH_ERROR;
+
+  if(authcmd == 0x0a)
+  {
+    memset(emul.aiv, 0, sizeof(emul.aiv));
+    emul_recv(&emul.akey, 1, emul.aiv, data, 2 * n);
+  }
+  else
+    emul_recv(&emul.akey, 0, emul.aiv, data, 2 * n);
+
+  emul_rol(rolb, emul.rndb, n);
+  if(memcmp(rolb, data + n, n))
+    return AUTHENTICATION_ERROR;
+
+  memcpy(rnda, data, n);
+  emul_rol(emul.resp, rnda, n);
+  if(authcmd == 0x0a)
+    memset(emul.aiv, 0, sizeof(emul.aiv));
+  emul_send(&emul.akey, emul.aiv, emul.resp, n);
+  emul.resplen = n;
+
+  /* Sitzungsschlüssel aus RndA und RndB ableiten */
+  crypto = emul.app->crypto;
+  key    = emul.app->keys[emul.authno].data;
+  memcpy(sk,     rnda,     4);
+  memcpy(sk + 4, emul.rndb, 4);
+  switch(crypto)
+  {
+  case EMUL_AES:
+    memcpy(sk +  8, rnda      + 12, 4);
+    memcpy(sk + 12, emul.rndb + 12, 4);
+    break;
+
+  case EMUL_3K3DES:
+    memcpy(sk +  8, rnda      +  6, 4);
+    memcpy(sk + 12, emul.rndb +  6, 4);
+    memcpy(sk + 16, rnda      + 12, 4);
+    memcpy(sk + 20, emul.rndb + 12, 4);
+    break;
+
+  default:
+    /* Ein DES-Schlüssel ergibt wieder einen DES-Sitzungsschlüssel. */
+    if(!memcmp(key, key + 8, 8))
+      memcpy(sk + 8, sk, 8);
+    else
+    {
+      memcpy(sk +  8, rnda      + 4, 4);
+      memcpy(sk + 12, emul.rndb + 4, 4);
+    }
+    break;
+  }
+
+  if(emul_cipher_init(&emul.skey, crypto, sk) < 0)
+    return CRYPTO_ERROR;
+
+  emul.authkey = emul.authno;
+  emul.scheme  = authcmd == 0x0a ? EMUL_LEGACY : EMUL_NEW;
+  memset(emul.iv, 0, sizeof(emul.iv));
+  if(emul.scheme == EMUL_NEW)
+    emul_subkeys();
+
+
+  return OPERATION_OK;
+}
+
+
+
+
+/*
+ * Kommandos auf Ebene der Karte und der Applikationen
+ */
+static int emul_app_find(uint32_t aid)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < emul.napps; i++)
+    if(emul.apps[i]->aid == aid)
+      return i;
+
+
+  return -1;
+}
+
+
+/* Auflisten ist frei oder mit dem Hauptschlüssel erlaubt. */
+static uint8_t emul_listing(const struct emul_app *app)
+{
+  if(app->settings & EMUL_KS_FREELIST || emul_master())
+    return OPERATION_OK;
+
+
+  return AUTHENTICATION_ERROR;
+}
+
+
+/* Anlegen und Löschen ist frei oder mit dem Hauptschlüssel erlaubt. */
+static uint8_t emul_manage(const struct emul_app *app)
+{
+  if(app->settings & EMUL_KS_FREECREATE || emul_master())
+    return OPERATION_OK;
+
+
+  return AUTHENTICATION_ERROR;
+}
+
+
+static uint8_t emul_select_app()
+{
+  int i;
+
+
+  emul_abort();
+  emul_deauth();
+  emul.rcomm = EMUL_RAW;
+  emul.app   = &emul.picc;
+
+  if(emul.cmdlen != 4)
+    return LENGTH_ERROR;
+
+  if(emul_get(emul.cmd + 1, 3) == 0x000000)
+    return OPERATION_OK;
+
+  i = emul_app_find(emul_get(emul.cmd + 1, 3));
+  if(i < 0)
+    return APPLICATION_NOT_FOUND;
+
+  emul.app = emul.apps[i];
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_create_app()
+{
+  struct emul_app *app;
+  uint32_t aid;
+  uint8_t ks1, ks2;
+  unsigned int i;
+  uint8_t status;
+
+
+  if(emul.cmdlen < 6)
+    return LENGTH_ERROR;
+
+  if(emul.app != &emul.picc)
+    return PERMISSION_DENIED;
+
+  status = emul_manage(&emul.picc);
+  if(status != OPERATION_OK)
+    return status;
+
+  aid = emul_get(emul.cmd + 1, 3);
+  ks1 = emul.cmd[4];
+  ks2 = emul.cmd[5];
+
+  /* Mit ISO-Dateikennung folgen diese und optional der DF-Name. */
+  if(ks2 & 0x20 ? emul.cmdlen < 8 || emul.cmdlen > 24 : emul.cmdlen != 6)
+    return LENGTH_ERROR;
+
+  if(aid == 0x000000 || (ks2 & 0x0f) < 1 || (ks2 & 0x0f) > EMUL_KEYS || (ks2 & 0xc0) == 0xc0)
+    return PARAMETER_ERROR;
+
+  if(emul_app_find(aid) >= 0)
+    return DUPLICATE_ERROR;
+
+  if(emul.napps >= EMUL_APPS)
+    return COUNT_ERROR;
+
+  if(ks2 & 0x20)
+    for(i = 0; i < emul.napps; i++)
+      if(emul.apps[i]->isofid == emul_get(emul.cmd + 6, 2) ||
+         (emul.cmdlen > 8 && emul.apps[i]->dfnamelen == emul.cmdlen - 8 &&
+          !memcmp(emul.apps[i]->dfname, emul.cmd + 8, emul.cmdlen - 8)))
+        return DUPLICATE_ERROR;
+
+  app = calloc(1, sizeof(struct emul_app));
+  if(app == NULL)
+    return OUT_OF_EEPROM_ERROR;
+
+  app->aid      = aid;
+  app->settings = ks1;
+  app->nkeys    = ks2 & 0x0f;
+  app->crypto   = ks2 & 0xc0;
+  app->isofid   = 0xffff;
+
+  if(ks2 & 0x20)
+  {
+    app->isofid    = emul_get(emul.cmd + 6, 2);
+    app->dfnamelen = emul.cmdlen - 8;
+    memcpy(app->dfname, emul.cmd + 8, app->dfnamelen);
+  }
+
+  emul.apps[emul.napps++] = app;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_delete_app()
+{
+  int i;
+
+
+  if(emul.cmdlen != 4)
+    return LENGTH_ERROR;
+
+  i = emul_app_find(emul_get(emul.cmd + 1, 3));
+  if(i < 0)
+    return APPLICATION_NOT_FOUND;
+
+  /* Hauptschlüssel der Karte oder der Applikation selbst */
+  if(!emul_master() || (emul.app != &emul.picc && emul.app != emul.apps[i]))
+    return AUTHENTICATION_ERROR;
+
+  /* Die Antwort wird noch mit dem Sitzungsschlüssel gesichert. */
+  if(emul.app == emul.apps[i])
+  {
+    emul_abort();
+    emul.app  = &emul.picc;
+    emul.drop = 1;
+  }
+
+  emul_app_free(emul.apps[i]);
+  memmove(emul.apps + i, emul.apps + i + 1, (emul.napps - i - 1) * sizeof(struct emul_app*));
+  emul.napps--;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_app_ids()
+{
+  unsigned int i;
+  uint8_t status;
+
+
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  if(emul.app != &emul.picc)
+    return PERMISSION_DENIED;
+
+  status = emul_listing(&emul.picc);
+  if(status != OPERATION_OK)
+    return status;
+
+  for(i = 0; i < emul.napps; i++)
+    emul_put(emul.resp + 3 * i, emul.apps[i]->aid, 3);
+  emul.resplen = 3 * emul.napps;
+
+
+  return OPERATION_OK;
+}
+
+
+/*
+ * Jeder DF-Name kommt in einem eigenen Rahmen. libfreefare wertet die
+ * Rahmen einzeln aus und sichert diese Antwort nicht mit einem CMAC.
+ */
+static uint8_t emul_df_names()
+{
+  struct emul_app *app;
+  unsigned int i;
+  uint8_t status;
+
+
+  emul.rcomm = EMUL_RAW;
+
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  if(emul.app != &emul.picc)
+    return PERMISSION_DENIED;
+
+  status = emul_listing(&emul.picc);
+  if(status != OPERATION_OK)
+    return status;
+
+  for(i = 0; i < emul.napps; i++)
+  {
+    app = emul.apps[i];
+    if(app->isofid == 0xffff)
+      continue;
+
+    emul_put(emul.resp + emul.resplen,     app->aid,    3);
+    emul_put(emul.resp + emul.resplen + 3, app->isofid, 2);
+    memcpy(emul.resp + emul.resplen + 5, app->dfname, app->dfnamelen);
+    emul.framesz[emul.nframes++] = 5 + app->dfnamelen;
+    emul.resplen += 5 + app->dfnamelen;
+  }
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_format()
+{
+  unsigned int i;
+
+
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  if(emul.app != &emul.picc || !emul_master())
+    return AUTHENTICATION_ERROR;
+
+  for(i = 0; i < emul.napps; i++)
+    emul_app_free(emul.apps[i]);
+  emul.napps = 0;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_free_mem()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  emul_put(emul.resp, EMUL_MEMORY - emul.used, 3);
+  emul.resplen = 3;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_get_version()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  memcpy(emul.resp,      emul_hwversion, 7);
+  memcpy(emul.resp +  7, emul_swversion, 7);
+  memcpy(emul.resp + 14, emul_uid,       7);
+  memcpy(emul.resp + 21, emul_batch,     7);
+  emul.resplen = 28;
+
+  emul.framesz[0] = 7;
+  emul.framesz[1] = 7;
+  emul.nframes    = 2;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_card_uid()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  if(emul.authkey < 0)
+    return AUTHENTICATION_ERROR;
+
+  memcpy(emul.resp, emul_uid, 7);
+  emul.resplen = 7;
+  emul.rcomm   = MDCM_ENCIPHERED;
+
+
+  return OPERATION_OK;
+}
+
+
+
+
+/*
+ * Schlüsselverwaltung
+ */
+static uint8_t emul_key_settings()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  emul.resp[0] = emul.app->settings;
+  emul.resp[1] = emul.app->nkeys | emul.app->crypto;
+  emul.resplen = 2;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_change_key_settings()
+{
+  uint8_t status;
+
+
+  if(!emul_master())
+    return AUTHENTICATION_ERROR;
+
+  if(!(emul.app->settings & EMUL_KS_CHANGECONF))
+    return PERMISSION_DENIED;
+
+  status = emul_unwrap(1, MDCM_ENCIPHERED, 1);
+  if(status != OPERATION_OK)
+    return status;
+
+  emul.app->settings = emul.cmd[1];
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_key_version()
+{
+  const struct emul_key *key;
+  unsigned int i;
+
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  if(emul.cmd[1] >= emul.app->nkeys)
+    return NO_SUCH_KEY;
+
+  /* DES-Schlüssel tragen die Version in den Paritätsbits. */
+  key = &emul.app->keys[emul.cmd[1]];
+  if(emul.app->crypto == EMUL_AES)
+    emul.resp[0] = key->version;
+  else
+    for(emul.resp[0] = 0, i = 0; i < 8; i++)
+      emul.resp[0] = emul.resp[0] << 1 | (key->data[i] & 0x01);
+  emul.resplen = 1;
+
+
+  return OPERATION_OK;
+}
+
+
+/*
+ * Wird nicht der authentifizierte Schlüssel geändert, ist der neue Schlüssel
+ * mit dem alten verknüpft und trägt eine zweite Prüfsumme über den neuen
+ * Schlüssel. Beim authentifizierten Schlüssel endet die Sitzung sofort.
+ */
+static uint8_t emul_change_key()
+{
+  struct emul_app *app;
+  struct emul_key *key;
+  uint8_t *data, iv[16], newkey[24];
+  uint8_t keyno, crypto, ck;
+  unsigned int keylen, plen, crclen, same;
+  uint32_t crc;
+
+
+  if(emul.cmdlen < 2)
+    return LENGTH_ERROR;
+
+  app    = emul.app;
+  keyno  = emul.cmd[1] & 0x0f;
+  crypto = app->crypto;
+
+  /* Der Kartenhauptschlüssel kann den Algorithmus wechseln. */
+  if(app == &emul.picc)
+    crypto = emul.cmd[1] & 0xc0;
+  else if(emul.cmd[1] & 0xf0)
+    return PARAMETER_ERROR;
+
+  if(crypto == 0xc0)
+    return PARAMETER_ERROR;
+
+  if(keyno >= app->nkeys)
+    return NO_SUCH_KEY;
+
+  if(emul.authkey < 0)
+    return AUTHENTICATION_ERROR;
+
+  ck = app->settings >> 4;
+  if(keyno == 0)
+  {
+    if(emul.authkey != 0)
+      return AUTHENTICATION_ERROR;
+    if(!(app->settings & EMUL_KS_CHANGEMK))
+      return PERMISSION_DENIED;
+  }
+  else if(ck == MDAR_DENY)
+    return PERMISSION_DENIED;
+  else if(emul.authkey != (ck == MDAR_FREE ? keyno : ck))
+    return AUTHENTICATION_ERROR;
+
+  key    = &app->keys[keyno];
+  keylen = crypto == EMUL_3K3DES ? 24 : 16;
+  plen   = keylen + (crypto == EMUL_AES ? 1 : 0);
+  crclen = emul.scheme == EMUL_LEGACY ? 2 : 4;
+  same   = emul.authkey == keyno;
+
+  if(emul.cmdlen - 2 != emul_pad(plen + crclen * (same ? 1 : 2), emul.skey.bs))
+    return LENGTH_ERROR;
+
+  emul.unwrapped = 1;
+  data = emul.cmd + 2;
+  if(emul.scheme == EMUL_LEGACY)
+  {
+    memset(iv, 0, sizeof(iv));
+    emul_recv(&emul.skey, 1, iv, data, emul.cmdlen - 2);
+    crc = emul_crc16(data, plen);
+  }
+  else
+  {
+    emul_recv(&emul.skey, 0, emul.iv, data, emul.cmdlen - 2);
+    crc = emul_crc32(emul.cmd, 2 + plen);
+  }
+
+  if(crc != emul_get(data + plen, crclen))
+    return INTEGRITY_ERROR;
+
+  memcpy(newkey, data, keylen);
+  if(!same)
+  {
+    emul_xor(newkey, key->data, keylen);
+    if(emul.scheme == EMUL_LEGACY)
+      crc = emul_crc16(newkey, keylen);
+    else
+      crc = emul_crc32(newkey, keylen);
+
+    if(crc != emul_get(data + plen + crclen, crclen))
+      return INTEGRITY_ERROR;
+  }
+
+  memset(key->data, 0, sizeof(key->data));
+  memcpy(key->data, newkey, keylen);
+  key->version = crypto == EMUL_AES ? data[keylen] : 0;
+  app->crypto  = crypto;
+
+  if(same)
+  {
+    emul_deauth();
+    emul.rcomm = EMUL_RAW;
+  }
+
+
+  return OPERATION_OK;
+}
+
+
+
+
+/*
+ * Dateiverwaltung
+ */
+static uint8_t emul_create_file()
+{
+  struct emul_file *f;
+  unsigned int base, off;
+  uint64_t size;
+  uint8_t type, fno, status;
+  int mem;
+
+
+  switch(emul.cmd[0])
+  {
+  case 0xcd: type = MDFT_STANDARD_DATA_FILE;             base =  8; break;
+  case 0xcb: type = MDFT_BACKUP_DATA_FILE;               base =  8; break;
+  case 0xcc: type = MDFT_VALUE_FILE_WITH_BACKUP;         base = 18; break;
+  case 0xc1: type = MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP; base = 11; break;
+  default:   type = MDFT_LINEAR_RECORD_FILE_WITH_BACKUP; base = 11; break;
+  }
+
+  /* Außer Wertdateien können eine ISO-Dateikennung tragen. */
+  off = 2;
+  if(type != MDFT_VALUE_FILE_WITH_BACKUP && emul.cmdlen == base + 2)
+    off = 4;
+  else if(emul.cmdlen != base)
+    return LENGTH_ERROR;
+
+  if(emul.app == &emul.picc)
+    return PERMISSION_DENIED;
+
+  status = emul_manage(emul.app);
+  if(status != OPERATION_OK)
+    return status;
+
+  fno = emul.cmd[1];
+  if(fno >= EMUL_FILES || emul.cmd[off] & ~MDCM_ENCIPHERED)
+    return PARAMETER_ERROR;
+
+  if(emul.app->files[fno] != NULL)
+    return DUPLICATE_ERROR;
+
+  f = calloc(1, sizeof(struct emul_file));
+  if(f == NULL)
+    return OUT_OF_EEPROM_ERROR;
+
+  f->type   = type;
+  f->comm   = emul.cmd[off];
+  f->ar     = emul_get(emul.cmd + off + 1, 2);
+  f->isofid = off == 4 ? emul_get(emul.cmd + 2, 2) : 0xffff;
+  off += 3;
+
+  status = OPERATION_OK;
+  switch(type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    f->size = emul_get(emul.cmd + off, 3);
+    size = type == MDFT_BACKUP_DATA_FILE ? 2 * (uint64_t)f->size : f->size;
+    if(size > EMUL_MEMORY)
+      status = OUT_OF_EEPROM_ERROR;
+    else
+    {
+      f->data   = calloc(f->size + 1, 1);
+      f->shadow = calloc(f->size + 1, 1);
+    }
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    f->lower   = emul_get(emul.cmd + off,     4);
+    f->upper   = emul_get(emul.cmd + off + 4, 4);
+    f->value   = emul_get(emul.cmd + off + 8, 4);
+    f->limited = emul.cmd[off + 12];
+    f->pending = f->value;
+    size = 4;
+    if(f->lower > f->upper || f->value < f->lower || f->value > f->upper)
+      status = BOUNDARY_ERROR;
+    break;
+
+  default:
+    f->size   = emul_get(emul.cmd + off,     3);
+    f->maxrec = emul_get(emul.cmd + off + 3, 3);
+    size = (uint64_t)f->size * f->maxrec;
+    if(f->size == 0 || f->maxrec == 0 ||
+       (type == MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP && f->maxrec < 2))
+      status = PARAMETER_ERROR;
+    else if(size > EMUL_MEMORY)
+      status = OUT_OF_EEPROM_ERROR;
+    else
+    {
+      f->data   = calloc(size, 1);
+      f->shadow = calloc(f->size, 1);
+    }
+    break;
+  }
+
+  if(status == OPERATION_OK && type != MDFT_VALUE_FILE_WITH_BACKUP &&
+     (f->data == NULL || f->shadow == NULL))
+    status = OUT_OF_EEPROM_ERROR;
+
+  if(status == OPERATION_OK)
+  {
+    mem = emul_alloc(size);
+    if(mem < 0)
+      status = OUT_OF_EEPROM_ERROR;
+    else
+      f->mem = mem;
+  }
+
+  if(status != OPERATION_OK)
+  {
+    free(f->data);
+    free(f->shadow);
+    free(f);
+    return status;
+  }
+
+  emul.app->files[fno] = f;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_delete_file()
+{
+  uint8_t status;
+
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  status = emul_manage(emul.app);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(emul_file(emul.cmd[1]) == NULL)
+    return FILE_NOT_FOUND;
+
+  emul_file_free(emul.app->files[emul.cmd[1]]);
+  emul.app->files[emul.cmd[1]] = NULL;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_file_ids()
+{
+  unsigned int i;
+  uint8_t status;
+
+
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  if(emul.app == &emul.picc)
+    return PERMISSION_DENIED;
+
+  status = emul_listing(emul.app);
+  if(status != OPERATION_OK)
+    return status;
+
+  for(i = 0; i < EMUL_FILES; i++)
+    if(emul.app->files[i] != NULL)
+      emul.resp[emul.resplen++] = i;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_file_settings()
+{
+  struct emul_file *f;
+  uint8_t *r;
+  uint8_t status;
+
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  status = emul_listing(emul.app);
+  if(status != OPERATION_OK)
+    return status;
+
+  f = emul_file(emul.cmd[1]);
+  if(f == NULL)
+    return FILE_NOT_FOUND;
+
+  r = emul.resp;
+  r[0] = f->type;
+  r[1] = f->comm;
+  emul_put(r + 2, f->ar, 2);
+
+  switch(f->type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    emul_put(r + 4, f->size, 3);
+    emul.resplen = 7;
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    emul_put(r +  4, f->lower, 4);
+    emul_put(r +  8, f->upper, 4);
+    emul_put(r + 12, f->limit, 4);
+    r[16] = f->limited;
+    emul.resplen = 17;
+    break;
+
+  default:
+    emul_put(r +  4, f->size,   3);
+    emul_put(r +  7, f->maxrec, 3);
+    emul_put(r + 10, f->nrec,   3);
+    emul.resplen = 13;
+    break;
+  }
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_change_file_settings()
+{
+  struct emul_file *f;
+  uint8_t car, status;
+
+
+  if(emul.cmdlen < 2)
+    return LENGTH_ERROR;
+
+  f = emul_file(emul.cmd[1]);
+  if(f == NULL)
+    return FILE_NOT_FOUND;
+
+  /* Bei freiem Zugriff im Klartext, sonst verschlüsselt */
+  car = MDAR_CHANGE_AR(f->ar);
+  if(car == MDAR_FREE)
+    status = emul_unwrap(2, MDCM_PLAIN, 3);
+  else if(car == MDAR_DENY)
+    return PERMISSION_DENIED;
+  else if(emul.authkey != car)
+    return AUTHENTICATION_ERROR;
+  else
+    status = emul_unwrap(2, MDCM_ENCIPHERED, 3);
+
+  if(status != OPERATION_OK)
+    return status;
+
+  if(emul.cmd[2] & ~MDCM_ENCIPHERED)
+    return PARAMETER_ERROR;
+
+  f->comm = emul.cmd[2];
+  f->ar   = emul_get(emul.cmd + 3, 2);
+
+
+  return OPERATION_OK;
+}
+
+
+
+
+/*
+ * Zugriff auf Dateien
+ */
+static int emul_is_data(const struct emul_file *f)
+{
+  return f->type == MDFT_STANDARD_DATA_FILE || f->type == MDFT_BACKUP_DATA_FILE;
+}
+
+
+static int emul_is_record(const struct emul_file *f)
+{
+  return f->type == MDFT_LINEAR_RECORD_FILE_WITH_BACKUP || f->type == MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP;
+}
+
+
+static uint8_t emul_file_access(struct emul_file **fp, unsigned int len, uint8_t *comm, unsigned int rights)
+{
+  struct emul_file *f;
+  uint8_t keys[3];
+  unsigned int n;
+
+
+  if(emul.cmdlen < len)
+    return LENGTH_ERROR;
+
+  f = emul_file(emul.cmd[1]);
+  if(f == NULL)
+    return FILE_NOT_FOUND;
+
+  n = 0;
+  if(rights & 0x04)
+    keys[n++] = MDAR_READ(f->ar);
+  if(rights & 0x02)
+    keys[n++] = MDAR_WRITE(f->ar);
+  if(rights & 0x01)
+    keys[n++] = MDAR_READ_WRITE(f->ar);
+
+  *fp = f;
+
+
+  return emul_access(f, keys, n, comm);
+}
+
+/* Zugriffsrechte als Maske aus Lesen (4), Schreiben (2) und beidem (1) */
+#define EMUL_R		0x05
+#define EMUL_W		0x03
+#define EMUL_RW		0x01
+#define EMUL_ANY	0x07
+
+
+/* Erwartete Länge eines über mehrere Rahmen geschriebenen Kommandos */
+static size_t emul_expect()
+{
+  struct emul_file *f;
+  uint8_t comm;
+
+
+  if(emul_file_access(&f, 8, &comm, EMUL_W) != OPERATION_OK)
+    return emul.cmdlen;
+
+
+  return 8 + emul_wirelen(comm, emul_get(emul.cmd + 5, 3));
+}
+
+
+static uint8_t emul_read_data()
+{
+  struct emul_file *f;
+  uint32_t off, len;
+  uint8_t comm, status;
+
+
+  if(emul.cmdlen != 8)
+    return LENGTH_ERROR;
+
+  status = emul_file_access(&f, 8, &comm, EMUL_R);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(!emul_is_data(f))
+    return PARAMETER_ERROR;
+
+  off = emul_get(emul.cmd + 2, 3);
+  len = emul_get(emul.cmd + 5, 3);
+  if(off > f->size || len > f->size - off)
+    return BOUNDARY_ERROR;
+  if(len == 0)
+    len = f->size - off;
+
+  /* Eine Sicherungsdatei liefert den zuletzt bestätigten Stand. */
+  memcpy(emul.resp, f->data + off, len);
+  emul.resplen = len;
+  emul.rcomm   = comm;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_write_data()
+{
+  struct emul_file *f;
+  uint32_t off, len;
+  uint8_t comm, status;
+
+
+  status = emul_file_access(&f, 8, &comm, EMUL_W);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(emul.cmd[0] == 0x3d ? !emul_is_data(f) : !emul_is_record(f))
+    return PARAMETER_ERROR;
+
+  off = emul_get(emul.cmd + 2, 3);
+  len = emul_get(emul.cmd + 5, 3);
+  if(off > f->size || len > f->size - off)
+    return BOUNDARY_ERROR;
+
+  status = emul_unwrap(8, comm, len);
+  if(status != OPERATION_OK)
+    return status;
+
+  switch(f->type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+    memcpy(f->data + off, emul.cmd + 8, len);
+    break;
+
+  case MDFT_BACKUP_DATA_FILE:
+    memcpy(f->shadow + off, emul.cmd + 8, len);
+    f->dirty = 1;
+    break;
+
+  default:
+    /* Eine lineare Datei nimmt keine weiteren Datensätze auf. */
+    if(f->type == MDFT_LINEAR_RECORD_FILE_WITH_BACKUP && f->nrec >= f->maxrec && !f->clear)
+      return BOUNDARY_ERROR;
+
+    if(!f->dirty)
+      memset(f->shadow, 0, f->size);
+    memcpy(f->shadow + off, emul.cmd + 8, len);
+    f->dirty = 1;
+    break;
+  }
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_read_records()
+{
+  struct emul_file *f;
+  uint32_t off, n;
+  uint8_t comm, status;
+
+
+  if(emul.cmdlen != 8)
+    return LENGTH_ERROR;
+
+  status = emul_file_access(&f, 8, &comm, EMUL_R);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(!emul_is_record(f))
+    return PARAMETER_ERROR;
+
+  /* Der Versatz zählt vom neuesten Datensatz, geliefert wird ältester zuerst. */
+  off = emul_get(emul.cmd + 2, 3);
+  n   = emul_get(emul.cmd + 5, 3);
+  if(off >= f->nrec || n > f->nrec - off)
+    return BOUNDARY_ERROR;
+  if(n == 0)
+    n = f->nrec - off;
+
+  memcpy(emul.resp, f->data + (f->nrec - off - n) * f->size, n * f->size);
+  emul.resplen = n * f->size;
+  emul.rcomm   = comm;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_clear_records()
+{
+  struct emul_file *f;
+  uint8_t comm, status;
+
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  status = emul_file_access(&f, 2, &comm, EMUL_RW);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(!emul_is_record(f))
+    return PARAMETER_ERROR;
+
+  f->clear = 1;
+  f->dirty = 0;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_get_value()
+{
+  struct emul_file *f;
+  uint8_t comm, status;
+
+
+  if(emul.cmdlen != 2)
+    return LENGTH_ERROR;
+
+  status = emul_file_access(&f, 2, &comm, EMUL_ANY);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(f->type != MDFT_VALUE_FILE_WITH_BACKUP)
+    return PARAMETER_ERROR;
+
+  emul_put(emul.resp, f->value, 4);
+  emul.resplen = 4;
+  emul.rcomm   = comm;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_value_op()
+{
+  struct emul_file *f;
+  unsigned int rights;
+  int64_t amount, pending;
+  uint8_t comm, status;
+
+
+  switch(emul.cmd[0])
+  {
+  case 0x0c: rights = EMUL_RW;  break;
+  case 0xdc: rights = EMUL_ANY; break;
+  default:   rights = EMUL_W;   break;
+  }
+
+  status = emul_file_access(&f, 2, &comm, rights);
+  if(status != OPERATION_OK)
+    return status;
+
+  if(f->type != MDFT_VALUE_FILE_WITH_BACKUP)
+    return PARAMETER_ERROR;
+
+  status = emul_unwrap(2, comm, 4);
+  if(status != OPERATION_OK)
+    return status;
+
+  amount = (int32_t)emul_get(emul.cmd + 2, 4);
+  if(amount < 0)
+    return PARAMETER_ERROR;
+
+  switch(emul.cmd[0])
+  {
+  case 0x0c:
+    pending = f->pending + amount;
+    if(pending > f->upper)
+      return BOUNDARY_ERROR;
+    f->credited = 1;
+    break;
+
+  case 0xdc:
+    pending = f->pending - amount;
+    if(pending < f->lower)
+      return BOUNDARY_ERROR;
+    f->debited += amount;
+    break;
+
+  default:
+    if(!(f->limited & 0x01))
+      return PERMISSION_DENIED;
+    pending = f->pending + amount;
+    if(amount > f->limit || pending > f->upper)
+      return BOUNDARY_ERROR;
+    f->lcredited = 1;
+    break;
+  }
+
+  f->pending = pending;
+  f->dirty   = 1;
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_commit_tx()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  emul_commit();
+
+
+  return OPERATION_OK;
+}
+
+
+static uint8_t emul_abort_tx()
+{
+  if(emul.cmdlen != 1)
+    return LENGTH_ERROR;
+
+  emul_abort();
+
+
+  return OPERATION_OK;
+}
+
+
+
+
+/*
+ * Ausführung der Kommandos
+ */
+static const struct
+{
+  uint8_t ins;
+  uint8_t (*fn)();
+} emul_cmds[] =
+{
+  { 0x0a, emul_auth                 },
+  { 0x1a, emul_auth                 },
+  { 0xaa, emul_auth                 },
+  { 0x5a, emul_select_app           },
+  { 0xca, emul_create_app           },
+  { 0xda, emul_delete_app           },
+  { 0x6a, emul_app_ids              },
+  { 0x6d, emul_df_names             },
+  { 0xfc, emul_format               },
+  { 0x6e, emul_free_mem             },
+  { 0x60, emul_get_version          },
+  { 0x51, emul_card_uid             },
+  { 0x45, emul_key_settings         },
+  { 0x54, emul_change_key_settings  },
+  { 0x64, emul_key_version          },
+  { 0xc4, emul_change_key           },
+  { 0xcd, emul_create_file          },
+  { 0xcb, emul_create_file          },
+  { 0xcc, emul_create_file          },
+  { 0xc1, emul_create_file          },
+  { 0xc0, emul_create_file          },
+  { 0xdf, emul_delete_file          },
+  { 0x6f, emul_file_ids             },
+  { 0xf5, emul_file_settings        },
+  { 0x5f, emul_change_file_settings },
+  { 0xbd, emul_read_data            },
+  { 0x3d, emul_write_data           },
+  { 0x6c, emul_get_value            },
+  { 0x0c, emul_value_op             },
+  { 0xdc, emul_value_op             },
+  { 0x1c, emul_value_op             },
+  { 0xbb, emul_read_records         },
+  { 0x3b, emul_write_data           },
+  { 0xeb, emul_clear_records        },
+  { 0xc7, emul_commit_tx            },
+  { 0xa7, emul_abort_tx             },
+  { 0x00, NULL                      },
+};
+
+
+static uint8_t emul_dispatch()
+{
+  unsigned int i;
+
+
+  for(i = 0; emul_cmds[i].fn != NULL; i++)
+    if(emul_cmds[i].ins == emul.cmd[0])
+      return emul_cmds[i].fn();
+
+
+  return ILLEGAL_COMMAND_CODE;
+}
+
+
+/*
+ * Kommando ausführen und Antwort sichern. Jeder Fehler beendet die
+ * Authentifizierung.
+ */
+static void emul_exec(uint8_t (*fn)())
+{
+  uint8_t mac[8];
+  uint8_t status;
+
+
+  emul.resplen   = 0;
+  emul.resppos   = 0;
+  emul.nframes   = 0;
+  emul.frame     = 0;
+  emul.rcomm     = MDCM_PLAIN;
+  emul.unwrapped = 0;
+  emul.drop      = 0;
+
+  status = fn();
+  if(status == OPERATION_OK)
+  {
+    if(!emul.unwrapped && emul.rcomm != EMUL_RAW && emul.authkey >= 0 && emul.scheme == EMUL_NEW)
+      emul_cmac(emul.cmd, emul.cmdlen, mac);
+    emul_wrap(emul.rcomm);
+  }
+  else if(status != ADDITIONAL_FRAME)
+  {
+    emul.resplen = 0;
+    emul_deauth();
+  }
+
+  if(emul.drop)
+    emul_deauth();
+
+  emul.status = status;
+}
+
+
+/* Kommando erwartet weitere Rahmen */
+static void emul_more()
+{
+  emul.resplen = 0;
+  emul.resppos = 0;
+  emul.nframes = 0;
+  emul.frame   = 0;
+  emul.status  = ADDITIONAL_FRAME;
+}
+
+
+static int emul_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen)
+{
+  const uint8_t *data;
+  size_t len, max, n, exp;
+  unsigned int iso;
+  uint8_t ins, status;
+
+
+  /* ISO 7816 verpackte Kommandos: 90 INS 00 00 [Lc Daten] 00 */
+  iso = txlen >= 5 && tx[0] == 0x90 && tx[2] == 0x00 && tx[3] == 0x00 &&
+        (txlen == 5 ? tx[4] == 0x00 : txlen == 6 + (size_t)tx[4]);
+  if(iso)
+  {
+    ins  = tx[1];
+    data = tx + 5;
+    len  = txlen == 5 ? 0 : tx[4];
+  }
+  else if(txlen > 0)
+  {
+    ins  = tx[0];
+    data = tx + 1;
+    len  = txlen - 1;
+  }
+  else
+  {
+    emul.error = NFC_EINVARG;
+    return NFC_EINVARG;
+  }
+
+  if(rxlen < (iso ? 2 : 1))
+  {
+    emul.error = NFC_EOVFLOW;
+    return NFC_EOVFLOW;
+  }
+
+  pthread_mutex_lock(&emul.mutex);
+
+  if(ins == ADDITIONAL_FRAME && emul.resppos < emul.resplen)
+    ;
+  else if(ins == ADDITIONAL_FRAME && emul.authcmd != 0)
+  {
+    emul.cmd[0] = ins;
+    memcpy(emul.cmd + 1, data, len);
+    emul.cmdlen = 1 + len;
+    emul_exec(emul_auth2);
+  }
+  else if(ins == ADDITIONAL_FRAME && emul.cmdexp != 0)
+  {
+    if(emul.cmdlen + len > emul.cmdexp)
+    {
+      emul.cmdexp = 0;
+      emul_more();
+      emul.status = LENGTH_ERROR;
+      emul_deauth();
+    }
+    else
+    {
+      memcpy(emul.cmd + emul.cmdlen, data, len);
+      emul.cmdlen += len;
+      if(emul.cmdlen < emul.cmdexp)
+        emul_more();
+      else
+      {
+        emul.cmdexp = 0;
+        emul_exec(emul_dispatch);
+      }
+    }
+  }
+  else
+  {
+    emul.authcmd = 0;
+    emul.cmdexp  = 0;
+    emul.cmd[0]  = ins;
+    memcpy(emul.cmd + 1, data, len);
+    emul.cmdlen = 1 + len;
+
+    /* Lange Schreibkommandos folgen in weiteren Rahmen. */
+    exp = ins == 0x3d || ins == 0x3b ? emul_expect() : emul.cmdlen;
+    if(exp > emul.cmdlen && exp <= EMUL_MAXCMD)
+    {
+      emul.cmdexp = exp;
+      emul_more();
+    }
+    else
+      emul_exec(emul_dispatch);
+  }
+
+  /* Nächsten Teil der Antwort ausliefern */
+  max = rxlen - (iso ? 2 : 1);
+  if(max > EMUL_FRAME)
+    max = EMUL_FRAME;
+  if(emul.frame < emul.nframes && emul.framesz[emul.frame] < max)
+    max = emul.framesz[emul.frame];
+
+  n = emul.resplen - emul.resppos;
+  if(n > max)
+    n = max;
+  status = emul.resppos + n < emul.resplen ? ADDITIONAL_FRAME : emul.status;
+
+  if(iso)
+  {
+    memcpy(rx, emul.resp + emul.resppos, n);
+    rx[n]     = 0x91;
+    rx[n + 1] = status;
+  }
+  else
+  {
+    rx[0] = status;
+    memcpy(rx + 1, emul.resp + emul.resppos, n);
+  }
+
+  emul.resppos += n;
+  emul.frame++;
+  emul.error = 0;
+
+  pthread_mutex_unlock(&emul.mutex);
+
+
+  return n + (iso ? 2 : 1);
+}
+
+
+
+
+/*
+ * Gerät
+ */
+nfc_device *emul_device()
+{
+  emul.active = 1;
+
+
+  return (nfc_device*)&emul.dev;
+}
+
+
+static int emul_owns(const nfc_device *pnd)
+{
+  return emul.active && pnd == (const nfc_device*)&emul.dev;
+}
+
+
+static void emul_target(nfc_modulation nm, nfc_target *target)
+{
+  nfc_iso14443a_info *nai;
+
+
+  memset(target, 0, sizeof(nfc_target));
+  target->nm.nmt = NMT_ISO14443A;
+  target->nm.nbr = nm.nbr == NBR_UNDEFINED ? NBR_106 : nm.nbr;
+
+  nai = &target->nti.nai;
+  nai->abtAtqa[0] = 0x03;
+  nai->abtAtqa[1] = 0x44;
+  nai->btSak      = 0x20;
+  nai->szUidLen   = sizeof(emul_uid);
+  memcpy(nai->abtUid, emul_uid, sizeof(emul_uid));
+  nai->szAtsLen   = sizeof(emul_ats);
+  memcpy(nai->abtAts, emul_ats, sizeof(emul_ats));
+}
+
+
+static int emul_list(nfc_modulation nm, nfc_target ant[], size_t n)
+{
+  if(nm.nmt != NMT_ISO14443A || n < 1)
+    return 0;
+
+  emul_target(nm, &ant[0]);
+
+
+  return 1;
+}
+
+
+static int emul_select(nfc_modulation nm, const uint8_t *uid, size_t uidlen, nfc_target *target)
+{
+  if(nm.nmt != NMT_ISO14443A)
+    return 0;
+
+  if(uid != NULL && (uidlen != sizeof(emul_uid) || memcmp(uid, emul_uid, uidlen)))
+    return 0;
+
+  /* Neue Auswahl setzt die Karte zurück. */
+  pthread_mutex_lock(&emul.mutex);
+  emul_reset();
+  pthread_mutex_unlock(&emul.mutex);
+
+  if(target != NULL)
+    emul_target(nm, target);
+
+
+  return 1;
+}
+
+
+static int emul_deselect()
+{
+  pthread_mutex_lock(&emul.mutex);
+  emul_reset();
+  pthread_mutex_unlock(&emul.mutex);
+
+
+  return 0;
+}
+
+
+static int emul_error()
+{
+  return emul.error;
+}
+
+
+static const char *emul_strerror()
+{
+  switch(emul.error)
+  {
+  case 0:            return "Success";
+  case NFC_EINVARG:  return "Empty frame";
+  case NFC_EOVFLOW:  return "Buffer overflow";
+  default:           return "Emulation error";
+  }
+}
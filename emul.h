@@ -0,0 +1,45 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_EMUL_H_
+#define _DESF_EMUL_H_
+
+#include <nfc/nfc.h>
+
+#include "trace.h"
+
+
+/*
+ * Grenzen der emulierten DESFire EV1 Karte mit 8 kByte Speicher. Der
+ * Speicher wird wie bei der Karte in Blöcken zu 32 Bytes belegt.
+ */
+#define EMUL_APPS	28
+#define EMUL_FILES	32
+#define EMUL_KEYS	14
+#define EMUL_MEMORY	7936
+#define EMUL_BLOCK	32
+#define EMUL_FRAME	59
+
+
+extern const struct trace_backend emul_backend;
+
+extern nfc_device *emul_device();
+
+
+#endif
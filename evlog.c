@@ -0,0 +1,538 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "evlog.h"
+#include "fn.h"
+
+
+/*
+ * Ereignisprotokoll
+ *
+ * Ereignisse werden als JSON-Zeilen formatiert und in einem Ringpuffer
+ * abgelegt. Ein eigener Thread schreibt sie in die Protokolldatei. Ist der
+ * Ringpuffer voll, wird das Ereignis verworfen, damit die Kommunikation mit
+ * der Karte niemals auf die Ausgabe warten muss.
+ */
+#define EVLOG_SLOTS	1024
+#define EVLOG_SLOTSIZE	512
+#define EVLOG_BATCH	32
+
+
+struct evlog_s
+{
+  FILE *out;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned char active;
+  unsigned char stop;
+  unsigned char atexit;
+
+  char (*ring)[EVLOG_SLOTSIZE];
+  unsigned long head;
+  unsigned long tail;
+
+  unsigned long written;
+  unsigned long dropped;
+};
+
+static struct evlog_s evlog =
+{
+  .out    = NULL,
+  .mutex  = PTHREAD_MUTEX_INITIALIZER,
+  .cond   = PTHREAD_COND_INITIALIZER,
+  .active = 0,
+};
+
+
+/* Das gerade laufende Kommando des jeweiligen Threads. */
+struct evlog_cmd_s
+{
+  unsigned char pending;
+  char name[32];
+  struct timespec start;
+  char params[EVLOG_SLOTSIZE / 2];
+  size_t plen;
+};
+
+static __thread struct evlog_cmd_s evcmd;
+
+
+static int evlog_event(lua_State *l);
+static int evlog_lopen(lua_State *l);
+static int evlog_lclose(lua_State *l);
+static int evlog_stats(lua_State *l);
+
+
+
+
+static size_t evlog_escape(char *dst, size_t size, const char *src)
+{
+  size_t len;
+
+
+  len = 0;
+  for(; *src != '\0' && len + 7 < size; src++)
+  {
+    unsigned char c = *src;
+
+    switch(c)
+    {
+    case '"':  dst[len++] = '\\'; dst[len++] = '"';  break;
+    case '\\': dst[len++] = '\\'; dst[len++] = '\\'; break;
+    case '\n': dst[len++] = '\\'; dst[len++] = 'n';  break;
+    default:
+      if(c < 0x20)
+        len += sprintf(dst + len, "\\u%04x", c);
+      else
+        dst[len++] = c;
+      break;
+    }
+  }
+
+  dst[len] = '\0';
+
+
+  return len;
+}
+
+
+static double evlog_now()
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void evlog_push(const char *line)
+{
+  pthread_mutex_lock(&evlog.mutex);
+
+  if(!evlog.active)
+  {
+    pthread_mutex_unlock(&evlog.mutex);
+    return;
+  }
+
+  if(evlog.head - evlog.tail >= EVLOG_SLOTS)
+    evlog.dropped++;
+  else
+  {
+    strncpy(evlog.ring[evlog.head % EVLOG_SLOTS], line, EVLOG_SLOTSIZE - 1);
+    evlog.ring[evlog.head % EVLOG_SLOTS][EVLOG_SLOTSIZE - 1] = '\0';
+    evlog.head++;
+    pthread_cond_signal(&evlog.cond);
+  }
+
+  pthread_mutex_unlock(&evlog.mutex);
+}
+
+
+static void *evlog_writer(void *arg)
+{
+  char batch[EVLOG_BATCH][EVLOG_SLOTSIZE];
+  unsigned long n, i;
+
+
+  (void)arg;
+
+  while(1)
+  {
+    pthread_mutex_lock(&evlog.mutex);
+    while(evlog.head == evlog.tail && !evlog.stop)
+      pthread_cond_wait(&evlog.cond, &evlog.mutex);
+
+    if(evlog.head == evlog.tail && evlog.stop)
+    {
+      pthread_mutex_unlock(&evlog.mutex);
+      break;
+    }
+
+    /* Ereignisse kopieren und erst außerhalb der Sperre schreiben. */
+    n = evlog.head - evlog.tail;
+    if(n > EVLOG_BATCH)
+      n = EVLOG_BATCH;
+    for(i = 0; i < n; i++)
+      memcpy(batch[i], evlog.ring[(evlog.tail + i) % EVLOG_SLOTS], EVLOG_SLOTSIZE);
+    evlog.tail += n;
+    pthread_mutex_unlock(&evlog.mutex);
+
+    for(i = 0; i < n; i++)
+      fprintf(evlog.out, "%s\n", batch[i]);
+    fflush(evlog.out);
+
+    pthread_mutex_lock(&evlog.mutex);
+    evlog.written += n;
+    pthread_mutex_unlock(&evlog.mutex);
+  }
+
+
+  return NULL;
+}
+
+
+
+
+int evlog_open(const char *filename)
+{
+  evlog_close();
+
+  evlog.ring = malloc(EVLOG_SLOTS * EVLOG_SLOTSIZE);
+  if(evlog.ring == NULL)
+    return -1;
+
+  evlog.out = fopen(filename, "a");
+  if(evlog.out == NULL)
+  {
+    free(evlog.ring);
+    evlog.ring = NULL;
+    return -1;
+  }
+
+  evlog.head    = 0;
+  evlog.tail    = 0;
+  evlog.stop    = 0;
+  evlog.written = 0;
+  evlog.dropped = 0;
+
+  if(pthread_create(&evlog.thread, NULL, evlog_writer, NULL))
+  {
+    fclose(evlog.out);
+    free(evlog.ring);
+    evlog.out  = NULL;
+    evlog.ring = NULL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&evlog.mutex);
+  evlog.active = 1;
+  pthread_mutex_unlock(&evlog.mutex);
+
+  /* Beim Programmende noch ausstehende Ereignisse schreiben. */
+  if(!evlog.atexit)
+  {
+    atexit(evlog_close);
+    evlog.atexit = 1;
+  }
+
+
+  return 0;
+}
+
+
+void evlog_close()
+{
+  if(!evlog.active)
+    return;
+
+  pthread_mutex_lock(&evlog.mutex);
+  evlog.active = 0;
+  evlog.stop   = 1;
+  pthread_cond_signal(&evlog.cond);
+  pthread_mutex_unlock(&evlog.mutex);
+
+  pthread_join(evlog.thread, NULL);
+
+  fclose(evlog.out);
+  free(evlog.ring);
+  evlog.out  = NULL;
+  evlog.ring = NULL;
+}
+
+
+int evlog_active()
+{
+  return evlog.active;
+}
+
+
+
+
+/*
+ * Kommandos protokollieren
+ *
+ * debug_cmd() beginnt ein Kommando, debug_gen() sammelt die
+ * Eingabeparameter und debug_result() schließt es mit Status und Dauer ab.
+ */
+
+void evlog_cmd(const char *name)
+{
+  if(!evlog.active)
+    return;
+
+  evcmd.pending = 1;
+  evlog_escape(evcmd.name, sizeof(evcmd.name), name);
+  evcmd.params[0] = '\0';
+  evcmd.plen = 0;
+  clock_gettime(CLOCK_MONOTONIC, &evcmd.start);
+}
+
+
+void evlog_param(const char *label, const char *fmt, va_list args)
+{
+  char val[128], esc[EVLOG_SLOTSIZE / 4];
+  int len;
+
+
+  if(!evlog.active || !evcmd.pending)
+    return;
+
+  vsnprintf(val, sizeof(val), fmt, args);
+  evlog_escape(esc, sizeof(esc), val);
+
+  len = snprintf(evcmd.params + evcmd.plen, sizeof(evcmd.params) - evcmd.plen,
+    "%s\"%s\":\"%s\"", evcmd.plen > 0 ? "," : "", label, esc);
+  if(len > 0 && evcmd.plen + len < sizeof(evcmd.params))
+    evcmd.plen += len;
+  else
+    evcmd.params[evcmd.plen] = '\0';
+}
+
+
+void evlog_result(uint8_t err, const char *str)
+{
+  char line[EVLOG_SLOTSIZE], esc[64];
+  struct timespec end;
+  double dur;
+
+
+  if(!evlog.active || !evcmd.pending)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  dur = (end.tv_sec - evcmd.start.tv_sec) + (end.tv_nsec - evcmd.start.tv_nsec) / 1e9;
+
+  evlog_escape(esc, sizeof(esc), str);
+  snprintf(line, sizeof(line),
+    "{\"ts\":%.6f,\"cmd\":\"%s\",\"params\":{%s},\"code\":%d,\"status\":\"%s\",\"dur\":%.6f}",
+    evlog_now(), evcmd.name, evcmd.params, err, esc, dur);
+
+  evcmd.pending = 0;
+  evlog_push(line);
+}
+
+
+
+
+FN_ALIAS(evlog_event) = { "event", NULL };
+FN_PARAM(evlog_event) =
+{
+  FNPARAM("name", "Event Name", 0),
+  FNPARAM("data", "Event Data", 1),
+  FNPARAMEND
+};
+FN_RET(evlog_event) =
+{
+  FNPARAMEND
+};
+FN("log", evlog_event, "Log Event",
+"Appends the event <name> to the event log. <data> is either a scalar value\n" \
+"or a table whose entries with string keys and scalar values are logged.\n" \
+"The event is written by a background thread. When the log is not opened,\n" \
+"the event is discarded.\n");
+
+
+static int evlog_event(lua_State *l)
+{
+  char line[EVLOG_SLOTSIZE], esc[EVLOG_SLOTSIZE / 2];
+  size_t len;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "event name expected");
+
+  if(!evlog.active)
+    return 0;
+
+  evlog_escape(esc, sizeof(esc), lua_tostring(l, 1));
+  len = snprintf(line, sizeof(line), "{\"ts\":%.6f,\"event\":\"%s\"", evlog_now(), esc);
+
+  lua_settop(l, 2);
+  lua_checkstack(l, 3);
+
+  if(lua_istable(l, 2))
+  {
+    unsigned char first = 1;
+
+    len += snprintf(line + len, sizeof(line) - len, ",\"data\":{");
+
+    lua_pushnil(l);
+    while(lua_next(l, 2) != 0 && len < sizeof(line))
+    {
+      if(lua_type(l, -2) == LUA_TSTRING)
+      {
+        evlog_escape(esc, sizeof(esc) / 2, lua_tostring(l, -2));
+        len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":", first ? "" : ",", esc);
+        first = 0;
+
+        if(len >= sizeof(line))
+          ;
+        else if(lua_type(l, -1) == LUA_TNUMBER)
+          len += snprintf(line + len, sizeof(line) - len, "%.14g", lua_tonumber(l, -1));
+        else if(lua_type(l, -1) == LUA_TBOOLEAN)
+          len += snprintf(line + len, sizeof(line) - len, "%s", lua_toboolean(l, -1) ? "true" : "false");
+        else if(lua_type(l, -1) == LUA_TSTRING)
+        {
+          evlog_escape(esc, sizeof(esc), lua_tostring(l, -1));
+          len += snprintf(line + len, sizeof(line) - len, "\"%s\"", esc);
+        }
+        else
+          len += snprintf(line + len, sizeof(line) - len, "null");
+      }
+      lua_pop(l, 1);
+    }
+
+    if(len < sizeof(line))
+      len += snprintf(line + len, sizeof(line) - len, "}");
+  }
+  else if(lua_type(l, 2) == LUA_TNUMBER)
+    len += snprintf(line + len, sizeof(line) - len, ",\"data\":%.14g", lua_tonumber(l, 2));
+  else if(lua_type(l, 2) == LUA_TBOOLEAN)
+    len += snprintf(line + len, sizeof(line) - len, ",\"data\":%s", lua_toboolean(l, 2) ? "true" : "false");
+  else if(lua_type(l, 2) == LUA_TSTRING)
+  {
+    evlog_escape(esc, sizeof(esc), lua_tostring(l, 2));
+    len += snprintf(line + len, sizeof(line) - len, ",\"data\":\"%s\"", esc);
+  }
+
+  /* Zu lange Ereignisse werden verworfen, statt ungültiges JSON zu schreiben. */
+  if(len + 1 >= sizeof(line))
+    return luaL_error(l, "event too large");
+
+  snprintf(line + len, sizeof(line) - len, "}");
+  evlog_push(line);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(evlog_lopen) = { "open", NULL };
+FN_PARAM(evlog_lopen) =
+{
+  FNPARAM("file", "Log File", 0),
+  FNPARAMEND
+};
+FN_RET(evlog_lopen) =
+{
+  FNPARAM("ok", "Success", 0),
+  FNPARAMEND
+};
+FN("log", evlog_lopen, "Open Event Log",
+"Opens <file> as event log. Events are appended as JSON lines. Afterwards\n" \
+"all commands are logged with their name, input parameters, status and\n" \
+"duration. A previously opened log is closed.\n");
+
+
+static int evlog_lopen(lua_State *l)
+{
+  int result;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "file name expected");
+
+  result = evlog_open(lua_tostring(l, 1));
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, result == 0);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(evlog_lclose) = { "close", NULL };
+FN_PARAM(evlog_lclose) =
+{
+  FNPARAMEND
+};
+FN_RET(evlog_lclose) =
+{
+  FNPARAMEND
+};
+FN("log", evlog_lclose, "Close Event Log",
+"Writes all pending events and closes the event log.\n");
+
+
+static int evlog_lclose(lua_State *l)
+{
+  evlog_close();
+  lua_settop(l, 0);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(evlog_stats) = { "stats", NULL };
+FN_PARAM(evlog_stats) =
+{
+  FNPARAMEND
+};
+FN_RET(evlog_stats) =
+{
+  FNPARAM("written", "Written Events", 0),
+  FNPARAM("dropped", "Dropped Events", 0),
+  FNPARAM("pending", "Pending Events", 0),
+  FNPARAMEND
+};
+FN("log", evlog_stats, "Event Log Statistics",
+"Returns the number of events written, dropped due to a full buffer and\n" \
+"still waiting to be written.\n");
+
+
+static int evlog_stats(lua_State *l)
+{
+  unsigned long written, dropped, pending;
+
+
+  pthread_mutex_lock(&evlog.mutex);
+  written = evlog.written;
+  dropped = evlog.dropped;
+  pending = evlog.head - evlog.tail;
+  pthread_mutex_unlock(&evlog.mutex);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 3);
+  lua_pushinteger(l, written);
+  lua_pushinteger(l, dropped);
+  lua_pushinteger(l, pending);
+
+
+  return 3;
+}
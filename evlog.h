@@ -0,0 +1,42 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_EVLOG_H_
+#define _DESF_EVLOG_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "fn.h"
+
+
+extern int evlog_open(const char *filename);
+extern void evlog_close();
+extern int evlog_active();
+extern void evlog_cmd(const char *name);
+extern void evlog_param(const char *label, const char *fmt, va_list args);
+extern void evlog_result(uint8_t err, const char *str);
+
+extern FNDECL(evlog_event);
+extern FNDECL(evlog_lopen);
+extern FNDECL(evlog_lclose);
+extern FNDECL(evlog_stats);
+
+
+#endif
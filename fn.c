@@ -22,15 +22,26 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "async.h"
+#include "bench.h"
 #include "buffer.h"
 #include "cmd.h"
 #include "crc.h"
 #include "crypto.h"
 #include "debug.h"
+#include "evlog.h"
 #include "fn.h"
 #include "help.h"
+#include "image.h"
 #include "key.h"
+#include "prof.h"
+#include "rcache.h"
+#include "replay.h"
+#include "session.h"
 #include "show.h"
+#include "stats.h"
+#include "trace.h"
+#include "wback.h"
 
 
 
@@ -143,6 +154,7 @@ int fn_init(lua_State *l, int online)
     fn_register(l, FNREF(cmd_createapp));
     fn_register(l, FNREF(cmd_deleteapp));
     fn_register(l, FNREF(cmd_appids));
+    fn_register(l, FNREF(cmd_dfnames));
     fn_register(l, FNREF(cmd_selapp));
     fn_register(l, FNREF(cmd_format));
     fn_register(l, FNREF(cmd_getver));
@@ -170,12 +182,66 @@ int fn_init(lua_State *l, int online)
     fn_register(l, FNREF(cmd_crec));
     fn_register(l, FNREF(cmd_commit));
     fn_register(l, FNREF(cmd_abort));
+    fn_register(l, FNREF(cmd_values));
+    fn_register(l, FNREF(cmd_wrecs));
+    fn_register(l, FNREF(cmd_records));
+
+    fn_register(l, FNREF(cmd_raw));
 
     fn_register(l, FNREF(show_picc));
     fn_register(l, FNREF(show_apps));
     fn_register(l, FNREF(show_files));
+
+    fn_register(l, FNREF(session_state));
+    fn_register(l, FNREF(session_skip));
+    fn_register(l, FNREF(session_stats));
+    fn_register(l, FNREF(session_clear));
+    fn_register(l, FNREF(session_recovery));
+    fn_register(l, FNREF(session_frame));
+    fn_register(l, FNREF(session_selectrate));
+    fn_register(l, FNREF(wback_mode));
+    fn_register(l, FNREF(rcache_mode));
+
+    fn_register(l, FNREF(img_dump));
+    fn_register(l, FNREF(img_restore));
+
+    fn_register(l, FNREF(async_spawn));
+    fn_register(l, FNREF(async_wait));
+    fn_register(l, FNREF(async_yield));
   }
 
+  fn_register(l, FNREF(img_save));
+  fn_register(l, FNREF(img_load));
+
+  fn_register(l, FNREF(evlog_event));
+  fn_register(l, FNREF(evlog_lopen));
+  fn_register(l, FNREF(evlog_lclose));
+  fn_register(l, FNREF(evlog_stats));
+
+  fn_register(l, FNREF(stats_get));
+  fn_register(l, FNREF(stats_reset));
+  fn_register(l, FNREF(stats_print));
+
+  fn_register(l, FNREF(bench_clock));
+  fn_register(l, FNREF(bench_run));
+  fn_register(l, FNREF(bench_print));
+  fn_register(l, FNREF(bench_save));
+  fn_register(l, FNREF(bench_reset));
+
+  fn_register(l, FNREF(prof_start));
+  fn_register(l, FNREF(prof_stop));
+  fn_register(l, FNREF(prof_save));
+  fn_register(l, FNREF(prof_reset));
+  fn_register(l, FNREF(prof_stats));
+
+  fn_register(l, FNREF(trace_enable));
+  fn_register(l, FNREF(trace_ldump));
+  fn_register(l, FNREF(trace_lrecord));
+  fn_register(l, FNREF(trace_clear));
+  fn_register(l, FNREF(trace_last));
+  fn_register(l, FNREF(trace_stats));
+  fn_register(l, FNREF(replay_stats));
+
   fn_register(l, FNREF(buffer_from_table));
   fn_register(l, FNREF(buffer_from_hexstr));
   fn_register(l, FNREF(buffer_from_ascii));
@@ -26,7 +26,7 @@
 
 char *hexdump_line(uint8_t *buffer, unsigned int len, unsigned int offset)
 {
-  static char line[80];
+  static __thread char line[80];
   unsigned int col;
   char *linepos;
 
@@ -0,0 +1,2165 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <freefare.h>
+
+#include "async.h"
+#include "buffer.h"
+#include "desflua.h"
+#include "desfsh.h"
+#include "fn.h"
+#include "image.h"
+#include "key.h"
+#include "rcache.h"
+#include "session.h"
+#include "wback.h"
+
+
+/*
+ * Unterscheiden sich zwei geänderte Bereiche einer Datei um höchstens so
+ * viele Bytes, werden sie in einem gemeinsamen WriteData-Kommando
+ * geschrieben. Die unveränderten Bytes dazwischen kosten weniger als ein
+ * zusätzlicher Kommandoaustausch.
+ */
+#define IMG_MERGEGAP	16
+
+#define IMG_MAXFILES	32
+#define IMG_MAXDEPTH	16
+
+
+struct img_ctx
+{
+  lua_State *l;
+  int keys;
+  unsigned char dryrun;
+  uint32_t aid;
+  int authkno;
+  unsigned char newapp;
+  enum keytype_e keytype;
+  unsigned int nops;
+  int err;
+  char errstr[256];
+};
+
+struct img_file
+{
+  uint8_t type;
+  uint8_t comm;
+  uint16_t acl;
+  uint32_t size;
+  int32_t lower, upper, value;
+  uint8_t lcred;
+  uint32_t recsize, mrec, crec;
+};
+
+
+
+static int img_dump(lua_State *l);
+static int img_restore(lua_State *l);
+static int img_save(lua_State *l);
+static int img_load(lua_State *l);
+
+
+
+
+static int img_error(struct img_ctx *ctx, const char *fmt, ...)
+{
+  va_list args;
+
+
+  va_start(args, fmt);
+  vsnprintf(ctx->errstr, sizeof(ctx->errstr), fmt, args);
+  va_end(args);
+
+  ctx->err = -1;
+
+
+  return -1;
+}
+
+
+static int img_fail(struct img_ctx *ctx, const char *fmt, ...)
+{
+  va_list args;
+  int len;
+
+
+  va_start(args, fmt);
+  len = vsnprintf(ctx->errstr, sizeof(ctx->errstr), fmt, args);
+  va_end(args);
+
+  if(len >= 0 && (size_t)len < sizeof(ctx->errstr))
+    snprintf(ctx->errstr + len, sizeof(ctx->errstr) - len, ": %s", freefare_strerror(tag));
+
+  ctx->err = mifare_desfire_last_picc_error(tag);
+
+  /* Nach einem Fehler ist die Authentifizierung verloren. */
+  ctx->authkno = -1;
+  session_reset();
+
+
+  return -1;
+}
+
+
+static int img_op(struct img_ctx *ctx, const char *fmt, ...)
+{
+  va_list args;
+
+
+  ctx->nops++;
+
+  printf("%s0x%06x  ", ctx->dryrun ? "[DRY] " : "", ctx->aid);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+
+
+  return !ctx->dryrun;
+}
+
+
+static uint8_t img_comm(uint8_t comm)
+{
+  switch(comm & 0x03)
+  {
+  case MDCM_MACED:      return MDCM_MACED;
+  case MDCM_ENCIPHERED: return MDCM_ENCIPHERED;
+  default:              return MDCM_PLAIN;
+  }
+}
+
+
+static const char *img_typestr(uint8_t type)
+{
+  switch(type)
+  {
+  case MDFT_STANDARD_DATA_FILE:             return "SDF";
+  case MDFT_BACKUP_DATA_FILE:               return "BDF";
+  case MDFT_VALUE_FILE_WITH_BACKUP:         return "VF";
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP: return "LRF";
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP: return "CRF";
+  default:                                  return NULL;
+  }
+}
+
+
+static void img_pushhex(lua_State *l, const uint8_t *data, unsigned int len)
+{
+  char *str;
+  unsigned int i;
+
+
+  str = (char*)malloc(2 * len + 1);
+  if(str == NULL)
+  {
+    luaL_error(l, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+    return;
+  }
+
+  for(i = 0; i < len; i++)
+    sprintf(str + 2 * i, "%02x", data[i]);
+  str[2 * len] = '\0';
+
+  lua_checkstack(l, 1);
+  lua_pushstring(l, str);
+  free(str);
+}
+
+
+
+
+/*
+ * Schlüsselverwaltung
+ *
+ * Die Schlüsseltabelle ist nach AIDs indiziert. Jeder Eintrag ist entweder
+ * direkt ein Schlüssel (dann gilt er als Schlüssel 0 der Applikation) oder
+ * eine Tabelle, die Schlüsselnummern auf Schlüssel abbildet.
+ */
+
+static void img_pushkey(struct img_ctx *ctx, uint32_t aid, uint8_t kno)
+{
+  lua_State *l = ctx->l;
+  unsigned char iskey;
+
+
+  lua_checkstack(l, 3);
+
+  if(ctx->keys == 0)
+  {
+    lua_pushnil(l);
+    return;
+  }
+
+  lua_pushinteger(l, aid);
+  lua_gettable(l, ctx->keys);
+  if(!lua_istable(l, -1))
+    return;
+
+  lua_getfield(l, -1, "t");
+  iskey = !lua_isnil(l, -1);
+  lua_pop(l, 1);
+
+  if(iskey)
+  {
+    if(kno != 0)
+    {
+      lua_pop(l, 1);
+      lua_pushnil(l);
+    }
+    return;
+  }
+
+  lua_pushinteger(l, kno);
+  lua_gettable(l, -2);
+  lua_remove(l, -2);
+}
+
+
+static int img_getkey(struct img_ctx *ctx, uint8_t kno, struct session_key *k)
+{
+  lua_State *l = ctx->l;
+  int result;
+
+
+  /* Neu angelegte Applikationen besitzen nur Standardschlüssel. */
+  if(ctx->newapp)
+  {
+    if(k != NULL)
+      session_defkey(ctx->keytype, k);
+    return 0;
+  }
+
+  img_pushkey(ctx, ctx->aid, kno);
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    return 1;
+  }
+
+  if(k == NULL)
+  {
+    lua_pop(l, 1);
+    return 0;
+  }
+
+  result = session_getkey(l, -1, k, NULL);
+  if(result)
+  {
+    img_error(ctx, "key %d of application 0x%06x: %s", kno, ctx->aid, lua_tostring(l, -1));
+    lua_pop(l, 2);
+    return -1;
+  }
+  lua_pop(l, 1);
+
+
+  return 0;
+}
+
+
+static int img_auth(struct img_ctx *ctx, uint8_t kno)
+{
+  int result;
+  struct session_key k;
+
+
+  if(ctx->authkno == kno)
+    return 0;
+
+  result = img_getkey(ctx, kno, &k);
+  if(result < 0)
+    return -1;
+  if(result > 0)
+    return img_error(ctx, "no key %d given for application 0x%06x", kno, ctx->aid);
+
+  result = session_auth(kno, &k);
+  if(result < 0)
+    return img_fail(ctx, "Authenticate(%d)", kno);
+
+  ctx->authkno = kno;
+
+
+  return 0;
+}
+
+
+/*
+ * Für einen Dateizugriff authentifizieren. <mode> gibt die Art des Zugriffs
+ * an:
+ *
+ *   r  Lesen (RD, RW)
+ *   w  Schreiben (WR, RW)
+ *   v  Wert lesen bzw. abbuchen (RD, WR, RW)
+ *   x  Lesen und Schreiben (RW)
+ *   c  Einstellungen ändern (CA)
+ *
+ * Der Rückgabewert ist 1, wenn kein passender Schlüssel bekannt ist.
+ */
+static int img_access(struct img_ctx *ctx, uint16_t acl, char mode)
+{
+  uint8_t knos[3];
+  unsigned int n, i;
+  int result;
+
+
+  n = 0;
+  switch(mode)
+  {
+  case 'r': knos[n++] = MDAR_READ(acl);  knos[n++] = MDAR_READ_WRITE(acl); break;
+  case 'w': knos[n++] = MDAR_WRITE(acl); knos[n++] = MDAR_READ_WRITE(acl); break;
+  case 'v': knos[n++] = MDAR_READ(acl);  knos[n++] = MDAR_WRITE(acl);
+            knos[n++] = MDAR_READ_WRITE(acl);                              break;
+  case 'x': knos[n++] = MDAR_READ_WRITE(acl);                              break;
+  case 'c': knos[n++] = MDAR_CHANGE_AR(acl);                               break;
+  }
+
+  for(i = 0; i < n; i++)
+    if(knos[i] == MDAR_FREE)
+      return 0;
+
+  for(i = 0; i < n; i++)
+    if(knos[i] == ctx->authkno)
+      return 0;
+
+  for(i = 0; i < n; i++)
+  {
+    if(knos[i] == MDAR_DENY)
+      continue;
+
+    result = img_getkey(ctx, knos[i], NULL);
+    if(result < 0)
+      return -1;
+    if(result > 0)
+      continue;
+
+    return img_auth(ctx, knos[i]);
+  }
+
+
+  return 1;
+}
+
+
+static int img_select(struct img_ctx *ctx, uint32_t aid)
+{
+  int result;
+
+
+  result = session_select(aid);
+
+  ctx->aid = aid;
+  ctx->authkno = -1;
+
+  if(result < 0)
+    return img_fail(ctx, "SelectApplication(0x%06x)", aid);
+
+
+  return 0;
+}
+
+
+/*
+ * Die folgenden Hilfsfunktionen führen ein Kommando zunächst ohne weitere
+ * Authentifizierung aus. Verweigert die Karte den Zugriff, authentifizieren
+ * wir uns mit dem Master-Key und versuchen es erneut.
+ */
+static int img_retry(struct img_ctx *ctx)
+{
+  uint8_t err;
+
+
+  err = mifare_desfire_last_picc_error(tag);
+  if(err != AUTHENTICATION_ERROR && err != PERMISSION_DENIED)
+    return 0;
+
+  ctx->authkno = -1;
+  if(img_getkey(ctx, 0, NULL) != 0)
+    return 0;
+
+  return img_auth(ctx, 0) == 0;
+}
+
+
+static int img_keysettings(struct img_ctx *ctx, uint8_t *settings, uint8_t *nkeys)
+{
+  int result;
+
+
+  result = mifare_desfire_get_key_settings(tag, settings, nkeys);
+  if(result < 0 && img_retry(ctx))
+    result = mifare_desfire_get_key_settings(tag, settings, nkeys);
+  if(result < 0)
+    return ctx->err ? -1 : img_fail(ctx, "GetKeySettings()");
+
+
+  return 0;
+}
+
+
+static int img_fileids(struct img_ctx *ctx, uint8_t **fids, size_t *nfids)
+{
+  int result;
+
+
+  result = mifare_desfire_get_file_ids(tag, fids, nfids);
+  if(result < 0 && img_retry(ctx))
+    result = mifare_desfire_get_file_ids(tag, fids, nfids);
+  if(result < 0)
+    return ctx->err ? -1 : img_fail(ctx, "GetFileIDs()");
+
+
+  return 0;
+}
+
+
+static int img_filesettings(struct img_ctx *ctx, uint8_t fid, struct img_file *f)
+{
+  int result;
+  struct mifare_desfire_file_settings settings;
+
+
+  result = mifare_desfire_get_file_settings(tag, fid, &settings);
+  if(result < 0 && img_retry(ctx))
+    result = mifare_desfire_get_file_settings(tag, fid, &settings);
+  if(result < 0)
+    return ctx->err ? -1 : img_fail(ctx, "GetFileSettings(%d)", fid);
+
+  memset(f, 0, sizeof(*f));
+  f->type = settings.file_type;
+  f->comm = img_comm(settings.communication_settings);
+  f->acl  = settings.access_rights;
+
+  switch(settings.file_type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    f->size = settings.settings.standard_file.file_size;
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    f->lower = settings.settings.value_file.lower_limit;
+    f->upper = settings.settings.value_file.upper_limit;
+    f->lcred = settings.settings.value_file.limited_credit_enabled;
+    break;
+
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+    f->recsize = settings.settings.linear_record_file.record_size;
+    f->mrec    = settings.settings.linear_record_file.max_number_of_records;
+    f->crec    = settings.settings.linear_record_file.current_number_of_records;
+    break;
+  }
+
+
+  return 0;
+}
+
+
+
+
+/*
+ * Abbild einer Karte erstellen
+ */
+
+static int img_dump_file(struct img_ctx *ctx, uint8_t fid)
+{
+  lua_State *l = ctx->l;
+  int result;
+  struct img_file f;
+  uint8_t *data;
+  uint32_t len, i;
+  int32_t value;
+
+
+  result = img_filesettings(ctx, fid, &f);
+  if(result)
+    return -1;
+
+  if(img_typestr(f.type) == NULL)
+    return img_error(ctx, "file %d: unknown file type %d", fid, f.type);
+
+  lua_checkstack(l, 3);
+  lua_newtable(l);
+  lua_pushstring(l, img_typestr(f.type)); lua_setfield(l, -2, "type");
+  lua_pushinteger(l, f.comm);             lua_setfield(l, -2, "comm");
+  desflua_push_acl(l, f.acl);             lua_setfield(l, -2, "acl");
+
+  switch(f.type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    lua_pushinteger(l, f.size); lua_setfield(l, -2, "size");
+    len = f.size;
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    lua_pushinteger(l, f.lower);  lua_setfield(l, -2, "lower");
+    lua_pushinteger(l, f.upper);  lua_setfield(l, -2, "upper");
+    lua_pushboolean(l, f.lcred);  lua_setfield(l, -2, "lcred");
+    len = 0;
+    break;
+
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+    lua_pushinteger(l, f.recsize); lua_setfield(l, -2, "recsize");
+    lua_pushinteger(l, f.mrec);    lua_setfield(l, -2, "mrec");
+    len = f.recsize * f.crec;
+    break;
+
+  default:
+    len = 0;
+    break;
+  }
+
+
+  /* Inhalt auslesen. */
+  result = img_access(ctx, f.acl, f.type == MDFT_VALUE_FILE_WITH_BACKUP ? 'v' : 'r');
+  if(result < 0)
+    goto fail;
+  if(result > 0)
+  {
+    printf("0x%06x  file %d: no read access, content skipped\n", ctx->aid, fid);
+    return 0;
+  }
+
+  if(f.type == MDFT_VALUE_FILE_WITH_BACKUP)
+  {
+    result = mifare_desfire_get_value_ex(tag, fid, &value, f.comm);
+    if(result < 0)
+    {
+      img_fail(ctx, "GetValue(%d)", fid);
+      goto fail;
+    }
+
+    lua_pushinteger(l, value);
+    lua_setfield(l, -2, "value");
+    return 0;
+  }
+
+  if(len == 0)
+  {
+    if(f.type == MDFT_LINEAR_RECORD_FILE_WITH_BACKUP ||
+       f.type == MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP)
+    {
+      lua_newtable(l);
+      lua_setfield(l, -2, "records");
+    }
+    return 0;
+  }
+
+  data = (uint8_t*)malloc(len);
+  if(data == NULL)
+  {
+    img_error(ctx, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+    goto fail;
+  }
+
+  if(f.type == MDFT_STANDARD_DATA_FILE || f.type == MDFT_BACKUP_DATA_FILE)
+  {
+    result = mifare_desfire_read_data_ex(tag, fid, 0, len, data, f.comm);
+    if(result < 0)
+    {
+      free(data);
+      img_fail(ctx, "ReadData(%d)", fid);
+      goto fail;
+    }
+
+    img_pushhex(l, data, result);
+    lua_setfield(l, -2, "data");
+  }
+  else
+  {
+    result = mifare_desfire_read_records_ex(tag, fid, 0, f.crec, data, f.comm);
+    if(result < 0)
+    {
+      free(data);
+      img_fail(ctx, "ReadRecords(%d)", fid);
+      goto fail;
+    }
+
+    lua_newtable(l);
+    for(i = 0; i < f.crec && (i + 1) * f.recsize <= (uint32_t)result; i++)
+    {
+      lua_pushinteger(l, i + 1);
+      img_pushhex(l, data + i * f.recsize, f.recsize);
+      lua_settable(l, -3);
+    }
+    lua_setfield(l, -2, "records");
+  }
+
+  free(data);
+
+
+  return 0;
+
+
+fail:
+  lua_pop(l, 1);
+  return -1;
+}
+
+
+static int img_dump_app(struct img_ctx *ctx, uint32_t aid)
+{
+  lua_State *l = ctx->l;
+  int result;
+  uint8_t settings, nkeys;
+  uint8_t *fids;
+  size_t nfids, i;
+
+
+  result = img_select(ctx, aid);
+  if(result)
+    return -1;
+
+  result = img_keysettings(ctx, &settings, &nkeys);
+  if(result)
+    return -1;
+
+  lua_checkstack(l, 4);
+  lua_newtable(l);
+  lua_pushinteger(l, settings); lua_setfield(l, -2, "settings");
+  lua_pushinteger(l, nkeys);    lua_setfield(l, -2, "nkeys");
+
+  /*
+   * Der Schlüsseltyp lässt sich über libfreefare nicht auslesen. Wir
+   * übernehmen ihn aus dem übergebenen Master-Key, sofern vorhanden.
+   */
+  img_pushkey(ctx, aid, 0);
+  if(lua_istable(l, -1))
+    lua_getfield(l, -1, "t");
+  else
+    lua_pushnil(l);
+  lua_setfield(l, -3, "keytype");
+  lua_pop(l, 1);
+
+  result = img_fileids(ctx, &fids, &nfids);
+  if(result)
+  {
+    lua_pop(l, 1);
+    return -1;
+  }
+
+  lua_newtable(l);
+  for(i = 0; i < nfids; i++)
+  {
+    result = img_dump_file(ctx, fids[i]);
+    if(result)
+    {
+      free(fids);
+      lua_pop(l, 2);
+      return -1;
+    }
+
+    lua_rawseti(l, -2, fids[i]);
+  }
+  lua_setfield(l, -2, "files");
+  free(fids);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(img_dump) = { "dump", NULL };
+FN_PARAM(img_dump) =
+{
+  FNPARAM("keys", "Table of Keys per AID", 1),
+  FNPARAMEND
+};
+FN_RET(img_dump) =
+{
+  FNPARAM("code",  "Return Code",  0),
+  FNPARAM("err",   "Error String", 0),
+  FNPARAM("image", "Card Image",   1),
+  FNPARAMEND
+};
+FN("img", img_dump, "Create Card Image",
+"Reads the structure and the content of all applications and files into a\n" \
+"card image. <keys> is a table indexed by AID. Each value is either a key,\n" \
+"which is used as master key of the application, or a table mapping key\n" \
+"numbers to keys. Index 0 holds the PICC master key. Files without read\n" \
+"access are imaged without content. Keys themselves are not part of the\n" \
+"image.\n");
+
+
+static int img_dump(lua_State *l)
+{
+  int result;
+  struct img_ctx ctx;
+  uint8_t settings, nkeys;
+  MifareDESFireAID *apps;
+  MifareDESFireDF *dfs;
+  size_t napps, ndfs, i, j;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) || lua_istable(l, 1), 1,
+    "keys must be stored inside a table");
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.l       = l;
+  ctx.keys    = lua_istable(l, 1) ? 1 : 0;
+  ctx.authkno = -1;
+
+  async_sync();
+  wback_flush();
+
+  lua_settop(l, 1);
+  lua_checkstack(l, 4);
+  lua_newtable(l);
+
+
+  /* PICC-Ebene */
+  result = img_select(&ctx, 0);
+  if(result)
+    goto fail;
+
+  if(img_getkey(&ctx, 0, NULL) == 0)
+  {
+    result = img_auth(&ctx, 0);
+    if(result)
+      goto fail;
+  }
+
+  result = img_keysettings(&ctx, &settings, &nkeys);
+  if(result)
+    goto fail;
+
+  lua_newtable(l);
+  lua_pushinteger(l, settings); lua_setfield(l, -2, "settings");
+  lua_pushinteger(l, nkeys);    lua_setfield(l, -2, "nkeys");
+  lua_setfield(l, -2, "picc");
+
+  result = mifare_desfire_get_application_ids(tag, &apps, &napps);
+  if(result < 0)
+  {
+    img_fail(&ctx, "GetApplicationIDs()");
+    goto fail;
+  }
+
+  /*
+   * Die ISO-Parameter aller Applikationen liefert ein einziges Kommando.
+   * Karten ohne dieses Kommando werden ohne ISO-Parameter abgebildet.
+   */
+  result = mifare_desfire_get_df_names(tag, &dfs, &ndfs);
+  if(result < 0)
+  {
+    session_reset();
+    dfs  = NULL;
+    ndfs = 0;
+  }
+
+
+  /* Applikationen */
+  lua_newtable(l);
+  for(i = 0; i < napps; i++)
+  {
+    uint32_t aid;
+
+    aid = mifare_desfire_aid_get_aid(apps[i]);
+    result = img_dump_app(&ctx, aid);
+    if(result)
+    {
+      mifare_desfire_free_application_ids(apps);
+      free(dfs);
+      goto fail;
+    }
+
+    for(j = 0; j < ndfs && dfs[j].aid != aid; j++);
+    if(j < ndfs)
+    {
+      lua_pushinteger(l, dfs[j].fid);
+      lua_setfield(l, -2, "isofid");
+      img_pushhex(l, dfs[j].df_name, dfs[j].df_name_len);
+      lua_setfield(l, -2, "dfname");
+    }
+
+    lua_pushinteger(l, aid);
+    lua_insert(l, -2);
+    lua_settable(l, -3);
+  }
+  lua_setfield(l, -2, "apps");
+  mifare_desfire_free_application_ids(apps);
+  free(dfs);
+
+  img_select(&ctx, 0);
+
+  lua_settop(l, 2);
+  lua_pushinteger(l, 0);
+  lua_pushstring(l, "OK");
+  lua_insert(l, -3);
+  lua_insert(l, -3);
+
+
+  return 3;
+
+
+fail:
+  lua_settop(l, 0);
+  lua_pushinteger(l, ctx.err);
+  lua_pushstring(l, ctx.errstr);
+  return 2;
+}
+
+
+
+
+/*
+ * Abbild auf eine Karte zurückschreiben
+ */
+
+static int img_getfield_int(lua_State *l, int idx, const char *name, int32_t *val)
+{
+  int present;
+
+
+  lua_checkstack(l, 1);
+  lua_getfield(l, idx, name);
+  present = lua_isnumber(l, -1);
+  if(present)
+    *val = lua_tointeger(l, -1);
+  lua_pop(l, 1);
+
+
+  return present;
+}
+
+
+static int img_parse_file(struct img_ctx *ctx, int idx, uint8_t fid, struct img_file *f)
+{
+  lua_State *l = ctx->l;
+  int result;
+  const char *typestr;
+  int32_t val;
+
+
+  if(!lua_istable(l, idx))
+    return img_error(ctx, "file %d: table expected", fid);
+
+  memset(f, 0, sizeof(*f));
+
+  lua_checkstack(l, 1);
+  lua_getfield(l, idx, "type");
+  typestr = lua_isstring(l, -1) ? lua_tostring(l, -1) : "";
+       if(!strcasecmp(typestr, "SDF")) { f->type = MDFT_STANDARD_DATA_FILE;             }
+  else if(!strcasecmp(typestr, "BDF")) { f->type = MDFT_BACKUP_DATA_FILE;               }
+  else if(!strcasecmp(typestr, "VF"))  { f->type = MDFT_VALUE_FILE_WITH_BACKUP;         }
+  else if(!strcasecmp(typestr, "LRF")) { f->type = MDFT_LINEAR_RECORD_FILE_WITH_BACKUP; }
+  else if(!strcasecmp(typestr, "CRF")) { f->type = MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP; }
+  else
+  {
+    lua_pop(l, 1);
+    return img_error(ctx, "file %d: unknown file type", fid);
+  }
+  lua_pop(l, 1);
+
+  lua_getfield(l, idx, "comm");
+  result = desflua_get_comm(l, lua_gettop(l), &f->comm);
+  if(result)
+  {
+    img_error(ctx, "file %d: comm: %s", fid, lua_tostring(l, -1));
+    lua_pop(l, 2);
+    return -1;
+  }
+  lua_pop(l, 1);
+  f->comm = img_comm(f->comm);
+
+  lua_getfield(l, idx, "acl");
+  result = desflua_get_acl(l, lua_gettop(l), &f->acl);
+  if(result)
+  {
+    img_error(ctx, "file %d: acl: %s", fid, lua_tostring(l, -1));
+    lua_pop(l, 2);
+    return -1;
+  }
+  lua_pop(l, 1);
+
+  switch(f->type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    if(!img_getfield_int(l, idx, "size", &val))
+      return img_error(ctx, "file %d: size expected", fid);
+    f->size = val;
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    if(!img_getfield_int(l, idx, "lower", &f->lower) ||
+       !img_getfield_int(l, idx, "upper", &f->upper))
+      return img_error(ctx, "file %d: lower and upper limit expected", fid);
+    img_getfield_int(l, idx, "value", &f->value);
+    lua_getfield(l, idx, "lcred");
+    f->lcred = lua_toboolean(l, -1);
+    lua_pop(l, 1);
+    break;
+
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+    if(!img_getfield_int(l, idx, "recsize", &val))
+      return img_error(ctx, "file %d: record size expected", fid);
+    f->recsize = val;
+    if(!img_getfield_int(l, idx, "mrec", &val))
+      return img_error(ctx, "file %d: maximum number of records expected", fid);
+    f->mrec = val;
+    break;
+  }
+
+
+  return 0;
+}
+
+
+static int img_same_layout(const struct img_file *a, const struct img_file *b)
+{
+  if(a->type != b->type)
+    return 0;
+
+  switch(a->type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+  case MDFT_BACKUP_DATA_FILE:
+    return a->size == b->size;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    return a->lower == b->lower && a->upper == b->upper && !a->lcred == !b->lcred;
+
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+    return a->recsize == b->recsize && a->mrec == b->mrec;
+  }
+
+
+  return 0;
+}
+
+
+static int img_create_file(struct img_ctx *ctx, uint8_t fid, const struct img_file *f)
+{
+  int result;
+
+
+  if(!img_op(ctx, "Create%s(%d)", img_typestr(f->type), fid))
+    return 0;
+
+  switch(f->type)
+  {
+  case MDFT_STANDARD_DATA_FILE:
+    result = mifare_desfire_create_std_data_file(tag, fid, f->comm, f->acl, f->size);
+    break;
+
+  case MDFT_BACKUP_DATA_FILE:
+    result = mifare_desfire_create_backup_data_file(tag, fid, f->comm, f->acl, f->size);
+    break;
+
+  case MDFT_VALUE_FILE_WITH_BACKUP:
+    result = mifare_desfire_create_value_file(tag, fid, f->comm, f->acl,
+      f->lower, f->upper, f->value, f->lcred);
+    break;
+
+  case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    result = mifare_desfire_create_linear_record_file(tag, fid, f->comm, f->acl,
+      f->recsize, f->mrec);
+    break;
+
+  case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+    result = mifare_desfire_create_cyclic_record_file(tag, fid, f->comm, f->acl,
+      f->recsize, f->mrec);
+    break;
+
+  default:
+    return img_error(ctx, "file %d: unknown file type %d", fid, f->type);
+  }
+
+  if(result < 0)
+    return img_fail(ctx, "Create%s(%d)", img_typestr(f->type), fid);
+
+
+  return 0;
+}
+
+
+static int img_commit(struct img_ctx *ctx)
+{
+  if(!img_op(ctx, "CommitTransaction()"))
+    return 0;
+
+  if(mifare_desfire_commit_transaction(tag) < 0)
+    return img_fail(ctx, "CommitTransaction()");
+
+
+  return 0;
+}
+
+
+static int img_restore_df(struct img_ctx *ctx, int idx, uint8_t fid,
+  const struct img_file *f, const struct img_file *cur, unsigned char created)
+{
+  lua_State *l = ctx->l;
+  int result;
+  uint8_t *want, *have;
+  unsigned int wantlen;
+  uint32_t pos, start, last;
+  unsigned int nwrites;
+  unsigned char full;
+
+
+  lua_checkstack(l, 1);
+  lua_getfield(l, idx, "data");
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    return 0;
+  }
+
+  result = buffer_get(l, -1, &want, &wantlen);
+  if(result)
+  {
+    img_error(ctx, "file %d: data: %s", fid, lua_tostring(l, -1));
+    lua_pop(l, 2);
+    return -1;
+  }
+  lua_pop(l, 1);
+
+  if(wantlen > f->size)
+  {
+    free(want);
+    return img_error(ctx, "file %d: data exceeds file size", fid);
+  }
+
+  if(wantlen == 0)
+  {
+    free(want);
+    return 0;
+  }
+
+  have = (uint8_t*)calloc(wantlen, 1);
+  if(have == NULL)
+  {
+    free(want);
+    return img_error(ctx, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+  }
+
+
+  /*
+   * Aktuellen Inhalt lesen. Neu angelegte Dateien sind mit Nullen gefüllt.
+   * Können wir den Inhalt nicht lesen, schreiben wir die Datei vollständig.
+   */
+  full = 0;
+  if(!created)
+  {
+    result = img_access(ctx, cur->acl, 'r');
+    if(result < 0)
+      goto fail;
+
+    if(result == 0)
+    {
+      result = mifare_desfire_read_data_ex(tag, fid, 0, wantlen, have, cur->comm);
+      if(result < 0)
+      {
+        img_fail(ctx, "ReadData(%d)", fid);
+        goto fail;
+      }
+    }
+    else
+      full = 1;
+  }
+
+
+  /* Geänderte Bereiche zusammenfassen und schreiben. */
+  nwrites = 0;
+  pos = 0;
+  while(pos < wantlen)
+  {
+    if(!full && have[pos] == want[pos])
+    {
+      pos++;
+      continue;
+    }
+
+    start = pos;
+    last  = full ? wantlen - 1 : pos;
+
+    for(pos = start + 1; pos < wantlen && pos - last <= IMG_MERGEGAP; pos++)
+      if(have[pos] != want[pos])
+        last = pos;
+
+    pos = last + 1;
+    nwrites++;
+
+    if(!img_op(ctx, "WriteData(%d, %d, %d)", fid, start, last - start + 1))
+      continue;
+
+    result = img_access(ctx, created ? f->acl : cur->acl, 'w');
+    if(result)
+    {
+      if(result > 0)
+        img_error(ctx, "file %d: no write access", fid);
+      goto fail;
+    }
+
+    result = mifare_desfire_write_data_ex(tag, fid, start, last - start + 1,
+      want + start, created ? f->comm : cur->comm);
+    if(result < 0)
+    {
+      img_fail(ctx, "WriteData(%d)", fid);
+      goto fail;
+    }
+  }
+
+  free(want);
+  free(have);
+
+  if(nwrites > 0 && f->type == MDFT_BACKUP_DATA_FILE)
+    return img_commit(ctx);
+
+
+  return 0;
+
+
+fail:
+  free(want);
+  free(have);
+  return -1;
+}
+
+
+static int img_restore_vf(struct img_ctx *ctx, int idx, uint8_t fid,
+  const struct img_file *cur, unsigned char created)
+{
+  int result;
+  int32_t want, have;
+
+
+  /* Der Initialwert wurde bereits beim Anlegen gesetzt. */
+  if(created || !img_getfield_int(ctx->l, idx, "value", &want))
+    return 0;
+
+  result = img_access(ctx, cur->acl, 'v');
+  if(result)
+  {
+    if(result > 0)
+      img_error(ctx, "file %d: no read access", fid);
+    return -1;
+  }
+
+  result = mifare_desfire_get_value_ex(tag, fid, &have, cur->comm);
+  if(result < 0)
+    return img_fail(ctx, "GetValue(%d)", fid);
+
+  if(want == have)
+    return 0;
+
+  if(want > have)
+  {
+    if(!img_op(ctx, "Credit(%d, %d)", fid, want - have))
+      return 0;
+
+    result = img_access(ctx, cur->acl, 'x');
+    if(result)
+    {
+      if(result > 0)
+        img_error(ctx, "file %d: no credit access", fid);
+      return -1;
+    }
+
+    result = mifare_desfire_credit_ex(tag, fid, want - have, cur->comm);
+    if(result < 0)
+      return img_fail(ctx, "Credit(%d)", fid);
+  }
+  else
+  {
+    if(!img_op(ctx, "Debit(%d, %d)", fid, have - want))
+      return 0;
+
+    result = mifare_desfire_debit_ex(tag, fid, have - want, cur->comm);
+    if(result < 0)
+      return img_fail(ctx, "Debit(%d)", fid);
+  }
+
+
+  return img_commit(ctx);
+}
+
+
+static int img_restore_rf(struct img_ctx *ctx, int idx, uint8_t fid,
+  const struct img_file *f, const struct img_file *cur, unsigned char created)
+{
+  lua_State *l = ctx->l;
+  int result;
+  uint8_t *want, *have, *rec;
+  unsigned int nwant, reclen, i, start;
+  uint16_t acl;
+  uint8_t comm;
+
+
+  lua_checkstack(l, 2);
+  lua_getfield(l, idx, "records");
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    return 0;
+  }
+
+  if(!lua_istable(l, -1))
+  {
+    lua_pop(l, 1);
+    return img_error(ctx, "file %d: records must be stored inside a table", fid);
+  }
+
+#if LUA_VERSION_NUM > 501
+  nwant = lua_rawlen(l, -1);
+#else
+  nwant = lua_objlen(l, -1);
+#endif
+
+  if(nwant > f->mrec)
+  {
+    lua_pop(l, 1);
+    return img_error(ctx, "file %d: too many records", fid);
+  }
+
+  want = (uint8_t*)calloc(nwant + 1, f->recsize);
+  have = (uint8_t*)calloc(f->mrec + 1, f->recsize);
+  if(want == NULL || have == NULL)
+  {
+    free(want);
+    free(have);
+    lua_pop(l, 1);
+    return img_error(ctx, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+  }
+
+  for(i = 0; i < nwant; i++)
+  {
+    lua_rawgeti(l, -1, i + 1);
+    result = buffer_get(l, -1, &rec, &reclen);
+    if(result)
+    {
+      img_error(ctx, "file %d: record %d: %s", fid, i + 1, lua_tostring(l, -1));
+      lua_pop(l, 3);
+      goto fail;
+    }
+    lua_pop(l, 1);
+
+    if(reclen > f->recsize)
+    {
+      free(rec);
+      lua_pop(l, 1);
+      img_error(ctx, "file %d: record %d exceeds record size", fid, i + 1);
+      goto fail;
+    }
+
+    memcpy(want + i * f->recsize, rec, reclen);
+    free(rec);
+  }
+  lua_pop(l, 1);
+
+  acl  = created ? f->acl  : cur->acl;
+  comm = created ? f->comm : cur->comm;
+
+
+  /*
+   * Beginnt das Abbild mit den bereits vorhandenen Datensätzen, hängen wir
+   * nur die fehlenden an. Andernfalls wird die Datei geleert und
+   * vollständig neu geschrieben.
+   */
+  start = 0;
+  if(!created && cur->crec > 0)
+  {
+    result = img_access(ctx, acl, 'r');
+    if(result < 0)
+      goto fail;
+
+    if(result == 0 && cur->crec <= nwant)
+    {
+      result = mifare_desfire_read_records_ex(tag, fid, 0, cur->crec, have, comm);
+      if(result < 0)
+      {
+        img_fail(ctx, "ReadRecords(%d)", fid);
+        goto fail;
+      }
+
+      if(!memcmp(have, want, cur->crec * f->recsize))
+        start = cur->crec;
+    }
+
+    if(start == 0)
+    {
+      if(img_op(ctx, "ClearRecordFile(%d)", fid))
+      {
+        result = img_access(ctx, acl, 'x');
+        if(result)
+        {
+          if(result > 0)
+            img_error(ctx, "file %d: no clear access", fid);
+          goto fail;
+        }
+
+        if(mifare_desfire_clear_record_file(tag, fid) < 0)
+        {
+          img_fail(ctx, "ClearRecordFile(%d)", fid);
+          goto fail;
+        }
+      }
+
+      if(img_commit(ctx))
+        goto fail;
+    }
+  }
+
+  for(i = start; i < nwant; i++)
+  {
+    if(img_op(ctx, "WriteRecord(%d, #%d)", fid, i + 1))
+    {
+      result = img_access(ctx, acl, 'w');
+      if(result)
+      {
+        if(result > 0)
+          img_error(ctx, "file %d: no write access", fid);
+        goto fail;
+      }
+
+      result = mifare_desfire_write_record_ex(tag, fid, 0, f->recsize,
+        want + i * f->recsize, comm);
+      if(result < 0)
+      {
+        img_fail(ctx, "WriteRecord(%d)", fid);
+        goto fail;
+      }
+    }
+
+    if(img_commit(ctx))
+      goto fail;
+  }
+
+  free(want);
+  free(have);
+
+
+  return 0;
+
+
+fail:
+  free(want);
+  free(have);
+  return -1;
+}
+
+
+static int img_restore_app(struct img_ctx *ctx, uint32_t aid, int idx, unsigned char exists)
+{
+  lua_State *l = ctx->l;
+  int result;
+  int32_t val;
+  uint8_t settings, nkeys, cursettings, curnkeys;
+  enum keytype_e keytype;
+  unsigned char recreate;
+  int filesidx;
+  uint8_t *fids;
+  size_t nfids, i;
+  int32_t isofid;
+  uint8_t *dfname;
+  unsigned int dfnamelen;
+  struct img_file f, cur[IMG_MAXFILES];
+  unsigned char oncard[IMG_MAXFILES], created[IMG_MAXFILES];
+  int top;
+
+
+  if(!lua_istable(l, idx))
+    return img_error(ctx, "application 0x%06x: table expected", aid);
+
+  top = lua_gettop(l);
+  lua_checkstack(l, 3);
+
+
+  /* Einstellungen der Applikation aus dem Abbild lesen. */
+  settings = img_getfield_int(l, idx, "settings", &val) ? val : 0x0f;
+  if(!img_getfield_int(l, idx, "nkeys", &val))
+    return img_error(ctx, "application 0x%06x: number of keys expected", aid);
+  nkeys = val;
+
+  keytype = _DES_;
+  lua_getfield(l, idx, "keytype");
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    img_pushkey(ctx, aid, 0);
+    if(lua_istable(l, -1))
+      lua_getfield(l, -1, "t");
+    else
+      lua_pushnil(l);
+    lua_remove(l, -2);
+  }
+  if(!lua_isnil(l, -1))
+  {
+    result = key_gettype(l, -1, &keytype, NULL);
+    if(result)
+    {
+      img_error(ctx, "application 0x%06x: keytype: %s", aid, lua_tostring(l, -1));
+      lua_settop(l, top);
+      return -1;
+    }
+  }
+  lua_pop(l, 1);
+
+
+  /*
+   * Anzahl und Typ der Schlüssel lassen sich nicht nachträglich ändern.
+   * Weicht die Anzahl ab, muss die Applikation neu angelegt werden.
+   */
+  recreate = 0;
+  cursettings = settings;
+  ctx->newapp = 0;
+
+  if(exists)
+  {
+    result = img_select(ctx, aid);
+    if(result)
+      return -1;
+
+    result = img_keysettings(ctx, &cursettings, &curnkeys);
+    if(result)
+      return -1;
+
+    recreate = curnkeys != nkeys;
+  }
+
+  if(!exists || recreate)
+  {
+    result = img_select(ctx, 0);
+    if(result)
+      return -1;
+
+    if(img_getkey(ctx, 0, NULL) == 0)
+    {
+      result = img_auth(ctx, 0);
+      if(result)
+        return -1;
+    }
+
+    ctx->aid = aid;
+
+    if(recreate && img_op(ctx, "DeleteApplication()"))
+    {
+      MifareDESFireAID app;
+
+      app = mifare_desfire_aid_new(aid);
+      result = mifare_desfire_delete_application(tag, app);
+      free(app);
+      if(result < 0)
+        return img_fail(ctx, "DeleteApplication(0x%06x)", aid);
+      session_deleted(aid);
+    }
+
+    /*
+     * Die Applikation wird zunächst mit offenen Einstellungen angelegt.
+     * Die Einstellungen aus dem Abbild setzen wir erst ganz am Ende.
+     */
+    if(img_op(ctx, "CreateApplication(0x0f, %d)", nkeys))
+    {
+      MifareDESFireAID app;
+      uint8_t maxkeys;
+
+      maxkeys = nkeys;
+      switch(keytype)
+      {
+      case _DES_:                                          break;
+      case _3DES_:                                         break;
+      case _3K3DES_: maxkeys |= APPLICATION_CRYPTO_3K3DES; break;
+      case _AES_:    maxkeys |= APPLICATION_CRYPTO_AES;    break;
+      }
+
+      /* ISO-Parameter werden nur beim Anlegen übernommen. */
+      dfname    = NULL;
+      dfnamelen = 0;
+      lua_getfield(l, idx, "dfname");
+      if(!lua_isnil(l, -1) && (buffer_get(l, -1, &dfname, &dfnamelen) || dfnamelen > 16))
+      {
+        free(dfname);
+        img_error(ctx, "application 0x%06x: invalid DF name", aid);
+        lua_settop(l, top);
+        return -1;
+      }
+      lua_pop(l, 1);
+
+      app = mifare_desfire_aid_new(aid);
+      if(img_getfield_int(l, idx, "isofid", &isofid))
+        result = mifare_desfire_create_application_iso(tag, app, 0x0f, maxkeys, 0, isofid, dfname, dfnamelen);
+      else
+        result = mifare_desfire_create_application(tag, app, 0x0f, maxkeys);
+      free(app);
+      free(dfname);
+      if(result < 0)
+        return img_fail(ctx, "CreateApplication(0x%06x)", aid);
+
+      result = img_select(ctx, aid);
+      if(result)
+        return -1;
+    }
+
+    ctx->newapp = 1;
+    ctx->keytype = keytype;
+    cursettings = 0x0f;
+  }
+
+
+  /* Dateien abgleichen. */
+  memset(oncard,  0, sizeof(oncard));
+  memset(created, 0, sizeof(created));
+
+  if(!ctx->newapp)
+  {
+    result = img_fileids(ctx, &fids, &nfids);
+    if(result)
+      return -1;
+
+    for(i = 0; i < nfids; i++)
+    {
+      if(fids[i] >= IMG_MAXFILES)
+        continue;
+
+      result = img_filesettings(ctx, fids[i], &cur[fids[i]]);
+      if(result)
+      {
+        free(fids);
+        return -1;
+      }
+      oncard[fids[i]] = 1;
+    }
+    free(fids);
+  }
+
+  lua_getfield(l, idx, "files");
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    lua_newtable(l);
+  }
+  filesidx = lua_gettop(l);
+
+  if(!lua_istable(l, filesidx))
+  {
+    lua_settop(l, top);
+    return img_error(ctx, "application 0x%06x: files must be stored inside a table", aid);
+  }
+
+
+  /* Überzählige und inkompatible Dateien löschen, fehlende anlegen. */
+  for(i = 0; i < IMG_MAXFILES; i++)
+  {
+    lua_rawgeti(l, filesidx, i);
+
+    if(lua_isnil(l, -1))
+    {
+      lua_pop(l, 1);
+
+      if(!oncard[i])
+        continue;
+
+      if(img_op(ctx, "DeleteFile(%d)", i))
+      {
+        if(!(cursettings & 0x04) && img_auth(ctx, 0))
+          goto fail;
+
+        if(mifare_desfire_delete_file(tag, i) < 0)
+        {
+          img_fail(ctx, "DeleteFile(%d)", i);
+          goto fail;
+        }
+      }
+
+      oncard[i] = 0;
+      continue;
+    }
+
+    result = img_parse_file(ctx, lua_gettop(l), i, &f);
+    lua_pop(l, 1);
+    if(result)
+      goto fail;
+
+    if(oncard[i] && img_same_layout(&f, &cur[i]))
+      continue;
+
+    if(!(cursettings & 0x04) && !(ctx->dryrun && ctx->newapp) && img_auth(ctx, 0))
+      goto fail;
+
+    if(oncard[i] && img_op(ctx, "DeleteFile(%d)", i))
+    {
+      if(mifare_desfire_delete_file(tag, i) < 0)
+      {
+        img_fail(ctx, "DeleteFile(%d)", i);
+        goto fail;
+      }
+    }
+
+    result = img_create_file(ctx, i, &f);
+    if(result)
+      goto fail;
+
+    oncard[i] = 0;
+    created[i] = 1;
+  }
+
+
+  /* Inhalte abgleichen. */
+  for(i = 0; i < IMG_MAXFILES; i++)
+  {
+    lua_rawgeti(l, filesidx, i);
+    if(lua_isnil(l, -1))
+    {
+      lua_pop(l, 1);
+      continue;
+    }
+
+    result = img_parse_file(ctx, lua_gettop(l), i, &f);
+    if(result)
+      goto fail;
+
+    /* Im Probelauf können wir neu anzulegende Dateien nicht lesen. */
+    switch(f.type)
+    {
+    case MDFT_STANDARD_DATA_FILE:
+    case MDFT_BACKUP_DATA_FILE:
+      result = img_restore_df(ctx, lua_gettop(l), i, &f, &cur[i], created[i]);
+      break;
+
+    case MDFT_VALUE_FILE_WITH_BACKUP:
+      result = img_restore_vf(ctx, lua_gettop(l), i, &cur[i], created[i]);
+      break;
+
+    case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+      if(created[i])
+        cur[i].crec = 0;
+      result = img_restore_rf(ctx, lua_gettop(l), i, &f, &cur[i], created[i]);
+      break;
+    }
+    lua_pop(l, 1);
+
+    if(result)
+      goto fail;
+  }
+
+
+  /*
+   * Zugriffsrechte erst nach dem Schreiben der Inhalte anpassen, damit wir
+   * uns nicht selbst aussperren.
+   */
+  for(i = 0; i < IMG_MAXFILES; i++)
+  {
+    if(!oncard[i])
+      continue;
+
+    lua_rawgeti(l, filesidx, i);
+    result = img_parse_file(ctx, lua_gettop(l), i, &f);
+    lua_pop(l, 1);
+    if(result)
+      goto fail;
+
+    if(f.comm == cur[i].comm && f.acl == cur[i].acl)
+      continue;
+
+    if(!img_op(ctx, "ChangeFileSettings(%d)", i))
+      continue;
+
+    result = img_access(ctx, cur[i].acl, 'c');
+    if(result)
+    {
+      if(result > 0)
+        img_error(ctx, "file %d: no change access", i);
+      goto fail;
+    }
+
+    if(mifare_desfire_change_file_settings(tag, i, f.comm, f.acl) < 0)
+    {
+      img_fail(ctx, "ChangeFileSettings(%d)", i);
+      goto fail;
+    }
+  }
+
+  lua_settop(l, top);
+
+
+  /* Zum Schluss die Schlüsseleinstellungen setzen. */
+  if(settings != cursettings && img_op(ctx, "ChangeKeySettings(0x%02x)", settings))
+  {
+    if(img_auth(ctx, 0))
+      return -1;
+
+    if(mifare_desfire_change_key_settings(tag, settings) < 0)
+      return img_fail(ctx, "ChangeKeySettings()");
+  }
+
+  ctx->newapp = 0;
+
+
+  return 0;
+
+
+fail:
+  lua_settop(l, top);
+  ctx->newapp = 0;
+  return -1;
+}
+
+
+
+
+FN_ALIAS(img_restore) = { "restore", NULL };
+FN_PARAM(img_restore) =
+{
+  FNPARAM("image",  "Card Image",            0),
+  FNPARAM("keys",   "Table of Keys per AID", 1),
+  FNPARAM("dryrun", "Only show operations",  1),
+  FNPARAMEND
+};
+FN_RET(img_restore) =
+{
+  FNPARAM("code", "Return Code",          0),
+  FNPARAM("err",  "Error String",         0),
+  FNPARAM("nops", "Number of Operations", 1),
+  FNPARAMEND
+};
+FN("img", img_restore, "Restore Card Image",
+"Compares the card image <image> with the current card and issues only the\n" \
+"operations required to make the card match the image. Applications and\n" \
+"files missing in the image are deleted, missing ones are created. Changed\n" \
+"data ranges are coalesced into as few WriteData commands as possible.\n" \
+"Record files are only appended to, if the existing records match the\n" \
+"image. Applications which have to be created use default keys. Keys are\n" \
+"never changed. <keys> has the same format as for img.dump(). When <dryrun>\n" \
+"is true, the operations are only printed. <nops> is the number of\n" \
+"modifying operations.\n");
+
+
+static int img_restore(lua_State *l)
+{
+  int result;
+  struct img_ctx ctx;
+  MifareDESFireAID *apps;
+  size_t napps, i;
+  uint32_t *aids;
+  int imgidx, appsidx;
+  int32_t val;
+  uint8_t settings, nkeys;
+
+
+  luaL_argcheck(l, lua_istable(l, 1), 1, "card image expected");
+  luaL_argcheck(l, lua_gettop(l) < 2 || lua_isnil(l, 2) || lua_istable(l, 2), 2,
+    "keys must be stored inside a table");
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.l       = l;
+  ctx.keys    = lua_istable(l, 2) ? 2 : 0;
+  ctx.dryrun  = lua_toboolean(l, 3);
+  ctx.authkno = -1;
+
+  async_sync();
+  wback_flush();
+  rcache_clear();
+
+  lua_settop(l, 3);
+  lua_checkstack(l, 4);
+  imgidx = 1;
+
+  lua_getfield(l, imgidx, "apps");
+  if(lua_isnil(l, -1))
+  {
+    lua_pop(l, 1);
+    lua_newtable(l);
+  }
+  luaL_argcheck(l, lua_istable(l, -1), 1, "applications must be stored inside a table");
+  appsidx = lua_gettop(l);
+
+
+  /* PICC-Ebene */
+  result = img_select(&ctx, 0);
+  if(result)
+    goto fail;
+
+  if(img_getkey(&ctx, 0, NULL) == 0)
+  {
+    result = img_auth(&ctx, 0);
+    if(result)
+      goto fail;
+  }
+
+  result = mifare_desfire_get_application_ids(tag, &apps, &napps);
+  if(result < 0)
+  {
+    img_fail(&ctx, "GetApplicationIDs()");
+    goto fail;
+  }
+
+  aids = (uint32_t*)malloc((napps + 1) * sizeof(uint32_t));
+  if(aids == NULL)
+  {
+    mifare_desfire_free_application_ids(apps);
+    img_error(&ctx, "internal error (%s:%d): out of memory", __FILE__, __LINE__);
+    goto fail;
+  }
+
+  for(i = 0; i < napps; i++)
+    aids[i] = mifare_desfire_aid_get_aid(apps[i]);
+  mifare_desfire_free_application_ids(apps);
+
+
+  /* Applikationen löschen, die nicht im Abbild enthalten sind. */
+  for(i = 0; i < napps; i++)
+  {
+    MifareDESFireAID app;
+    unsigned char keep;
+
+    lua_pushinteger(l, aids[i]);
+    lua_gettable(l, appsidx);
+    keep = !lua_isnil(l, -1);
+    lua_pop(l, 1);
+
+    if(keep)
+      continue;
+
+    ctx.aid = aids[i];
+    keep = !img_op(&ctx, "DeleteApplication()");
+    ctx.aid = 0;
+    if(keep)
+      continue;
+
+    /* Gelöscht wird mit dem Hauptschlüssel der PICC. */
+    if(ctx.authkno != 0 && img_getkey(&ctx, 0, NULL) == 0)
+    {
+      if(img_auth(&ctx, 0))
+      {
+        free(aids);
+        goto fail;
+      }
+    }
+
+    app = mifare_desfire_aid_new(aids[i]);
+    result = mifare_desfire_delete_application(tag, app);
+    free(app);
+    if(result < 0)
+    {
+      img_fail(&ctx, "DeleteApplication(0x%06x)", aids[i]);
+      free(aids);
+      goto fail;
+    }
+    session_deleted(aids[i]);
+  }
+
+
+  /* Applikationen des Abbilds abgleichen. */
+  lua_pushnil(l);
+  while(lua_next(l, appsidx) != 0)
+  {
+    uint32_t aid;
+    unsigned char exists;
+
+    if(!lua_isnumber(l, -2))
+    {
+      lua_pop(l, 2);
+      free(aids);
+      img_error(&ctx, "application IDs must be numbers");
+      goto fail;
+    }
+
+    aid = lua_tointeger(l, -2);
+    exists = 0;
+    for(i = 0; i < napps; i++)
+      if(aids[i] == aid)
+        exists = 1;
+
+    result = img_restore_app(&ctx, aid, lua_gettop(l), exists);
+    lua_pop(l, 1);
+    if(result)
+    {
+      lua_pop(l, 1);
+      free(aids);
+      goto fail;
+    }
+  }
+  free(aids);
+
+
+  /* PICC-Einstellungen */
+  result = img_select(&ctx, 0);
+  if(result)
+    goto fail;
+
+  lua_getfield(l, imgidx, "picc");
+  if(lua_istable(l, -1) && img_getfield_int(l, lua_gettop(l), "settings", &val))
+  {
+    result = img_keysettings(&ctx, &settings, &nkeys);
+    if(result)
+      goto fail;
+
+    if(settings != (uint8_t)val && img_op(&ctx, "ChangeKeySettings(0x%02x)", (uint8_t)val))
+    {
+      if(img_auth(&ctx, 0))
+        goto fail;
+
+      if(mifare_desfire_change_key_settings(tag, val) < 0)
+      {
+        img_fail(&ctx, "ChangeKeySettings()");
+        goto fail;
+      }
+    }
+  }
+
+  img_select(&ctx, 0);
+
+  lua_settop(l, 0);
+  lua_pushinteger(l, 0);
+  lua_pushstring(l, "OK");
+  lua_pushinteger(l, ctx.nops);
+
+
+  return 3;
+
+
+fail:
+  lua_settop(l, 0);
+  lua_pushinteger(l, ctx.err);
+  lua_pushstring(l, ctx.errstr);
+  return 2;
+}
+
+
+
+
+/*
+ * Abbilder speichern und laden
+ *
+ * Ein Abbild wird als Lua-Quelltext gespeichert, der die Abbild-Tabelle
+ * zurückgibt.
+ */
+
+static void img_save_string(FILE *f, const char *str, size_t len)
+{
+  size_t i;
+
+
+  fputc('"', f);
+  for(i = 0; i < len; i++)
+  {
+    unsigned char c = str[i];
+
+    switch(c)
+    {
+    case '"':  fputs("\\\"", f); break;
+    case '\\': fputs("\\\\", f); break;
+    case '\n': fputs("\\n",  f); break;
+    default:
+      if(c < 0x20 || c >= 0x7f)
+        fprintf(f, "\\%03d", c);
+      else
+        fputc(c, f);
+      break;
+    }
+  }
+  fputc('"', f);
+}
+
+
+static int img_save_value(lua_State *l, FILE *f, int idx, unsigned int depth)
+{
+  size_t len;
+  const char *str;
+
+
+  if(idx < 0)
+    idx = lua_gettop(l) + 1 + idx;
+
+  switch(lua_type(l, idx))
+  {
+  case LUA_TNIL:
+    fputs("nil", f);
+    break;
+
+  case LUA_TBOOLEAN:
+    fputs(lua_toboolean(l, idx) ? "true" : "false", f);
+    break;
+
+  case LUA_TNUMBER:
+    lua_checkstack(l, 1);
+    lua_pushvalue(l, idx);
+    fputs(lua_tostring(l, -1), f);
+    lua_pop(l, 1);
+    break;
+
+  case LUA_TSTRING:
+    str = lua_tolstring(l, idx, &len);
+    img_save_string(f, str, len);
+    break;
+
+  case LUA_TTABLE:
+    if(depth >= IMG_MAXDEPTH)
+    {
+      lua_checkstack(l, 1);
+      lua_pushstring(l, "image nested too deeply");
+      return -1;
+    }
+
+    fprintf(f, "{\n");
+    lua_checkstack(l, 2);
+    lua_pushnil(l);
+    while(lua_next(l, idx) != 0)
+    {
+      fprintf(f, "%*s[", 2 * (depth + 1), "");
+      if(img_save_value(l, f, -2, depth + 1))
+      {
+        lua_remove(l, -2);
+        lua_remove(l, -2);
+        return -1;
+      }
+      fprintf(f, "] = ");
+      if(img_save_value(l, f, -1, depth + 1))
+      {
+        lua_remove(l, -2);
+        lua_remove(l, -2);
+        return -1;
+      }
+      fprintf(f, ",\n");
+      lua_pop(l, 1);
+    }
+    fprintf(f, "%*s}", 2 * depth, "");
+    break;
+
+  default:
+    lua_checkstack(l, 1);
+    lua_pushfstring(l, "cannot save value of type %s", lua_typename(l, lua_type(l, idx)));
+    return -1;
+  }
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(img_save) = { "save", NULL };
+FN_PARAM(img_save) =
+{
+  FNPARAM("image", "Card Image", 0),
+  FNPARAM("file",  "File Name",  0),
+  FNPARAMEND
+};
+FN_RET(img_save) =
+{
+  FNPARAMEND
+};
+FN("img", img_save, "Save Card Image",
+"Writes the card image <image> to <file>. The file contains Lua code which\n" \
+"returns the image and can be read back via img.load().\n");
+
+
+static int img_save(lua_State *l)
+{
+  int result;
+  const char *filename;
+  FILE *f;
+
+
+  luaL_argcheck(l, lua_istable(l, 1), 1, "card image expected");
+  luaL_argcheck(l, lua_isstring(l, 2), 2, "file name expected");
+
+  filename = lua_tostring(l, 2);
+  f = fopen(filename, "w");
+  if(f == NULL)
+    return luaL_error(l, "cannot open '%s' for writing", filename);
+
+  fprintf(f, "return ");
+  result = img_save_value(l, f, 1, 0);
+  fprintf(f, "\n");
+
+  if(result)
+  {
+    fclose(f);
+    return luaL_error(l, "%s", lua_tostring(l, -1));
+  }
+
+  /* Schreibfehler zeigen sich ggf. erst beim Schließen der Datei. */
+  result = ferror(f);
+  if(fclose(f) != 0 || result)
+    return luaL_error(l, "cannot write '%s': %s", filename, strerror(errno));
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(img_load) = { "load", NULL };
+FN_PARAM(img_load) =
+{
+  FNPARAM("file", "File Name", 0),
+  FNPARAMEND
+};
+FN_RET(img_load) =
+{
+  FNPARAM("image", "Card Image", 0),
+  FNPARAMEND
+};
+FN("img", img_load, "Load Card Image",
+"Reads a card image previously written by img.save(). The file is evaluated\n" \
+"in an empty environment without access to any global functions.\n");
+
+
+static int img_load(lua_State *l)
+{
+  const char *filename;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "file name expected");
+
+  filename = lua_tostring(l, 1);
+  lua_settop(l, 1);
+
+  if(luaL_loadfile(l, filename))
+    return luaL_error(l, "%s", lua_tostring(l, -1));
+
+  /*
+   * Das Abbild enthält nur Daten. Damit eine fremde Datei keinen Zugriff
+   * auf Bibliotheken und Karte erhält, läuft sie in einer leeren Umgebung.
+   */
+  lua_newtable(l);
+#if LUA_VERSION_NUM > 501
+  lua_setupvalue(l, -2, 1);
+#else
+  lua_setfenv(l, -2);
+#endif
+
+  lua_call(l, 0, 1);
+
+  if(!lua_istable(l, -1))
+    return luaL_error(l, "'%s' does not contain a card image", filename);
+
+
+  return 1;
+}
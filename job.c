@@ -0,0 +1,808 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "job.h"
+
+
+/*
+ * Auftragsdateien
+ *
+ * Die Eingabedatei enthält einen Datensatz je Zeile, entweder als CSV mit
+ * Kopfzeile oder als JSON-Objekt (JSONL). Die Datei wird zeilenweise
+ * gelesen. Enthalten die Datensätze ein Feld "uid", wird jeder Karte der
+ * Datensatz mit ihrer UID zugeordnet. Dazu halten wir höchstens
+ * JOB_WINDOW noch nicht zugeordnete Datensätze vor. Ohne UID-Feld werden
+ * die Datensätze der Reihe nach vergeben.
+ */
+#define JOB_WINDOW	256
+
+
+struct job_field
+{
+  char *key;
+  char *val;
+  char type;
+};
+
+struct job_rec
+{
+  unsigned long lineno;
+  unsigned int nfields;
+  struct job_field *fields;
+  const char *uid;
+};
+
+struct job_s
+{
+  FILE *in;
+  FILE *out;
+  unsigned char jsonl;
+  unsigned long lineno;
+
+  unsigned int ncols;
+  char **cols;
+
+  unsigned int nqueue;
+  struct job_rec *queue[JOB_WINDOW];
+
+  struct job_rec *cur;
+};
+
+static struct job_s job =
+{
+  .in  = NULL,
+  .out = NULL,
+  .cur = NULL,
+};
+
+
+
+static void job_free_rec(struct job_rec *rec)
+{
+  unsigned int i;
+
+
+  if(rec == NULL)
+    return;
+
+  for(i = 0; i < rec->nfields; i++)
+  {
+    free(rec->fields[i].key);
+    free(rec->fields[i].val);
+  }
+  free(rec->fields);
+  free(rec);
+}
+
+
+static int job_add_field(struct job_rec *rec, const char *key, size_t keylen, const char *val, size_t vallen, char type)
+{
+  struct job_field *fields, *f;
+
+
+  fields = (struct job_field*)realloc(rec->fields, (rec->nfields + 1) * sizeof(struct job_field));
+  if(fields == NULL)
+    return -1;
+  rec->fields = fields;
+
+  f = &fields[rec->nfields];
+  f->key  = strndup(key, keylen);
+  f->val  = strndup(val, vallen);
+  f->type = type;
+  if(f->key == NULL || f->val == NULL)
+  {
+    free(f->key);
+    free(f->val);
+    return -1;
+  }
+
+  rec->nfields++;
+
+  if(!strcasecmp(f->key, "uid"))
+    rec->uid = f->val;
+
+
+  return 0;
+}
+
+
+
+
+/*
+ * CSV
+ *
+ * Felder werden durch Kommata getrennt und dürfen in Anführungszeichen
+ * stehen. Doppelte Anführungszeichen innerhalb eines Feldes stehen für ein
+ * einzelnes. Felder über mehrere Zeilen werden nicht unterstützt.
+ */
+
+static const char *job_csv_field(const char *pos, char *buf, size_t *len)
+{
+  *len = 0;
+
+  if(*pos == '"')
+  {
+    pos++;
+    while(*pos != '\0')
+    {
+      if(*pos == '"')
+      {
+        if(pos[1] != '"')
+        {
+          pos++;
+          break;
+        }
+        pos++;
+      }
+      buf[(*len)++] = *pos++;
+    }
+  }
+
+  while(*pos != '\0' && *pos != ',' && *pos != '\r' && *pos != '\n')
+    buf[(*len)++] = *pos++;
+
+  buf[*len] = '\0';
+
+
+  return pos;
+}
+
+
+static int job_csv_header(const char *line)
+{
+  const char *pos;
+  char *buf, **cols;
+  size_t len;
+
+
+  buf = (char*)malloc(strlen(line) + 1);
+  if(buf == NULL)
+    return -1;
+
+  pos = line;
+  while(1)
+  {
+    pos = job_csv_field(pos, buf, &len);
+
+    cols = (char**)realloc(job.cols, (job.ncols + 1) * sizeof(char*));
+    if(cols == NULL)
+      goto fail;
+    job.cols = cols;
+
+    job.cols[job.ncols] = strndup(buf, len);
+    if(job.cols[job.ncols] == NULL)
+      goto fail;
+    job.ncols++;
+
+    if(*pos != ',')
+      break;
+    pos++;
+  }
+
+  free(buf);
+
+
+  return 0;
+
+
+fail:
+  free(buf);
+  return -1;
+}
+
+
+static struct job_rec *job_csv_rec(const char *line)
+{
+  struct job_rec *rec;
+  const char *pos;
+  char *buf;
+  size_t len;
+  unsigned int col;
+
+
+  rec = (struct job_rec*)calloc(1, sizeof(struct job_rec));
+  buf = (char*)malloc(strlen(line) + 1);
+  if(rec == NULL || buf == NULL)
+    goto fail;
+
+  pos = line;
+  for(col = 0; col < job.ncols; col++)
+  {
+    pos = job_csv_field(pos, buf, &len);
+
+    if(job_add_field(rec, job.cols[col], strlen(job.cols[col]), buf, len, 's'))
+      goto fail;
+
+    if(*pos != ',')
+      break;
+    pos++;
+  }
+
+  free(buf);
+
+
+  return rec;
+
+
+fail:
+  free(buf);
+  job_free_rec(rec);
+  return NULL;
+}
+
+
+
+
+/*
+ * JSONL
+ *
+ * Jede Zeile enthält ein flaches JSON-Objekt. Als Werte sind
+ * Zeichenketten, Zahlen, Wahrheitswerte und null erlaubt.
+ */
+
+static const char *job_json_ws(const char *pos)
+{
+  while(*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n')
+    pos++;
+
+  return pos;
+}
+
+
+static const char *job_json_string(const char *pos, char *buf, size_t *len)
+{
+  unsigned int cp;
+
+
+  if(*pos != '"')
+    return NULL;
+  pos++;
+
+  *len = 0;
+  while(*pos != '"')
+  {
+    if(*pos == '\0')
+      return NULL;
+
+    if(*pos != '\\')
+    {
+      buf[(*len)++] = *pos++;
+      continue;
+    }
+
+    pos++;
+    switch(*pos)
+    {
+    case '"':  buf[(*len)++] = '"';  break;
+    case '\\': buf[(*len)++] = '\\'; break;
+    case '/':  buf[(*len)++] = '/';  break;
+    case 'b':  buf[(*len)++] = '\b'; break;
+    case 'f':  buf[(*len)++] = '\f'; break;
+    case 'n':  buf[(*len)++] = '\n'; break;
+    case 'r':  buf[(*len)++] = '\r'; break;
+    case 't':  buf[(*len)++] = '\t'; break;
+
+    case 'u':
+      if(!isxdigit((unsigned char)pos[1]) || !isxdigit((unsigned char)pos[2]) ||
+         !isxdigit((unsigned char)pos[3]) || !isxdigit((unsigned char)pos[4]))
+        return NULL;
+      if(sscanf(pos + 1, "%4x", &cp) != 1)
+        return NULL;
+      pos += 4;
+
+      /* UTF-8 kodieren. Ersatzzeichenpaare werden nicht zusammengefasst. */
+      if(cp < 0x80)
+        buf[(*len)++] = cp;
+      else if(cp < 0x800)
+      {
+        buf[(*len)++] = 0xc0 | (cp >> 6);
+        buf[(*len)++] = 0x80 | (cp & 0x3f);
+      }
+      else
+      {
+        buf[(*len)++] = 0xe0 | (cp >> 12);
+        buf[(*len)++] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[(*len)++] = 0x80 | (cp & 0x3f);
+      }
+      break;
+
+    default:
+      return NULL;
+    }
+    pos++;
+  }
+
+  buf[*len] = '\0';
+
+
+  return pos + 1;
+}
+
+
+/*
+ * Zahlen nach der Grammatik von JSON prüfen. strtod() würde auch
+ * Hexadezimalzahlen, "inf" oder "nan" annehmen und bei ungültigen
+ * Eingaben stillschweigend 0 liefern.
+ */
+static int job_json_number(const char *val, size_t len)
+{
+  const char *pos, *end;
+
+
+  pos = val;
+  end = val + len;
+
+  if(pos < end && *pos == '-')
+    pos++;
+
+  if(pos < end && *pos == '0')
+    pos++;
+  else if(pos < end && *pos >= '1' && *pos <= '9')
+    while(pos < end && isdigit((unsigned char)*pos))
+      pos++;
+  else
+    return 0;
+
+  if(pos < end && *pos == '.')
+  {
+    pos++;
+    if(pos == end || !isdigit((unsigned char)*pos))
+      return 0;
+    while(pos < end && isdigit((unsigned char)*pos))
+      pos++;
+  }
+
+  if(pos < end && (*pos == 'e' || *pos == 'E'))
+  {
+    pos++;
+    if(pos < end && (*pos == '+' || *pos == '-'))
+      pos++;
+    if(pos == end || !isdigit((unsigned char)*pos))
+      return 0;
+    while(pos < end && isdigit((unsigned char)*pos))
+      pos++;
+  }
+
+
+  return pos == end;
+}
+
+
+static struct job_rec *job_json_rec(const char *line)
+{
+  struct job_rec *rec;
+  const char *pos, *val;
+  char *key, *buf;
+  size_t keylen, vallen;
+  char type;
+
+
+  rec = (struct job_rec*)calloc(1, sizeof(struct job_rec));
+  key = (char*)malloc(strlen(line) + 1);
+  buf = (char*)malloc(strlen(line) + 1);
+  if(rec == NULL || key == NULL || buf == NULL)
+    goto fail;
+
+  pos = job_json_ws(line);
+  if(*pos++ != '{')
+    goto fail;
+
+  pos = job_json_ws(pos);
+  if(*pos == '}')
+    goto done;
+
+  while(1)
+  {
+    pos = job_json_ws(pos);
+    pos = job_json_string(pos, key, &keylen);
+    if(pos == NULL)
+      goto fail;
+
+    pos = job_json_ws(pos);
+    if(*pos++ != ':')
+      goto fail;
+    pos = job_json_ws(pos);
+
+    if(*pos == '"')
+    {
+      pos = job_json_string(pos, buf, &vallen);
+      if(pos == NULL)
+        goto fail;
+      val  = buf;
+      type = 's';
+    }
+    else
+    {
+      val = pos;
+      while(*pos != '\0' && *pos != ',' && *pos != '}' &&
+            *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n')
+        pos++;
+      vallen = pos - val;
+
+           if(vallen == 4 && !strncmp(val, "true",  4)) { type = 'b'; }
+      else if(vallen == 5 && !strncmp(val, "false", 5)) { type = 'b'; }
+      else if(vallen == 4 && !strncmp(val, "null",  4)) { type = '0'; }
+      else if(job_json_number(val, vallen))              { type = 'n'; }
+      else
+        goto fail;
+    }
+
+    if(job_add_field(rec, key, keylen, val, vallen, type))
+      goto fail;
+
+    pos = job_json_ws(pos);
+    if(*pos == '}')
+      break;
+    if(*pos++ != ',')
+      goto fail;
+  }
+
+done:
+  free(key);
+  free(buf);
+
+
+  return rec;
+
+
+fail:
+  free(key);
+  free(buf);
+  job_free_rec(rec);
+  return NULL;
+}
+
+
+
+
+/*
+ * Nächsten Datensatz aus der Eingabedatei lesen. Leere Zeilen werden
+ * übersprungen. Am Dateiende ist der Rückgabewert NULL.
+ */
+static struct job_rec *job_read()
+{
+  char *line;
+  size_t size;
+  ssize_t len;
+  struct job_rec *rec;
+
+
+  line = NULL;
+  size = 0;
+
+  while((len = getline(&line, &size, job.in)) >= 0)
+  {
+    job.lineno++;
+
+    if(strspn(line, " \t\r\n") == (size_t)len)
+      continue;
+
+    rec = job.jsonl ? job_json_rec(line) : job_csv_rec(line);
+    if(rec == NULL)
+    {
+      fprintf(stderr, "Job file line %lu invalid, skipped.\n", job.lineno);
+      continue;
+    }
+
+    rec->lineno = job.lineno;
+    free(line);
+    return rec;
+  }
+
+  free(line);
+
+
+  return NULL;
+}
+
+
+static struct job_rec *job_take(unsigned int idx)
+{
+  struct job_rec *rec;
+
+
+  rec = job.queue[idx];
+  memmove(&job.queue[idx], &job.queue[idx + 1], (job.nqueue - idx - 1) * sizeof(struct job_rec*));
+  job.nqueue--;
+
+
+  return rec;
+}
+
+
+static struct job_rec *job_find(const char *uid)
+{
+  struct job_rec *rec;
+  unsigned int i;
+
+
+  /* Bereits gelesene Datensätze durchsuchen. */
+  for(i = 0; i < job.nqueue; i++)
+    if(uid == NULL || job.queue[i]->uid == NULL || !strcasecmp(job.queue[i]->uid, uid))
+      return job_take(i);
+
+  /* Weiterlesen, bis der Datensatz gefunden wurde oder das Fenster voll ist. */
+  while(job.nqueue < JOB_WINDOW && (rec = job_read()) != NULL)
+  {
+    if(uid == NULL || rec->uid == NULL || !strcasecmp(rec->uid, uid))
+      return rec;
+
+    job.queue[job.nqueue++] = rec;
+  }
+
+
+  return NULL;
+}
+
+
+
+
+int job_open(const char *infile, const char *outfile)
+{
+  const char *ext;
+  char *line;
+  size_t size;
+  ssize_t len;
+
+
+  job.in = fopen(infile, "r");
+  if(job.in == NULL)
+  {
+    fprintf(stderr, "Unable to open job file '%s'.\n", infile);
+    return -1;
+  }
+
+  ext = strrchr(infile, '.');
+  job.jsonl = ext != NULL && (!strcasecmp(ext, ".jsonl") || !strcasecmp(ext, ".json"));
+
+  if(outfile != NULL)
+  {
+    job.out = fopen(outfile, "a");
+    if(job.out == NULL)
+    {
+      fprintf(stderr, "Unable to open result file '%s'.\n", outfile);
+      job_close();
+      return -1;
+    }
+  }
+  else
+    job.out = stdout;
+
+  if(job.jsonl)
+    return 0;
+
+  /* Kopfzeile der CSV-Datei lesen. */
+  line = NULL;
+  size = 0;
+  len = getline(&line, &size, job.in);
+  if(len < 0 || job_csv_header(line))
+  {
+    free(line);
+    fprintf(stderr, "Job file '%s' has no valid header.\n", infile);
+    job_close();
+    return -1;
+  }
+  free(line);
+  job.lineno = 1;
+
+
+  return 0;
+}
+
+
+void job_close()
+{
+  unsigned int i;
+
+
+  if(job.in != NULL)
+    fclose(job.in);
+  if(job.out != NULL && job.out != stdout)
+    fclose(job.out);
+
+  for(i = 0; i < job.ncols; i++)
+    free(job.cols[i]);
+  free(job.cols);
+
+  for(i = 0; i < job.nqueue; i++)
+    job_free_rec(job.queue[i]);
+
+  job_free_rec(job.cur);
+
+  memset(&job, 0, sizeof(job));
+}
+
+
+/*
+ * Den Datensatz für die Karte <uid> suchen und als globale Tabelle JOB
+ * bereitstellen. Der Rückgabewert ist 1, wenn kein Datensatz vorliegt.
+ */
+int job_begin(lua_State *l, const char *uid)
+{
+  struct job_rec *rec;
+  unsigned int i;
+
+
+  job_free_rec(job.cur);
+  job.cur = NULL;
+
+  rec = job_find(uid);
+
+  lua_checkstack(l, 2);
+  if(rec == NULL)
+  {
+    lua_pushnil(l);
+    lua_setglobal(l, "JOB");
+    return 1;
+  }
+
+  lua_newtable(l);
+  for(i = 0; i < rec->nfields; i++)
+  {
+    struct job_field *f = &rec->fields[i];
+
+    switch(f->type)
+    {
+    case 'n': lua_pushnumber(l, strtod(f->val, NULL));  break;
+    case 'b': lua_pushboolean(l, !strcmp(f->val, "true")); break;
+    case '0': continue;
+    default:  lua_pushstring(l, f->val);                break;
+    }
+    lua_setfield(l, -2, f->key);
+  }
+  lua_setglobal(l, "JOB");
+
+  lua_pushnil(l);
+  lua_setglobal(l, "RESULT");
+
+  job.cur = rec;
+
+
+  return 0;
+}
+
+
+
+
+/*
+ * Ergebnisprotokoll
+ *
+ * Für jede Karte wird eine Zeile als JSON-Objekt angehängt. Legt das
+ * Skript eine Tabelle RESULT an, werden deren Einträge mit Zeichenketten
+ * als Schlüssel in das Feld "result" übernommen.
+ */
+
+static void job_json_puts(const char *str)
+{
+  fputc('"', job.out);
+  for(; *str != '\0'; str++)
+  {
+    unsigned char c = *str;
+
+    switch(c)
+    {
+    case '"':  fputs("\\\"", job.out); break;
+    case '\\': fputs("\\\\", job.out); break;
+    case '\n': fputs("\\n",  job.out); break;
+    case '\r': fputs("\\r",  job.out); break;
+    case '\t': fputs("\\t",  job.out); break;
+    default:
+      if(c < 0x20)
+        fprintf(job.out, "\\u%04x", c);
+      else
+        fputc(c, job.out);
+      break;
+    }
+  }
+  fputc('"', job.out);
+}
+
+
+static void job_json_result(lua_State *l)
+{
+  unsigned char first;
+
+
+  lua_checkstack(l, 3);
+  lua_getglobal(l, "RESULT");
+  if(!lua_istable(l, -1))
+  {
+    lua_pop(l, 1);
+    return;
+  }
+
+  fprintf(job.out, ", \"result\": {");
+
+  first = 1;
+  lua_pushnil(l);
+  while(lua_next(l, -2) != 0)
+  {
+    if(lua_type(l, -2) != LUA_TSTRING)
+    {
+      lua_pop(l, 1);
+      continue;
+    }
+
+    fprintf(job.out, first ? " " : ", ");
+    job_json_puts(lua_tostring(l, -2));
+    fprintf(job.out, ": ");
+
+    switch(lua_type(l, -1))
+    {
+    case LUA_TBOOLEAN:
+      fprintf(job.out, lua_toboolean(l, -1) ? "true" : "false");
+      break;
+
+    case LUA_TNUMBER:
+      /* NaN und Unendlich gibt es in JSON nicht. */
+      if(isfinite(lua_tonumber(l, -1)))
+        fprintf(job.out, "%.14g", lua_tonumber(l, -1));
+      else
+        fprintf(job.out, "null");
+      break;
+
+    case LUA_TSTRING:
+      job_json_puts(lua_tostring(l, -1));
+      break;
+
+    default:
+      fprintf(job.out, "null");
+      break;
+    }
+
+    first = 0;
+    lua_pop(l, 1);
+  }
+
+  fprintf(job.out, " }");
+  lua_pop(l, 1);
+}
+
+
+void job_end(lua_State *l, const char *uid, const char *status, double elapsed)
+{
+  fprintf(job.out, "{ \"time\": %ld, \"uid\": ", (long)time(NULL));
+  job_json_puts(uid != NULL ? uid : "");
+
+  if(job.cur != NULL)
+    fprintf(job.out, ", \"line\": %lu", job.cur->lineno);
+
+  fprintf(job.out, ", \"status\": ");
+  job_json_puts(status);
+  fprintf(job.out, ", \"elapsed\": %.3f", elapsed);
+
+  if(job.cur != NULL)
+    job_json_result(l);
+
+  fprintf(job.out, " }\n");
+  fflush(job.out);
+
+  job_free_rec(job.cur);
+  job.cur = NULL;
+}
@@ -0,0 +1,508 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "fn.h"
+#include "prof.h"
+
+
+/*
+ * Profiler für Lua-Skripte
+ *
+ * Ein Zähler-Hook nimmt in regelmäßigen Abständen eine Probe des Lua-Stacks
+ * und ordnet ihr die seit der letzten Probe vergangene Zeit zu. Zusätzlich
+ * wird beim Betreten und Verlassen jeder C-Funktion eine Probe genommen, da
+ * der Zähler-Hook innerhalb von C-Funktionen nicht auslöst. So wird die Zeit
+ * in Kartenkommandos und anderen C-Funktionen diesen zugeordnet und nicht
+ * dem aufrufenden Lua-Code. Die über fn_register() registrierten Funktionen
+ * erscheinen unter ihrem Namen in der Shell (z.B. cmd.read).
+ *
+ * Die Stacks werden als "folded stacks" gesammelt: eine Zeile je Stack mit
+ * den durch Semikolon getrennten Funktionen von außen nach innen und der
+ * Zeit in Mikrosekunden. Daraus erzeugen flamegraph.pl oder speedscope
+ * einen Flame Graph.
+ */
+struct prof_stack
+{
+  char stack[PROF_STACKLEN];
+  uint64_t ns;
+  unsigned long samples;
+};
+
+struct prof_s
+{
+  pthread_mutex_t mutex;
+  uint64_t interval;
+  char *autofile;
+  unsigned int nstacks;
+  unsigned long samples;
+  unsigned long dropped;
+  uint64_t total;
+  struct prof_stack stacks[PROF_STACKS];
+};
+
+static struct prof_s prof =
+{
+  .mutex    = PTHREAD_MUTEX_INITIALIZER,
+  .interval = PROF_INTERVAL * 1000,
+  .autofile = NULL,
+  .nstacks  = 0,
+  .samples  = 0,
+  .dropped  = 0,
+  .total    = 0,
+};
+
+/* Zeitpunkt der letzten Probe, jeder Lua-Zustand läuft in einem Thread */
+static __thread uint64_t prof_last = 0;
+
+
+static int prof_start(lua_State *l);
+static int prof_stop(lua_State *l);
+static int prof_save(lua_State *l);
+static int prof_reset(lua_State *l);
+static int prof_stats(lua_State *l);
+
+
+
+
+static uint64_t prof_now()
+{
+  struct timespec ts;
+
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Name einer Funktion auf dem Stack als Element eines gefalteten Stacks */
+static void prof_frame(lua_State *l, lua_Debug *ar, char *buf, size_t size)
+{
+  const struct fn_t *fn;
+  lua_CFunction cfn;
+  char *p;
+
+
+  lua_getinfo(l, "Snf", ar);
+  cfn = lua_tocfunction(l, -1);
+  lua_pop(l, 1);
+
+  fn = NULL;
+  if(cfn != NULL)
+  {
+    /* Registrierte Funktionen wie in help() nachschlagen */
+    lua_getfield(l, LUA_REGISTRYINDEX, "desfsh");
+    if(lua_istable(l, -1))
+    {
+      lua_pushlightuserdata(l, cfn);
+      lua_gettable(l, -2);
+      fn = lua_touserdata(l, -1);
+      lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+  }
+
+  if(fn != NULL && fn->class != NULL)
+    snprintf(buf, size, "%s.%s", fn->class, fn->alias[0]);
+  else if(fn != NULL)
+    snprintf(buf, size, "%s", fn->alias[0]);
+  else if(ar->what[0] == 'C')
+    snprintf(buf, size, "[C] %s", ar->name != NULL ? ar->name : "?");
+  else if(ar->what[0] == 'm')
+    snprintf(buf, size, "main (%s)", ar->short_src);
+  else
+    snprintf(buf, size, "%s (%s:%d)", ar->name != NULL ? ar->name : "?", ar->short_src, ar->linedefined);
+
+  /* Das Semikolon trennt die Funktionen. */
+  for(p = buf; *p != '\0'; p++)
+    if(*p == ';')
+      *p = ':';
+}
+
+
+static struct prof_stack *prof_lookup(const char *stack)
+{
+  struct prof_stack *s;
+  uint32_t h;
+  const char *p;
+  unsigned int i, n;
+
+
+  /* FNV-1a mit linearer Sondierung */
+  h = 2166136261u;
+  for(p = stack; *p != '\0'; p++)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+
+  for(n = 0, i = h % PROF_STACKS; n < PROF_STACKS; n++, i = (i + 1) % PROF_STACKS)
+  {
+    s = &prof.stacks[i];
+    if(s->stack[0] == '\0')
+    {
+      if(prof.nstacks >= PROF_STACKS * 3 / 4)
+        return NULL;
+
+      snprintf(s->stack, sizeof(s->stack), "%s", stack);
+      prof.nstacks++;
+      return s;
+    }
+
+    if(!strcmp(s->stack, stack))
+      return s;
+  }
+
+
+  return NULL;
+}
+
+
+/*
+ * Die seit der letzten Probe vergangene Zeit dem Stack ab <level> zuordnen.
+ * Die Laufzeit des Profilers selbst wird nicht mitgezählt.
+ */
+static void prof_sample(lua_State *l, int level, uint64_t now)
+{
+  struct prof_stack *s;
+  lua_Debug ar;
+  char stack[PROF_STACKLEN], frame[128];
+  int levels[PROF_DEPTH];
+  int n, i;
+  size_t len;
+  uint64_t ns;
+
+
+  ns = prof_last != 0 ? now - prof_last : 0;
+
+  for(n = 0; n < PROF_DEPTH && lua_getstack(l, level + n, &ar); n++)
+    levels[n] = level + n;
+
+  lua_checkstack(l, 3);
+  len = 0;
+  stack[0] = '\0';
+  for(i = n - 1; i >= 0 && len < sizeof(stack) - 1; i--)
+  {
+    lua_getstack(l, levels[i], &ar);
+    prof_frame(l, &ar, frame, sizeof(frame));
+    len += snprintf(stack + len, sizeof(stack) - len, "%s%s", len > 0 ? ";" : "", frame);
+  }
+
+  if(len > 0)
+  {
+    pthread_mutex_lock(&prof.mutex);
+
+    s = prof_lookup(stack);
+    if(s != NULL)
+    {
+      s->ns += ns;
+      s->samples++;
+    }
+    else
+      prof.dropped++;
+
+    prof.samples++;
+    prof.total += ns;
+
+    pthread_mutex_unlock(&prof.mutex);
+  }
+
+  prof_last = prof_now();
+}
+
+
+static void prof_hook(lua_State *l, lua_Debug *ar)
+{
+  uint64_t now;
+
+
+  now = prof_now();
+
+  switch(ar->event)
+  {
+  case LUA_HOOKCOUNT:
+    if(now - prof_last >= prof.interval)
+      prof_sample(l, 0, now);
+    break;
+
+  case LUA_HOOKCALL:
+    /* Die Zeit bis zum Aufruf gehört noch dem Aufrufer. */
+    lua_getinfo(l, "S", ar);
+    if(ar->what[0] == 'C')
+      prof_sample(l, 1, now);
+    break;
+
+  case LUA_HOOKRET:
+    lua_getinfo(l, "S", ar);
+    if(ar->what[0] == 'C')
+      prof_sample(l, 0, now);
+    break;
+  }
+}
+
+
+static void prof_enable(lua_State *l)
+{
+  prof_last = prof_now();
+  lua_sethook(l, prof_hook, LUA_MASKCOUNT | LUA_MASKCALL | LUA_MASKRET, PROF_COUNT);
+}
+
+
+static int prof_write(const char *filename)
+{
+  struct prof_stack *s;
+  unsigned int i;
+  FILE *f;
+  int result;
+
+
+  f = fopen(filename, "w");
+  if(f == NULL)
+    return -1;
+
+  pthread_mutex_lock(&prof.mutex);
+
+  for(i = 0; i < PROF_STACKS; i++)
+  {
+    s = &prof.stacks[i];
+    if(s->stack[0] != '\0' && s->ns >= 1000)
+      fprintf(f, "%s %llu\n", s->stack, (unsigned long long)(s->ns / 1000));
+  }
+
+  pthread_mutex_unlock(&prof.mutex);
+
+  result = ferror(f) ? -1 : 0;
+  if(fclose(f))
+    result = -1;
+
+
+  return result;
+}
+
+
+static void prof_atexit()
+{
+  if(prof.autofile != NULL && prof_write(prof.autofile))
+    fprintf(stderr, "Unable to write profile '%s'.\n", prof.autofile);
+}
+
+
+/*
+ * Mit -P wird jeder Lua-Zustand von Beginn an profiliert und das Ergebnis
+ * beim Programmende geschrieben.
+ */
+void prof_autostart(const char *filename)
+{
+  if(prof.autofile == NULL && filename != NULL)
+    atexit(prof_atexit);
+
+  free(prof.autofile);
+  prof.autofile = filename != NULL ? strdup(filename) : NULL;
+}
+
+
+void prof_attach(lua_State *l)
+{
+  if(prof.autofile != NULL)
+    prof_enable(l);
+}
+
+
+
+
+FN_ALIAS(prof_start) = { "start", NULL };
+FN_PARAM(prof_start) =
+{
+  FNPARAM("interval", "Sampling Interval in Milliseconds (def. 1)", 1),
+  FNPARAMEND
+};
+FN_RET(prof_start) =
+{
+  FNPARAMEND
+};
+FN("prof", prof_start, "Start Profiler",
+"Starts profiling the calling script. Every <interval> milliseconds of Lua\n" \
+"execution and on each entry and exit of a C function the elapsed time is\n" \
+"added to the current call stack. Time spent in C functions like card\n" \
+"commands is attributed to these functions. Already collected stacks are\n" \
+"kept, see prof.reset().\n");
+
+
+static int prof_start(lua_State *l)
+{
+  luaL_argcheck(l, lua_isnoneornil(l, 1) || lua_isnumber(l, 1), 1, "number expected");
+
+  if(lua_isnumber(l, 1))
+  {
+    luaL_argcheck(l, lua_tonumber(l, 1) > 0, 1, "positive interval expected");
+    prof.interval = lua_tonumber(l, 1) * 1e6;
+  }
+
+  lua_settop(l, 0);
+  prof_enable(l);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(prof_stop) = { "stop", NULL };
+FN_PARAM(prof_stop) =
+{
+  FNPARAMEND
+};
+FN_RET(prof_stop) =
+{
+  FNPARAMEND
+};
+FN("prof", prof_stop, "Stop Profiler", NULL);
+
+
+static int prof_stop(lua_State *l)
+{
+  lua_sethook(l, NULL, 0, 0);
+  lua_settop(l, 0);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(prof_save) = { "save", NULL };
+FN_PARAM(prof_save) =
+{
+  FNPARAM("file", "Output File", 0),
+  FNPARAMEND
+};
+FN_RET(prof_save) =
+{
+  FNPARAM("ok", "Success", 0),
+  FNPARAMEND
+};
+FN("prof", prof_save, "Save Profile",
+"Writes the collected stacks in the folded format to <file>. Each line\n" \
+"lists the functions of a stack from the outermost to the innermost,\n" \
+"separated by semicolons, followed by the time in microseconds. The file\n" \
+"is the input of flame graph tools like flamegraph.pl.\n");
+
+
+static int prof_save(lua_State *l)
+{
+  int result;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "file name expected");
+
+  result = prof_write(lua_tostring(l, 1));
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, result == 0);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(prof_reset) = { "reset", NULL };
+FN_PARAM(prof_reset) =
+{
+  FNPARAMEND
+};
+FN_RET(prof_reset) =
+{
+  FNPARAMEND
+};
+FN("prof", prof_reset, "Reset Profile", NULL);
+
+
+static int prof_reset(lua_State *l)
+{
+  pthread_mutex_lock(&prof.mutex);
+  memset(prof.stacks, 0, sizeof(prof.stacks));
+  prof.nstacks = 0;
+  prof.samples = 0;
+  prof.dropped = 0;
+  prof.total   = 0;
+  pthread_mutex_unlock(&prof.mutex);
+
+  lua_settop(l, 0);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(prof_stats) = { "stats", NULL };
+FN_PARAM(prof_stats) =
+{
+  FNPARAMEND
+};
+FN_RET(prof_stats) =
+{
+  FNPARAM("samples", "Number of Samples",          0),
+  FNPARAM("stacks",  "Number of distinct Stacks",  0),
+  FNPARAM("dropped", "Samples of dropped Stacks",  0),
+  FNPARAM("total",   "Profiled Time in Seconds",   0),
+  FNPARAMEND
+};
+FN("prof", prof_stats, "Profiler Statistics",
+"Returns the number of samples, the number of distinct stacks, the number\n" \
+"of samples dropped because the stack table was full and the total time\n" \
+"attributed to stacks.\n");
+
+
+static int prof_stats(lua_State *l)
+{
+  unsigned long samples, stacks, dropped;
+  uint64_t total;
+
+
+  pthread_mutex_lock(&prof.mutex);
+  samples = prof.samples;
+  stacks  = prof.nstacks;
+  dropped = prof.dropped;
+  total   = prof.total;
+  pthread_mutex_unlock(&prof.mutex);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 4);
+  lua_pushinteger(l, samples);
+  lua_pushinteger(l, stacks);
+  lua_pushinteger(l, dropped);
+  lua_pushnumber(l, total / 1e9);
+
+
+  return 4;
+}
@@ -0,0 +1,50 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_PROF_H_
+#define _DESF_PROF_H_
+
+#include <lua.h>
+
+#include "fn.h"
+
+
+/*
+ * Der Zähler-Hook wird alle PROF_COUNT Lua-Instruktionen aufgerufen und
+ * nimmt eine Probe, wenn seit der letzten Probe mindestens das Intervall
+ * (Vorgabe PROF_INTERVAL in Mikrosekunden) vergangen ist.
+ */
+#define PROF_COUNT	1000
+#define PROF_INTERVAL	1000
+#define PROF_STACKS	2048
+#define PROF_STACKLEN	512
+#define PROF_DEPTH	64
+
+
+extern void prof_autostart(const char *filename);
+extern void prof_attach(lua_State *l);
+
+extern FNDECL(prof_start);
+extern FNDECL(prof_stop);
+extern FNDECL(prof_save);
+extern FNDECL(prof_reset);
+extern FNDECL(prof_stats);
+
+
+#endif
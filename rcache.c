@@ -0,0 +1,384 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <freefare.h>
+
+#include "debug.h"
+#include "fn.h"
+#include "rcache.h"
+#include "session.h"
+
+
+/*
+ * Lesecache
+ *
+ * Für die Daten- und Backup-Dateien der ausgewählten Applikation merken wir
+ * uns die Dateieinstellungen und alle bereits gelesenen Bytes. Der Inhalt
+ * gilt nur für die Authentifizierung, unter der er gelesen wurde. Nach
+ * SelectApplication derselben Applikation wird er erst nach erneuter
+ * Authentifizierung mit demselben Schlüssel wieder verwendet.
+ *
+ * Verworfen wird der Cache bei einem Wechsel der Applikation oder des
+ * Schlüssels, nach Fehlern, beim Löschen von Applikationen und Dateien,
+ * beim Ändern von Dateieinstellungen und bei Schlüsseländerungen.
+ * Geschriebene Bereiche werden sofort ungültig. CommitTransaction und
+ * AbortTransaction machen den Inhalt aller Backup-Dateien ungültig.
+ */
+struct rcache_file
+{
+  unsigned char hassettings;
+  struct mifare_desfire_file_settings settings;
+  uint32_t size;
+  uint8_t *data;
+  uint8_t *valid;
+};
+
+struct rcache_s
+{
+  unsigned char enabled;
+
+  unsigned char hasaid;
+  uint32_t aid;
+
+  unsigned char hasauth;
+  uint8_t kno;
+  struct session_key key;
+  unsigned char authok;
+
+  struct rcache_file files[RCACHE_FILES];
+
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static __thread struct rcache_s rcache;
+
+static int rcache_mode(lua_State *l);
+
+
+
+
+static void rcache_flushfile(struct rcache_file *f)
+{
+  free(f->data);
+  free(f->valid);
+  f->data  = NULL;
+  f->valid = NULL;
+}
+
+
+static void rcache_flushall()
+{
+  unsigned int i;
+
+
+  for(i = 0; i < RCACHE_FILES; i++)
+  {
+    rcache_flushfile(&rcache.files[i]);
+    rcache.files[i].hassettings = 0;
+  }
+}
+
+
+/*
+ * Liefert den Eintrag einer Datei, wenn der Cache für den aktuellen
+ * Zustand der Karte gültig ist.
+ */
+static struct rcache_file *rcache_file(uint8_t fid)
+{
+  if(!rcache.enabled || !rcache.hasaid || !rcache.authok || fid >= RCACHE_FILES)
+    return NULL;
+
+  return &rcache.files[fid];
+}
+
+
+void rcache_clear()
+{
+  rcache_flushall();
+
+  rcache.hasaid  = 0;
+  rcache.hasauth = 0;
+  rcache.authok  = 0;
+}
+
+
+void rcache_select(uint32_t aid)
+{
+  if(!rcache.hasaid || rcache.aid != aid)
+  {
+    rcache_flushall();
+    rcache.hasaid  = 1;
+    rcache.aid     = aid;
+    rcache.hasauth = 0;
+  }
+
+  /* Die Authentifizierung ist jetzt aufgehoben. */
+  rcache.authok = !rcache.hasauth;
+}
+
+
+void rcache_auth(uint8_t kno, const struct session_key *sk)
+{
+  if(!rcache.hasaid)
+    return;
+
+  if(!rcache.hasauth || rcache.kno != kno || !session_samekey(&rcache.key, sk))
+  {
+    rcache_flushall();
+    rcache.hasauth = 1;
+    rcache.kno     = kno;
+    rcache.key     = *sk;
+  }
+
+  rcache.authok = 1;
+}
+
+
+void rcache_drop(uint8_t fid)
+{
+  if(fid >= RCACHE_FILES)
+    return;
+
+  rcache_flushfile(&rcache.files[fid]);
+  rcache.files[fid].hassettings = 0;
+}
+
+
+void rcache_invalidate(uint8_t fid, uint32_t off, uint32_t len)
+{
+  struct rcache_file *f;
+
+
+  if(fid >= RCACHE_FILES)
+    return;
+
+  f = &rcache.files[fid];
+  if(f->valid == NULL || off >= f->size)
+    return;
+
+  if(len > f->size - off)
+    len = f->size - off;
+
+  memset(f->valid + off, 0, len);
+}
+
+
+void rcache_commit()
+{
+  unsigned int i;
+
+
+  for(i = 0; i < RCACHE_FILES; i++)
+  {
+    struct rcache_file *f = &rcache.files[i];
+
+    if(f->hassettings && f->settings.file_type == MDFT_BACKUP_DATA_FILE)
+      rcache_flushfile(f);
+  }
+}
+
+
+int rcache_getsettings(uint8_t fid, struct mifare_desfire_file_settings *settings)
+{
+  struct rcache_file *f;
+
+
+  f = rcache_file(fid);
+  if(f == NULL || !f->hassettings)
+    return 0;
+
+  *settings = f->settings;
+
+
+  return 1;
+}
+
+
+void rcache_putsettings(uint8_t fid, const struct mifare_desfire_file_settings *settings)
+{
+  struct rcache_file *f;
+
+
+  f = rcache_file(fid);
+  if(f == NULL)
+    return;
+
+  /* Nur bei Datendateien ändern sich die Einstellungen nicht beim Schreiben. */
+  if(settings->file_type != MDFT_STANDARD_DATA_FILE &&
+     settings->file_type != MDFT_BACKUP_DATA_FILE)
+    return;
+
+  rcache_flushfile(f);
+  f->hassettings = 1;
+  f->settings    = *settings;
+  f->size        = settings->settings.standard_file.file_size;
+}
+
+
+/*
+ * Ermittelt den zusammenhängenden Bereich, der die noch nicht gelesenen
+ * Bytes des angefragten Bereichs abdeckt. Kleine Dateien lesen wir dabei
+ * vollständig. Liefert 0, wenn alles im Cache liegt, 1, wenn gelesen werden
+ * muss, und -1, wenn die Datei nicht zwischengespeichert werden kann.
+ */
+int rcache_missing(uint8_t fid, uint32_t off, uint32_t len, uint32_t *moff, uint32_t *mlen)
+{
+  struct rcache_file *f;
+  uint32_t lo, hi, i;
+
+
+  f = rcache_file(fid);
+  if(f == NULL || !f->hassettings || len == 0 || off > f->size || len > f->size - off)
+    return -1;
+
+  if(f->size <= RCACHE_READAHEAD)
+  {
+    off = 0;
+    len = f->size;
+  }
+
+  lo = off + len;
+  hi = off;
+  for(i = off; i < off + len; i++)
+  {
+    if(f->valid != NULL && f->valid[i])
+      continue;
+
+    if(i < lo) lo = i;
+    hi = i + 1;
+  }
+
+  if(lo >= hi)
+  {
+    rcache.hits++;
+    return 0;
+  }
+
+  rcache.misses++;
+  *moff = lo;
+  *mlen = hi - lo;
+
+
+  return 1;
+}
+
+
+void rcache_store(uint8_t fid, uint32_t off, uint32_t len, const uint8_t *data)
+{
+  struct rcache_file *f;
+
+
+  f = rcache_file(fid);
+  if(f == NULL || !f->hassettings || off > f->size || len > f->size - off)
+    return;
+
+  if(f->data == NULL)
+  {
+    f->data  = malloc(f->size);
+    f->valid = calloc(f->size, 1);
+    if(f->data == NULL || f->valid == NULL)
+    {
+      rcache_flushfile(f);
+      return;
+    }
+  }
+
+  memcpy(f->data + off, data, len);
+  memset(f->valid + off, 1, len);
+}
+
+
+int rcache_copy(uint8_t fid, uint32_t off, uint32_t len, uint8_t *data)
+{
+  struct rcache_file *f;
+  uint32_t i;
+
+
+  f = rcache_file(fid);
+  if(f == NULL || f->valid == NULL || off > f->size || len > f->size - off)
+    return -1;
+
+  for(i = off; i < off + len; i++)
+    if(!f->valid[i])
+      return -1;
+
+  memcpy(data, f->data + off, len);
+  debug_info("%u bytes of file %d taken from cache.", len, fid);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(rcache_mode) = { "readcache", NULL };
+FN_PARAM(rcache_mode) =
+{
+  FNPARAM("enable", "Enable Read Cache", 1),
+  FNPARAMEND
+};
+FN_RET(rcache_mode) =
+{
+  FNPARAM("enabled", "Previous State",                    0),
+  FNPARAM("hits",    "Reads Served from Cache",           0),
+  FNPARAM("misses",  "Reads Partially Fetched from Card", 0),
+  FNPARAMEND
+};
+FN("session", rcache_mode, "Set Read Cache Mode",
+"Enables or disables the read cache. When enabled, the settings and the\n" \
+"content of standard and backup data files read via cmd.read() are kept in\n" \
+"memory. Reads of bytes already known are served without a command. Only\n" \
+"the missing range is read from the card, small files are read as a whole.\n" \
+"The cache is bound to the selected application and the key used for\n" \
+"authentication. It is cleared by errors and whenever the application, the\n" \
+"key, the file settings or the files change. Written ranges are invalidated\n" \
+"immediately, backup files on commit and abort. Disabling the cache clears\n" \
+"it. Returns the previous state and the number of reads served from the\n" \
+"cache or requiring a command.\n");
+
+
+static int rcache_mode(lua_State *l)
+{
+  unsigned char enabled;
+
+
+  enabled = rcache.enabled;
+
+  if(lua_gettop(l) >= 1 && !lua_isnil(l, 1))
+  {
+    rcache.enabled = lua_toboolean(l, 1);
+    if(!rcache.enabled)
+      rcache_flushall();
+  }
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 3);
+  lua_pushboolean(l, enabled);
+  lua_pushinteger(l, rcache.hits);
+  lua_pushinteger(l, rcache.misses);
+
+
+  return 3;
+}
@@ -0,0 +1,53 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_RCACHE_H_
+#define _DESF_RCACHE_H_
+
+#include <stdint.h>
+#include <freefare.h>
+
+#include "fn.h"
+#include "session.h"
+
+
+/*
+ * Anzahl der Dateien einer Applikation und größte Datei, die bei einem
+ * Fehlzugriff vollständig gelesen wird.
+ */
+#define RCACHE_FILES		32
+#define RCACHE_READAHEAD	SESSION_FRAMESIZE
+
+
+extern void rcache_clear();
+extern void rcache_select(uint32_t aid);
+extern void rcache_auth(uint8_t kno, const struct session_key *sk);
+extern void rcache_drop(uint8_t fid);
+extern void rcache_invalidate(uint8_t fid, uint32_t off, uint32_t len);
+extern void rcache_commit();
+extern int rcache_getsettings(uint8_t fid, struct mifare_desfire_file_settings *settings);
+extern void rcache_putsettings(uint8_t fid, const struct mifare_desfire_file_settings *settings);
+extern int rcache_missing(uint8_t fid, uint32_t off, uint32_t len, uint32_t *moff, uint32_t *mlen);
+extern void rcache_store(uint8_t fid, uint32_t off, uint32_t len, const uint8_t *data);
+extern int rcache_copy(uint8_t fid, uint32_t off, uint32_t len, uint8_t *data);
+
+extern FNDECL(rcache_mode);
+
+
+#endif
@@ -0,0 +1,520 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <nfc/nfc.h>
+
+#include "fn.h"
+#include "replay.h"
+#include "trace.h"
+
+
+/*
+ * Wiedergabe einer Aufzeichnung
+ *
+ * Statt eines Lesers beantwortet das Wiedergabegerät alle Anfragen aus einer
+ * mit trace.record() bzw. -X aufgezeichneten Datei. Jeder gesendete Rahmen
+ * wird mit den nächsten aufgezeichneten Anfragen verglichen. Stimmt er mit
+ * einer davon überein, liefern wir die dazu aufgezeichnete Antwort bzw. den
+ * Fehler. Dazwischen liegende Anfragen gelten als übersprungen. Findet sich
+ * innerhalb von REPLAY_WINDOW Anfragen keine passende, antwortet die Karte
+ * nicht (NFC_ETIMEOUT).
+ *
+ * Ohne Echtzeitbetrieb werden die Antworten sofort geliefert, sodass nur
+ * die Laufzeit auf dem Rechner gemessen wird. Im Echtzeitbetrieb warten
+ * wir vor jeder Antwort so lange, wie Leser und Karte bei der Aufzeichnung
+ * gebraucht haben. Die Zeit zwischen den Kommandos wird nie nachgestellt,
+ * da sie vom Rechner selbst abhängt.
+ */
+struct replay_ex
+{
+  const uint8_t *tx;
+  uint16_t txlen;
+  uint16_t txstored;
+  uint8_t dir;
+  const uint8_t *rx;
+  uint16_t rxlen;
+  int code;
+  uint64_t dt;
+};
+
+struct replay_rnd
+{
+  const uint8_t *data;
+  uint16_t len;
+};
+
+struct replay_s
+{
+  pthread_mutex_t mutex;
+  char dev;
+  unsigned char loaded;
+  unsigned char realtime;
+  uint8_t *file;
+  struct replay_ex *ex;
+  unsigned long nex;
+  unsigned long cur;
+  struct replay_rnd *rnd;
+  unsigned long nrnd;
+  unsigned long rcur;
+  nfc_target targets[REPLAY_TARGETS];
+  unsigned int ntargets;
+  int error;
+  unsigned long served;
+  unsigned long skipped;
+  unsigned long mismatched;
+  unsigned long rndmissed;
+};
+
+static struct replay_s replay =
+{
+  .mutex    = PTHREAD_MUTEX_INITIALIZER,
+  .loaded   = 0,
+  .realtime = 0,
+  .file     = NULL,
+  .ex       = NULL,
+  .rnd      = NULL,
+  .ntargets = 0,
+  .error    = 0,
+};
+
+
+static int replay_owns(const nfc_device *pnd);
+static int replay_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen);
+static int replay_list(nfc_modulation nm, nfc_target ant[], size_t n);
+static int replay_select(nfc_modulation nm, const uint8_t *uid, size_t uidlen, nfc_target *target);
+static int replay_deselect();
+static int replay_error();
+static const char *replay_strerror();
+
+static int replay_stats(lua_State *l);
+
+
+const struct trace_backend replay_backend =
+{
+  .name       = "Trace Replay",
+  .connstring = "replay",
+  .owns       = replay_owns,
+  .transceive = replay_transceive,
+  .list       = replay_list,
+  .select     = replay_select,
+  .deselect   = replay_deselect,
+  .error      = replay_error,
+  .strerror   = replay_strerror,
+};
+
+
+
+
+static void replay_target(const uint8_t *data, size_t len)
+{
+  nfc_target target;
+  unsigned int i;
+
+
+  if(trace_target_unpack(data, len, &target) || replay.ntargets >= REPLAY_TARGETS)
+    return;
+
+  /* Jeder Tag wird nur einmal in der Reihenfolge seines Auftretens geführt. */
+  for(i = 0; i < replay.ntargets; i++)
+  {
+    const nfc_iso14443a_info *nai = &replay.targets[i].nti.nai;
+
+    if(nai->szUidLen == target.nti.nai.szUidLen &&
+       !memcmp(nai->abtUid, target.nti.nai.abtUid, nai->szUidLen))
+      return;
+  }
+
+  replay.targets[replay.ntargets++] = target;
+}
+
+
+/*
+ * Die Datei wird vollständig eingelesen. Die Anfragen, Antworten und
+ * Zufallszahlen verweisen direkt in den eingelesenen Inhalt.
+ */
+static int replay_parse(size_t size)
+{
+  const uint8_t *tx;
+  uint16_t txlen, txstored;
+  uint64_t txts;
+  size_t pos;
+
+
+  tx = NULL;
+  txlen = txstored = 0;
+  txts = 0;
+
+  for(pos = 8; pos < size; )
+  {
+    const uint8_t *hdr, *data;
+    uint64_t ts;
+    uint16_t len, stored;
+    unsigned int i;
+
+    if(pos + 12 > size)
+      return -1;
+
+    hdr = replay.file + pos;
+    for(ts = 0, i = 0; i < 8; i++)
+      ts |= (uint64_t)hdr[i] << (8 * i);
+    len = hdr[10] | hdr[11] << 8;
+    stored = len > TRACE_MAXFRAME ? TRACE_MAXFRAME : len;
+    data = hdr + 12;
+
+    pos += 12 + stored;
+    if(pos > size)
+      return -1;
+
+    switch(hdr[8])
+    {
+    case TRACE_TX:
+      tx = data;
+      txlen = len;
+      txstored = stored;
+      txts = ts;
+      break;
+
+    case TRACE_RX:
+    case TRACE_ERR:
+      if(tx == NULL || (hdr[8] == TRACE_ERR && stored != 4))
+        break;
+
+      {
+        struct replay_ex *e = &replay.ex[replay.nex++];
+
+        e->tx       = tx;
+        e->txlen    = txlen;
+        e->txstored = txstored;
+        e->dir      = hdr[8];
+        e->rx       = data;
+        e->rxlen    = stored;
+        e->code     = hdr[8] == TRACE_ERR ? (int32_t)(data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24) : 0;
+        e->dt       = ts > txts ? ts - txts : 0;
+      }
+
+      tx = NULL;
+      break;
+
+    case TRACE_TARGET:
+      replay_target(data, stored);
+      break;
+
+    case TRACE_RAND:
+      replay.rnd[replay.nrnd].data = data;
+      replay.rnd[replay.nrnd].len  = len;
+      replay.nrnd++;
+      break;
+    }
+  }
+
+
+  return 0;
+}
+
+
+int replay_open(const char *filename, int realtime)
+{
+  FILE *in;
+  long size;
+  unsigned long nrec;
+
+
+  in = fopen(filename, "rb");
+  if(in == NULL)
+    return -1;
+
+  if(fseek(in, 0, SEEK_END) || (size = ftell(in)) < 8 || fseek(in, 0, SEEK_SET))
+  {
+    fclose(in);
+    return -1;
+  }
+
+  replay.file = malloc(size);
+  if(replay.file == NULL || fread(replay.file, size, 1, in) != 1 ||
+     memcmp(replay.file, TRACE_MAGIC, 8))
+  {
+    fclose(in);
+    goto fail;
+  }
+
+  fclose(in);
+
+  /* Jeder Eintrag belegt mindestens seinen Kopf. */
+  nrec = (size - 8) / 12 + 1;
+  replay.ex  = malloc(nrec * sizeof(struct replay_ex));
+  replay.rnd = malloc(nrec * sizeof(struct replay_rnd));
+  if(replay.ex == NULL || replay.rnd == NULL)
+    goto fail;
+
+  replay.nex = replay.cur = 0;
+  replay.nrnd = replay.rcur = 0;
+  replay.ntargets = 0;
+  if(replay_parse(size))
+    goto fail;
+
+  replay.realtime = realtime;
+  replay.served = replay.skipped = replay.mismatched = replay.rndmissed = 0;
+  replay.loaded = 1;
+
+
+  return 0;
+
+
+fail:
+  free(replay.file);
+  free(replay.ex);
+  free(replay.rnd);
+  replay.file = NULL;
+  replay.ex   = NULL;
+  replay.rnd  = NULL;
+
+
+  return -1;
+}
+
+
+nfc_device *replay_device()
+{
+  return (nfc_device*)&replay.dev;
+}
+
+
+static int replay_owns(const nfc_device *pnd)
+{
+  return replay.loaded && pnd == (const nfc_device*)&replay.dev;
+}
+
+
+
+
+static int replay_transceive(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen)
+{
+  struct replay_ex *e;
+  unsigned long i;
+  struct timespec delay;
+  int result;
+
+
+  pthread_mutex_lock(&replay.mutex);
+
+  for(i = replay.cur; i < replay.nex && i < replay.cur + REPLAY_WINDOW; i++)
+  {
+    e = &replay.ex[i];
+    if(e->txlen == txlen && !memcmp(e->tx, tx, e->txstored))
+      break;
+  }
+
+  if(i >= replay.nex || i >= replay.cur + REPLAY_WINDOW)
+  {
+    replay.mismatched++;
+    replay.error = NFC_ETIMEOUT;
+    pthread_mutex_unlock(&replay.mutex);
+    return NFC_ETIMEOUT;
+  }
+
+  replay.skipped += i - replay.cur;
+  replay.served++;
+  replay.cur = i + 1;
+
+  if(e->dir == TRACE_ERR)
+    result = e->code;
+  else if(e->rxlen > rxlen)
+    result = NFC_EOVFLOW;
+  else
+  {
+    memcpy(rx, e->rx, e->rxlen);
+    result = e->rxlen;
+  }
+
+  replay.error = result < 0 ? result : 0;
+  delay.tv_sec  = e->dt / 1000000000;
+  delay.tv_nsec = e->dt % 1000000000;
+
+  pthread_mutex_unlock(&replay.mutex);
+
+  if(replay.realtime)
+    nanosleep(&delay, NULL);
+
+
+  return result;
+}
+
+
+static int replay_list(nfc_modulation nm, nfc_target ant[], size_t n)
+{
+  unsigned int i;
+
+
+  if(nm.nmt != NMT_ISO14443A)
+    return 0;
+
+  for(i = 0; i < replay.ntargets && i < n; i++)
+    ant[i] = replay.targets[i];
+
+
+  return i;
+}
+
+
+static int replay_select(nfc_modulation nm, const uint8_t *uid, size_t uidlen, nfc_target *target)
+{
+  unsigned int i;
+
+
+  if(nm.nmt != NMT_ISO14443A)
+    return 0;
+
+  for(i = 0; i < replay.ntargets; i++)
+  {
+    const nfc_iso14443a_info *nai = &replay.targets[i].nti.nai;
+
+    if(uid == NULL || (nai->szUidLen == uidlen && !memcmp(nai->abtUid, uid, uidlen)))
+      break;
+  }
+
+  if(i >= replay.ntargets)
+    return 0;
+
+  if(target != NULL)
+  {
+    *target = replay.targets[i];
+    target->nm.nbr = nm.nbr;
+  }
+
+
+  return 1;
+}
+
+
+/*
+ * Zufallszahlen werden in der aufgezeichneten Reihenfolge geliefert. Passt
+ * keine, erzeugt OpenSSL sie wie gewohnt. Die folgenden Rahmen weichen dann
+ * von der Aufzeichnung ab.
+ */
+int replay_rand(unsigned char *buf, int num)
+{
+  unsigned long i;
+
+
+  if(!replay.loaded)
+    return -1;
+
+  pthread_mutex_lock(&replay.mutex);
+
+  for(i = replay.rcur; i < replay.nrnd && i < replay.rcur + REPLAY_WINDOW; i++)
+    if(replay.rnd[i].len == num && num <= TRACE_MAXFRAME)
+      break;
+
+  if(i >= replay.nrnd || i >= replay.rcur + REPLAY_WINDOW)
+  {
+    replay.rndmissed++;
+    pthread_mutex_unlock(&replay.mutex);
+    return -1;
+  }
+
+  memcpy(buf, replay.rnd[i].data, num);
+  replay.rcur = i + 1;
+
+  pthread_mutex_unlock(&replay.mutex);
+
+
+  return 0;
+}
+
+
+static int replay_deselect()
+{
+  return 0;
+}
+
+
+static int replay_error()
+{
+  return replay.error;
+}
+
+
+static const char *replay_strerror()
+{
+  switch(replay.error)
+  {
+  case 0:            return "Success";
+  case NFC_ETIMEOUT: return "No matching frame in trace";
+  case NFC_EOVFLOW:  return "Buffer overflow";
+  default:           return "Recorded error";
+  }
+}
+
+
+
+
+FN_ALIAS(replay_stats) = { "replay", NULL };
+FN_PARAM(replay_stats) =
+{
+  FNPARAMEND
+};
+FN_RET(replay_stats) =
+{
+  FNPARAM("served",     "Number of served Frames",            0),
+  FNPARAM("skipped",    "Number of skipped Frames",           0),
+  FNPARAM("mismatched", "Number of unmatched Frames",         0),
+  FNPARAM("remaining",  "Number of remaining Frames",         0),
+  FNPARAM("rndmissed",  "Number of unmatched Random Numbers", 0),
+  FNPARAMEND
+};
+FN("trace", replay_stats, "Get Replay Statistics",
+"Returns how many frames the replay device answered from the trace, how\n" \
+"many recorded frames were skipped to find a match, how many frames had no\n" \
+"match at all and how many recorded frames are left. The last value counts\n" \
+"the random numbers which were not found in the trace. A script that runs\n" \
+"identically to the recording ends with zero skipped, unmatched and\n" \
+"remaining frames.\n");
+
+
+static int replay_stats(lua_State *l)
+{
+  unsigned long served, skipped, mismatched, remaining, rndmissed;
+
+
+  pthread_mutex_lock(&replay.mutex);
+  served     = replay.served;
+  skipped    = replay.skipped;
+  mismatched = replay.mismatched;
+  remaining  = replay.loaded ? replay.nex - replay.cur : 0;
+  rndmissed  = replay.rndmissed;
+  pthread_mutex_unlock(&replay.mutex);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 5);
+  lua_pushinteger(l, served);
+  lua_pushinteger(l, skipped);
+  lua_pushinteger(l, mismatched);
+  lua_pushinteger(l, remaining);
+  lua_pushinteger(l, rndmissed);
+
+
+  return 5;
+}
@@ -0,0 +1,48 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_REPLAY_H_
+#define _DESF_REPLAY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <nfc/nfc.h>
+
+#include "fn.h"
+#include "trace.h"
+
+
+/*
+ * Anzahl der aufgezeichneten Rahmen, die bei einer Abweichung
+ * übersprungen werden dürfen, um die passende Anfrage zu finden.
+ */
+#define REPLAY_WINDOW	16
+#define REPLAY_TARGETS	16
+
+
+extern const struct trace_backend replay_backend;
+
+extern int replay_open(const char *filename, int realtime);
+extern nfc_device *replay_device();
+extern int replay_rand(unsigned char *buf, int num);
+
+extern FNDECL(replay_stats);
+
+
+#endif
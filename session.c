@@ -0,0 +1,1039 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <nfc/nfc.h>
+#include <freefare.h>
+
+#include "async.h"
+#include "debug.h"
+#include "desfsh.h"
+#include "fn.h"
+#include "key.h"
+#include "rcache.h"
+#include "session.h"
+#include "trace.h"
+#include "wback.h"
+
+
+/*
+ * Sitzungszustand
+ *
+ * Wir merken uns, welche Applikation ausgewählt ist und mit welchem
+ * Schlüssel wir authentifiziert sind. Ist der Zustand unbekannt (etwa nach
+ * einem Fehler), ist <valid> nicht gesetzt. Im Modus <skip> werden
+ * SelectApplication und Authenticate nicht gesendet, wenn sie den Zustand
+ * der Karte nicht ändern würden.
+ *
+ * Unabhängig davon merken wir uns den zuletzt erfolgreich hergestellten
+ * Zustand (<taid>, <tkno>, <tkey>). Er bleibt auch nach Fehlern erhalten,
+ * damit wir ihn nach einer Übertragungsstörung wiederherstellen können.
+ */
+struct session_s
+{
+  unsigned char valid;
+  uint32_t aid;
+  int authkno;
+  struct session_key key;
+
+  unsigned char thasaid;
+  uint32_t taid;
+  int tkno;
+  struct session_key tkey;
+
+  unsigned char skip;
+  unsigned int retries;
+  unsigned int backoff;
+  unsigned int framesize;
+  unsigned int maxframe;
+  unsigned int selectrate;
+  unsigned int reqrate;
+  unsigned char txn;
+
+  unsigned long nselect;
+  unsigned long nauth;
+  unsigned long skipselect;
+  unsigned long skipauth;
+  unsigned long nretry;
+  unsigned long recovered;
+  unsigned long failed;
+  unsigned long nframes;
+};
+
+static __thread struct session_s session =
+{
+  .valid   = 0,
+  .aid     = 0,
+  .authkno = -1,
+  .thasaid = 0,
+  .tkno    = -1,
+  .skip    = 0,
+  .retries = 0,
+  .backoff = 20,
+};
+
+/* Über die Kommandozeile vorgegebene Rahmengröße aller Sitzungen. */
+static unsigned int session_defframe = SESSION_FRAMESIZE;
+
+/* Übertragungsraten nach ISO 14443-4, absteigend sortiert. */
+static const struct
+{
+  unsigned int kbps;
+  nfc_baud_rate nbr;
+  uint8_t ta1;
+} session_rates[] =
+{
+  { 848, NBR_847, 0x44 },
+  { 424, NBR_424, 0x22 },
+  { 212, NBR_212, 0x11 },
+  { 106, NBR_106, 0x00 },
+};
+
+#define SESSION_NRATES	(sizeof(session_rates) / sizeof(session_rates[0]))
+
+static unsigned int session_defrate = 106;
+
+
+static int session_state(lua_State *l);
+static int session_skip(lua_State *l);
+static int session_stats(lua_State *l);
+static int session_clear(lua_State *l);
+static int session_recovery(lua_State *l);
+static int session_frame(lua_State *l);
+static int session_selectrate(lua_State *l);
+static const char *session_scheme(enum keytype_e type);
+
+
+
+
+int session_getkey(lua_State *l, int idx, struct session_key *sk, char **keystr)
+{
+  int result;
+  uint8_t *key;
+
+
+  result = key_getraw(l, idx, &sk->type, &key, &sk->keylen, &sk->ver, keystr);
+  if(result)
+    return -1;
+
+  memset(sk->key, 0, sizeof(sk->key));
+  memcpy(sk->key, key, sk->keylen);
+  free(key);
+
+
+  return 0;
+}
+
+
+void session_defkey(enum keytype_e type, struct session_key *sk)
+{
+  memset(sk, 0, sizeof(*sk));
+  sk->type = type;
+
+  switch(type)
+  {
+  case _DES_:    sk->keylen =  8; break;
+  case _3DES_:   sk->keylen = 16; break;
+  case _3K3DES_: sk->keylen = 24; break;
+  case _AES_:    sk->keylen = 16; break;
+  }
+}
+
+
+static MifareDESFireKey session_mkkey(const struct session_key *sk)
+{
+  switch(sk->type)
+  {
+  case _DES_:    return mifare_desfire_des_key_new(sk->key);
+  case _3DES_:   return mifare_desfire_3des_key_new(sk->key);
+  case _3K3DES_: return mifare_desfire_3k3des_key_new(sk->key);
+  case _AES_:    return mifare_desfire_aes_key_new_with_version(sk->key, sk->ver);
+  }
+
+  return NULL;
+}
+
+
+int session_samekey(const struct session_key *a, const struct session_key *b)
+{
+  return a->type == b->type &&
+         a->keylen == b->keylen &&
+         a->ver == b->ver &&
+         !memcmp(a->key, b->key, a->keylen);
+}
+
+
+int session_select(uint32_t aid)
+{
+  int result;
+  MifareDESFireAID app;
+
+
+  /*
+   * Eine erneute Auswahl der aktuellen Applikation hebt die
+   * Authentifizierung auf. Nur ohne Authentifizierung ändert sie nichts.
+   */
+  if(session.skip && session.valid && session.aid == aid && session.authkno < 0)
+  {
+    session.skipselect++;
+    debug_info("SelectApplication(0x%06x) skipped, already selected", aid);
+    return 0;
+  }
+
+  app = mifare_desfire_aid_new(aid);
+  if(app == NULL)
+    return -1;
+
+  session.nselect++;
+  result = mifare_desfire_select_application(tag, app);
+  free(app);
+
+  if(result < 0)
+  {
+    session_reset();
+    return result;
+  }
+
+  session.valid   = 1;
+  session.aid     = aid;
+  session.authkno = -1;
+  session.txn     = 0;
+
+  session.thasaid = 1;
+  session.taid    = aid;
+  session.tkno    = -1;
+
+  rcache_select(aid);
+
+
+  return result;
+}
+
+
+int session_auth(uint8_t kno, const struct session_key *sk)
+{
+  int result;
+  MifareDESFireKey k;
+
+
+  if(session.skip && session.valid && session.authkno == kno && session_samekey(&session.key, sk))
+  {
+    session.skipauth++;
+    debug_info("Authenticate(%d) skipped, already authenticated", kno);
+    return 0;
+  }
+
+  k = session_mkkey(sk);
+  if(k == NULL)
+    return -1;
+
+  session.nauth++;
+  result = mifare_desfire_authenticate(tag, kno, k);
+  mifare_desfire_key_free(k);
+
+  if(result < 0)
+  {
+    session_reset();
+    return result;
+  }
+
+  session.authkno = kno;
+  session.key     = *sk;
+
+  session.tkno    = kno;
+  session.tkey    = *sk;
+
+  rcache_auth(kno, sk);
+
+
+  return result;
+}
+
+
+/*
+ * Prüft, ob eine Folge aus SelectApplication und Authenticate entfallen
+ * kann, weil die Karte bereits in diesem Zustand ist.
+ */
+int session_keep(uint32_t aid, uint8_t kno, const struct session_key *sk)
+{
+  if(!session.skip || !session.valid || session.aid != aid)
+    return 0;
+
+  if(session.authkno != kno || !session_samekey(&session.key, sk))
+    return 0;
+
+  session.skipselect++;
+  session.skipauth++;
+  debug_info("SelectApplication(0x%06x) and Authenticate(%d) skipped, session unchanged", aid, kno);
+
+
+  return 1;
+}
+
+
+void session_deauth()
+{
+  session.authkno = -1;
+  memset(&session.key, 0, sizeof(session.key));
+
+  session.tkno = -1;
+  memset(&session.tkey, 0, sizeof(session.tkey));
+
+  rcache_clear();
+}
+
+
+void session_deleted(uint32_t aid)
+{
+  /*
+   * Wird die aktuelle Applikation gelöscht, ist anschließend die PICC
+   * ausgewählt und die Authentifizierung verloren.
+   */
+  if(session.taid == aid)
+    session.taid = 0;
+
+  if(session.aid != aid)
+    return;
+
+  session.aid = 0;
+  session_deauth();
+}
+
+
+void session_reset()
+{
+  session.valid = 0;
+  session.authkno = -1;
+  memset(&session.key, 0, sizeof(session.key));
+
+  rcache_clear();
+}
+
+
+/*
+ * Für eine neue Karte sind weder Ist- noch Sollzustand bekannt.
+ */
+void session_newtag()
+{
+  session_reset();
+  wback_discard();
+  session.txn = 0;
+
+  session.thasaid = 0;
+  session.taid    = 0;
+  session.tkno    = -1;
+  memset(&session.tkey, 0, sizeof(session.tkey));
+}
+
+
+/*
+ * Offene Transaktion
+ *
+ * Schreibzugriffe auf Backup-, Value- und Record-Dateien wirken erst mit
+ * CommitTransaction. Die erneute Auswahl der Karte bei der Wiederherstellung
+ * würde sie stillschweigend verwerfen. Solange eine Transaktion offen sein
+ * kann, stellen wir deshalb nichts wieder her. Für Dateien, deren Typ wir
+ * nicht kennen, nehmen wir eine Transaktion an. SelectApplication beendet
+ * die Transaktion auf der Karte ebenfalls.
+ */
+void session_txnopen(uint8_t fid)
+{
+  struct mifare_desfire_file_settings settings;
+
+
+  if(rcache_getsettings(fid, &settings) && settings.file_type == MDFT_STANDARD_DATA_FILE)
+    return;
+
+  session.txn = 1;
+}
+
+
+void session_txnclose(int result)
+{
+  if(result >= 0)
+    session.txn = 0;
+}
+
+
+/*
+ * Übertragungsstörungen erkennen wir daran, dass libfreefare einen Fehler
+ * meldet, die Karte keinen Statuscode geliefert hat und libnfc einen Fehler
+ * beim Austausch mit der Karte meldet. Ohne Fehler von libnfc hat
+ * libfreefare selbst den Aufruf abgelehnt (z.B. ungültige Argumente oder
+ * eine falsche Prüfsumme der Antwort). Ein Integritätsfehler der Karte
+ * deutet ebenfalls auf eine gestörte Übertragung hin.
+ */
+static int session_transient()
+{
+  uint8_t err;
+
+
+  err = mifare_desfire_last_picc_error(tag);
+  if(err == OPERATION_OK)
+    return nfc_device_get_last_error(device) < 0;
+
+
+  return err == INTEGRITY_ERROR || err == COMMAND_ABORTED;
+}
+
+
+int session_recover(unsigned int *tries)
+{
+  uint32_t aid;
+  unsigned char hasaid;
+  int kno;
+  struct session_key key;
+  unsigned int delay;
+
+
+  if(session.retries == 0 || !session_transient())
+    return 0;
+
+  if(session.txn)
+  {
+    debug_info("Transmission error within an open transaction, no recovery.");
+    session.failed++;
+    return 0;
+  }
+
+  /*
+   * Der Sollzustand wird durch die erneute Auswahl überschrieben. Wir
+   * sichern ihn deshalb vorher.
+   */
+  hasaid = session.thasaid;
+  aid    = session.taid;
+  kno    = session.tkno;
+  key    = session.tkey;
+
+  while(*tries < session.retries)
+  {
+    delay = session.backoff << (*tries < 8 ? *tries : 8);
+    (*tries)++;
+    session.nretry++;
+
+    debug_info("Transmission error, recovery attempt %d/%d in %d ms", *tries, session.retries, delay);
+    usleep(delay * 1000);
+
+    /* Karte neu auswählen. */
+    session_reset();
+    mifare_desfire_disconnect(tag);
+    if(session_connect() < 0)
+    {
+      debug_info("  --> Reconnecting tag failed.");
+      continue;
+    }
+
+    /* Letzte Auswahl und Authentifizierung wiederholen. */
+    if(hasaid && session_select(aid) < 0)
+    {
+      debug_info("  --> SelectApplication(0x%06x) failed.", aid);
+      continue;
+    }
+
+    if(kno >= 0 && session_auth(kno, &key) < 0)
+    {
+      debug_info("  --> Authenticate(%d) failed.", kno);
+      continue;
+    }
+
+    return 1;
+  }
+
+  session.failed++;
+
+
+  return 0;
+}
+
+
+void session_counters(unsigned long *saved, unsigned long *recovered, unsigned long *failed)
+{
+  *saved     = session.skipselect + session.skipauth;
+  *recovered = session.recovered;
+  *failed    = session.failed;
+}
+
+
+/*
+ * Die Rahmengröße legt der Nutzer fest. Kennen wir die maximale
+ * Rahmengröße der Karte (FSC aus dem ATS), begrenzen wir sie darauf.
+ */
+void session_defframesize(unsigned int size)
+{
+  session_defframe = size;
+}
+
+
+static void session_setfsc(const nfc_target *target)
+{
+  static const unsigned int fsc[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+  unsigned int fsci, size;
+
+
+  /* Ohne ATS gilt die Rahmengröße des Nutzers unverändert. */
+  if(target == NULL || target->nti.nai.szAtsLen < 1)
+  {
+    session.maxframe = 0;
+    return;
+  }
+
+  fsci = target->nti.nai.abtAts[0] & 0x0f;
+  size = fsci < sizeof(fsc) / sizeof(fsc[0]) ? fsc[fsci] : 256;
+
+  /* PCB, CRC und ISO 7816-4 Kopf abziehen. */
+  session.maxframe = size - 9;
+}
+
+
+unsigned int session_framesize()
+{
+  unsigned int size;
+
+
+  size = session.framesize ? session.framesize : session_defframe;
+  if(session.maxframe && size > session.maxframe)
+    size = session.maxframe;
+
+
+  return size;
+}
+
+
+void session_frames(unsigned long n)
+{
+  session.nframes += n;
+}
+
+
+/*
+ * Modulationsrate bei der Auswahl
+ *
+ * libfreefare wählt die Karte immer mit 106 kbit/s aus. Ist eine höhere
+ * Rate eingestellt, wählen wir die Karte danach erneut mit dieser Rate aus.
+ * Unterstützt das Lesegerät oder laut TA(1) im ATS die Karte die Rate nicht
+ * oder schlägt die Auswahl fehl, versuchen wir die nächst niedrigere Rate.
+ *
+ * Die Rate geben wir nur an den Treiber von libnfc weiter. Ein PPS lässt
+ * sich über die Schnittstelle von libnfc nicht senden und libnfc meldet
+ * nicht, mit welcher Rate tatsächlich übertragen wird. Der pn53x-Treiber
+ * etwa bleibt bei ISO 14443-A immer bei 106 kbit/s. Wir merken uns deshalb
+ * nur die angeforderte Rate.
+ */
+static int session_rateidx(unsigned int kbps)
+{
+  unsigned int i;
+
+
+  for(i = 0; i < SESSION_NRATES; i++)
+    if(session_rates[i].kbps == kbps || (kbps == 847 && session_rates[i].kbps == 848))
+      return i;
+
+
+  return -1;
+}
+
+
+int session_defselectrate(unsigned int kbps)
+{
+  if(session_rateidx(kbps) < 0)
+    return -1;
+
+  session_defrate = kbps;
+
+
+  return 0;
+}
+
+
+static int session_supported(nfc_baud_rate nbr)
+{
+  const nfc_baud_rate *supported;
+  unsigned int i;
+
+
+  if(nbr == NBR_106)
+    return 1;
+
+  if(nfc_device_get_supported_baud_rate(device, NMT_ISO14443A, &supported) < 0)
+    return 0;
+
+  for(i = 0; supported[i] != 0; i++)
+    if(supported[i] == nbr)
+      return 1;
+
+
+  return 0;
+}
+
+
+static int session_cardrate(const nfc_target *target, unsigned int idx)
+{
+  const uint8_t *ats;
+
+
+  if(session_rates[idx].ta1 == 0)
+    return 1;
+
+  /* Ohne TA(1) beherrscht die Karte nur 106 kbit/s. */
+  if(target == NULL || target->nti.nai.szAtsLen < 2)
+    return 0;
+
+  ats = target->nti.nai.abtAts;
+  if(!(ats[0] & 0x10))
+    return 0;
+
+
+  return (ats[1] & session_rates[idx].ta1) == session_rates[idx].ta1;
+}
+
+
+static int session_reselect(nfc_baud_rate nbr)
+{
+  nfc_modulation nm;
+  nfc_target nt;
+  uint8_t uid[10];
+  size_t uidlen;
+  char *uidstr;
+  unsigned int byte;
+  int result;
+
+
+  uidstr = freefare_get_tag_uid(tag);
+  if(uidstr == NULL)
+    return -1;
+
+  for(uidlen = 0; uidlen < sizeof(uid) && sscanf(uidstr + 2 * uidlen, "%2x", &byte) == 1; uidlen++)
+    uid[uidlen] = byte;
+  free(uidstr);
+
+  nm.nmt = NMT_ISO14443A;
+  nm.nbr = nbr;
+
+  nfc_device_set_property_bool(device, NP_FORCE_SPEED_106, nbr == NBR_106);
+  nfc_initiator_deselect_target(device);
+  result = nfc_initiator_select_passive_target(device, nm, uid, uidlen, &nt);
+
+
+  return result > 0 ? 0 : -1;
+}
+
+
+int session_connect()
+{
+  const nfc_target *selp;
+  nfc_target sel;
+  unsigned int want, tried;
+  int i;
+
+
+  if(mifare_desfire_connect(tag) < 0)
+    return -1;
+
+  if(trace_selected() != NULL)
+  {
+    sel = *trace_selected();
+    selp = &sel;
+  }
+  else
+    selp = NULL;
+
+  session_setfsc(selp);
+
+  want = session.selectrate ? session.selectrate : session_defrate;
+  session.reqrate = 106;
+  if(want == 106 || device == NULL)
+    return 0;
+
+  tried = 0;
+  for(i = session_rateidx(want); i >= 0 && session_rates[i].kbps > 106; i++)
+  {
+    if(!session_supported(session_rates[i].nbr))
+    {
+      debug_info("Bit rate %u kbit/s not supported by the reader.", session_rates[i].kbps);
+      continue;
+    }
+
+    if(!session_cardrate(selp, i))
+    {
+      debug_info("Bit rate %u kbit/s not supported by the tag.", session_rates[i].kbps);
+      continue;
+    }
+
+    tried = 1;
+    if(session_reselect(session_rates[i].nbr) == 0)
+    {
+      session.reqrate = session_rates[i].kbps;
+      debug_info("Tag selected, %u kbit/s requested from the reader driver (not confirmed by libnfc).", session.reqrate);
+      return 0;
+    }
+
+    debug_info("Selecting tag with %u kbit/s failed.", session_rates[i].kbps);
+  }
+
+  /* Rückfall auf die Grundrate. */
+  if(tried && session_reselect(NBR_106) < 0)
+    return -1;
+
+
+  return 0;
+}
+
+
+void session_outcome(int result, unsigned int tries)
+{
+  if(result >= 0 && tries > 0)
+    session.recovered++;
+}
+
+
+static const char *session_scheme(enum keytype_e type)
+{
+  switch(type)
+  {
+  case _DES_:    return "D40";
+  case _3DES_:   return "D40";
+  case _3K3DES_: return "ISO";
+  case _AES_:    return "AES";
+  }
+
+  return NULL;
+}
+
+
+
+
+FN_ALIAS(session_state) = { "state", NULL };
+FN_PARAM(session_state) =
+{
+  FNPARAMEND
+};
+FN_RET(session_state) =
+{
+  FNPARAM("aid",     "Selected Application",  1),
+  FNPARAM("kno",     "Authenticated Key",     1),
+  FNPARAM("keytype", "Key Type",              1),
+  FNPARAM("scheme",  "Secure Messaging Mode", 1),
+  FNPARAMEND
+};
+FN("session", session_state, "Get Session State",
+"Returns the session state as tracked by the shell. <aid> is the currently\n" \
+"selected application or 'nil' if unknown. <kno> is the key number of the\n" \
+"current authentication or 'nil' when unauthenticated. <keytype> is the type\n" \
+"of the authentication key and <scheme> the resulting secure messaging mode\n" \
+"('D40', 'ISO' or 'AES').\n");
+
+
+static int session_state(lua_State *l)
+{
+  lua_settop(l, 0);
+  lua_checkstack(l, 4);
+
+  if(!session.valid)
+  {
+    lua_pushnil(l);
+    return 1;
+  }
+
+  lua_pushinteger(l, session.aid);
+
+  if(session.authkno < 0)
+    return 1;
+
+  lua_pushinteger(l, session.authkno);
+  switch(session.key.type)
+  {
+  case _DES_:    lua_pushstring(l, "DES");    break;
+  case _3DES_:   lua_pushstring(l, "3DES");   break;
+  case _3K3DES_: lua_pushstring(l, "3K3DES"); break;
+  case _AES_:    lua_pushstring(l, "AES");    break;
+  }
+  lua_pushstring(l, session_scheme(session.key.type));
+
+
+  return 4;
+}
+
+
+
+
+FN_ALIAS(session_skip) = { "skip", NULL };
+FN_PARAM(session_skip) =
+{
+  FNPARAM("enable", "Skip Redundant Commands", 1),
+  FNPARAMEND
+};
+FN_RET(session_skip) =
+{
+  FNPARAM("enabled", "Previous Setting", 0),
+  FNPARAMEND
+};
+FN("session", session_skip, "Skip Redundant Commands",
+"When <enable> is true, SelectApplication and Authenticate are not sent to\n" \
+"the card if they would not change the session state. Selecting the current\n" \
+"application is only skipped when unauthenticated, because it would drop\n" \
+"the authentication otherwise. Authentication is only skipped for the same\n" \
+"key number and key. Without <enable> the setting is left unchanged.\n");
+
+
+static int session_skip(lua_State *l)
+{
+  unsigned char old;
+
+
+  old = session.skip;
+  if(lua_gettop(l) >= 1 && !lua_isnil(l, 1))
+    session.skip = lua_toboolean(l, 1);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, old);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(session_stats) = { "stats", NULL };
+FN_PARAM(session_stats) =
+{
+  FNPARAMEND
+};
+FN_RET(session_stats) =
+{
+  FNPARAM("stats", "Statistics", 0),
+  FNPARAMEND
+};
+FN("session", session_stats, "Get Session Statistics",
+"Returns a table with the number of SelectApplication and Authenticate\n" \
+"commands sent ('select', 'auth') and skipped ('skipselect', 'skipauth').\n" \
+"'saved' is the total number of avoided round trips. 'retries' counts the\n" \
+"recovery attempts after transmission errors, 'recovered' the commands which\n" \
+"succeeded after a recovery and 'failed' the commands which failed due to a\n" \
+"transmission error in the end. 'frames' is the number of frames exchanged\n" \
+"by cmd.raw().\n");
+
+
+static int session_stats(lua_State *l)
+{
+  lua_settop(l, 0);
+  lua_checkstack(l, 2);
+  lua_newtable(l);
+  lua_pushinteger(l, session.nselect);    lua_setfield(l, -2, "select");
+  lua_pushinteger(l, session.nauth);      lua_setfield(l, -2, "auth");
+  lua_pushinteger(l, session.skipselect); lua_setfield(l, -2, "skipselect");
+  lua_pushinteger(l, session.skipauth);   lua_setfield(l, -2, "skipauth");
+  lua_pushinteger(l, session.skipselect + session.skipauth);
+  lua_setfield(l, -2, "saved");
+  lua_pushinteger(l, session.nretry);     lua_setfield(l, -2, "retries");
+  lua_pushinteger(l, session.recovered);  lua_setfield(l, -2, "recovered");
+  lua_pushinteger(l, session.failed);     lua_setfield(l, -2, "failed");
+  lua_pushinteger(l, session.nframes);    lua_setfield(l, -2, "frames");
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(session_clear) = { "reset", NULL };
+FN_PARAM(session_clear) =
+{
+  FNPARAMEND
+};
+FN_RET(session_clear) =
+{
+  FNPARAMEND
+};
+FN("session", session_clear, "Reset Session State",
+"Marks the session state as unknown, so the next SelectApplication and\n" \
+"Authenticate commands are sent to the card in any case.\n");
+
+
+static int session_clear(lua_State *l)
+{
+  session_reset();
+  lua_settop(l, 0);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(session_recovery) = { "recovery", NULL };
+FN_PARAM(session_recovery) =
+{
+  FNPARAM("retries", "Number of Retries",     1),
+  FNPARAM("backoff", "Initial Backoff in ms", 1),
+  FNPARAMEND
+};
+FN_RET(session_recovery) =
+{
+  FNPARAM("retries", "Previous Number of Retries", 0),
+  FNPARAM("backoff", "Previous Backoff in ms",     0),
+  FNPARAMEND
+};
+FN("session", session_recovery, "Set Recovery Policy",
+"Configures the recovery of idempotent commands after transmission errors.\n" \
+"Up to <retries> times the tag is reselected, the last SelectApplication and\n" \
+"Authenticate are replayed and the command is repeated. Before each attempt\n" \
+"the shell waits <backoff> milliseconds, doubling the delay each time. The\n" \
+"default of 0 retries disables recovery. Omitted parameters are left\n" \
+"unchanged. Commands which modify the card are never repeated. While a\n" \
+"transaction may be open, i.e. after writing to a file not known to be a\n" \
+"standard data file and before the next commit, abort or\n" \
+"SelectApplication, no recovery takes place.\n");
+
+
+static int session_recovery(lua_State *l)
+{
+  unsigned int retries, backoff;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) || lua_isnumber(l, 1), 1, "number of retries expected");
+  luaL_argcheck(l, lua_gettop(l) < 2 || lua_isnil(l, 2) || lua_isnumber(l, 2), 2, "backoff must be a number");
+
+  retries = session.retries;
+  backoff = session.backoff;
+
+  if(lua_isnumber(l, 1))
+    session.retries = lua_tointeger(l, 1);
+  if(lua_isnumber(l, 2))
+    session.backoff = lua_tointeger(l, 2);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 2);
+  lua_pushinteger(l, retries);
+  lua_pushinteger(l, backoff);
+
+
+  return 2;
+}
+
+
+
+
+FN_ALIAS(session_frame) = { "framesize", NULL };
+FN_PARAM(session_frame) =
+{
+  FNPARAM("size", "Data Bytes per Frame", 1),
+  FNPARAMEND
+};
+FN_RET(session_frame) =
+{
+  FNPARAM("size", "Previous Data Bytes per Frame", 0),
+  FNPARAMEND
+};
+FN("session", session_frame, "Set Frame Size",
+"Sets the number of data bytes cmd.raw() sends per frame. Larger frames need\n" \
+"fewer additional frames and thus fewer round trips. The default is 52 bytes\n" \
+"or the value given via the -F option. Up to 247 bytes are possible, but the\n" \
+"card must support the resulting frame size (e.g. 64 bytes for DESFire EV1,\n" \
+"256 bytes for EV2 and later). In station mode the size is limited to the\n" \
+"frame size announced by the card. A size of 0 restores the default.\n" \
+"Returns the effective previous size.\n");
+
+
+static int session_frame(lua_State *l)
+{
+  unsigned int size;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) ||
+    (lua_isnumber(l, 1) && lua_tointeger(l, 1) >= 0 && lua_tointeger(l, 1) <= SESSION_MAXFRAME),
+    1, "frame size must be between 0 and 247");
+
+  size = session_framesize();
+
+  if(lua_isnumber(l, 1))
+    session.framesize = lua_tointeger(l, 1);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushinteger(l, size);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(session_selectrate) = { "selectrate", NULL };
+FN_PARAM(session_selectrate) =
+{
+  FNPARAM("kbps", "Modulation Bit Rate in kbit/s", 1),
+  FNPARAMEND
+};
+FN_RET(session_selectrate) =
+{
+  FNPARAM("kbps", "Bit Rate passed to the Reader Driver", 0),
+  FNPARAMEND
+};
+FN("session", session_selectrate, "Set Modulation Bit Rate for Selection",
+"Selects the tag again and passes the modulation bit rate 106, 212, 424 or\n" \
+"848 kbit/s to the reader driver. When the reader or the tag (TA(1) in the\n" \
+"ATS) doesn't support the rate, the next lower rate is passed. No PPS is\n" \
+"sent and the rate actually used for the transmission is neither changed\n" \
+"nor verified by desfsh; it depends on the driver. The pn53x driver, for\n" \
+"example, always communicates with 106 kbit/s. The selected application and\n" \
+"the authentication are lost. The setting also applies when the tag is\n" \
+"reselected after a transmission error. The default is 106 kbit/s or the\n" \
+"value given via the -b option. Without parameter the setting is left\n" \
+"unchanged. Returns the rate passed to the driver.\n");
+
+
+static int session_selectrate(lua_State *l)
+{
+  int idx;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) || lua_isnumber(l, 1), 1, "modulation bit rate expected");
+
+  if(lua_isnumber(l, 1))
+  {
+    idx = session_rateidx(lua_tointeger(l, 1));
+    luaL_argcheck(l, idx >= 0, 1, "bit rate must be 106, 212, 424 or 848");
+
+    async_sync();
+    wback_flush();
+
+    session.selectrate = session_rates[idx].kbps;
+    session_reset();
+    mifare_desfire_disconnect(tag);
+    if(session_connect() < 0)
+      return luaL_error(l, "unable to select tag");
+  }
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushinteger(l, session.reqrate ? session.reqrate : 106);
+
+
+  return 1;
+}
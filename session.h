@@ -0,0 +1,92 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_SESSION_H_
+#define _DESF_SESSION_H_
+
+#include <stdint.h>
+#include <lua.h>
+
+#include "fn.h"
+#include "key.h"
+
+
+/*
+ * Idempotente Kommandos nach Übertragungsfehlern gemäß der eingestellten
+ * Strategie wiederholen.
+ */
+#define SESSION_RETRY(result, call) \
+  do \
+  { \
+    unsigned int _tries = 0; \
+    while(((result) = (call)) < 0 && session_recover(&_tries)); \
+    session_outcome((result), _tries); \
+  } while(0)
+
+
+/*
+ * Nutzdaten je Rahmen bei selbst aufgeteilten Kommandos. Der Standardwert
+ * entspricht der Aufteilung durch libfreefare. Das Maximum ergibt sich aus
+ * der größten Rahmengröße nach ISO 14443-4 (256 Bytes) abzüglich
+ * Protokoll- und ISO 7816-4 Verwaltungsdaten.
+ */
+#define SESSION_FRAMESIZE	52
+#define SESSION_MAXFRAME	247
+
+
+struct session_key
+{
+  enum keytype_e type;
+  uint8_t key[24];
+  unsigned int keylen;
+  uint8_t ver;
+};
+
+
+extern int session_samekey(const struct session_key *a, const struct session_key *b);
+extern int session_getkey(lua_State *l, int idx, struct session_key *sk, char **keystr);
+extern void session_defkey(enum keytype_e type, struct session_key *sk);
+extern int session_select(uint32_t aid);
+extern int session_auth(uint8_t kno, const struct session_key *sk);
+extern int session_keep(uint32_t aid, uint8_t kno, const struct session_key *sk);
+extern void session_deauth();
+extern void session_deleted(uint32_t aid);
+extern void session_reset();
+extern void session_newtag();
+extern void session_txnopen(uint8_t fid);
+extern void session_txnclose(int result);
+extern int session_recover(unsigned int *tries);
+extern void session_outcome(int result, unsigned int tries);
+extern void session_counters(unsigned long *saved, unsigned long *recovered, unsigned long *failed);
+extern void session_defframesize(unsigned int size);
+extern unsigned int session_framesize();
+extern void session_frames(unsigned long n);
+extern int session_defselectrate(unsigned int kbps);
+extern int session_connect();
+
+extern FNDECL(session_state);
+extern FNDECL(session_skip);
+extern FNDECL(session_stats);
+extern FNDECL(session_clear);
+extern FNDECL(session_recovery);
+extern FNDECL(session_frame);
+extern FNDECL(session_selectrate);
+
+
+#endif
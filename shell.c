@@ -30,16 +30,17 @@
 #define QL(x)	LUA_QL(x)
 #endif
 
+#include "async.h"
 #include "fn.h"
+#include "prof.h"
 #include "shell.h"
+#include "wback.h"
 
 
 
-void shell(int online, int interactive, const char *command)
+lua_State *shell_open(int online)
 {
   lua_State *l;
-  const char *prompt;
-  char *s;
   int result;
 
 
@@ -47,99 +48,170 @@ void shell(int online, int interactive, const char *command)
   if(l == NULL)
   {
     fprintf(stderr, "Failed to create LUA state.\n");
-    return;
+    return NULL;
   }
 
   luaL_openlibs(l);
   result = fn_init(l, online);
   if(result)
-    goto fail;
+  {
+    fprintf(stderr, "%s\n", lua_tostring(l, -1));
+    lua_close(l);
+    return NULL;
+  }
 
+  prof_attach(l);
 
 
-  /*
-   * Auf der Kommandozeile angegebenes Kommando ausführen.
-   */
-  if(command != NULL)
+  return l;
+}
+
+
+void shell_close(lua_State *l)
+{
+  async_close();
+  lua_close(l);
+}
+
+
+/*
+ * Auf der Kommandozeile angegebenes Kommando ausführen.
+ */
+int shell_run(lua_State *l, const char *command)
+{
+  int result;
+
+
+  lua_settop(l, 0);
+  result = luaL_dostring(l, command);
+  if(result)
+    fprintf(stderr, "%s\n", lua_tostring(l, -1));
+  lua_settop(l, 0);
+
+  /* Noch nicht beendete Coroutinen abarbeiten. */
+  if(async_run(l))
   {
-    lua_settop(l, 0);
-    result = luaL_dostring(l, command);
-    if(result)
-      goto fail;
+    fprintf(stderr, "%s\n", lua_tostring(l, -1));
+    result = 1;
   }
+  lua_settop(l, 0);
+
+  wback_done();
+
+
+  return result;
+}
 
 
-  /*
-   * Interaktive Shell starten.
-   */
-  if(interactive)
+/*
+ * Informationen zum aktuellen Tag in der globalen Tabelle TAG ablegen.
+ */
+void shell_settag(lua_State *l, unsigned int idx, const char *uid)
+{
+  lua_checkstack(l, 2);
+  lua_newtable(l);
+  lua_pushinteger(l, idx); lua_setfield(l, -2, "idx");
+  lua_pushstring(l, uid);  lua_setfield(l, -2, "uid");
+  lua_setglobal(l, "TAG");
+}
+
+
+/*
+ * Interaktive Shell starten.
+ */
+void shell_interactive(lua_State *l)
+{
+  const char *prompt;
+  char *s;
+  int result;
+
+
+  lua_settop(l, 0);
+  prompt = "> ";
+  while((s = readline(prompt)) != NULL)
   {
-    lua_settop(l, 0);
-    prompt = "> ";
-    while((s = readline(prompt)) != NULL)
-    {
-      add_history(s);
+    add_history(s);
 
-      lua_checkstack(l, 1);
-      lua_pushstring(l, s);
-      if(lua_gettop(l) > 1)
-        lua_concat(l, 2);
+    lua_checkstack(l, 1);
+    lua_pushstring(l, s);
+    if(lua_gettop(l) > 1)
+      lua_concat(l, 2);
 
-      /* Den übergebenen Code übersetzen. */
-      size_t len;
+    /* Den übergebenen Code übersetzen. */
+    size_t len;
 
 #if LUA_VERSION_NUM > 501
-      len = lua_rawlen(l, -1);
+    len = lua_rawlen(l, -1);
 #else
-      len = lua_objlen(l, -1);
+    len = lua_objlen(l, -1);
 #endif
-      result = luaL_loadbuffer(l, lua_tostring(l, -1), len, "shell");
+    result = luaL_loadbuffer(l, lua_tostring(l, -1), len, "shell");
 
-      /*
-       * Wenn das Kommando lediglich unvollständig ist, nicht mit einem
-       * Syntax-Fehler abbrechen, sondern weitere Eingaben entgegennehmen.
-       */
-      if(result == LUA_ERRSYNTAX)
-      {
-        size_t len;
-        const char *msg, *p;
-
-        msg = lua_tolstring(l, -1, &len);
-        p   = msg + len - strlen(QL("<eof>"));
-        if(strstr(msg, QL("<eof>")) != p)
-          fprintf(stderr, "%s\n", lua_tostring(l, -1));
-        else
-        {
-          prompt = ">> ";
-          lua_pop(l, 1);
-          lua_pushliteral(l, "\n");
-          lua_concat(l, 2);
-          continue;
-        }
-      }
-    
-      prompt = "> ";
+    /*
+     * Wenn das Kommando lediglich unvollständig ist, nicht mit einem
+     * Syntax-Fehler abbrechen, sondern weitere Eingaben entgegennehmen.
+     */
+    if(result == LUA_ERRSYNTAX)
+    {
+      size_t len;
+      const char *msg, *p;
 
-      /* Im Fehlerfall den Kommando-Code verwerfen. */
-      if(result)
+      msg = lua_tolstring(l, -1, &len);
+      p   = msg + len - strlen(QL("<eof>"));
+      if(strstr(msg, QL("<eof>")) != p)
+        fprintf(stderr, "%s\n", lua_tostring(l, -1));
+      else
       {
-        lua_settop(l, 0);
+        prompt = ">> ";
+        lua_pop(l, 1);
+        lua_pushliteral(l, "\n");
+        lua_concat(l, 2);
         continue;
       }
+    }
+  
+    prompt = "> ";
 
-      /* Den übergebenen Code ausführen. */
-      if(lua_pcall(l, 0, 0, 0))
-        fprintf(stderr, "%s\n", lua_tostring(l, -1));
+    /* Im Fehlerfall den Kommando-Code verwerfen. */
+    if(result)
+    {
       lua_settop(l, 0);
+      continue;
     }
 
-    result = 0;
+    /* Den übergebenen Code ausführen. */
+    if(lua_pcall(l, 0, 0, 0))
+      fprintf(stderr, "%s\n", lua_tostring(l, -1));
+    lua_settop(l, 0);
+
+    if(async_run(l))
+      fprintf(stderr, "%s\n", lua_tostring(l, -1));
+    lua_settop(l, 0);
+
+    wback_done();
   }
+}
 
 
-fail:
-  if(result)
-    fprintf(stderr, "%s\n", lua_tostring(l, -1));
+int shell(int online, int interactive, const char *command)
+{
+  lua_State *l;
+  int result;
 
-  lua_close(l);
+
+  l = shell_open(online);
+  if(l == NULL)
+    return -1;
+
+  result = 0;
+  if(command != NULL)
+    result = shell_run(l, command);
+
+  if(!result && interactive)
+    shell_interactive(l);
+
+  shell_close(l);
+
+
+  return result;
 }
@@ -20,6 +20,14 @@
 #ifndef _DESF_SHELL_H_
 #define _DESF_SHELL_H_
 
-extern void shell(int online, int interactive, const char *command);
+#include <lua.h>
+
+
+extern lua_State *shell_open(int online);
+extern void shell_close(lua_State *l);
+extern int shell_run(lua_State *l, const char *command);
+extern void shell_settag(lua_State *l, unsigned int idx, const char *uid);
+extern void shell_interactive(lua_State *l);
+extern int shell(int online, int interactive, const char *command);
 
 #endif
@@ -24,10 +24,14 @@
 #include <lauxlib.h>
 #include <freefare.h>
 
+#include "async.h"
 #include "cmd.h"
 #include "desflua.h"
 #include "desfsh.h"
 #include "key.h"
+#include "session.h"
+#include "stats.h"
+#include "wback.h"
 
 
 
@@ -43,6 +47,7 @@ static void show_handle_error(FreefareTag tag, const char *fmt, ...)
 
 
   printf("%3d: '%s'", mifare_desfire_last_picc_error(tag), freefare_strerror(tag));
+  session_reset();
 
   if(fmt != NULL)
   {
@@ -78,16 +83,18 @@ static int show_picc(lua_State *l)
 {
   int result;
   unsigned char haskey;
-  MifareDESFireKey pmk;
-  MifareDESFireAID piccapp;
+  struct session_key pmk;
 
 
+  /* Die Karte darf nicht mehr von einem asynchronen Kommando belegt sein. */
+  async_sync();
+  wback_flush();
 
   /* Sollte ein PMK angegeben sein, lesen wir ihn aus. */
   haskey = lua_gettop(l) >= 1 && !lua_isnil(l, 1);
   if(haskey)
   {
-    result = key_get(l, 1, &pmk, NULL);
+    result = session_getkey(l, 1, &pmk, NULL);
     if(result)
     {
       lua_checkstack(l, 1);
@@ -101,16 +108,17 @@ static int show_picc(lua_State *l)
    * Master-APP auswählen. Wir benötigen Sie, um am Ende die
    * PICC-Schlüsseleinstellungen auslesen zu können.
    */
-  piccapp = mifare_desfire_aid_new(0);
-  result = mifare_desfire_select_application(tag, piccapp);
+  if(haskey && session_keep(0, 0, &pmk))
+    goto skip_select;
+
+  STATS(result, "SelectApplication", session_select(0));
   if(result < 0)
     show_handle_error(tag, "SelectApplication(0x000000)");
-  free(piccapp);
 
   /* Wenn wir einen Schlüssel haben, authentifizieren wir uns. */
   if(haskey)
   {
-    result = mifare_desfire_authenticate(tag, 0, pmk);
+    STATS(result, "Authenticate", session_auth(0, &pmk));
     if(result < 0)
     {
       show_handle_error(tag, "Authenticate(0)");
@@ -118,6 +126,8 @@ static int show_picc(lua_State *l)
     }
   }
 
+skip_select:;
+
 
 
   /*
@@ -129,7 +139,7 @@ static int show_picc(lua_State *l)
   static const char units[] = { ' ', 'K', 'M', 'G', 'T' };
 
 
-  result = mifare_desfire_get_version(tag, &info);
+  STATS(result, "GetVersion", mifare_desfire_get_version(tag, &info));
   if(result < 0)
   {
     show_handle_error(tag, "GetVersion()");
@@ -204,13 +214,13 @@ fail_version:;
   uint32_t freemem;
   char *cuid;
 
-  result = mifare_desfire_free_mem(tag, &freemem);
+  STATS(result, "FreeMem", mifare_desfire_free_mem(tag, &freemem));
   if(result < 0)
     show_handle_error(tag, "FreeMem()");
   else
     printf(" FREE: %d\n", freemem);
 
-  result = mifare_desfire_get_card_uid(tag, &cuid);
+  STATS(result, "GetCardUID", mifare_desfire_get_card_uid(tag, &cuid));
   if(result < 0)
   {
     uint8_t err;
@@ -233,7 +243,7 @@ fail_version:;
   uint8_t settings, maxkeys;
 
 
-  result = mifare_desfire_get_key_settings(tag, &settings, &maxkeys);
+  STATS(result, "GetKeySettings", mifare_desfire_get_key_settings(tag, &settings, &maxkeys));
   if(result < 0)
     show_handle_error(tag, "GetKeySettings()");
   else
@@ -273,6 +283,7 @@ FN_PARAM(show_apps) =
 {
   FNPARAM("key",     "PICC Master Key",                 1),
   FNPARAM("keylist", "List of Application Master Keys", 1),
+  FNPARAM("brief",   "Skip Application Settings",       1),
   FNPARAMEND
 };
 FN_RET(show_apps) =
@@ -284,17 +295,20 @@ FN("show", show_apps, "Show Application Information",
 "0x000000. <keylist> is a table where each index specifies an application id\n" \
 "and the corresponding value will be used as application master key. When no\n" \
 "application master key is given, the application settings are read out\n" \
-"unauthenticated.\n");
+"unauthenticated. When <brief> is true, the application settings are skipped\n" \
+"and the ISO file IDs and DF names of all applications are listed instead,\n" \
+"which are queried at once without selecting each application.\n");
 
 
 static int show_apps(lua_State *l)
 {
   int result;
   unsigned char haspmk;
-  MifareDESFireKey pmk;
-  MifareDESFireAID piccapp;
+  struct session_key pmk;
   MifareDESFireAID *apps;
-  size_t len, i;
+  MifareDESFireDF *dfs;
+  size_t len, ndfs, i, j;
+  int brief;
 
   static const char *akc[] =
   {
@@ -305,12 +319,14 @@ static int show_apps(lua_State *l)
   };
 
 
+  async_sync();
+  wback_flush();
 
   /* Sollte ein PMK angegeben sein, lesen wir ihn aus. */
   haspmk = lua_gettop(l) >= 1 && !lua_isnil(l, 1);
   if(haspmk)
   {
-    result = key_get(l, 1, &pmk, NULL);
+    result = session_getkey(l, 1, &pmk, NULL);
     if(result)
     {
       lua_checkstack(l, 1);
@@ -323,13 +339,18 @@ static int show_apps(lua_State *l)
   luaL_argcheck(l, lua_gettop(l) < 2 || lua_isnil(l, 2) || lua_istable(l, 2), 2,
     "application master keys must be stored inside a table");
 
+  brief = lua_toboolean(l, 3);
+  lua_settop(l, 2);
+
 
   /*
    * Master-APP auswählen. Wir benötigen Sie ggf., um die gespeicherten APPs
    * auflisten zu können.
    */
-  piccapp = mifare_desfire_aid_new(0);
-  result = mifare_desfire_select_application(tag, piccapp);
+  if(haspmk && session_keep(0, 0, &pmk))
+    goto skip_select;
+
+  STATS(result, "SelectApplication", session_select(0));
   if(result < 0)
     show_handle_error(tag, "SelectApplication(0x000000)");
 
@@ -337,7 +358,7 @@ static int show_apps(lua_State *l)
   /* Wenn wir einen Schlüssel haben, authentifizieren wir uns. */
   if(haspmk)
   {
-    result = mifare_desfire_authenticate(tag, 0, pmk);
+    STATS(result, "Authenticate", session_auth(0, &pmk));
     if(result < 0)
     {
       show_handle_error(tag, "Authenticate(0)");
@@ -345,9 +366,11 @@ static int show_apps(lua_State *l)
     }
   }
 
+skip_select:
+
 
   /* APPs abfragen. */
-  result = mifare_desfire_get_application_ids(tag, &apps, &len);
+  STATS(result, "GetApplicationIDs", mifare_desfire_get_application_ids(tag, &apps, &len));
   if(result < 0)
   {
     show_handle_error(tag, "GetApplicationIDs()");
@@ -355,10 +378,51 @@ static int show_apps(lua_State *l)
   }
 
 
+  /*
+   * In der Kurzform die ISO-Namen aller APPs mit einem einzigen Kommando
+   * abfragen. Nicht jede APP besitzt einen Namen, deshalb bleibt
+   * GetApplicationIDs() die maßgebliche Liste.
+   */
+  dfs  = NULL;
+  ndfs = 0;
+  if(brief)
+  {
+    STATS(result, "GetDFNames", mifare_desfire_get_df_names(tag, &dfs, &ndfs));
+    if(result < 0)
+    {
+      /*
+       * Ältere Karten kennen das Kommando nicht, die APPs besitzen dann
+       * keine Namen. Der Fehler beendet aber die Authentifizierung, die wir
+       * ggf. wiederherstellen.
+       */
+      session_reset();
+      dfs  = NULL;
+      ndfs = 0;
+
+      if(haspmk)
+      {
+        STATS(result, "SelectApplication", session_select(0));
+        if(result >= 0)
+          STATS(result, "Authenticate", session_auth(0, &pmk));
+        if(result < 0)
+          show_handle_error(tag, "Authenticate(0)");
+      }
+    }
+  }
+
+
   /* APPs auflisten. */
   printf("\n");
-  printf("AID        AKC   CONF  FILE  LIST  AMKC  KEYS\n");
-  printf("---------------------------------------------\n");
+  if(brief)
+  {
+    printf("AID       ISOFID  DFNAME\n");
+    printf("----------------------------------------\n");
+  }
+  else
+  {
+    printf("AID        AKC   CONF  FILE  LIST  AMKC  KEYS\n");
+    printf("---------------------------------------------\n");
+  }
 
   lua_checkstack(l, 1);
 
@@ -366,16 +430,43 @@ static int show_apps(lua_State *l)
   {
     uint32_t aid;
     uint8_t err;
-    MifareDESFireKey amk;
+    struct session_key amk;
     uint8_t settings, maxkeys;
 
 
     /* ID auflisten. */
     aid = mifare_desfire_aid_get_aid(apps[i]);
+
+    /* In der Kurzform folgen die ISO-Namen statt der Einstellungen. */
+    if(brief)
+    {
+      printf("0x%06x  ", aid);
+
+      for(j = 0; j < ndfs && dfs[j].aid != aid; j++);
+      if(j < ndfs)
+      {
+        size_t k;
+
+        printf("0x%04x  ", dfs[j].fid);
+        for(k = 0; k < 16 && k < dfs[j].df_name_len; k++)
+        {
+          if(dfs[j].df_name[k] >= 0x20 && dfs[j].df_name[k] < 0x7f)
+            printf("%c", dfs[j].df_name[k]);
+          else
+            printf(".");
+        }
+      }
+      else
+        printf("------  ----------------");
+
+      printf("\n");
+      continue;
+    }
+
     printf("0x%06x : ", aid);
 
     /* APP auswählen. */
-    result = mifare_desfire_select_application(tag, apps[i]);
+    STATS(result, "SelectApplication", session_select(aid));
     if(result < 0)
     {
       show_handle_error(tag, "SelectApplication(0x%06x)", aid);
@@ -383,7 +474,7 @@ static int show_apps(lua_State *l)
     }
 
     /* Auf gut Glück versuchen, die Einstellungen auszulesen. */
-    result = mifare_desfire_get_key_settings(tag, &settings, &maxkeys);
+    STATS(result, "GetKeySettings", mifare_desfire_get_key_settings(tag, &settings, &maxkeys));
     if(result < 0)
     {
       err = mifare_desfire_last_picc_error(tag);
@@ -395,7 +486,7 @@ static int show_apps(lua_State *l)
       }
     }
     else
-      goto skip_amk;
+      goto show_settings;
 
 
     /*
@@ -418,32 +509,32 @@ static int show_apps(lua_State *l)
       continue;
     }
 
-    result = key_get(l, -1, &amk, NULL);
+    result = session_getkey(l, -1, &amk, NULL);
     if(result < 0)
     {
       printf("APP Master Key invalid: %s\n", lua_tostring(l, -1));
       lua_pop(l, 2);
       continue;
     }
+    lua_pop(l, 1);
 
     /* Authentifizierung vornehmen. */
-    result = mifare_desfire_authenticate(tag, 0, amk);
+    STATS(result, "Authenticate", session_auth(0, &amk));
     if(result < 0)
     {
       show_handle_error(tag, "Authenticate(0)");
       continue;
     }
 
-skip_amk:
-
     /* Schlüsseleinstellungen authentifiziert auslesen. */
-    result = mifare_desfire_get_key_settings(tag, &settings, &maxkeys);
+    STATS(result, "GetKeySettings", mifare_desfire_get_key_settings(tag, &settings, &maxkeys));
     if(result < 0)
     {
       show_handle_error(tag, "GetKeySettings()");
       continue;
     }
 
+show_settings:
     /* Einstellungen ausgeben. */
     printf("%s  %s  %s  %s  %s   %2d\n",
       akc[(settings >> 4) & 0x0f],
@@ -454,15 +545,19 @@ skip_amk:
       maxkeys);
   }
   mifare_desfire_free_application_ids(apps);
+  free(dfs);
   printf("\n");
 
+  /* Ohne Einzelabfrage ist die Master-APP weiterhin ausgewählt. */
+  if(brief)
+    return 0;
+
 
-  result = mifare_desfire_select_application(tag, piccapp);
+  STATS(result, "SelectApplication", session_select(0));
   if(result < 0)
     show_handle_error(tag, "SelectApplication(0x000000)");
   else
     printf("Application 0x000000 selected.\nUnauthenticated.\n");
-  free(piccapp);
   printf("\n");
 
 
@@ -502,7 +597,7 @@ static int show_files(__attribute__((unused)) lua_State *l)
 
 
 
-  result = mifare_desfire_get_file_ids(tag, &fids, &len);
+  STATS(result, "GetFileIDs", mifare_desfire_get_file_ids(tag, &fids, &len));
   if(result < 0)
   {
     show_handle_error(tag, "GetFileIDs()");
@@ -518,7 +613,7 @@ static int show_files(__attribute__((unused)) lua_State *l)
     struct mifare_desfire_file_settings settings;
 
 
-    result = mifare_desfire_get_file_settings(tag, fids[i], &settings);
+    STATS(result, "GetFileSettings", mifare_desfire_get_file_settings(tag, fids[i], &settings));
     if(result < 0)
     {
       show_handle_error(tag, "GetFileSettings(%d)", fids[i]);
@@ -0,0 +1,385 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "fn.h"
+#include "stats.h"
+
+
+/*
+ * Laufzeitstatistik
+ *
+ * Jedes Kartenkommando wird zwischen debug_cmd() und debug_result() mit
+ * einer monotonen Uhr gemessen. Aufrufe außerhalb dieser Klammer (z.B. in
+ * den show-Funktionen) werden über das STATS-Makro erfasst. Die Zähler
+ * werden über alle Threads gemeinsam geführt.
+ */
+struct stats_cmd
+{
+  char name[32];
+  unsigned long count;
+  unsigned long errors;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint32_t hist[STATS_BUCKETS];
+};
+
+struct stats_s
+{
+  pthread_mutex_t mutex;
+  struct timespec start;
+  unsigned char started;
+  unsigned int ncmds;
+  struct stats_cmd cmds[STATS_MAXCMDS];
+};
+
+static struct stats_s stats =
+{
+  .mutex   = PTHREAD_MUTEX_INITIALIZER,
+  .started = 0,
+  .ncmds   = 0,
+};
+
+
+/* Das gerade laufende Kommando des jeweiligen Threads. */
+struct stats_cur_s
+{
+  unsigned char pending;
+  char name[32];
+  struct timespec start;
+};
+
+static __thread struct stats_cur_s stcur;
+
+
+static int stats_get(lua_State *l);
+static int stats_reset(lua_State *l);
+static int stats_print(lua_State *l);
+
+
+
+
+void stats_now(struct timespec *ts)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+
+uint64_t stats_since(const struct timespec *ts)
+{
+  struct timespec now;
+
+
+  stats_now(&now);
+
+  return (uint64_t)(now.tv_sec - ts->tv_sec) * 1000000 +
+         (now.tv_nsec - ts->tv_nsec) / 1000;
+}
+
+
+static unsigned int stats_bucket(uint64_t us)
+{
+  unsigned int e;
+
+
+  if(us < (1 << STATS_SUBBITS))
+    return us;
+
+  for(e = STATS_SUBBITS; e < 63 && (us >> (e + 1)) != 0; e++);
+
+  e = (e - STATS_SUBBITS + 1) << STATS_SUBBITS |
+      ((us >> (e - STATS_SUBBITS)) & ((1 << STATS_SUBBITS) - 1));
+
+  return e < STATS_BUCKETS ? e : STATS_BUCKETS - 1;
+}
+
+
+/* Mitte des von einer Klasse abgedeckten Bereichs */
+static uint64_t stats_value(unsigned int bucket)
+{
+  unsigned int e, sub;
+
+
+  if(bucket < (1 << STATS_SUBBITS))
+    return bucket;
+
+  e   = (bucket >> STATS_SUBBITS) - 1;
+  sub = bucket & ((1 << STATS_SUBBITS) - 1);
+
+  return ((uint64_t)((1 << STATS_SUBBITS) + sub) << e) + ((uint64_t)1 << e) / 2;
+}
+
+
+static uint64_t stats_percentile(const struct stats_cmd *c, double q)
+{
+  unsigned long want, sum;
+  unsigned int i;
+  uint64_t v;
+
+
+  if(c->count == 0)
+    return 0;
+
+  want = q * c->count + 0.5;
+  if(want < 1)
+    want = 1;
+
+  sum = 0;
+  for(i = 0; i < STATS_BUCKETS; i++)
+  {
+    sum += c->hist[i];
+    if(sum >= want)
+      break;
+  }
+
+  v = stats_value(i < STATS_BUCKETS ? i : STATS_BUCKETS - 1);
+  if(v < c->min) v = c->min;
+  if(v > c->max) v = c->max;
+
+
+  return v;
+}
+
+
+void stats_add(const char *name, uint64_t us, int failed)
+{
+  struct stats_cmd *c;
+  unsigned int i;
+
+
+  pthread_mutex_lock(&stats.mutex);
+
+  if(!stats.started)
+  {
+    stats_now(&stats.start);
+    stats.started = 1;
+  }
+
+  for(i = 0; i < stats.ncmds && strcmp(stats.cmds[i].name, name); i++);
+  if(i >= STATS_MAXCMDS)
+  {
+    pthread_mutex_unlock(&stats.mutex);
+    return;
+  }
+
+  c = &stats.cmds[i];
+  if(i == stats.ncmds)
+  {
+    memset(c, 0, sizeof(struct stats_cmd));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->min = us;
+    stats.ncmds++;
+  }
+
+  c->count++;
+  if(failed)
+    c->errors++;
+  c->total += us;
+  if(us < c->min) c->min = us;
+  if(us > c->max) c->max = us;
+  c->hist[stats_bucket(us)]++;
+
+  pthread_mutex_unlock(&stats.mutex);
+}
+
+
+void stats_begin(const char *name)
+{
+  snprintf(stcur.name, sizeof(stcur.name), "%s", name);
+  stats_now(&stcur.start);
+  stcur.pending = 1;
+}
+
+
+void stats_end(uint8_t err, const char *str)
+{
+  if(!stcur.pending)
+    return;
+
+  /* Zurückgehaltene Schreibzugriffe sind kein Fehler. */
+  stats_add(stcur.name, stats_since(&stcur.start),
+    err != 0 || (strcmp(str, "OK") && strcmp(str, "Deferred")));
+  stcur.pending = 0;
+}
+
+
+void stats_summary(FILE *out)
+{
+  struct stats_cmd *c;
+  unsigned int i;
+  uint64_t busy;
+
+
+  pthread_mutex_lock(&stats.mutex);
+
+  if(stats.ncmds == 0)
+  {
+    pthread_mutex_unlock(&stats.mutex);
+    return;
+  }
+
+  fprintf(out, "%-24s %8s %6s %9s %9s %9s %9s %9s\n",
+    "COMMAND", "COUNT", "ERR", "MEAN/ms", "P50/ms", "P90/ms", "P99/ms", "MAX/ms");
+
+  busy = 0;
+  for(i = 0; i < stats.ncmds; i++)
+  {
+    c = &stats.cmds[i];
+    busy += c->total;
+
+    fprintf(out, "%-24s %8lu %6lu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+      c->name, c->count, c->errors,
+      c->total / 1e3 / c->count,
+      stats_percentile(c, 0.50) / 1e3,
+      stats_percentile(c, 0.90) / 1e3,
+      stats_percentile(c, 0.99) / 1e3,
+      c->max / 1e3);
+  }
+
+  fprintf(out, "%.3f s in card commands, %.3f s elapsed\n",
+    busy / 1e6, stats_since(&stats.start) / 1e6);
+
+  pthread_mutex_unlock(&stats.mutex);
+}
+
+
+
+
+FN_ALIAS(stats_get) = { "get", NULL };
+FN_PARAM(stats_get) =
+{
+  FNPARAMEND
+};
+FN_RET(stats_get) =
+{
+  FNPARAM("stats", "Statistics by Command", 0),
+  FNPARAMEND
+};
+FN("stats", stats_get, "Get Command Statistics",
+"Returns a table indexed by command name. Each entry contains the number of\n" \
+"executions (count), the number of failures (errors) and the total, mean,\n" \
+"minimum, maximum and median latency as well as the 90th and 99th\n" \
+"percentile (total, mean, min, max, p50, p90, p99) in seconds. Percentiles\n" \
+"are taken from a histogram with a relative error of up to 12.5 %. The\n" \
+"field elapsed of the table holds the time since the first command.\n");
+
+
+static int stats_get(lua_State *l)
+{
+  struct stats_cmd *c;
+  unsigned int i;
+
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 3);
+  lua_newtable(l);
+
+  pthread_mutex_lock(&stats.mutex);
+
+  for(i = 0; i < stats.ncmds; i++)
+  {
+    c = &stats.cmds[i];
+
+    lua_newtable(l);
+    lua_pushinteger(l, c->count);                        lua_setfield(l, -2, "count");
+    lua_pushinteger(l, c->errors);                       lua_setfield(l, -2, "errors");
+    lua_pushnumber(l, c->total / 1e6);                   lua_setfield(l, -2, "total");
+    lua_pushnumber(l, c->total / 1e6 / c->count);        lua_setfield(l, -2, "mean");
+    lua_pushnumber(l, c->min / 1e6);                     lua_setfield(l, -2, "min");
+    lua_pushnumber(l, c->max / 1e6);                     lua_setfield(l, -2, "max");
+    lua_pushnumber(l, stats_percentile(c, 0.50) / 1e6);  lua_setfield(l, -2, "p50");
+    lua_pushnumber(l, stats_percentile(c, 0.90) / 1e6);  lua_setfield(l, -2, "p90");
+    lua_pushnumber(l, stats_percentile(c, 0.99) / 1e6);  lua_setfield(l, -2, "p99");
+    lua_setfield(l, -2, c->name);
+  }
+
+  if(stats.started)
+  {
+    lua_pushnumber(l, stats_since(&stats.start) / 1e6);
+    lua_setfield(l, -2, "elapsed");
+  }
+
+  pthread_mutex_unlock(&stats.mutex);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(stats_reset) = { "reset", NULL };
+FN_PARAM(stats_reset) =
+{
+  FNPARAMEND
+};
+FN_RET(stats_reset) =
+{
+  FNPARAMEND
+};
+FN("stats", stats_reset, "Reset Command Statistics", NULL);
+
+
+static int stats_reset(lua_State *l)
+{
+  (void)l;
+
+  pthread_mutex_lock(&stats.mutex);
+  stats.ncmds   = 0;
+  stats.started = 0;
+  pthread_mutex_unlock(&stats.mutex);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(stats_print) = { "print", NULL };
+FN_PARAM(stats_print) =
+{
+  FNPARAMEND
+};
+FN_RET(stats_print) =
+{
+  FNPARAMEND
+};
+FN("stats", stats_print, "Print Command Statistics",
+"Prints the number of executions, failures and the mean, median, 90th and\n" \
+"99th percentile and maximum latency of each command.\n");
+
+
+static int stats_print(lua_State *l)
+{
+  (void)l;
+
+  stats_summary(stdout);
+
+
+  return 0;
+}
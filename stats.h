@@ -0,0 +1,66 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_STATS_H_
+#define _DESF_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fn.h"
+
+
+/*
+ * Laufzeit eines Aufrufs, der nicht über debug_cmd() und debug_result()
+ * geklammert ist, erfassen.
+ */
+#define STATS(result, name, call) \
+  do \
+  { \
+    struct timespec _t0; \
+    stats_now(&_t0); \
+    (result) = (call); \
+    stats_add((name), stats_since(&_t0), (result) < 0); \
+  } while(0)
+
+
+/*
+ * Histogramm nach dem Vorbild von HDR-Histogrammen: Jede Zweierpotenz
+ * (in Mikrosekunden) ist in 2^STATS_SUBBITS gleich breite Klassen
+ * unterteilt. Der relative Fehler beträgt damit höchstens 12,5 %.
+ */
+#define STATS_SUBBITS	3
+#define STATS_BUCKETS	272
+#define STATS_MAXCMDS	64
+
+
+extern void stats_now(struct timespec *ts);
+extern uint64_t stats_since(const struct timespec *ts);
+extern void stats_add(const char *name, uint64_t us, int failed);
+extern void stats_begin(const char *name);
+extern void stats_end(uint8_t err, const char *str);
+extern void stats_summary(FILE *out);
+
+extern FNDECL(stats_get);
+extern FNDECL(stats_reset);
+extern FNDECL(stats_print);
+
+
+#endif
@@ -0,0 +1,66 @@
+-- Standard-Benchmarks für "make bench"
+--
+-- Die Kartenkommandos laufen gegen die emulierte Karte, die bei jedem Start
+-- leer ist:
+--
+--   ./desfsh -E -t 0 -c 'dofile("test/bench.lua")'
+--
+-- BENCH_OUT benennt die Datei, an die die Ergebnisse als JSON-Zeilen
+-- angehängt werden, BENCH_LABEL die Bezeichnung (z.B. die Revision).
+
+local data = {}
+for i = 1, 256 do
+  data[i] = (i - 1) % 256
+end
+
+local hex = buf.tohexstr(data)
+local mk  = "00112233445566778899aabbccddeeff"
+
+
+bench.run("buf.fromhexstr/256",     function() buf.fromhexstr(hex) end, 10000)
+bench.run("buf.tohexstr/256",       function() buf.tohexstr(data) end, 10000)
+bench.run("buf.totable/256",        function() buf.totable(hex) end, 10000)
+bench.run("buf.hexdump/256",        function() buf.hexdump(data) end, 2000)
+bench.run("crypto.cmac/aes/256",    function() crypto.cmac("AES-128-CBC", data, mk) end, 5000)
+bench.run("crypto.hmac/sha256/256", function() crypto.hmac("SHA256", data, mk) end, 5000)
+bench.run("key.div/aes",            function() key.div(AES(mk), "04444553465348", "0x000001", "0x01") end, 5000)
+
+
+-- Kartenkommandos
+local function check(code, err)
+  if code ~= 0 then
+    error(err)
+  end
+end
+
+local acl = { rd = 0, wr = 0, rw = 0, ca = 0 }
+
+check(cmd.select(0))
+check(cmd.auth(0, DES()))
+check(cmd.format())
+check(cmd.capp("AES", 1, 0x0f, 2))
+check(cmd.select(1))
+check(cmd.auth(0, AES()))
+check(cmd.csdf(0, "CRYPT", acl, 32))
+check(cmd.csdf(1, "CRYPT", acl, 1024))
+check(cmd.cvf(2, "MAC", acl, 0, 1000000, 0))
+
+local big = {}
+for i = 1, 1024 do
+  big[i] = i % 256
+end
+
+bench.run("cmd.getver",             function() check(cmd.getver()) end, 500)
+bench.run("cmd.auth/aes",           function() check(cmd.auth(0, AES())) end, 500)
+bench.run("cmd.write/32/crypt",     function() check(cmd.write(0, 0, hex:sub(1, 64), "CRYPT")) end, 500)
+bench.run("cmd.read/32/crypt",      function() check(cmd.read(0, 0, 32, "CRYPT")) end, 500)
+bench.run("cmd.write/1024/crypt",   function() check(cmd.write(1, 0, big, "CRYPT")) end, 200)
+bench.run("cmd.read/1024/crypt",    function() check(cmd.read(1, 0, 1024, "CRYPT")) end, 200)
+bench.run("cmd.credit+commit/mac",  function() check(cmd.credit(2, 1, "MAC")) check(cmd.commit()) end, 500)
+
+
+bench.print()
+
+if os.getenv("BENCH_OUT") then
+  assert(bench.save(os.getenv("BENCH_OUT"), os.getenv("BENCH_LABEL")), "unable to write results")
+end
@@ -0,0 +1,206 @@
+-- Transaktionen, Datensätze und Wertdateien der emulierten Karte prüfen:
+--
+--   ./desfsh -E -t 0 -c 'dofile("test/emul.lua")'
+--
+-- Die Dateien sind frei zugänglich, damit erwartete Fehler (die auf der
+-- Karte die Authentifizierung beenden) die folgenden Kommandos nicht stören.
+
+local BOUNDARY_ERROR    = 0xbe
+local PERMISSION_DENIED = 0x9d
+
+local function check(code, err, ...)
+  if code ~= 0 then
+    error(err, 2)
+  end
+  return ...
+end
+
+local function expect(want, code, err)
+  if code ~= want then
+    error(string.format("expected status 0x%02x, got 0x%02x (%s)", want, code, tostring(err)), 2)
+  end
+end
+
+local function data(fid, len)
+  return buf.tohexstr(check(cmd.read(fid, 0, len)))
+end
+
+local function records(fid)
+  return buf.tohexstr(check(cmd.rrec(fid, 0, 0)))
+end
+
+local function nrecs(fid)
+  return check(cmd.gfs(fid)).crec
+end
+
+local function value(fid)
+  return check(cmd.getval(fid))
+end
+
+local free = { rd = 0xe, wr = 0xe, rw = 0xe, ca = 0 }
+
+
+check(cmd.select(0))
+check(cmd.auth(0, DES()))
+check(cmd.format())
+check(cmd.capp("AES", 1, 0x0f, 2))
+check(cmd.select(1))
+
+
+-- Sicherungsdatei: Geschriebenes gilt erst nach dem Commit.
+check(cmd.cbdf(1, "PLAIN", free, 8))
+
+check(cmd.write(1, 0, "1122334455667788"))
+assert(data(1, 8) == "0000000000000000")
+check(cmd.abort())
+assert(data(1, 8) == "0000000000000000")
+
+check(cmd.write(1, 0, "1122334455667788"))
+check(cmd.write(1, 4, "aabb"))
+check(cmd.commit())
+assert(data(1, 8) == "11223344aabb7788")
+
+-- SelectApplication verwirft eine offene Transaktion.
+check(cmd.write(1, 0, "ffffffffffffffff"))
+check(cmd.select(1))
+assert(data(1, 8) == "11223344aabb7788")
+
+
+-- Wertdatei mit begrenzter Gutschrift
+check(cmd.cvf(2, "PLAIN", free, 0, 1000, 100, true))
+
+check(cmd.credit(2, 50))
+assert(value(2) == 100)
+check(cmd.abort())
+assert(value(2) == 100)
+
+expect(BOUNDARY_ERROR, cmd.debit(2, 101))
+check(cmd.abort())
+
+check(cmd.debit(2, 20))
+check(cmd.debit(2, 10))
+check(cmd.commit())
+assert(value(2) == 70)
+assert(check(cmd.gfs(2)).lcred == 30)
+
+-- Begrenzt gutgeschrieben werden darf höchstens die letzte Abbuchung.
+expect(BOUNDARY_ERROR, cmd.lcredit(2, 31))
+check(cmd.abort())
+check(cmd.lcredit(2, 30))
+check(cmd.commit())
+assert(value(2) == 100)
+
+-- Danach ist die Grenze aufgebraucht.
+expect(BOUNDARY_ERROR, cmd.lcredit(2, 1))
+check(cmd.abort())
+
+-- Eine normale Gutschrift hebt die Grenze ebenfalls auf.
+check(cmd.debit(2, 40))
+check(cmd.commit())
+check(cmd.credit(2, 5))
+check(cmd.commit())
+expect(BOUNDARY_ERROR, cmd.lcredit(2, 1))
+check(cmd.abort())
+assert(value(2) == 65)
+
+-- Ohne Freigabe ist keine begrenzte Gutschrift möglich.
+check(cmd.cvf(3, "PLAIN", free, 0, 1000, 100))
+check(cmd.debit(3, 10))
+check(cmd.commit())
+expect(PERMISSION_DENIED, cmd.lcredit(3, 10))
+check(cmd.abort())
+assert(value(3) == 90)
+
+-- cmd.values() führt alles in einer Transaktion aus oder nichts.
+local code, err, idx = cmd.values({ { 2, "credit", 10 }, { 3, "debit", 1000 } })
+expect(BOUNDARY_ERROR, code, err)
+assert(idx == 2)
+assert(value(2) == 65 and value(3) == 90)
+
+local vals = check(cmd.values({ { 2, "credit", 10 }, { 3, "debit", 5 } }, true))
+assert(vals[2] == 75 and vals[3] == 85)
+
+
+-- Lineare Datensatzdatei
+check(cmd.clrf(4, "PLAIN", free, 4, 3))
+
+check(cmd.wrec(4, 0, "01000000"))
+assert(nrecs(4) == 0)
+check(cmd.abort())
+assert(nrecs(4) == 0)
+
+-- Je Transaktion entsteht nur ein Datensatz, weitere Schreibzugriffe
+-- ändern ihn.
+check(cmd.wrec(4, 0, "01000000"))
+check(cmd.wrec(4, 2, "0101"))
+check(cmd.commit())
+assert(records(4) == "01000101")
+
+check(cmd.wrecs(4, { "02000000", "03000000" }))
+assert(records(4) == "010001010200000003000000")
+
+-- Der Versatz zählt vom neuesten Datensatz.
+assert(buf.tohexstr(check(cmd.rrec(4, 1, 0))) == "0100010102000000")
+
+local n = 0
+for i, rec in cmd.records(4, nil, 2) do
+  n = n + 1
+  assert(i == n)
+  assert(buf.tohexstr(rec):sub(1, 2) == string.format("%02x", i))
+end
+assert(n == 3)
+
+-- Eine volle lineare Datei nimmt nichts mehr auf.
+expect(BOUNDARY_ERROR, cmd.wrec(4, 0, "04000000"))
+check(cmd.abort())
+assert(nrecs(4) == 3)
+
+-- Löschen gilt ebenfalls erst nach dem Commit.
+check(cmd.crec(4))
+check(cmd.abort())
+assert(nrecs(4) == 3)
+check(cmd.crec(4))
+check(cmd.commit())
+assert(nrecs(4) == 0)
+
+-- cmd.wrecs() meldet den ersten fehlgeschlagenen Datensatz.
+code, err, idx = cmd.wrecs(4, { "0a000000", "0b000000", "0c000000", "0d000000" })
+expect(BOUNDARY_ERROR, code, err)
+assert(idx == 4)
+assert(records(4) == "0a0000000b0000000c000000")
+
+-- Ein ungültiger Datensatz wird vor dem ersten Kommando mit seinem Index
+-- gemeldet.
+local ok, msg = pcall(cmd.wrecs, 4, { "0e000000", "xyz", "0f000000" })
+assert(not ok and msg:find("record 2:", 1, true))
+assert(nrecs(4) == 3)
+
+
+-- Zyklische Datensatzdatei: Ein Datensatz bleibt für die Transaktion frei,
+-- danach wird der älteste überschrieben.
+check(cmd.ccrf(5, "PLAIN", free, 2, 3))
+
+check(cmd.wrecs(5, { "0001", "0002" }))
+assert(nrecs(5) == 2)
+assert(records(5) == "00010002")
+
+check(cmd.wrec(5, 0, "0003"))
+assert(records(5) == "00010002")
+check(cmd.commit())
+assert(nrecs(5) == 2)
+assert(records(5) == "00020003")
+
+check(cmd.wrecs(5, { "0004", "0005", "0006" }))
+assert(records(5) == "00050006")
+
+
+-- Verschlüsselte Sicherungsdatei unter Authentifizierung
+check(cmd.auth(0, AES()))
+check(cmd.cbdf(6, "CRYPT", { rd = 0, wr = 0, rw = 0, ca = 0 }, 32))
+check(cmd.write(6, 0, string.rep("5a", 32), "CRYPT"))
+assert(buf.tohexstr(check(cmd.read(6, 0, 32, "CRYPT"))) == string.rep("00", 32))
+check(cmd.commit())
+assert(buf.tohexstr(check(cmd.read(6, 0, 32, "CRYPT"))) == string.rep("5a", 32))
+
+
+print("All emulator checks passed.")
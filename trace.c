@@ -0,0 +1,913 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <nfc/nfc.h>
+#include <openssl/rand.h>
+
+#include "buffer.h"
+#include "fn.h"
+#include "emul.h"
+#include "replay.h"
+#include "trace.h"
+
+
+/*
+ * APDU-Trace
+ *
+ * Wir überdecken nfc_initiator_transceive_bytes() von libnfc. Da libfreefare
+ * diese Funktion für jeden Rahmen aufruft, landen alle ausgetauschten
+ * Rahmen hier, bevor wir sie an libnfc weiterreichen. Die Rahmen werden
+ * ohne Formatierung in einen Ringpuffer fester Größe kopiert, sodass die
+ * Aufzeichnung im Betrieb immer eingeschaltet bleiben kann. Geschrieben
+ * wird nur auf Anforderung oder nach einem fehlgeschlagenen Kommando.
+ * Zusätzlich kann jeder Rahmen sofort in eine Datei geschrieben werden,
+ * um längere Abläufe vollständig für die Wiedergabe aufzuzeichnen.
+ *
+ * Dieselbe Schnittstelle dient als Transportschicht für Ersatzgeräte:
+ * Gehört das Gerät zur Wiedergabe einer Aufzeichnung (replay.c) oder zur
+ * emulierten Karte (emul.c), beantwortet dieses die Aufrufe, statt sie an
+ * libnfc weiterzureichen.
+ */
+struct trace_rec
+{
+  uint64_t ts;
+  uint8_t dir;
+  uint8_t flags;
+  uint16_t len;
+  uint8_t data[TRACE_MAXFRAME];
+};
+
+struct trace_next
+{
+  __typeof__(nfc_initiator_transceive_bytes)      *transceive;
+  __typeof__(nfc_initiator_init)                  *init;
+  __typeof__(nfc_initiator_list_passive_targets)  *list;
+  __typeof__(nfc_initiator_select_passive_target) *select;
+  __typeof__(nfc_initiator_deselect_target)       *deselect;
+  __typeof__(nfc_initiator_target_is_present)     *present;
+  __typeof__(nfc_device_set_property_bool)        *setprop;
+  __typeof__(nfc_device_get_supported_baud_rate)  *bitrates;
+  __typeof__(nfc_device_get_last_error)           *lasterror;
+  __typeof__(nfc_strerror)                        *strerror;
+  __typeof__(nfc_device_get_name)                 *name;
+  __typeof__(nfc_device_get_connstring)           *connstring;
+  __typeof__(nfc_abort_command)                   *abort;
+  __typeof__(nfc_close)                           *close;
+  __typeof__(RAND_bytes)                          *rand;
+};
+
+struct trace_s
+{
+  pthread_mutex_t mutex;
+  pthread_once_t once;
+  struct trace_next next;
+  unsigned char enabled;
+  struct trace_rec *ring;
+  unsigned long head;
+  char *autodump;
+  FILE *stream;
+};
+
+static struct trace_s trace =
+{
+  .mutex    = PTHREAD_MUTEX_INITIALIZER,
+  .once     = PTHREAD_ONCE_INIT,
+  .enabled  = 1,
+  .ring     = NULL,
+  .head     = 0,
+  .autodump = NULL,
+  .stream   = NULL,
+};
+
+
+/*
+ * Zuletzt ausgewählte Karte des Threads. Hier landet auch die Auswahl
+ * innerhalb von mifare_desfire_connect(), deren ATS uns libfreefare sonst
+ * nicht verrät.
+ */
+static __thread nfc_target trace_sel;
+static __thread unsigned char trace_hassel = 0;
+
+
+static const struct trace_backend *trace_backends[] =
+{
+  &replay_backend,
+  &emul_backend,
+  NULL,
+};
+
+
+static int trace_enable(lua_State *l);
+static int trace_ldump(lua_State *l);
+static int trace_lrecord(lua_State *l);
+static int trace_clear(lua_State *l);
+static int trace_last(lua_State *l);
+static int trace_stats(lua_State *l);
+
+
+
+
+static void trace_init()
+{
+  trace.next.transceive = dlsym(RTLD_NEXT, "nfc_initiator_transceive_bytes");
+  trace.next.init       = dlsym(RTLD_NEXT, "nfc_initiator_init");
+  trace.next.list       = dlsym(RTLD_NEXT, "nfc_initiator_list_passive_targets");
+  trace.next.select     = dlsym(RTLD_NEXT, "nfc_initiator_select_passive_target");
+  trace.next.deselect   = dlsym(RTLD_NEXT, "nfc_initiator_deselect_target");
+  trace.next.present    = dlsym(RTLD_NEXT, "nfc_initiator_target_is_present");
+  trace.next.setprop    = dlsym(RTLD_NEXT, "nfc_device_set_property_bool");
+  trace.next.bitrates   = dlsym(RTLD_NEXT, "nfc_device_get_supported_baud_rate");
+  trace.next.lasterror  = dlsym(RTLD_NEXT, "nfc_device_get_last_error");
+  trace.next.strerror   = dlsym(RTLD_NEXT, "nfc_strerror");
+  trace.next.name       = dlsym(RTLD_NEXT, "nfc_device_get_name");
+  trace.next.connstring = dlsym(RTLD_NEXT, "nfc_device_get_connstring");
+  trace.next.abort      = dlsym(RTLD_NEXT, "nfc_abort_command");
+  trace.next.close      = dlsym(RTLD_NEXT, "nfc_close");
+  trace.next.rand       = dlsym(RTLD_NEXT, "RAND_bytes");
+}
+
+
+static const struct trace_backend *trace_backend(const nfc_device *pnd)
+{
+  const struct trace_backend **b;
+
+
+  for(b = trace_backends; *b != NULL; b++)
+    if((*b)->owns(pnd))
+      return *b;
+
+
+  return NULL;
+}
+
+
+static int trace_write(FILE *out, const struct trace_rec *r)
+{
+  uint8_t hdr[12];
+  unsigned int i, len;
+
+
+  for(i = 0; i < 8; i++)
+    hdr[i] = r->ts >> (8 * i);
+  hdr[8]  = r->dir;
+  hdr[9]  = r->flags;
+  hdr[10] = r->len;
+  hdr[11] = r->len >> 8;
+
+  len = r->len > TRACE_MAXFRAME ? TRACE_MAXFRAME : r->len;
+  if(fwrite(hdr, sizeof(hdr), 1, out) != 1 || fwrite(r->data, 1, len, out) != len)
+    return -1;
+
+
+  return 0;
+}
+
+
+static void trace_record(uint8_t dir, const uint8_t *data, size_t len)
+{
+  struct trace_rec *r, rec;
+  struct timespec ts;
+  unsigned char ring;
+
+
+  if(!trace.enabled && trace.stream == NULL)
+    return;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  pthread_mutex_lock(&trace.mutex);
+
+  /*
+   * Zufallszahlen der Authentifizierung landen nur in einer ausdrücklich
+   * gestarteten Aufzeichnung, nie im Ringpuffer und damit auch nicht in
+   * den Fehlerabzügen.
+   */
+  ring = trace.enabled && dir != TRACE_RAND;
+  if(!ring && trace.stream == NULL)
+  {
+    pthread_mutex_unlock(&trace.mutex);
+    return;
+  }
+
+  if(ring && trace.ring == NULL)
+    trace.ring = malloc(TRACE_SLOTS * sizeof(struct trace_rec));
+
+  r = ring && trace.ring != NULL ? &trace.ring[trace.head++ % TRACE_SLOTS] : &rec;
+  r->ts    = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  r->dir   = dir;
+  r->flags = len > TRACE_MAXFRAME ? TRACE_TRUNC : 0;
+  r->len   = len > 0xffff ? 0xffff : len;
+  memcpy(r->data, data, len > TRACE_MAXFRAME ? TRACE_MAXFRAME : len);
+
+  /* Ein Schreibfehler beendet die Aufzeichnung in die Datei. */
+  if(trace.stream != NULL && trace_write(trace.stream, r))
+  {
+    fprintf(stderr, "Unable to write trace stream. Recording stopped.\n");
+    fclose(trace.stream);
+    trace.stream = NULL;
+  }
+
+  pthread_mutex_unlock(&trace.mutex);
+}
+
+
+/*
+ * Tags werden mit Modulation, ATQA, SAK, UID und ATS aufgezeichnet. Das
+ * genügt libfreefare, um den Tag bei der Wiedergabe wiederzuerkennen.
+ */
+static void trace_target(const nfc_target *target)
+{
+  const nfc_iso14443a_info *nai;
+  uint8_t data[TRACE_MAXFRAME];
+  size_t uidlen, atslen;
+
+
+  if(target->nm.nmt != NMT_ISO14443A)
+    return;
+
+  nai = &target->nti.nai;
+  uidlen = nai->szUidLen > sizeof(nai->abtUid) ? sizeof(nai->abtUid) : nai->szUidLen;
+  atslen = nai->szAtsLen > TRACE_MAXFRAME - 18 ? TRACE_MAXFRAME - 18 : nai->szAtsLen;
+
+  data[0] = target->nm.nmt;
+  data[1] = target->nm.nbr;
+  data[2] = nai->abtAtqa[0];
+  data[3] = nai->abtAtqa[1];
+  data[4] = nai->btSak;
+  data[5] = uidlen;
+  memset(data + 6, 0, 10);
+  memcpy(data + 6, nai->abtUid, uidlen);
+  data[16] = atslen;
+  memcpy(data + 17, nai->abtAts, atslen);
+
+  trace_record(TRACE_TARGET, data, 17 + atslen);
+}
+
+
+const nfc_target *trace_selected()
+{
+  return trace_hassel ? &trace_sel : NULL;
+}
+
+
+int trace_target_unpack(const uint8_t *data, size_t len, nfc_target *target)
+{
+  nfc_iso14443a_info *nai;
+
+
+  if(len < 17 || data[0] != NMT_ISO14443A || data[5] > 10 || len != 17 + (size_t)data[16])
+    return -1;
+
+  memset(target, 0, sizeof(nfc_target));
+  nai = &target->nti.nai;
+
+  target->nm.nmt  = data[0];
+  target->nm.nbr  = data[1];
+  nai->abtAtqa[0] = data[2];
+  nai->abtAtqa[1] = data[3];
+  nai->btSak      = data[4];
+  nai->szUidLen   = data[5];
+  memcpy(nai->abtUid, data + 6, data[5]);
+  nai->szAtsLen   = data[16];
+  memcpy(nai->abtAts, data + 17, data[16]);
+
+
+  return 0;
+}
+
+
+
+
+int nfc_initiator_transceive_bytes(nfc_device *pnd, const uint8_t *pbtTx, const size_t szTx,
+  uint8_t *pbtRx, const size_t szRx, int timeout)
+{
+  const struct trace_backend *b;
+  int result;
+  uint8_t code[4];
+
+
+  pthread_once(&trace.once, trace_init);
+
+  trace_record(TRACE_TX, pbtTx, szTx);
+
+  if((b = trace_backend(pnd)) != NULL)
+    result = b->transceive(pbtTx, szTx, pbtRx, szRx);
+  else if(trace.next.transceive != NULL)
+    result = trace.next.transceive(pnd, pbtTx, szTx, pbtRx, szRx, timeout);
+  else
+    result = NFC_ESOFT;
+
+  if(result >= 0)
+    trace_record(TRACE_RX, pbtRx, result);
+  else
+  {
+    code[0] = result;
+    code[1] = result >> 8;
+    code[2] = result >> 16;
+    code[3] = result >> 24;
+    trace_record(TRACE_ERR, code, sizeof(code));
+  }
+
+
+  return result;
+}
+
+
+int nfc_initiator_list_passive_targets(nfc_device *pnd, const nfc_modulation nm, nfc_target ant[], const size_t szTargets)
+{
+  const struct trace_backend *b;
+  int result, i;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    result = b->list(nm, ant, szTargets);
+  else if(trace.next.list != NULL)
+    result = trace.next.list(pnd, nm, ant, szTargets);
+  else
+    result = NFC_ESOFT;
+
+  for(i = 0; i < result; i++)
+    trace_target(&ant[i]);
+
+
+  return result;
+}
+
+
+int nfc_initiator_select_passive_target(nfc_device *pnd, const nfc_modulation nm,
+  const uint8_t *pbtInitData, const size_t szInitData, nfc_target *pnt)
+{
+  const struct trace_backend *b;
+  int result;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    result = b->select(nm, pbtInitData, szInitData, pnt);
+  else if(trace.next.select != NULL)
+    result = trace.next.select(pnd, nm, pbtInitData, szInitData, pnt);
+  else
+    result = NFC_ESOFT;
+
+  if(result > 0 && pnt != NULL)
+  {
+    trace_target(pnt);
+    trace_sel = *pnt;
+    trace_hassel = 1;
+  }
+  else
+    trace_hassel = 0;
+
+
+  return result;
+}
+
+
+/*
+ * Die Zufallszahlen der Authentifizierung werden aufgezeichnet und bei der
+ * Wiedergabe aus der Aufzeichnung bedient. Nur so stimmen die gesendeten
+ * Rahmen mit den aufgezeichneten überein.
+ */
+int RAND_bytes(unsigned char *buf, int num)
+{
+  int result;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if(replay_rand(buf, num) == 0)
+    result = 1;
+  else if(trace.next.rand != NULL)
+    result = trace.next.rand(buf, num);
+  else
+    result = 0;
+
+  if(result == 1 && num > 0)
+    trace_record(TRACE_RAND, buf, num);
+
+
+  return result;
+}
+
+
+/*
+ * Die übrigen Funktionen von libnfc, die desfsh und libfreefare nutzen,
+ * reichen wir nur weiter bzw. beantworten sie für Ersatzgeräte.
+ */
+int nfc_initiator_init(nfc_device *pnd)
+{
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+    return 0;
+
+
+  return trace.next.init != NULL ? trace.next.init(pnd) : NFC_ESOFT;
+}
+
+
+int nfc_initiator_deselect_target(nfc_device *pnd)
+{
+  const struct trace_backend *b;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    return b->deselect();
+
+
+  return trace.next.deselect != NULL ? trace.next.deselect(pnd) : NFC_ESOFT;
+}
+
+
+int nfc_initiator_target_is_present(nfc_device *pnd, const nfc_target *pnt)
+{
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+    return 0;
+
+
+  return trace.next.present != NULL ? trace.next.present(pnd, pnt) : NFC_ESOFT;
+}
+
+
+int nfc_device_set_property_bool(nfc_device *pnd, const nfc_property property, const bool bEnable)
+{
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+    return 0;
+
+
+  return trace.next.setprop != NULL ? trace.next.setprop(pnd, property, bEnable) : NFC_ESOFT;
+}
+
+
+int nfc_device_get_supported_baud_rate(nfc_device *pnd, const nfc_modulation_type nmt, const nfc_baud_rate **const supported_br)
+{
+  static const nfc_baud_rate rates[] = { NBR_847, NBR_424, NBR_212, NBR_106, NBR_UNDEFINED };
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+  {
+    *supported_br = rates;
+    return 0;
+  }
+
+
+  return trace.next.bitrates != NULL ? trace.next.bitrates(pnd, nmt, supported_br) : NFC_ESOFT;
+}
+
+
+int nfc_device_get_last_error(const nfc_device *pnd)
+{
+  const struct trace_backend *b;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    return b->error();
+
+
+  return trace.next.lasterror != NULL ? trace.next.lasterror(pnd) : NFC_ESOFT;
+}
+
+
+const char *nfc_strerror(const nfc_device *pnd)
+{
+  const struct trace_backend *b;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    return b->strerror();
+
+
+  return trace.next.strerror != NULL ? trace.next.strerror(pnd) : "Unknown error";
+}
+
+
+const char *nfc_device_get_name(nfc_device *pnd)
+{
+  const struct trace_backend *b;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    return b->name;
+
+
+  return trace.next.name != NULL ? trace.next.name(pnd) : "";
+}
+
+
+const char *nfc_device_get_connstring(nfc_device *pnd)
+{
+  const struct trace_backend *b;
+
+
+  pthread_once(&trace.once, trace_init);
+
+  if((b = trace_backend(pnd)) != NULL)
+    return b->connstring;
+
+
+  return trace.next.connstring != NULL ? trace.next.connstring(pnd) : "";
+}
+
+
+int nfc_abort_command(nfc_device *pnd)
+{
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+    return 0;
+
+
+  return trace.next.abort != NULL ? trace.next.abort(pnd) : NFC_ESOFT;
+}
+
+
+void nfc_close(nfc_device *pnd)
+{
+  pthread_once(&trace.once, trace_init);
+
+  if(trace_backend(pnd) != NULL)
+    return;
+
+  if(trace.next.close != NULL)
+    trace.next.close(pnd);
+}
+
+
+
+
+int trace_dump(const char *filename)
+{
+  FILE *out;
+  unsigned long i, first;
+  int result;
+
+
+  out = fopen(filename, "wb");
+  if(out == NULL)
+    return -1;
+
+  result = fwrite(TRACE_MAGIC, 8, 1, out) == 1 ? 0 : -1;
+
+  pthread_mutex_lock(&trace.mutex);
+
+  first = trace.head > TRACE_SLOTS ? trace.head - TRACE_SLOTS : 0;
+  for(i = first; i < trace.head && result == 0; i++)
+    result = trace_write(out, &trace.ring[i % TRACE_SLOTS]);
+
+  pthread_mutex_unlock(&trace.mutex);
+
+  if(fclose(out))
+    result = -1;
+
+
+  return result;
+}
+
+
+/*
+ * Alle folgenden Rahmen zusätzlich in die Datei schreiben. Ohne Dateinamen
+ * wird die laufende Aufzeichnung beendet.
+ */
+int trace_stream(const char *filename)
+{
+  FILE *out;
+  int result;
+
+
+  out = NULL;
+  if(filename != NULL)
+  {
+    out = fopen(filename, "wb");
+    if(out == NULL)
+      return -1;
+
+    if(fwrite(TRACE_MAGIC, 8, 1, out) != 1)
+    {
+      fclose(out);
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&trace.mutex);
+  result = trace.stream != NULL && fclose(trace.stream) ? -1 : 0;
+  trace.stream = out;
+  pthread_mutex_unlock(&trace.mutex);
+
+
+  return filename != NULL ? 0 : result;
+}
+
+
+void trace_autodump(const char *filename)
+{
+  free(trace.autodump);
+  trace.autodump = filename != NULL ? strdup(filename) : NULL;
+}
+
+
+/*
+ * Nach einem fehlgeschlagenen Kommando den Verlauf sichern. Die Datei
+ * enthält so immer die Vorgeschichte des letzten Fehlers.
+ */
+void trace_error()
+{
+  if(trace.autodump == NULL)
+    return;
+
+  if(trace_dump(trace.autodump))
+    fprintf(stderr, "Unable to write trace file '%s'.\n", trace.autodump);
+}
+
+
+
+
+FN_ALIAS(trace_enable) = { "enable", NULL };
+FN_PARAM(trace_enable) =
+{
+  FNPARAM("enable", "Enable Recording", 1),
+  FNPARAMEND
+};
+FN_RET(trace_enable) =
+{
+  FNPARAM("enabled", "Previous State", 0),
+  FNPARAMEND
+};
+FN("trace", trace_enable, "Enable Frame Recording",
+"Enables or disables the recording of the frames exchanged with the reader.\n" \
+"Recording is enabled by default. The last 2048 frames are kept in memory.\n" \
+"Returns the previous state.\n");
+
+
+static int trace_enable(lua_State *l)
+{
+  unsigned char enabled;
+
+
+  enabled = trace.enabled;
+
+  if(lua_gettop(l) >= 1 && !lua_isnil(l, 1))
+    trace.enabled = lua_toboolean(l, 1);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, enabled);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(trace_ldump) = { "dump", NULL };
+FN_PARAM(trace_ldump) =
+{
+  FNPARAM("file",    "Trace File",             0),
+  FNPARAM("onerror", "Dump after every Error", 1),
+  FNPARAMEND
+};
+FN_RET(trace_ldump) =
+{
+  FNPARAM("ok", "Success", 0),
+  FNPARAMEND
+};
+FN("trace", trace_ldump, "Dump Recorded Frames",
+"Writes the recorded frames to <file> in the binary trace format. If\n" \
+"<onerror> is true, nothing is written now. Instead the file is rewritten\n" \
+"after each failed command. If <onerror> is false, this is turned off.\n");
+
+
+static int trace_ldump(lua_State *l)
+{
+  int result;
+
+
+  luaL_argcheck(l, lua_isstring(l, 1), 1, "file name expected");
+
+  if(lua_gettop(l) >= 2 && !lua_isnil(l, 2))
+  {
+    trace_autodump(lua_toboolean(l, 2) ? lua_tostring(l, 1) : NULL);
+    result = 0;
+  }
+  else
+    result = trace_dump(lua_tostring(l, 1));
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, result == 0);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(trace_lrecord) = { "record", NULL };
+FN_PARAM(trace_lrecord) =
+{
+  FNPARAM("file", "Trace File", 1),
+  FNPARAMEND
+};
+FN_RET(trace_lrecord) =
+{
+  FNPARAM("ok", "Success", 0),
+  FNPARAMEND
+};
+FN("trace", trace_lrecord, "Record Frames to File",
+"Writes all following frames immediately to <file>, regardless of the size\n" \
+"of the ring buffer. Together with the selected tags and the random numbers\n" \
+"of the authentication the file can be replayed via the -R option. Without\n" \
+"<file> the recording is stopped.\n");
+
+
+static int trace_lrecord(lua_State *l)
+{
+  int result;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) || lua_isstring(l, 1), 1, "file name expected");
+
+  result = trace_stream(lua_isstring(l, 1) ? lua_tostring(l, 1) : NULL);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, result == 0);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(trace_clear) = { "clear", NULL };
+FN_PARAM(trace_clear) =
+{
+  FNPARAMEND
+};
+FN_RET(trace_clear) =
+{
+  FNPARAMEND
+};
+FN("trace", trace_clear, "Clear Recorded Frames", NULL);
+
+
+static int trace_clear(lua_State *l)
+{
+  (void)l;
+
+  pthread_mutex_lock(&trace.mutex);
+  trace.head = 0;
+  pthread_mutex_unlock(&trace.mutex);
+
+
+  return 0;
+}
+
+
+
+
+FN_ALIAS(trace_last) = { "last", NULL };
+FN_PARAM(trace_last) =
+{
+  FNPARAM("n", "Number of Frames", 1),
+  FNPARAMEND
+};
+FN_RET(trace_last) =
+{
+  FNPARAM("frames", "List of Frames", 0),
+  FNPARAMEND
+};
+FN("trace", trace_last, "Get Recorded Frames",
+"Returns the last <n> recorded frames (default 16), the oldest first. Each\n" \
+"frame is a table with the timestamp in seconds (ts), the direction \"tx\",\n" \
+"\"rx\", \"err\", \"target\" or \"rand\" (dir), the length (len) and the data\n" \
+"(data). For errors the field code holds the error code of libnfc.\n");
+
+
+static int trace_last(lua_State *l)
+{
+  static const char *dirs[] = { "tx", "rx", "err", "target", "rand" };
+  unsigned long n, i, first;
+  int idx;
+
+
+  luaL_argcheck(l, lua_gettop(l) < 1 || lua_isnil(l, 1) || lua_isnumber(l, 1), 1, "number expected");
+  n = lua_isnumber(l, 1) && lua_tointeger(l, 1) > 0 ? lua_tointeger(l, 1) : 16;
+  if(n > TRACE_SLOTS)
+    n = TRACE_SLOTS;
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 4);
+  lua_newtable(l);
+
+  pthread_mutex_lock(&trace.mutex);
+
+  first = trace.head > n ? trace.head - n : 0;
+  for(i = first, idx = 1; i < trace.head; i++, idx++)
+  {
+    struct trace_rec *r = &trace.ring[i % TRACE_SLOTS];
+
+    lua_newtable(l);
+    lua_pushnumber(l, r->ts / 1e9);       lua_setfield(l, -2, "ts");
+    lua_pushstring(l, dirs[r->dir]);      lua_setfield(l, -2, "dir");
+    lua_pushinteger(l, r->len);           lua_setfield(l, -2, "len");
+
+    if(r->dir == TRACE_ERR)
+    {
+      lua_pushinteger(l, (int32_t)(r->data[0] | r->data[1] << 8 | r->data[2] << 16 | (uint32_t)r->data[3] << 24));
+      lua_setfield(l, -2, "code");
+    }
+    else
+    {
+      buffer_push(l, r->data, r->len > TRACE_MAXFRAME ? TRACE_MAXFRAME : r->len);
+      lua_setfield(l, -2, "data");
+    }
+
+    lua_rawseti(l, -2, idx);
+  }
+
+  pthread_mutex_unlock(&trace.mutex);
+
+
+  return 1;
+}
+
+
+
+
+FN_ALIAS(trace_stats) = { "stats", NULL };
+FN_PARAM(trace_stats) =
+{
+  FNPARAMEND
+};
+FN_RET(trace_stats) =
+{
+  FNPARAM("recorded",    "Number of recorded Frames",    0),
+  FNPARAM("overwritten", "Number of overwritten Frames", 0),
+  FNPARAMEND
+};
+FN("trace", trace_stats, "Get Trace Statistics", NULL);
+
+
+static int trace_stats(lua_State *l)
+{
+  unsigned long head;
+
+
+  pthread_mutex_lock(&trace.mutex);
+  head = trace.head;
+  pthread_mutex_unlock(&trace.mutex);
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 2);
+  lua_pushinteger(l, head);
+  lua_pushinteger(l, head > TRACE_SLOTS ? head - TRACE_SLOTS : 0);
+
+
+  return 2;
+}
@@ -0,0 +1,89 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_TRACE_H_
+#define _DESF_TRACE_H_
+
+#include <stdint.h>
+#include <nfc/nfc.h>
+
+#include "fn.h"
+
+
+/*
+ * Aufzeichnung aller mit dem Leser ausgetauschten Rahmen
+ *
+ * Dateiformat: Auf die Kennung "DESFTRC1" folgen die Rahmen jeweils mit
+ * einem Kopf aus Zeitstempel (8 Bytes, Nanosekunden seit 1970), Richtung
+ * (1 Byte, siehe TRACE_*), Flags (1 Byte, TRACE_TRUNC bei gekürzten
+ * Rahmen), Länge (2 Bytes) und den gespeicherten Daten. Mehrbytewerte sind
+ * Little Endian. Fehler enthalten den Rückgabewert von libnfc als 4 Byte.
+ * Für die Wiedergabe werden außerdem die ausgewählten Tags (ATQA, SAK,
+ * UID und ATS) und die bei der Authentifizierung erzeugten Zufallszahlen
+ * aufgezeichnet. Die Zufallszahlen nur in die mit trace_stream() gestartete
+ * Aufzeichnung.
+ */
+#define TRACE_MAGIC	"DESFTRC1"
+#define TRACE_SLOTS	2048
+#define TRACE_MAXFRAME	264
+
+#define TRACE_TX	0
+#define TRACE_RX	1
+#define TRACE_ERR	2
+#define TRACE_TARGET	3
+#define TRACE_RAND	4
+
+#define TRACE_TRUNC	0x01
+
+
+/*
+ * Ersatz für einen Leser, z.B. die Wiedergabe einer Aufzeichnung oder eine
+ * emulierte Karte. Alle Aufrufe von libnfc für ein Gerät, das der Ersatz
+ * für sich beansprucht, beantwortet der Ersatz statt libnfc.
+ */
+struct trace_backend
+{
+  const char *name;
+  const char *connstring;
+  int (*owns)(const nfc_device *pnd);
+  int (*transceive)(const uint8_t *tx, size_t txlen, uint8_t *rx, size_t rxlen);
+  int (*list)(nfc_modulation nm, nfc_target ant[], size_t n);
+  int (*select)(nfc_modulation nm, const uint8_t *uid, size_t uidlen, nfc_target *target);
+  int (*deselect)();
+  int (*error)();
+  const char *(*strerror)();
+};
+
+
+extern int trace_dump(const char *filename);
+extern void trace_autodump(const char *filename);
+extern int trace_stream(const char *filename);
+extern void trace_error();
+extern int trace_target_unpack(const uint8_t *data, size_t len, nfc_target *target);
+extern const nfc_target *trace_selected();
+
+extern FNDECL(trace_enable);
+extern FNDECL(trace_ldump);
+extern FNDECL(trace_lrecord);
+extern FNDECL(trace_clear);
+extern FNDECL(trace_last);
+extern FNDECL(trace_stats);
+
+
+#endif
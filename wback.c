@@ -0,0 +1,383 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <freefare.h>
+
+#include "async.h"
+#include "debug.h"
+#include "desflua.h"
+#include "desfsh.h"
+#include "fn.h"
+#include "wback.h"
+
+
+/*
+ * Verzögertes Schreiben
+ *
+ * Bei aktiviertem Write-Behind landen WriteData-Kommandos zunächst in einem
+ * Puffer. Aufeinanderfolgende Schreibzugriffe auf dieselbe Datei werden
+ * übereinandergelegt, sodass benachbarte und überlappende Bereiche mit
+ * einem einzigen WriteData-Kommando übertragen werden. Geschrieben wird,
+ * sobald ein anderes Kartenkommando folgt (insbesondere CommitTransaction),
+ * eine andere Datei beschrieben wird oder der ausgeführte Code endet.
+ *
+ * Für jeden zurückgehaltenen Aufruf merken wir uns den Status des
+ * WriteData-Kommandos, das seinen Bereich übertragen hat.
+ */
+struct wback_call
+{
+  uint32_t off, len;
+  uint8_t *data;
+  unsigned int slot;
+};
+
+struct wback_status
+{
+  uint8_t fid;
+  uint32_t off, len;
+  int code;
+  const char *str;
+  unsigned char failed;
+};
+
+struct wback_s
+{
+  unsigned char enabled;
+  unsigned char busy;
+
+  uint8_t fid;
+  unsigned char hascomm;
+  uint8_t comm;
+  uint32_t lo, hi;
+  unsigned int ncalls;
+  struct wback_call calls[WBACK_MAXCALLS];
+
+  struct wback_status *status;
+  unsigned int nstatus;
+  unsigned int maxstatus;
+};
+
+static __thread struct wback_s wback;
+
+static int wback_mode(lua_State *l);
+
+
+
+
+int wback_active()
+{
+  return wback.enabled;
+}
+
+
+int wback_defer(uint8_t fid, uint32_t off, uint32_t len, uint8_t *data, unsigned char hascomm, uint8_t comm)
+{
+  struct wback_call *c;
+  struct wback_status *st;
+  uint32_t lo, hi;
+
+
+  /* Eine andere Datei oder andere Übertragungsart beendet den Puffer. */
+  if(wback.ncalls > 0 &&
+     (fid != wback.fid || hascomm != wback.hascomm || comm != wback.comm))
+    wback_flush();
+
+  lo = wback.ncalls > 0 && wback.lo < off       ? wback.lo : off;
+  hi = wback.ncalls > 0 && wback.hi > off + len ? wback.hi : off + len;
+  if(wback.ncalls >= WBACK_MAXCALLS || (wback.ncalls > 0 && hi - lo > WBACK_MAXSPAN))
+    wback_flush();
+
+  if(wback.nstatus >= wback.maxstatus)
+  {
+    st = realloc(wback.status, (wback.maxstatus + WBACK_MAXCALLS) * sizeof(struct wback_status));
+    if(st == NULL)
+      return -1;
+
+    wback.status     = st;
+    wback.maxstatus += WBACK_MAXCALLS;
+  }
+
+  if(wback.ncalls == 0)
+  {
+    wback.fid     = fid;
+    wback.hascomm = hascomm;
+    wback.comm    = comm;
+    wback.lo      = off;
+    wback.hi      = off + len;
+  }
+  else
+  {
+    if(off < wback.lo)       wback.lo = off;
+    if(off + len > wback.hi) wback.hi = off + len;
+  }
+
+  st = &wback.status[wback.nstatus];
+  st->fid  = fid;
+  st->off  = off;
+  st->len  = len;
+  st->code   = -1;
+  st->str    = "Pending";
+  st->failed = 1;
+
+  c = &wback.calls[wback.ncalls++];
+  c->off  = off;
+  c->len  = len;
+  c->data = data;
+  c->slot = wback.nstatus++;
+
+
+  return 0;
+}
+
+
+/*
+ * Einen zusammengefassten Bereich übertragen und den Status allen
+ * zurückgehaltenen Aufrufen zuordnen, die in diesem Bereich liegen. Da
+ * ein Bereich die Vereinigung der Aufrufe ist, liegt jeder Aufruf
+ * vollständig in genau einem Bereich.
+ */
+static int wback_write(uint32_t off, uint32_t len, uint8_t *data)
+{
+  int result;
+  uint8_t err;
+  const char *str;
+  unsigned int i;
+
+
+  debug_announce("WriteData");
+  debug_gen(DEBUG_IN, "FID", "%d", wback.fid);
+  debug_gen(DEBUG_IN, "OFF", "%d", off);
+  debug_buffer(DEBUG_IN, data, len, off);
+
+  if(wback.hascomm)
+    result = mifare_desfire_write_data_ex(tag, wback.fid, off, len, data, wback.comm);
+  else
+    result = mifare_desfire_write_data(tag, wback.fid, off, len, data);
+
+  desflua_result(result, tag, &err, &str);
+
+  for(i = 0; i < wback.ncalls; i++)
+  {
+    struct wback_call *c = &wback.calls[i];
+
+    if(c->off >= off && c->off + c->len <= off + len)
+    {
+      wback.status[c->slot].code   = err;
+      wback.status[c->slot].str    = str;
+      wback.status[c->slot].failed = result < 0;
+    }
+  }
+
+
+  return result;
+}
+
+
+void wback_flush()
+{
+  uint8_t *buf, *cover;
+  uint32_t span, start, pos;
+  unsigned int i;
+  int result;
+
+
+  if(wback.busy || wback.ncalls == 0)
+    return;
+
+  wback.busy = 1;
+  result     = 0;
+
+  async_sync();
+
+  span  = wback.hi - wback.lo;
+  buf   = malloc(span);
+  cover = calloc(span, 1);
+
+  if(buf != NULL && cover != NULL)
+  {
+    /* Spätere Aufrufe überschreiben frühere. */
+    for(i = 0; i < wback.ncalls; i++)
+    {
+      struct wback_call *c = &wback.calls[i];
+
+      memcpy(buf + c->off - wback.lo, c->data, c->len);
+      memset(cover + c->off - wback.lo, 1, c->len);
+    }
+
+    pos = 0;
+    while(pos < span && result >= 0)
+    {
+      while(pos < span && !cover[pos])
+        pos++;
+      if(pos >= span)
+        break;
+
+      start = pos;
+      while(pos < span && cover[pos])
+        pos++;
+
+      result = wback_write(wback.lo + start, pos - start, buf + start);
+    }
+  }
+  else
+  {
+    /* Ohne Speicher für die Zusammenfassung einzeln schreiben. */
+    for(i = 0; i < wback.ncalls && result >= 0; i++)
+      result = wback_write(wback.calls[i].off, wback.calls[i].len, wback.calls[i].data);
+  }
+
+  free(buf);
+  free(cover);
+
+  /* Nach einem Fehler wird nichts weiter übertragen. */
+  for(i = 0; i < wback.ncalls; i++)
+  {
+    if(wback.status[wback.calls[i].slot].code < 0)
+      wback.status[wback.calls[i].slot].str = "Not sent";
+    free(wback.calls[i].data);
+  }
+
+  wback.ncalls = 0;
+  wback.busy   = 0;
+}
+
+
+void wback_discard()
+{
+  unsigned int i;
+
+
+  for(i = 0; i < wback.ncalls; i++)
+    free(wback.calls[i].data);
+
+  wback.ncalls  = 0;
+  wback.nstatus = 0;
+}
+
+
+/*
+ * Status der zurückgehaltenen Aufrufe als Liste auf den Stack legen. Die
+ * Liste wird dabei geleert. Gab es keine solchen Aufrufe, wird nichts
+ * abgelegt.
+ */
+int wback_push(lua_State *l)
+{
+  unsigned int i;
+
+
+  if(wback.nstatus == 0)
+    return 0;
+
+  lua_checkstack(l, 3);
+  lua_newtable(l);
+
+  for(i = 0; i < wback.nstatus; i++)
+  {
+    lua_pushinteger(l, i + 1);
+    lua_newtable(l);
+    lua_pushinteger(l, wback.status[i].fid);  lua_setfield(l, -2, "fid");
+    lua_pushinteger(l, wback.status[i].off);  lua_setfield(l, -2, "off");
+    lua_pushinteger(l, wback.status[i].len);  lua_setfield(l, -2, "len");
+    lua_pushinteger(l, wback.status[i].code); lua_setfield(l, -2, "code");
+    lua_pushstring(l, wback.status[i].str);   lua_setfield(l, -2, "err");
+    lua_settable(l, -3);
+  }
+
+  wback.nstatus = 0;
+
+
+  return 1;
+}
+
+
+/*
+ * Am Ende des ausgeführten Codes alles schreiben. Fehler, die das Skript
+ * nicht mehr abfragen kann, geben wir aus.
+ */
+void wback_done()
+{
+  unsigned int i;
+
+
+  wback_flush();
+
+  for(i = 0; i < wback.nstatus; i++)
+  {
+    struct wback_status *st = &wback.status[i];
+
+    if(st->failed)
+      fprintf(stderr, "deferred write to file %d (offset %u, %u bytes) failed: %d: %s\n",
+        st->fid, st->off, st->len, st->code, st->str);
+  }
+
+  wback.nstatus = 0;
+}
+
+
+
+
+FN_ALIAS(wback_mode) = { "writeback", NULL };
+FN_PARAM(wback_mode) =
+{
+  FNPARAM("enable", "Enable Write-Behind", 1),
+  FNPARAMEND
+};
+FN_RET(wback_mode) =
+{
+  FNPARAM("enabled", "Previous State", 0),
+  FNPARAMEND
+};
+FN("session", wback_mode, "Set Write-Behind Mode",
+"Enables or disables write-behind for cmd.write(). When enabled, writes to a\n" \
+"data file are held back and merged. Adjacent and overlapping ranges are\n" \
+"sent as a single WriteData command as soon as another card command is\n" \
+"issued (e.g. cmd.commit()), another file is written or the executed code\n" \
+"ends. Later writes take precedence over earlier ones. Deferred calls return\n" \
+"the code 0 and the string \"Deferred\". The next cmd.commit() or cmd.abort()\n" \
+"returns the actual status of each deferred call as a third value. Failures\n" \
+"not queried this way are printed when the executed code ends. Disabling\n" \
+"write-behind sends pending writes immediately. Returns the previous state.\n");
+
+
+static int wback_mode(lua_State *l)
+{
+  unsigned char enabled;
+
+
+  enabled = wback.enabled;
+
+  if(lua_gettop(l) >= 1 && !lua_isnil(l, 1))
+  {
+    wback.enabled = lua_toboolean(l, 1);
+    if(!wback.enabled)
+      wback_done();
+  }
+
+  lua_settop(l, 0);
+  lua_checkstack(l, 1);
+  lua_pushboolean(l, enabled);
+
+
+  return 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * DESFire-Shell: Modify MIFARE DESFire Cards
+ *
+ * Copyright (C) 2015-2021 Mario Haustein
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see https://www.gnu.org/licenses/.
+ */
+
+#ifndef _DESF_WBACK_H_
+#define _DESF_WBACK_H_
+
+#include <stdint.h>
+#include <lua.h>
+
+#include "fn.h"
+
+
+/*
+ * Höchstzahl zurückgehaltener Schreibzugriffe und größter zusammengefasster
+ * Bereich einer Datei. Bei Überschreitung wird vorher geschrieben.
+ */
+#define WBACK_MAXCALLS	64
+#define WBACK_MAXSPAN	8192
+
+
+extern int wback_active();
+extern int wback_defer(uint8_t fid, uint32_t off, uint32_t len, uint8_t *data, unsigned char hascomm, uint8_t comm);
+extern void wback_flush();
+extern void wback_discard();
+extern int wback_push(lua_State *l);
+extern void wback_done();
+
+extern FNDECL(wback_mode);
+
+
+#endif